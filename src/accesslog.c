@@ -0,0 +1,321 @@
+/* Asynchronous access log
+ *
+ * Request handlers never write to the log file. Each finished request's
+ * record is copied into a bounded lock-free ring (one sequence number per
+ * slot, producers claim slots with a compare-and-swap), and a
+ * flusher thread formats what has accumulated into one large write every
+ * ACCESSLOG_FLUSH_MS. If the ring is full the record is dropped and counted;
+ * the flusher logs the count, so a slow disk costs log lines, not latency.
+ *
+ * The file is rotated to "<path>.<timestamp>" when it reaches max_bytes or
+ * is older than max_age seconds.
+ */
+
+#include "accesslog.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ACCESSLOG_SLOTS 8192  // Ring size, a power of two
+#define ACCESSLOG_FLUSH_MS 50 // How often the flusher drains the ring
+#define ACCESSLOG_BUFFER_SIZE (256 * 1024)
+
+struct accesslog_slot {
+  unsigned long seq; // == position when free, position + 1 when filled
+  struct accesslog_record rec;
+};
+
+struct accesslog {
+  // Claimed by producers; kept off the consumer's cache line
+  unsigned long tail __attribute__((aligned(64)));
+  unsigned long dropped __attribute__((aligned(64)));
+  unsigned long head; // Only touched by the flusher
+
+  struct accesslog_slot *slots;
+
+  char *path;
+  int fd;
+  long max_bytes;
+  int max_age;
+  long size;
+  time_t opened;
+
+  char *buf;
+  pthread_t flusher;
+  int stopping;
+};
+
+/* Open the log file, noting its size and age */
+static int open_file(struct accesslog *log) {
+  struct stat st;
+
+  log->fd = open(log->path, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0644);
+
+  if (log->fd < 0 || fstat(log->fd, &st) < 0) {
+    perror("open");
+    return -1;
+  }
+
+  log->size = st.st_size;
+  log->opened = time(NULL);
+
+  return 0;
+}
+
+/* Move the current file aside and start a new one */
+static void rotate(struct accesslog *log) {
+  char rotated[4096];
+  char stamp[32];
+  time_t now = time(NULL);
+  struct tm tm;
+
+  gmtime_r(&now, &tm);
+  strftime(stamp, sizeof stamp, "%Y%m%dT%H%M%SZ", &tm);
+  snprintf(rotated, sizeof rotated, "%s.%s", log->path, stamp);
+
+  // Don't clobber a file rotated earlier in the same second
+  for (int i = 1; access(rotated, F_OK) == 0; i++) {
+    snprintf(rotated, sizeof rotated, "%s.%s.%d", log->path, stamp, i);
+  }
+
+  if (rename(log->path, rotated) < 0) {
+    perror("rename");
+  }
+
+  close(log->fd);
+  if (open_file(log) < 0) {
+    log->fd = -1;
+  }
+}
+
+/* Write a whole buffer to the log file */
+static void write_all(struct accesslog *log, char *buf, int len) {
+  while (len > 0 && log->fd >= 0) {
+    ssize_t n = write(log->fd, buf, len);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write");
+      return;
+    }
+    buf += n;
+    len -= n;
+    log->size += n;
+  }
+}
+
+/* Append a record to buf as one line, returning the line's length
+ *
+ * buf needs room for 512 bytes plus four times the path.
+ */
+static int format_record(char *buf, struct accesslog_record *rec) {
+  struct tm tm;
+  char *p = buf;
+
+  gmtime_r(&rec->time.tv_sec, &tm);
+  p += strftime(p, 32, "%Y-%m-%dT%H:%M:%S", &tm);
+  p += sprintf(p, ".%03ldZ addr=%s method=%s path=\"",
+               rec->time.tv_nsec / 1000000, rec->addr,
+               rec->method[0] != '\0' ? rec->method : "-");
+
+  // Paths come straight from request lines
+  for (char *c = rec->path; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20 ||
+        (unsigned char)*c >= 0x7f) {
+      p += sprintf(p, "\\x%02x", (unsigned char)*c);
+    } else {
+      *p++ = *c;
+    }
+  }
+
+  p += sprintf(p, "\" status=%d bytes=%ld duration_us=%ld\n", rec->status,
+               rec->bytes, rec->duration_us);
+
+  return p - buf;
+}
+
+/* Flusher thread: drain the ring into the file until the log is closed */
+static void *flusher(void *arg) {
+  struct accesslog *log = arg;
+  unsigned long reported = 0;
+
+  while (1) {
+    int stopping = __atomic_load_n(&log->stopping, __ATOMIC_ACQUIRE);
+    int len = 0;
+
+    while (1) {
+      struct accesslog_slot *slot =
+          &log->slots[log->head & (ACCESSLOG_SLOTS - 1)];
+
+      if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log->head + 1) {
+        break; // Empty, or the producer is still copying
+      }
+
+      if (len > ACCESSLOG_BUFFER_SIZE - (512 + 4 * ACCESSLOG_PATH_LEN)) {
+        write_all(log, log->buf, len);
+        len = 0;
+      }
+      len += format_record(log->buf + len, &slot->rec);
+
+      // Hand the slot back for the next lap around the ring
+      __atomic_store_n(&slot->seq, log->head + ACCESSLOG_SLOTS,
+                       __ATOMIC_RELEASE);
+      log->head++;
+    }
+
+    unsigned long dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+
+    if (dropped != reported) {
+      len += sprintf(log->buf + len, "# dropped %lu records\n",
+                     dropped - reported);
+      reported = dropped;
+    }
+
+    if (len > 0) {
+      write_all(log, log->buf, len);
+    }
+
+    if (log->size >= log->max_bytes ||
+        (log->max_age > 0 && time(NULL) - log->opened >= log->max_age)) {
+      if (log->size > 0) {
+        rotate(log);
+      }
+    }
+
+    if (stopping) {
+      break;
+    }
+
+    struct timespec pause = {0, ACCESSLOG_FLUSH_MS * 1000000L};
+    nanosleep(&pause, NULL);
+  }
+
+  return NULL;
+}
+
+/* Open (or create) an access log and start its flusher thread
+ *
+ * max_bytes: rotate once the file is this big
+ * max_age:   rotate once the file is this many seconds old (0 for never)
+ *
+ * Returns NULL on error
+ */
+struct accesslog *accesslog_open(char *path, long max_bytes, int max_age) {
+  struct accesslog *log = calloc(1, sizeof *log);
+
+  if (log == NULL) {
+    return NULL;
+  }
+
+  log->path = strdup(path);
+  log->max_bytes = max_bytes;
+  log->max_age = max_age;
+  log->slots = calloc(ACCESSLOG_SLOTS, sizeof *log->slots);
+  log->buf = malloc(ACCESSLOG_BUFFER_SIZE);
+
+  if (log->path == NULL || log->slots == NULL || log->buf == NULL ||
+      open_file(log) < 0) {
+    goto fail;
+  }
+
+  for (unsigned long i = 0; i < ACCESSLOG_SLOTS; i++) {
+    log->slots[i].seq = i;
+  }
+
+  if (pthread_create(&log->flusher, NULL, flusher, log) != 0) {
+    fprintf(stderr, "accesslog: cannot start flusher thread\n");
+    close(log->fd);
+    goto fail;
+  }
+
+  return log;
+
+fail:
+  free(log->buf);
+  free(log->slots);
+  free(log->path);
+  free(log);
+  return NULL;
+}
+
+/* Write out everything queued, stop the flusher and close the log */
+void accesslog_close(struct accesslog *log) {
+  __atomic_store_n(&log->stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(log->flusher, NULL);
+
+  if (log->fd >= 0) {
+    close(log->fd);
+  }
+  free(log->buf);
+  free(log->slots);
+  free(log->path);
+  free(log);
+}
+
+/* Start a record for a request from addr */
+void accesslog_begin(struct accesslog_record *rec, char *addr) {
+  clock_gettime(CLOCK_REALTIME_COARSE, &rec->time);
+  clock_gettime(CLOCK_MONOTONIC, &rec->start);
+  snprintf(rec->addr, sizeof rec->addr, "%s", addr);
+  rec->method[0] = rec->path[0] = '\0';
+  rec->status = 0;
+  rec->bytes = 0;
+}
+
+/* Note the method (method_len bytes, not NUL-terminated) and path */
+void accesslog_request(struct accesslog_record *rec, char *method,
+                       int method_len, char *path) {
+  snprintf(rec->method, sizeof rec->method, "%.*s", method_len, method);
+  snprintf(rec->path, sizeof rec->path, "%s", path);
+}
+
+/* Note a response and the bytes sent for it */
+void accesslog_response(struct accesslog_record *rec, int status,
+                        long bytes) {
+  rec->status = status;
+  if (bytes > 0) {
+    rec->bytes += bytes;
+  }
+}
+
+/* Queue a finished record, or count it as dropped if the ring is full */
+void accesslog_end(struct accesslog *log, struct accesslog_record *rec) {
+  struct timespec now;
+  unsigned long pos = __atomic_load_n(&log->tail, __ATOMIC_RELAXED);
+  struct accesslog_slot *slot;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  rec->duration_us = (now.tv_sec - rec->start.tv_sec) * 1000000 +
+                     (now.tv_nsec - rec->start.tv_nsec) / 1000;
+
+  while (1) {
+    slot = &log->slots[pos & (ACCESSLOG_SLOTS - 1)];
+    long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+
+    if (diff == 0) {
+      // Free slot for this position; try to claim it
+      if (__atomic_compare_exchange_n(&log->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // The flusher hasn't emptied this slot since the last lap: full
+      __atomic_fetch_add(&log->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&log->tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->rec = *rec;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
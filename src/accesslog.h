@@ -0,0 +1,34 @@
+#ifndef _ACCESSLOG_H_
+#define _ACCESSLOG_H_
+
+#include <arpa/inet.h>
+#include <time.h>
+
+#define ACCESSLOG_PATH_LEN 256
+
+// One request's log line, filled in as the request goes along
+struct accesslog_record {
+  struct timespec time; // When the request started
+  struct timespec start;
+  long duration_us;
+  char addr[INET6_ADDRSTRLEN];
+  char method[8];
+  char path[ACCESSLOG_PATH_LEN];
+  int status;
+  long bytes;
+};
+
+struct accesslog;
+
+extern struct accesslog *accesslog_open(char *path, long max_bytes,
+                                        int max_age);
+extern void accesslog_close(struct accesslog *log);
+extern void accesslog_begin(struct accesslog_record *rec, char *addr);
+extern void accesslog_request(struct accesslog_record *rec, char *method,
+                              int method_len, char *path);
+extern void accesslog_response(struct accesslog_record *rec, int status,
+                               long bytes);
+extern void accesslog_end(struct accesslog *log,
+                          struct accesslog_record *rec);
+
+#endif
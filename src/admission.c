@@ -0,0 +1,59 @@
+/* Admission control
+ *
+ * Two limits keep the server answering past saturation instead of letting
+ * every request get slower until clients time out:
+ *
+ * - A cap on requests in flight (admitted but not yet answered), so slow
+ *   uploads and stalled readers can't pile up without bound.
+ *
+ * - CoDel-style shedding on queue delay, the time a request sat ready
+ *   before the loop got to it. A burst that drains quickly is fine; what
+ *   matters is a standing queue, which shows up as even the *smallest*
+ *   delay over an interval staying above target. While that is the case,
+ *   any request that has itself waited longer than target is refused, so
+ *   the ones still served are served promptly.
+ *
+ * Cheap requests (cache hits, metrics) only feed the delay estimate and are
+ * never refused; they are the priority lane.
+ */
+
+#include "admission.h"
+
+void admission_init(struct admission *adm, int max_inflight) {
+  adm->max_inflight = max_inflight;
+  adm->inflight = 0;
+  adm->interval_end = 0;
+  adm->min_delay = UINT64_MAX;
+  adm->overloaded = 0;
+}
+
+/* Note how long a request waited before being handled */
+void admission_observe(struct admission *adm, uint64_t delay_ns,
+                       uint64_t now_ns) {
+  if (delay_ns < adm->min_delay) {
+    adm->min_delay = delay_ns;
+  }
+
+  if (now_ns >= adm->interval_end) {
+    adm->overloaded = adm->min_delay > ADMISSION_TARGET_NS;
+    adm->min_delay = UINT64_MAX;
+    adm->interval_end = now_ns + ADMISSION_INTERVAL_NS;
+  }
+}
+
+/* Decide whether to handle an expensive request that waited delay_ns
+ *
+ * Returns 1 if it is admitted (call admission_done() once it is answered),
+ * or 0 if it should be shed.
+ */
+int admission_admit(struct admission *adm, uint64_t delay_ns) {
+  if (adm->inflight >= adm->max_inflight ||
+      (adm->overloaded && delay_ns > ADMISSION_TARGET_NS)) {
+    return 0;
+  }
+
+  adm->inflight++;
+  return 1;
+}
+
+void admission_done(struct admission *adm) { adm->inflight--; }
@@ -0,0 +1,25 @@
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <stdint.h>
+
+#define ADMISSION_TARGET_NS 5000000     // Queue delay we can live with
+#define ADMISSION_INTERVAL_NS 100000000 // How long it may stay above target
+
+// Admission control for expensive requests
+struct admission {
+  int max_inflight;
+  int inflight; // Admitted and not yet answered
+
+  uint64_t interval_end;
+  uint64_t min_delay; // Lowest queue delay seen this interval
+  int overloaded;     // The last interval never got below target
+};
+
+extern void admission_init(struct admission *adm, int max_inflight);
+extern void admission_observe(struct admission *adm, uint64_t delay_ns,
+                              uint64_t now_ns);
+extern int admission_admit(struct admission *adm, uint64_t delay_ns);
+extern void admission_done(struct admission *adm);
+
+#endif
@@ -0,0 +1,78 @@
+/* Bump allocator for per-request scratch
+ *
+ * Memory comes in blocks borrowed from the buffer pool, so a request that
+ * needs none takes none, and everything goes back in one arena_reset() once
+ * the request is answered. Anything too big for a pooled block gets a block
+ * of its own from malloc().
+ */
+
+#include "arena.h"
+#include "bufpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ALIGN 16
+
+struct arena_block {
+  struct arena_block *next;
+  int pooled; // From bufpool_get(), else malloc()
+} __attribute__((aligned(ALIGN)));
+
+void arena_init(struct arena *a) {
+  a->blocks = NULL;
+  a->p = a->end = NULL;
+}
+
+/* len bytes, valid until the next arena_reset(); NULL on error */
+void *arena_alloc(struct arena *a, size_t len) {
+  struct arena_block *b;
+
+  len = (len + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+
+  if ((size_t)(a->end - a->p) >= len) {
+    a->p += len;
+    return a->p - len;
+  }
+
+  if (len > BUFPOOL_SIZE - sizeof *b) {
+    // Its own block, behind the one still being bumped
+    if ((b = malloc(sizeof *b + len)) == NULL) {
+      perror("malloc");
+      return NULL;
+    }
+    b->pooled = 0;
+    if (a->blocks != NULL) {
+      b->next = a->blocks->next;
+      a->blocks->next = b;
+    } else {
+      b->next = NULL;
+      a->blocks = b;
+    }
+    return b + 1;
+  }
+
+  if ((b = (struct arena_block *)bufpool_get()) == NULL) {
+    return NULL;
+  }
+  b->pooled = 1;
+  b->next = a->blocks;
+  a->blocks = b;
+  a->p = (char *)(b + 1) + len;
+  a->end = (char *)b + BUFPOOL_SIZE;
+  return b + 1;
+}
+
+/* Give back everything allocated since arena_init() or the last reset */
+void arena_reset(struct arena *a) {
+  while (a->blocks != NULL) {
+    struct arena_block *b = a->blocks;
+
+    a->blocks = b->next;
+    if (b->pooled) {
+      bufpool_put((char *)b);
+    } else {
+      free(b);
+    }
+  }
+  a->p = a->end = NULL;
+}
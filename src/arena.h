@@ -0,0 +1,19 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+struct arena_block;
+
+// Scratch memory handed out by bumping a pointer, all given back at once by
+// arena_reset()
+struct arena {
+  struct arena_block *blocks; // Newest first
+  char *p, *end;              // Free space in the newest pooled block
+};
+
+extern void arena_init(struct arena *a);
+extern void *arena_alloc(struct arena *a, size_t len);
+extern void arena_reset(struct arena *a);
+
+#endif
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Run the standard load scenarios against a freshly started local server.
+#
+# Run from src/ (make bench does this). Knobs, via the environment:
+#
+#   BENCH_DURATION     seconds per scenario (default 10)
+#   BENCH_CONNECTIONS  concurrent connections (default 16)
+#   BENCH_RATE         open-loop arrival rate, req/s (default 2000)
+#   BENCH_FLAGS        extra loadgen flags, e.g. -j for JSON output
+
+PORT=3490
+DURATION=${BENCH_DURATION:-10}
+CONNECTIONS=${BENCH_CONNECTIONS:-16}
+RATE=${BENCH_RATE:-2000}
+LOADGEN="./bench/loadgen -d $DURATION -c $CONNECTIONS $BENCH_FLAGS"
+LARGE=serverroot/bench-large.bin
+
+# A file too big for the in-memory cache, served with sendfile()
+head -c 4194304 /dev/zero > $LARGE
+
+./server > /dev/null &
+SERVER=$!
+trap 'kill $SERVER 2> /dev/null; rm -f $LARGE' EXIT INT TERM
+
+# Wait for the listener
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  ./bench/loadgen -d 1 -c 1 -R 5 -j localhost:$PORT > /dev/null 2>&1 && break
+  sleep 0.2
+done
+
+scenario() {
+  name=$1
+  shift
+  echo "== $name"
+  $LOADGEN "$@" localhost:$PORT || exit 1
+  echo ""
+}
+
+scenario "cache hits" -u 3:GET:/ -u 1:GET:/kittens.jpg
+scenario "404s" -u 1:GET:/no/such/file
+scenario "d20" -u 1:GET:/d20
+scenario "POST /save" -u 1:POST:/save:512
+scenario "large file" -c 4 -u 1:GET:/bench-large.bin
+scenario "mixed, closed loop" -u 60:GET:/ -u 15:GET:/kittens.jpg \
+  -u 10:GET:/missing -u 10:GET:/d20 -u 4:POST:/save:512 \
+  -u 1:GET:/bench-large.bin
+scenario "mixed, open loop at $RATE req/s" -R $RATE -u 60:GET:/ \
+  -u 15:GET:/kittens.jpg -u 10:GET:/missing -u 10:GET:/d20 \
+  -u 4:POST:/save:512 -u 1:GET:/bench-large.bin
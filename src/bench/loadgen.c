@@ -0,0 +1,483 @@
+/* loadgen -- HTTP load generator for the webserver
+ *
+ * Usage: loadgen [options] host:port
+ *
+ *   -c N      concurrent connections, one thread each (default 8)
+ *   -d SECS   test duration (default 10)
+ *   -R RPS    open loop at a constant total arrival rate; without -R each
+ *             connection sends its next request as soon as the previous
+ *             one completes (closed loop)
+ *   -u SPEC   add a request to the mix, as weight:METHOD:path[:body_bytes]
+ *             (repeatable; default is 1:GET:/)
+ *   -j        print the results as one JSON object instead of a table
+ *
+ * Connections are kept open and reused unless the server closes them.
+ *
+ * In open-loop mode each request has an intended start time on a fixed
+ * schedule, and latency is measured from that time rather than from when
+ * the request was actually sent. A stalled server therefore shows up as
+ * queueing delay in every request that should have been sent during the
+ * stall (coordinated-omission correction), not just the one it blocked.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_TARGETS 32
+#define RESPONSE_BUFFER_SIZE 65536
+
+// Latency histogram: 32 linear sub-buckets per power of two, ~3% precision
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+// One request in the URL mix
+struct target {
+  int weight;
+  char *request; // Complete request bytes, prebuilt
+  int request_len;
+};
+
+struct worker {
+  pthread_t thread;
+  unsigned int seed;
+  uint64_t interval_ns; // Open loop: time between intended sends; 0 = closed
+  uint64_t phase_ns;    // Open loop: offset of this worker's schedule
+
+  uint64_t requests, errors, bytes;
+  uint64_t status[6]; // By class: [2] = 2xx etc.
+  struct histogram hist;
+};
+
+static struct addrinfo *server_addr;
+static struct target targets[MAX_TARGETS];
+static int num_targets, total_weight;
+static uint64_t start_ns, end_ns;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t) {
+  struct timespec ts = {t / 1000000000, t % 1000000000};
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+}
+
+static int hist_index(uint64_t v) {
+  if (v < 2 * HIST_SUB_COUNT) {
+    return v;
+  }
+  int msb = 63 - __builtin_clzll(v);
+  int shift = msb - HIST_SUB_BITS;
+
+  return (shift + 1) * HIST_SUB_COUNT + ((v >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+/* Highest value that lands in a bucket */
+static uint64_t hist_value(int index) {
+  if (index < 2 * HIST_SUB_COUNT) {
+    return index;
+  }
+  int shift = index / HIST_SUB_COUNT - 1;
+  uint64_t sub = index % HIST_SUB_COUNT;
+
+  return ((HIST_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+static void hist_record(struct histogram *h, uint64_t v) {
+  h->counts[hist_index(v)]++;
+  h->total++;
+  if (v > h->max) {
+    h->max = v;
+  }
+}
+
+static void hist_merge(struct histogram *dst, struct histogram *src) {
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->total += src->total;
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+}
+
+static uint64_t hist_percentile(struct histogram *h, double p) {
+  uint64_t rank = (uint64_t)(p / 100.0 * h->total + 0.5);
+  uint64_t seen = 0;
+
+  if (rank == 0) {
+    rank = 1;
+  }
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      uint64_t v = hist_value(i);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+/* Parse weight:METHOD:path[:body_bytes] and prebuild the request */
+static int add_target(char *spec, char *host) {
+  char method[16], path[1024];
+  int weight, body_size = 0;
+
+  if (num_targets == MAX_TARGETS ||
+      sscanf(spec, "%d:%15[^:]:%1023[^:]:%d", &weight, method, path,
+             &body_size) < 3 ||
+      weight <= 0 || body_size < 0) {
+    fprintf(stderr, "loadgen: bad request spec \"%s\"\n", spec);
+    return -1;
+  }
+
+  struct target *t = &targets[num_targets++];
+  char header[2048];
+  int header_len;
+
+  if (body_size > 0) {
+    header_len = snprintf(header, sizeof header,
+                          "%s %s HTTP/1.1\r\nHost: %s\r\n"
+                          "Content-Type: application/octet-stream\r\n"
+                          "Content-Length: %d\r\n\r\n",
+                          method, path, host, body_size);
+  } else {
+    header_len = snprintf(header, sizeof header,
+                          "%s %s HTTP/1.1\r\nHost: %s\r\n\r\n", method, path,
+                          host);
+  }
+
+  t->weight = weight;
+  t->request_len = header_len + body_size;
+  t->request = malloc(t->request_len);
+  memcpy(t->request, header, header_len);
+  memset(t->request + header_len, 'x', body_size);
+
+  total_weight += weight;
+  return 0;
+}
+
+static struct target *pick_target(struct worker *w) {
+  int r = rand_r(&w->seed) % total_weight;
+
+  for (int i = 0; i < num_targets; i++) {
+    r -= targets[i].weight;
+    if (r < 0) {
+      return &targets[i];
+    }
+  }
+  return &targets[0];
+}
+
+static int connect_server(void) {
+  int fd = socket(server_addr->ai_family, SOCK_STREAM, 0);
+
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int send_all(int fd, char *p, int len) {
+  while (len > 0) {
+    int n = send(fd, p, len, MSG_NOSIGNAL);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Read one response, discarding the body
+ *
+ * Returns the status code, or -1 on error; 0 if the connection was closed
+ * before any byte of the response arrived. Sets *keep_alive if the
+ * connection can be reused.
+ */
+static int read_response(int fd, char *buf, uint64_t *bytes,
+                         int *keep_alive) {
+  int len = 0;
+  char *body = NULL;
+
+  buf[0] = '\0';
+  while (body == NULL) {
+    if (len == RESPONSE_BUFFER_SIZE - 1) {
+      return -1;
+    }
+    int n = recv(fd, buf + len, RESPONSE_BUFFER_SIZE - 1 - len, 0);
+
+    if (n <= 0) {
+      return n == 0 && len == 0 ? 0 : -1;
+    }
+    len += n;
+    buf[len] = '\0';
+    body = strstr(buf, "\r\n\r\n");
+  }
+  body += 4;
+  *bytes += len;
+
+  int status;
+  if (sscanf(buf, "HTTP/1.%*d %d", &status) != 1) {
+    return -1;
+  }
+
+  *keep_alive = strncmp(buf, "HTTP/1.1", 8) == 0;
+  long content_length = -1;
+
+  for (char *line = strstr(buf, "\r\n") + 2; line < body - 2;
+       line = strstr(line, "\r\n") + 2) {
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      content_length = strtol(line + 15, NULL, 10);
+    } else if (strncasecmp(line, "Connection:", 11) == 0 &&
+               strncasecmp(line + 11 + strspn(line + 11, " "), "close", 5) ==
+                   0) {
+      *keep_alive = 0;
+    }
+  }
+
+  long remaining = content_length - (len - (body - buf));
+
+  if (content_length < 0) {
+    // Delimited by the end of the connection
+    *keep_alive = 0;
+    remaining = -1;
+  }
+
+  while (remaining != 0) {
+    int n = recv(fd, buf, RESPONSE_BUFFER_SIZE, 0);
+
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      return remaining < 0 ? status : -1;
+    }
+    *bytes += n;
+    if (remaining > 0) {
+      remaining -= n;
+    }
+  }
+
+  return status;
+}
+
+static void *worker_run(void *arg) {
+  struct worker *w = arg;
+  char *buf = malloc(RESPONSE_BUFFER_SIZE);
+  uint64_t intended = start_ns + w->phase_ns;
+  int fd = -1;
+
+  while (1) {
+    if (w->interval_ns > 0) {
+      intended += w->interval_ns;
+      if (intended >= end_ns) {
+        break;
+      }
+      sleep_until(intended);
+    } else {
+      intended = now_ns();
+      if (intended >= end_ns) {
+        break;
+      }
+    }
+
+    struct target *t = pick_target(w);
+    int status = -1, keep_alive = 0;
+
+    // A reused connection may have been closed by the server while idle;
+    // give the request one retry on a fresh connection in that case
+    for (int attempt = 0; attempt < 2 && status <= 0; attempt++) {
+      int reused = fd >= 0;
+
+      if (fd < 0 && (fd = connect_server()) < 0) {
+        break;
+      }
+      if (send_all(fd, t->request, t->request_len) == 0) {
+        status = read_response(fd, buf, &w->bytes, &keep_alive);
+      }
+      if (status <= 0) {
+        close(fd);
+        fd = -1;
+        if (!reused) {
+          break;
+        }
+      }
+    }
+
+    if (status <= 0) {
+      w->errors++;
+      continue;
+    }
+
+    hist_record(&w->hist, now_ns() - intended);
+    w->requests++;
+    w->status[status / 100 < 6 ? status / 100 : 0]++;
+
+    if (!keep_alive) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(buf);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  int connections = 8, duration = 10, json = 0, opt;
+  double rate = 0;
+  char *specs[MAX_TARGETS];
+  int num_specs = 0;
+
+  while ((opt = getopt(argc, argv, "c:d:R:u:j")) != -1) {
+    switch (opt) {
+    case 'c':
+      connections = atoi(optarg);
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      break;
+    case 'R':
+      rate = atof(optarg);
+      break;
+    case 'u':
+      if (num_specs < MAX_TARGETS) {
+        specs[num_specs++] = optarg;
+      }
+      break;
+    case 'j':
+      json = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: loadgen [-c conns] [-d secs] [-R rps] "
+                      "[-u weight:METHOD:path[:body_bytes]]... [-j] "
+                      "host:port\n");
+      return 1;
+    }
+  }
+
+  if (optind != argc - 1 || connections < 1 || duration < 1) {
+    fprintf(stderr, "loadgen: need host:port (see source for options)\n");
+    return 1;
+  }
+
+  char *host = argv[optind], *port = strrchr(host, ':');
+  if (port == NULL) {
+    fprintf(stderr, "loadgen: need host:port\n");
+    return 1;
+  }
+  *port++ = '\0';
+
+  struct addrinfo hints = {0};
+  hints.ai_socktype = SOCK_STREAM;
+  int rv = getaddrinfo(host, port, &hints, &server_addr);
+  if (rv != 0) {
+    fprintf(stderr, "loadgen: %s\n", gai_strerror(rv));
+    return 1;
+  }
+
+  if (num_specs == 0) {
+    specs[num_specs++] = "1:GET:/";
+  }
+  for (int i = 0; i < num_specs; i++) {
+    if (add_target(specs[i], host) < 0) {
+      return 1;
+    }
+  }
+
+  struct worker *workers = calloc(connections, sizeof *workers);
+
+  start_ns = now_ns();
+  end_ns = start_ns + (uint64_t)duration * 1000000000;
+
+  for (int i = 0; i < connections; i++) {
+    workers[i].seed = i * 7919 + 1;
+    workers[i].interval_ns = rate > 0 ? 1e9 * connections / rate : 0;
+    workers[i].phase_ns = workers[i].interval_ns * i / connections;
+    pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+  }
+
+  struct worker total = {0};
+
+  for (int i = 0; i < connections; i++) {
+    pthread_join(workers[i].thread, NULL);
+    total.requests += workers[i].requests;
+    total.errors += workers[i].errors;
+    total.bytes += workers[i].bytes;
+    for (int s = 0; s < 6; s++) {
+      total.status[s] += workers[i].status[s];
+    }
+    hist_merge(&total.hist, &workers[i].hist);
+  }
+
+  double elapsed = (now_ns() - start_ns) / 1e9;
+  double rps = total.requests / elapsed;
+  struct histogram *h = &total.hist;
+
+  if (json) {
+    printf("{\"mode\": \"%s\", \"connections\": %d, \"duration_s\": %.3f, "
+           "\"requests\": %lu, \"errors\": %lu, \"rps\": %.1f, "
+           "\"bytes\": %lu, \"status_2xx\": %lu, \"status_4xx\": %lu, "
+           "\"status_5xx\": %lu, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+           "\"p999_us\": %.1f, \"max_us\": %.1f}\n",
+           rate > 0 ? "open" : "closed", connections, elapsed,
+           (unsigned long)total.requests, (unsigned long)total.errors, rps,
+           (unsigned long)total.bytes, (unsigned long)total.status[2],
+           (unsigned long)total.status[4], (unsigned long)total.status[5],
+           hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+           hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+  } else {
+    printf("%s loop, %d connections, %.1fs", rate > 0 ? "open" : "closed",
+           connections, elapsed);
+    if (rate > 0) {
+      printf(", target %.0f req/s", rate);
+    }
+    printf("\n  requests  %lu (%lu errors), 2xx %lu, 4xx %lu, 5xx %lu\n",
+           (unsigned long)total.requests, (unsigned long)total.errors,
+           (unsigned long)total.status[2], (unsigned long)total.status[4],
+           (unsigned long)total.status[5]);
+    printf("  rate      %.1f req/s, %.2f MB/s\n", rps,
+           total.bytes / elapsed / 1e6);
+    printf("  latency   p50 %.1fus  p99 %.1fus  p99.9 %.1fus  max %.1fus\n",
+           hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+           hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+  }
+
+  freeaddrinfo(server_addr);
+  free(workers);
+  return total.requests > 0 ? 0 : 1;
+}
@@ -0,0 +1,654 @@
+/* microbench -- microbenchmarks for the hashtable, llist, cache and request
+ * head scanner
+ *
+ * Usage: microbench [-s scale] [filter]
+ *
+ *   -s SCALE  multiply iteration counts (default 1; use <1 for quick runs)
+ *   filter    only run benchmarks whose name contains this string
+ *
+ * Prints one JSON object per benchmark case:
+ *
+ *   {"bench": "hashtable_get", "size": 10000, "load": 1.00, "ops": ...,
+ *    "ns_per_op": ..., "allocs_per_op": ..., "cache_misses_per_op": ...}
+ *
+ * Allocations are counted by wrapping malloc() and friends at link time
+ * (-Wl,--wrap=...). Cache misses come from perf_event_open() and are null
+ * when hardware counters aren't available (VMs, containers, paranoid
+ * kernels).
+ *
+ * The head scanner cases ("head_scan_...", size in bytes) also report
+ * "ns_per_byte" and "cycles_per_byte", the latter in TSC ticks and null
+ * off x86. "head_scan_strstr" is the scan it replaced: strstr() for the
+ * blank line, then a pass over the lines for each field looked up.
+ */
+
+#include "../cache.h"
+#include "../hashtable.h"
+#include "../httphead.h"
+#include "../llist.h"
+#include <ctype.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+/* Allocation counting */
+
+static uint64_t alloc_count;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  alloc_count++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  alloc_count++;
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  alloc_count++;
+  return __real_realloc(p, size);
+}
+
+/* Measurement */
+
+static int perf_fd = -1;
+static double scale = 1;
+static char *filter;
+
+/* Accumulates time, allocations and misses over one or more intervals */
+struct measure {
+  uint64_t ns, allocs, misses;
+  uint64_t start_ns, start_allocs, start_misses;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void perf_open(void) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof attr);
+  attr.size = sizeof attr;
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+static uint64_t perf_read(void) {
+  uint64_t v = 0;
+
+  if (perf_fd >= 0 && read(perf_fd, &v, sizeof v) != sizeof v) {
+    v = 0;
+  }
+  return v;
+}
+
+static void measure_resume(struct measure *m) {
+  m->start_allocs = alloc_count;
+  m->start_misses = perf_read();
+  m->start_ns = now_ns();
+}
+
+static void measure_pause(struct measure *m) {
+  m->ns += now_ns() - m->start_ns;
+  m->misses += perf_read() - m->start_misses;
+  m->allocs += alloc_count - m->start_allocs;
+}
+
+static void measure_start(struct measure *m) {
+  m->ns = m->allocs = m->misses = 0;
+  measure_resume(m);
+}
+
+static void measure_report(struct measure *m, char *bench, int size,
+                           double load, long ops) {
+  printf("{\"bench\": \"%s\", \"size\": %d, \"load\": %.2f, \"ops\": %ld, "
+         "\"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, "
+         "\"cache_misses_per_op\": ",
+         bench, size, load, ops, (double)m->ns / ops,
+         (double)m->allocs / ops);
+  if (perf_fd >= 0) {
+    printf("%.3f}\n", (double)m->misses / ops);
+  } else {
+    printf("null}\n");
+  }
+  fflush(stdout);
+}
+
+static void measure_end(struct measure *m, char *bench, int size, double load,
+                        long ops) {
+  measure_pause(m);
+  measure_report(m, bench, size, load, ops);
+}
+
+static int selected(char *bench) {
+  return filter == NULL || strstr(bench, filter) != NULL;
+}
+
+static long scaled(long n) {
+  long v = n * scale;
+  return v > 0 ? v : 1;
+}
+
+/* Workload helpers */
+
+static uint64_t rng_state = 88172645463325252ull;
+
+static uint64_t rng(void) {
+  // xorshift64
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static char **make_keys(int n) {
+  char **keys = malloc(n * sizeof *keys);
+
+  for (int i = 0; i < n; i++) {
+    char buf[64];
+    snprintf(buf, sizeof buf, "/static/assets/%08x/file-%d.html",
+             (unsigned)(i * 2654435761u), i);
+    keys[i] = strdup(buf);
+  }
+  return keys;
+}
+
+static void free_keys(char **keys, int n) {
+  for (int i = 0; i < n; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+}
+
+/* Zipfian key sampler: cdf[i] = P(rank <= i) for ranks 0..n-1 */
+struct zipf {
+  int n;
+  double *cdf;
+};
+
+static void zipf_init(struct zipf *z, int n, double s) {
+  double sum = 0;
+
+  z->n = n;
+  z->cdf = malloc(n * sizeof *z->cdf);
+  for (int i = 0; i < n; i++) {
+    sum += 1.0 / pow(i + 1, s);
+    z->cdf[i] = sum;
+  }
+  for (int i = 0; i < n; i++) {
+    z->cdf[i] /= sum;
+  }
+}
+
+static int zipf_next(struct zipf *z) {
+  double u = (rng() >> 11) * (1.0 / 9007199254740992.0);
+  int lo = 0, hi = z->n - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (z->cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Benchmarks */
+
+/* Tables are rebuilt until enough puts and deletes have been timed */
+static void bench_hashtable(int size, double load) {
+  int buckets = size / load;
+  int reps = scaled(200000) / size + 1;
+  char **keys = make_keys(size);
+  int *order = malloc(size * sizeof *order);
+  struct measure put, del, m;
+  struct hashtable *ht = NULL;
+
+  for (int i = 0; i < size; i++) {
+    order[i] = rng() % size;
+  }
+
+  put.ns = put.allocs = put.misses = 0;
+  del = put;
+
+  for (int r = 0; r < reps; r++) {
+    if (ht != NULL) {
+      measure_resume(&del);
+      for (int i = 0; i < size; i++) {
+        hashtable_delete(ht, keys[i]);
+      }
+      measure_pause(&del);
+      hashtable_destroy(ht);
+    }
+
+    ht = hashtable_create(buckets > 0 ? buckets : 1, NULL);
+
+    measure_resume(&put);
+    for (int i = 0; i < size; i++) {
+      hashtable_put(ht, keys[i], keys[i]);
+    }
+    measure_pause(&put);
+  }
+
+  if (selected("hashtable_put")) {
+    measure_report(&put, "hashtable_put", size, load, (long)reps * size);
+  }
+
+  if (selected("hashtable_get")) {
+    long ops = scaled(200000);
+    volatile void *sink;
+
+    measure_start(&m);
+    for (long i = 0; i < ops; i++) {
+      sink = hashtable_get(ht, keys[order[i % size]]);
+    }
+    measure_end(&m, "hashtable_get", size, load, ops);
+    (void)sink;
+  }
+
+  if (selected("hashtable_get_miss")) {
+    long ops = scaled(200000);
+    volatile void *sink;
+
+    measure_start(&m);
+    for (long i = 0; i < ops; i++) {
+      sink = hashtable_get(ht, "/static/assets/not-there.html");
+    }
+    measure_end(&m, "hashtable_get_miss", size, load, ops);
+    (void)sink;
+  }
+
+  measure_resume(&del);
+  for (int i = 0; i < size; i++) {
+    hashtable_delete(ht, keys[i]);
+  }
+  measure_pause(&del);
+
+  if (selected("hashtable_delete")) {
+    measure_report(&del, "hashtable_delete", size, load, (long)reps * size);
+  }
+
+  hashtable_destroy(ht);
+  free(order);
+  free_keys(keys, size);
+}
+
+static int intcmp(void *a, void *b) { return *(int *)a - *(int *)b; }
+
+/* Lists are rebuilt until enough appends have been timed */
+static void bench_llist(int size) {
+  int reps = scaled(20000000) / ((long)size * size) + 1;
+  int *values = malloc(size * sizeof *values);
+  struct measure append, m;
+  struct llist *llist = NULL;
+
+  for (int i = 0; i < size; i++) {
+    values[i] = i;
+  }
+
+  append.ns = append.allocs = append.misses = 0;
+
+  for (int r = 0; r < reps; r++) {
+    if (llist != NULL) {
+      llist_destroy(llist);
+    }
+    llist = llist_create();
+
+    measure_resume(&append);
+    for (int i = 0; i < size; i++) {
+      llist_append(llist, &values[i]);
+    }
+    measure_pause(&append);
+  }
+
+  if (selected("llist_append")) {
+    measure_report(&append, "llist_append", size, 0, (long)reps * size);
+  }
+
+  if (selected("llist_find")) {
+    long ops = scaled(2000000 / size + 1000);
+    volatile void *sink;
+
+    measure_start(&m);
+    for (long i = 0; i < ops; i++) {
+      sink = llist_find(llist, &values[rng() % size], intcmp);
+    }
+    measure_end(&m, "llist_find", size, 0, ops);
+    (void)sink;
+  }
+
+  llist_destroy(llist);
+  free(values);
+}
+
+/* Serve a Zipfian request stream the way get_file() does: get, and put on
+ * a miss. keys / cache_size sets how much churn the LRU sees. */
+static void bench_cache(int cache_size, int keys_count, double s) {
+  char bench[64];
+  char **keys = make_keys(keys_count);
+  struct zipf z;
+  struct measure m;
+  char content[512];
+  long ops = scaled(300000);
+  long hits = 0;
+
+  memset(content, 'x', sizeof content);
+  zipf_init(&z, keys_count, s);
+
+  struct cache *cache = cache_create(cache_size, 0);
+
+  // Warm up so the measurement sees the steady state
+  for (long i = 0; i < ops / 4; i++) {
+    char *key = keys[zipf_next(&z)];
+    if (cache_get(cache, key) == NULL) {
+      cache_put(cache, key, "text/html", content, sizeof content);
+    }
+  }
+
+  snprintf(bench, sizeof bench, "cache_get_put_zipf%.2f", s);
+  if (selected(bench)) {
+    measure_start(&m);
+    for (long i = 0; i < ops; i++) {
+      char *key = keys[zipf_next(&z)];
+      if (cache_get(cache, key) == NULL) {
+        cache_put(cache, key, "text/html", content, sizeof content);
+      } else {
+        hits++;
+      }
+    }
+    measure_end(&m, bench, cache_size, (double)keys_count / cache_size, ops);
+    fprintf(stderr, "  %s cache=%d keys=%d hit rate %.1f%%\n", bench,
+            cache_size, keys_count, 100.0 * hits / ops);
+  }
+
+  if (selected("cache_get_hit")) {
+    long get_ops = scaled(300000);
+    volatile void *sink;
+
+    if (cache_get(cache, keys[0]) == NULL) {
+      cache_put(cache, keys[0], "text/html", content, sizeof content);
+    }
+    measure_start(&m);
+    for (long i = 0; i < get_ops; i++) {
+      sink = cache_get(cache, keys[0]);
+    }
+    measure_end(&m, "cache_get_hit", cache_size,
+                (double)keys_count / cache_size, get_ops);
+    (void)sink;
+  }
+
+  if (selected("cache_put_evict")) {
+    // Cycling through more keys than fit means every put evicts, and no key
+    // is put while an older copy is still cached
+    struct cache *fresh = cache_create(cache_size, 0);
+    long put_ops = scaled(100000);
+
+    measure_start(&m);
+    for (long i = 0; i < put_ops; i++) {
+      cache_put(fresh, keys[i % keys_count], "text/html", content,
+                sizeof content);
+    }
+    measure_end(&m, "cache_put_evict", cache_size,
+                (double)keys_count / cache_size, put_ops);
+    cache_free(fresh);
+  }
+
+  cache_free(cache);
+  free(z.cdf);
+  free_keys(keys, keys_count);
+}
+
+/* Request heads as browsers send them */
+static char *heads[] = {
+    // curl
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:3490\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    // Chrome, navigating
+    "GET /docs/getting-started.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", "
+    "\"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8,"
+    "application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: https://www.example.com/docs/\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "\r\n",
+
+    // Firefox, fetching a script with cookies
+    "GET /static/js/app.3f9a1c2e.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:125.0) "
+    "Gecko/20100101 Firefox/125.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-GB,en;q=0.7,de;q=0.3\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/account/settings?tab=profile\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0"
+    "NTY3ODkwIiwibmFtZSI6IkphbmUgRG9lIiwiaWF0IjoxNzE0MDAwMDAwfQ.c2lnbmF0dXJl"
+    "; _ga=GA1.2.1234567890.1714000000; _gid=GA1.2.987654321.1714000000; "
+    "theme=dark; consent=necessary%2Canalytics; lang=en-GB\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "If-None-Match: \"5d8c72a5edda8d6a:0\"\r\n"
+    "If-Modified-Since: Tue, 23 Apr 2024 09:12:44 GMT\r\n"
+    "Pragma: no-cache\r\n"
+    "Cache-Control: no-cache\r\n"
+    "\r\n",
+};
+
+/* The fields handle_http_request() looks up for every request */
+static char *lookups[] = {"Host", "Connection", "Content-Length",
+                          "Transfer-Encoding"};
+
+static uint64_t cycles(void) {
+#ifdef HAVE_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+/* The scan before http_head_scan(), as it was in conn.c */
+static char *find_start_of_body(char *header) {
+  char *start;
+
+  if ((start = strstr(header, "\r\n\r\n")) != NULL) {
+    return start + 4;
+  } else if ((start = strstr(header, "\n\n")) != NULL) {
+    return start + 2;
+  } else if ((start = strstr(header, "\r\r")) != NULL) {
+    return start + 2;
+  } else {
+    return start;
+  }
+}
+
+/* The field lookup before http_head_field(), as it was in body.c */
+static char *header_value(char *headers, int headers_len, char *name,
+                          int *len) {
+  int name_len = strlen(name);
+  char *end = headers + headers_len;
+
+  // Skip the request line
+  char *p = memchr(headers, '\n', headers_len);
+
+  while (p != NULL && ++p < end) {
+    char *eol = memchr(p, '\n', end - p);
+
+    if (eol == NULL) {
+      eol = end;
+    }
+
+    if (eol - p > name_len && p[name_len] == ':' &&
+        strncasecmp(p, name, name_len) == 0) {
+      char *v = p + name_len + 1;
+
+      while (v < eol && (*v == ' ' || *v == '\t')) {
+        v++;
+      }
+      char *vend = eol;
+      while (vend > v && isspace((unsigned char)vend[-1])) {
+        vend--;
+      }
+
+      *len = vend - v;
+      return v;
+    }
+
+    p = eol;
+  }
+
+  return NULL;
+}
+
+/* Find the end of a head and the fields a request needs, old and new */
+static void bench_head(char *head, char *impl) {
+  char bench[64];
+  struct http_head index;
+  struct measure m;
+  uint64_t start_cycles;
+  int size = strlen(head), len;
+  long ops = scaled(1000000);
+  volatile long sink = 0;
+
+  snprintf(bench, sizeof bench, "head_scan_%s", impl);
+  if (!selected(bench) ||
+      (strcmp(impl, "strstr") != 0 && http_head_use(impl) < 0)) {
+    return;
+  }
+
+  measure_start(&m);
+  start_cycles = cycles();
+  for (long i = 0; i < ops; i++) {
+    if (strcmp(impl, "strstr") == 0) {
+      int end = find_start_of_body(head) - head;
+
+      for (unsigned int j = 0; j < sizeof lookups / sizeof lookups[0]; j++) {
+        sink += header_value(head, end, lookups[j], &len) != NULL;
+      }
+    } else {
+      http_head_init(&index);
+      http_head_scan(head, size, &index);
+
+      for (unsigned int j = 0; j < sizeof lookups / sizeof lookups[0]; j++) {
+        sink += http_head_field(&index, head, lookups[j], &len) != NULL;
+      }
+    }
+  }
+  measure_pause(&m);
+
+  uint64_t elapsed = cycles() - start_cycles;
+
+  printf("{\"bench\": \"%s\", \"size\": %d, \"load\": 0.00, \"ops\": %ld, "
+         "\"ns_per_op\": %.2f, \"ns_per_byte\": %.3f, \"cycles_per_byte\": ",
+         bench, size, ops, (double)m.ns / ops, (double)m.ns / ops / size);
+  if (elapsed > 0) {
+    printf("%.3f}\n", (double)elapsed / ops / size);
+  } else {
+    printf("null}\n");
+  }
+  fflush(stdout);
+  (void)sink;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+    case 's':
+      scale = atof(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: microbench [-s scale] [filter]\n");
+      return 1;
+    }
+  }
+  if (optind < argc) {
+    filter = argv[optind];
+  }
+
+  perf_open();
+  if (perf_fd < 0) {
+    fprintf(stderr, "microbench: no hardware cache-miss counter\n");
+  }
+
+  int sizes[] = {1000, 10000, 100000};
+  double loads[] = {0.5, 1, 4, 16};
+
+  for (unsigned int i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+    for (unsigned int j = 0; j < sizeof loads / sizeof loads[0]; j++) {
+      bench_hashtable(sizes[i], loads[j]);
+    }
+  }
+
+  int lengths[] = {10, 100, 1000};
+
+  for (unsigned int i = 0; i < sizeof lengths / sizeof lengths[0]; i++) {
+    bench_llist(lengths[i]);
+  }
+
+  bench_cache(100, 1000, 0.99);
+  bench_cache(1000, 10000, 0.99);
+  bench_cache(1000, 100000, 0.99);
+  bench_cache(1000, 100000, 1.2);
+
+  char *impls[] = {"strstr", "scalar", "ssse3", "avx2"};
+
+  for (unsigned int i = 0; i < sizeof heads / sizeof heads[0]; i++) {
+    for (unsigned int j = 0; j < sizeof impls / sizeof impls[0]; j++) {
+      bench_head(heads[i], impls[j]);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Performance regression gate: run the microbenchmarks and a few loopback
+# load scenarios PERFCHECK_RUNS times, then compare the medians against
+# bench/baseline.json with bench/perfcmp. Fails if anything regressed
+# beyond its tolerance.
+#
+# Run from src/ (make perfcheck does this). Knobs, via the environment:
+#
+#   PERFCHECK_RUNS    runs of every case (default 5)
+#   PERFCHECK_CPU     CPU to pin the benchmarks to (default 0); on machines
+#                     with more CPUs loadgen gets PERFCHECK_CPU + 1
+#   PERFCHECK_UPDATE  if set, write the results as the new baseline
+#                     instead of checking them
+#
+# The baseline only means something on the machine it was recorded on;
+# re-record it (make perfcheck-baseline) when the reference machine changes.
+
+PORT=3490
+RUNS=${PERFCHECK_RUNS:-5}
+CPU=${PERFCHECK_CPU:-0}
+BASELINE=bench/baseline.json
+SAMPLES=$(mktemp)
+
+# Fixed settings: the same work every time, whatever the caller's env says
+MICRO_SCALE=0.2
+LOAD_SECONDS=2
+LOAD_CONNECTIONS=8
+
+if command -v taskset > /dev/null; then
+  PIN="taskset -c $CPU"
+  if [ "$(nproc)" -gt 1 ]; then
+    PIN_LOAD="taskset -c $((CPU + 1))"
+  else
+    PIN_LOAD="$PIN"
+  fi
+fi
+
+GOVERNOR=/sys/devices/system/cpu/cpu$CPU/cpufreq/scaling_governor
+if [ -r $GOVERNOR ] && [ "$(cat $GOVERNOR)" != performance ]; then
+  echo "perfcheck: warning: cpu$CPU governor is $(cat $GOVERNOR)," \
+    "results will be noisy" >&2
+fi
+
+$PIN ./server > /dev/null &
+SERVER=$!
+trap 'kill $SERVER 2> /dev/null; rm -f $SAMPLES' EXIT INT TERM
+
+# Wait for the listener
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  ./bench/loadgen -d 1 -c 1 -R 5 -j localhost:$PORT > /dev/null 2>&1 && break
+  sleep 0.2
+done
+
+scenario() {
+  name=$1
+  shift
+  $PIN_LOAD ./bench/loadgen -j -d $LOAD_SECONDS -c $LOAD_CONNECTIONS "$@" \
+    localhost:$PORT | sed "s/^{/{\"scenario\": \"$name\", /" >> $SAMPLES
+}
+
+# Interleave the runs so slow drift hits every case alike
+run=1
+while [ $run -le "$RUNS" ]; do
+  echo "perfcheck: run $run of $RUNS" >&2
+  $PIN ./bench/microbench -s $MICRO_SCALE >> $SAMPLES 2> /dev/null || exit 2
+  scenario cache_hits -u 1:GET:/
+  scenario not_found -u 1:GET:/no/such/file
+  scenario d20 -u 1:GET:/d20
+  run=$((run + 1))
+done
+
+if [ -n "$PERFCHECK_UPDATE" ]; then
+  if [ -f $BASELINE ]; then
+    OLD="-b $BASELINE"
+  fi
+  ./bench/perfcmp -w $OLD $SAMPLES > $BASELINE.new &&
+    mv $BASELINE.new $BASELINE &&
+    echo "perfcheck: wrote $BASELINE" >&2
+else
+  ./bench/perfcmp -b $BASELINE $SAMPLES
+fi
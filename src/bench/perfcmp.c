@@ -0,0 +1,360 @@
+/* perfcmp -- compare benchmark samples against a stored baseline
+ *
+ * Usage: perfcmp -b baseline.json samples     check for regressions
+ *        perfcmp -w [-b old.json] samples     print a new baseline
+ *
+ * samples holds the JSON lines printed by microbench and loadgen -j over
+ * several runs, with "scenario" added to each loadgen line. Every run of a
+ * case is one sample; perfcmp takes the median and a ~95% confidence
+ * interval for it from the order statistics.
+ *
+ * A metric has regressed when its median is worse than the baseline median
+ * by more than the case's tolerance AND its confidence interval no longer
+ * overlaps the baseline's, so a single noisy run can't fail the check.
+ *
+ * Metrics checked:
+ *
+ *    microbench  ns_per_op   lower is better
+ *    loadgen     rps         higher is better
+ *                p99_us      lower is better
+ *
+ * The baseline is a JSON document with one case per line; tolerances can be
+ * edited by hand and are kept when the baseline is rewritten with -b.
+ *
+ * Exits 1 on any regression, 2 on usage or input errors.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_CASES 512
+#define MAX_SAMPLES 64
+
+struct metric_case {
+  char name[128];
+  char metric[16];
+  int lower_better;
+  double tolerance;
+
+  double samples[MAX_SAMPLES];
+  int n;
+
+  double median, ci_low, ci_high; // From the baseline file, or computed
+};
+
+struct case_set {
+  struct metric_case cases[MAX_CASES];
+  int n;
+};
+
+/* Default tolerance for a metric; loopback tail latency is the noisiest */
+static double default_tolerance(char *metric) {
+  return strcmp(metric, "p99_us") == 0 ? 0.30 : 0.10;
+}
+
+/* Find the value after "key": on a JSON line, or NULL */
+static char *json_find(char *line, char *key) {
+  char pattern[64];
+  char *p;
+
+  snprintf(pattern, sizeof pattern, "\"%s\":", key);
+  if ((p = strstr(line, pattern)) == NULL) {
+    return NULL;
+  }
+  p += strlen(pattern);
+  while (*p == ' ') {
+    p++;
+  }
+  return p;
+}
+
+static int json_number(char *line, char *key, double *out) {
+  char *p = json_find(line, key), *end;
+
+  if (p == NULL) {
+    return -1;
+  }
+  *out = strtod(p, &end);
+  return end == p ? -1 : 0;
+}
+
+static int json_string(char *line, char *key, char *out, int size) {
+  char *p = json_find(line, key), *end;
+
+  if (p == NULL || *p != '"' || (end = strchr(p + 1, '"')) == NULL ||
+      end - p - 1 >= size) {
+    return -1;
+  }
+  memcpy(out, p + 1, end - p - 1);
+  out[end - p - 1] = '\0';
+  return 0;
+}
+
+static struct metric_case *find_case(struct case_set *set, char *name,
+                                     char *metric) {
+  for (int i = 0; i < set->n; i++) {
+    if (strcmp(set->cases[i].name, name) == 0 &&
+        strcmp(set->cases[i].metric, metric) == 0) {
+      return &set->cases[i];
+    }
+  }
+  return NULL;
+}
+
+static struct metric_case *get_case(struct case_set *set, char *name,
+                                    char *metric, int lower_better) {
+  struct metric_case *c = find_case(set, name, metric);
+
+  if (c == NULL && set->n < MAX_CASES) {
+    c = &set->cases[set->n++];
+    memset(c, 0, sizeof *c);
+    snprintf(c->name, sizeof c->name, "%s", name);
+    snprintf(c->metric, sizeof c->metric, "%s", metric);
+    c->lower_better = lower_better;
+    c->tolerance = default_tolerance(metric);
+  }
+  return c;
+}
+
+static void add_sample(struct case_set *set, char *name, char *metric,
+                       int lower_better, double value) {
+  struct metric_case *c = get_case(set, name, metric, lower_better);
+
+  if (c != NULL && c->n < MAX_SAMPLES) {
+    c->samples[c->n++] = value;
+  }
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Median and a ~95% distribution-free confidence interval for it */
+static void summarize(struct metric_case *c) {
+  double half = 1.96 * sqrt(c->n) / 2;
+  int lo = (int)floor(c->n / 2.0 - half);
+  int hi = (int)ceil(c->n / 2.0 + half);
+
+  qsort(c->samples, c->n, sizeof c->samples[0], cmp_double);
+
+  if (c->n % 2) {
+    c->median = c->samples[c->n / 2];
+  } else {
+    c->median = (c->samples[c->n / 2 - 1] + c->samples[c->n / 2]) / 2;
+  }
+
+  c->ci_low = c->samples[lo < 0 ? 0 : lo];
+  c->ci_high = c->samples[hi > c->n - 1 ? c->n - 1 : hi];
+}
+
+/* Read microbench and loadgen -j lines into per-case samples */
+static int read_samples(char *path, struct case_set *set) {
+  FILE *fp = fopen(path, "r");
+  char line[4096], name[128], bench[64];
+  double v, size, load;
+
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  while (fgets(line, sizeof line, fp) != NULL) {
+    if (json_string(line, "bench", bench, sizeof bench) == 0 &&
+        json_number(line, "size", &size) == 0 &&
+        json_number(line, "load", &load) == 0 &&
+        json_number(line, "ns_per_op", &v) == 0) {
+      snprintf(name, sizeof name, "%s/%.0f/%.2f", bench, size, load);
+      add_sample(set, name, "ns_per_op", 1, v);
+    } else if (json_string(line, "scenario", name, sizeof name) == 0) {
+      if (json_number(line, "rps", &v) == 0) {
+        add_sample(set, name, "rps", 0, v);
+      }
+      if (json_number(line, "p99_us", &v) == 0) {
+        add_sample(set, name, "p99_us", 1, v);
+      }
+    }
+  }
+
+  fclose(fp);
+
+  for (int i = 0; i < set->n; i++) {
+    summarize(&set->cases[i]);
+  }
+
+  return 0;
+}
+
+/* Read a baseline written by -w */
+static int read_baseline(char *path, struct case_set *set) {
+  FILE *fp = fopen(path, "r");
+  char line[4096], name[128], metric[16], better[16];
+
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  while (fgets(line, sizeof line, fp) != NULL) {
+    struct metric_case *c;
+
+    if (json_string(line, "case", name, sizeof name) < 0 ||
+        json_string(line, "metric", metric, sizeof metric) < 0 ||
+        json_string(line, "better", better, sizeof better) < 0 ||
+        (c = get_case(set, name, metric, strcmp(better, "lower") == 0)) ==
+            NULL) {
+      continue;
+    }
+
+    if (json_number(line, "tolerance", &c->tolerance) < 0 ||
+        json_number(line, "median", &c->median) < 0 ||
+        json_number(line, "ci_low", &c->ci_low) < 0 ||
+        json_number(line, "ci_high", &c->ci_high) < 0) {
+      fprintf(stderr, "perfcmp: %s: bad case \"%s\"\n", path, name);
+      fclose(fp);
+      return -1;
+    }
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+static void write_baseline(struct case_set *current, struct case_set *old) {
+  int runs = MAX_SAMPLES;
+
+  // Some microbench cases repeat within a run; count the others
+  for (int i = 0; i < current->n; i++) {
+    if (current->cases[i].n < runs) {
+      runs = current->cases[i].n;
+    }
+  }
+
+  printf("{\n  \"runs\": %d,\n  \"cases\": [\n", runs);
+
+  for (int i = 0; i < current->n; i++) {
+    struct metric_case *c = &current->cases[i];
+    struct metric_case *prev = find_case(old, c->name, c->metric);
+
+    printf("    {\"case\": \"%s\", \"metric\": \"%s\", \"better\": \"%s\", "
+           "\"tolerance\": %.2f, \"median\": %.2f, \"ci_low\": %.2f, "
+           "\"ci_high\": %.2f}%s\n",
+           c->name, c->metric, c->lower_better ? "lower" : "higher",
+           prev != NULL ? prev->tolerance : c->tolerance, c->median,
+           c->ci_low, c->ci_high, i < current->n - 1 ? "," : "");
+  }
+
+  printf("  ]\n}\n");
+}
+
+/* Print a comparison table; return the number of regressions */
+static int compare(struct case_set *current, struct case_set *baseline) {
+  int regressions = 0;
+
+  printf("%-34s %-9s %26s %26s %8s\n", "case", "metric", "baseline [95% CI]",
+         "current [95% CI]", "change");
+
+  for (int i = 0; i < baseline->n; i++) {
+    struct metric_case *b = &baseline->cases[i];
+    struct metric_case *c = find_case(current, b->name, b->metric);
+    char *verdict;
+
+    if (c == NULL || c->n == 0) {
+      printf("%-34s %-9s %26.1f %26s %8s  missing\n", b->name, b->metric,
+             b->median, "-", "-");
+      continue;
+    }
+
+    double change = b->median != 0 ? (c->median - b->median) / b->median : 0;
+    // Positive when worse, whichever direction is better
+    double worse = b->lower_better ? change : -change;
+    int separated =
+        b->lower_better ? c->ci_low > b->ci_high : c->ci_high < b->ci_low;
+    int improved =
+        b->lower_better ? c->ci_high < b->ci_low : c->ci_low > b->ci_high;
+
+    if (worse > b->tolerance && separated) {
+      verdict = "REGRESSED";
+      regressions++;
+    } else if (-worse > b->tolerance && improved) {
+      verdict = "improved";
+    } else {
+      verdict = "ok";
+    }
+
+    char base_text[64], cur_text[64];
+    snprintf(base_text, sizeof base_text, "%.1f [%.1f, %.1f]", b->median,
+             b->ci_low, b->ci_high);
+    snprintf(cur_text, sizeof cur_text, "%.1f [%.1f, %.1f]", c->median,
+             c->ci_low, c->ci_high);
+
+    printf("%-34s %-9s %26s %26s %+7.1f%%  %s\n", b->name, b->metric,
+           base_text, cur_text, change * 100, verdict);
+  }
+
+  for (int i = 0; i < current->n; i++) {
+    struct metric_case *c = &current->cases[i];
+
+    if (find_case(baseline, c->name, c->metric) == NULL) {
+      printf("%-34s %-9s %26s %26.1f %8s  new\n", c->name, c->metric, "-",
+             c->median, "-");
+    }
+  }
+
+  return regressions;
+}
+
+int main(int argc, char *argv[]) {
+  static struct case_set current, baseline;
+  char *baseline_path = NULL;
+  int update = 0, opt;
+
+  while ((opt = getopt(argc, argv, "b:w")) != -1) {
+    switch (opt) {
+    case 'b':
+      baseline_path = optarg;
+      break;
+    case 'w':
+      update = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: perfcmp [-w] [-b baseline.json] samples\n");
+      return 2;
+    }
+  }
+
+  if (optind != argc - 1 || (!update && baseline_path == NULL)) {
+    fprintf(stderr, "usage: perfcmp [-w] [-b baseline.json] samples\n");
+    return 2;
+  }
+
+  if (read_samples(argv[optind], &current) < 0 ||
+      (baseline_path != NULL && read_baseline(baseline_path, &baseline) < 0)) {
+    return 2;
+  }
+
+  if (current.n == 0) {
+    fprintf(stderr, "perfcmp: no samples in %s\n", argv[optind]);
+    return 2;
+  }
+
+  if (update) {
+    write_baseline(&current, &baseline);
+    return 0;
+  }
+
+  int regressions = compare(&current, &baseline);
+
+  if (regressions > 0) {
+    printf("\nperfcmp: %d metric%s regressed beyond tolerance\n", regressions,
+           regressions == 1 ? "" : "s");
+    return 1;
+  }
+
+  printf("\nperfcmp: no regressions\n");
+  return 0;
+}
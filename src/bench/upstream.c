@@ -0,0 +1,310 @@
+/* upstream -- a stand-in application server for trying the reverse proxy
+ *
+ * Usage: upstream [port]   (default 3500)
+ *
+ * Speaks HTTP/1.1 with keep-alive, one thread per connection. Paths:
+ *
+ *   /echo         the request body back, whether it came with a length or
+ *                 chunked
+ *   /headers      the request head, as the proxy passed it on
+ *   /bytes/N      N bytes with a Content-Length
+ *   /stream/N     N bytes, chunked
+ *   /close/N      N bytes up to the end of the connection, as HTTP/1.0
+ *   /cached/S     a count of how often it was asked for, cacheable for S
+ *                 seconds
+ *   /slow/MS      an answer after MS milliseconds
+ *
+ * and anything else gets a line naming the port, method and path, to see
+ * which upstream answered.
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE 65536
+#define CHUNK_SIZE 16384
+
+static int port = 3500;
+static long counter; // Answers to /cached/
+
+// A connection's read side, buffering past the head
+struct client {
+  int fd;
+  char buf[BUFFER_SIZE];
+  int start, end;
+};
+
+static int send_all(int fd, void *data, long len) {
+  char *p = data;
+
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Fill the buffer a little more; 0 at the end of the connection */
+static int fill(struct client *c) {
+  ssize_t n;
+
+  if (c->start > 0) {
+    memmove(c->buf, c->buf + c->start, c->end - c->start);
+    c->end -= c->start;
+    c->start = 0;
+  }
+  if (c->end == BUFFER_SIZE) {
+    return -1;
+  }
+  do {
+    n = recv(c->fd, c->buf + c->end, BUFFER_SIZE - c->end, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n > 0) {
+    c->end += n;
+  }
+  return n;
+}
+
+/* A line from the buffer, without its ending; NULL if the connection ends */
+static char *read_line(struct client *c) {
+  char *eol;
+
+  while ((eol = memchr(c->buf + c->start, '\n', c->end - c->start)) == NULL) {
+    if (fill(c) <= 0) {
+      return NULL;
+    }
+  }
+
+  char *line = c->buf + c->start;
+
+  c->start = eol + 1 - c->buf;
+  *eol = '\0';
+  if (eol > line && eol[-1] == '\r') {
+    eol[-1] = '\0';
+  }
+  return line;
+}
+
+/* Read n body bytes, appending them to *body if body isn't NULL */
+static int read_bytes(struct client *c, long n, char **body, long *len) {
+  while (n > 0) {
+    long k = c->end - c->start;
+
+    if (k == 0 && fill(c) <= 0) {
+      return -1;
+    }
+    k = c->end - c->start;
+    if (k > n) {
+      k = n;
+    }
+    if (body != NULL) {
+      char *p = realloc(*body, *len + k);
+
+      if (p == NULL) {
+        return -1;
+      }
+      memcpy(p + *len, c->buf + c->start, k);
+      *body = p;
+      *len += k;
+    }
+    c->start += k;
+    n -= k;
+  }
+  return 0;
+}
+
+/* Read a request body, framed by its length or chunked */
+static int read_body(struct client *c, long length, int chunked, char **body,
+                     long *len) {
+  char *line;
+
+  if (!chunked) {
+    return read_bytes(c, length, body, len);
+  }
+
+  while ((line = read_line(c)) != NULL) {
+    long size = strtol(line, NULL, 16);
+
+    if (size == 0) {
+      // Trailers, up to a blank line
+      while ((line = read_line(c)) != NULL && *line != '\0') {
+      }
+      return line != NULL ? 0 : -1;
+    }
+    if (read_bytes(c, size, body, len) < 0 || read_line(c) == NULL) {
+      return -1;
+    }
+  }
+  return -1;
+}
+
+static int respond(int fd, char *extra, char *body, long len) {
+  char head[512];
+  int n = snprintf(head, sizeof head,
+                   "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n%s"
+                   "Content-Length: %ld\r\n\r\n",
+                   extra, len);
+
+  return send_all(fd, head, n) < 0 || send_all(fd, body, len) < 0 ? -1 : 0;
+}
+
+static char *pattern(long n) {
+  char *p = malloc(n > 0 ? n : 1);
+
+  for (long i = 0; p != NULL && i < n; i++) {
+    p[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+  }
+  return p;
+}
+
+/* Answer one request; -1 to close the connection */
+static int serve(struct client *c) {
+  char method[16], path[1024], head[BUFFER_SIZE], *line, *body = NULL;
+  long length = 0, len = 0, n = 0;
+  int head_len = 0, chunked = 0, is_head, rv = 0;
+
+  if ((line = read_line(c)) == NULL ||
+      sscanf(line, "%15s %1023s", method, path) != 2) {
+    return -1;
+  }
+  head_len = snprintf(head, sizeof head, "%s\n", line);
+
+  while ((line = read_line(c)) != NULL && *line != '\0') {
+    if (strncasecmp(line, "Content-Length:", 15) == 0) {
+      length = atol(line + 15);
+    } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+      chunked = strstr(line, "chunked") != NULL;
+    }
+    if (head_len < (int)sizeof head - 1) {
+      head_len += snprintf(head + head_len, sizeof head - head_len, "%s\n",
+                           line);
+    }
+  }
+  if (line == NULL || read_body(c, length, chunked, &body, &len) < 0) {
+    free(body);
+    return -1;
+  }
+
+  is_head = strcmp(method, "HEAD") == 0;
+  if (strrchr(path, '/') != NULL) {
+    sscanf(strrchr(path, '/') + 1, "%ld", &n);
+  }
+
+  if (strcmp(path, "/echo") == 0) {
+    rv = respond(c->fd, "", body, len);
+  } else if (strcmp(path, "/headers") == 0) {
+    rv = respond(c->fd, "", head, head_len);
+  } else if (strncmp(path, "/bytes/", 7) == 0) {
+    char *p = pattern(n);
+
+    rv = respond(c->fd, "", p, is_head ? 0 : n);
+    free(p);
+  } else if (strncmp(path, "/stream/", 8) == 0) {
+    char *p = pattern(CHUNK_SIZE), size[16];
+    char *h = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+              "Transfer-Encoding: chunked\r\n\r\n";
+
+    rv = send_all(c->fd, h, strlen(h));
+    for (long left = n; rv == 0 && left > 0; left -= CHUNK_SIZE) {
+      int k = left < CHUNK_SIZE ? left : CHUNK_SIZE;
+
+      sprintf(size, "%x\r\n", k);
+      rv = send_all(c->fd, size, strlen(size)) < 0 ||
+                   send_all(c->fd, p, k) < 0 || send_all(c->fd, "\r\n", 2) < 0
+               ? -1
+               : 0;
+    }
+    rv = rv == 0 ? send_all(c->fd, "0\r\n\r\n", 5) : rv;
+    free(p);
+  } else if (strncmp(path, "/close/", 7) == 0) {
+    char *p = pattern(n);
+    char *h = "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n";
+
+    send_all(c->fd, h, strlen(h));
+    send_all(c->fd, p, n);
+    free(p);
+    rv = -1;
+  } else if (strncmp(path, "/cached/", 8) == 0) {
+    char extra[64], text[64];
+
+    snprintf(extra, sizeof extra, "Cache-Control: max-age=%ld\r\n", n);
+    rv = respond(c->fd, extra, text,
+                 sprintf(text, "%ld\n", __sync_add_and_fetch(&counter, 1)));
+  } else if (strncmp(path, "/slow/", 6) == 0) {
+    struct timespec ts = {n / 1000, n % 1000 * 1000000};
+
+    nanosleep(&ts, NULL);
+    rv = respond(c->fd, "", "slow\n", 5);
+  } else {
+    char text[1200];
+
+    rv = respond(c->fd, "", text,
+                 snprintf(text, sizeof text, "upstream %d: %s %s\n", port,
+                          method, path));
+  }
+
+  free(body);
+  return rv;
+}
+
+static void *connection(void *arg) {
+  struct client *c = arg;
+
+  while (serve(c) == 0) {
+  }
+  close(c->fd);
+  free(c);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_in addr = {.sin_family = AF_INET};
+  int fd, one = 1;
+
+  if (argc > 1) {
+    port = atoi(argv[1]);
+  }
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+      listen(fd, 128) < 0) {
+    perror("upstream");
+    return 1;
+  }
+  printf("upstream: listening on port %d\n", port);
+  fflush(stdout);
+
+  while (1) {
+    struct client *c = malloc(sizeof *c);
+    pthread_t thread;
+
+    if (c == NULL || (c->fd = accept(fd, NULL, NULL)) < 0) {
+      free(c);
+      continue;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    c->start = c->end = 0;
+    pthread_create(&thread, NULL, connection, c);
+    pthread_detach(thread);
+  }
+}
@@ -0,0 +1,442 @@
+/* Streaming HTTP request bodies
+ *
+ * The body is framed by Content-Length or Transfer-Encoding: chunked and is
+ * handed to a sink piece by piece as it arrives, so memory use stays at one
+ * I/O buffer no matter how large the upload is. Where the sink can take data
+ * straight from a pipe, raw body bytes are splice()d socket->pipe and never
+ * copied through user space. A connection that must be read through TLS
+ * supplies its own I/O instead and is always copied; so does an HTTP/2
+ * stream, whose body may also just run until the stream ends.
+ *
+ * On a non-blocking socket body_stream() returns BODY_AGAIN when it runs
+ * out of input; the reader remembers where it was in the framing, so the
+ * caller just calls it again once the socket is readable.
+ */
+
+#define _GNU_SOURCE
+#include "body.h"
+#include "httphead.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SPLICE_CHUNK 65536 // Default pipe capacity
+
+// Where body_stream() is in the framing
+enum body_state {
+  BODY_DATA,       // Content-Length body: remaining bytes to go
+  BODY_CHUNK_SIZE, // Expecting a chunk-size line
+  BODY_CHUNK_DATA, // remaining bytes of the current chunk to go
+  BODY_CHUNK_END,  // Expecting the CRLF after a chunk
+  BODY_TRAILER,    // Skipping trailer fields
+  BODY_TO_END,     // Unframed: everything until the input ends
+  BODY_DONE,
+};
+
+/* Parse a chunk-size line, ignoring any chunk extensions
+ *
+ * Returns -1 if the line is malformed
+ */
+static long long parse_chunk_size(char *s) {
+  long long n = 0;
+  int digits = 0;
+
+  for (; isxdigit((unsigned char)*s); s++, digits++) {
+    if (digits == 15) {
+      return -1; // Would overflow
+    }
+    n = n * 16 + (isdigit((unsigned char)*s) ? *s - '0' : tolower(*s) - 'a' + 10);
+  }
+
+  if (digits == 0 || (*s != '\0' && *s != ';' && *s != ' ' && *s != '\t')) {
+    return -1;
+  }
+
+  return n;
+}
+
+static int body_recv(struct body_reader *br, void *buf, int len) {
+  if (br->io != NULL && br->io->recv != NULL) {
+    return br->io->recv(br->io->arg, buf, len);
+  }
+  return recv(br->fd, buf, len, 0);
+}
+
+/* Read more data from the socket into the end of the buffer
+ *
+ * Returns the number of bytes read, -1 on error or early EOF, or BODY_AGAIN
+ */
+static int fill(struct body_reader *br) {
+  // Slide what's left to the front to make room
+  if (br->start > 0) {
+    memmove(br->buf, br->buf + br->start, br->end - br->start);
+    br->end -= br->start;
+    br->start = 0;
+  }
+
+  if (br->end == br->size) {
+    return -1; // Line longer than the whole buffer
+  }
+
+  int n;
+
+  do {
+    n = body_recv(br, br->buf + br->end, br->size - br->end);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return BODY_AGAIN;
+  }
+  if (n <= 0) {
+    return -1;
+  }
+
+  br->end += n;
+  return n;
+}
+
+/* Read a line, without its line ending, into *line
+ *
+ * The line stays valid until the next read from the reader. A partial line
+ * is left in the buffer when this returns BODY_AGAIN.
+ */
+static int read_line(struct body_reader *br, char **line) {
+  char *nl;
+  int rv;
+
+  while ((nl = memchr(br->buf + br->start, '\n', br->end - br->start)) ==
+         NULL) {
+    if ((rv = fill(br)) < 0) {
+      return rv;
+    }
+  }
+
+  *line = br->buf + br->start;
+  br->start = nl + 1 - br->buf;
+
+  *nl = '\0';
+  if (nl > *line && nl[-1] == '\r') {
+    nl[-1] = '\0';
+  }
+
+  return 0;
+}
+
+/* splice() the rest of the current body piece through a pipe into the sink
+ *
+ * Returns 0 when done, -1 on error, BODY_AGAIN, or 1 if splicing is not
+ * supported for this socket and nothing has been consumed.
+ */
+static int splice_remaining(struct body_reader *br, struct body_sink *sink) {
+  int moved = 0, rv;
+
+  while (br->remaining > 0) {
+    ssize_t k = splice(br->fd, NULL, br->pipefd[1], NULL,
+                       br->remaining < SPLICE_CHUNK ? br->remaining
+                                                    : SPLICE_CHUNK,
+                       SPLICE_F_MOVE);
+
+    if (k < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return BODY_AGAIN;
+      }
+      if (errno == EINVAL && !moved) {
+        return 1;
+      }
+      perror("splice");
+      return -1;
+    }
+    if (k == 0) {
+      return -1; // Client went away mid-body
+    }
+
+    // Drain the pipe straight away so a resumed call starts with it empty
+    if ((rv = sink->splice(sink->arg, br->pipefd[0], k)) == -1) {
+      return -1;
+    }
+
+    moved = 1;
+    br->remaining -= k;
+    br->total += k;
+    if (rv == BODY_AGAIN) {
+      return BODY_AGAIN;
+    }
+  }
+
+  return 0;
+}
+
+/* Pass the rest of the current body piece to the sink */
+static int stream_remaining(struct body_reader *br, struct body_sink *sink) {
+  int rv;
+
+  // Bytes that arrived with the headers (or a chunk-size line) go first
+  if (br->remaining > 0 && br->start < br->end) {
+    int k = br->end - br->start;
+
+    if (k > br->remaining) {
+      k = br->remaining;
+    }
+    if ((rv = sink->write(sink->arg, br->buf + br->start, k)) == -1) {
+      return -1;
+    }
+    br->start += k;
+    br->remaining -= k;
+    br->total += k;
+    if (rv == BODY_AGAIN) {
+      return BODY_AGAIN;
+    }
+  }
+
+  if (br->remaining > 0 && br->pipefd[0] >= 0) {
+    rv = splice_remaining(br, sink);
+
+    if (rv <= 0) {
+      return rv;
+    }
+    // Not spliceable, fall back to copying from now on
+    body_reader_close(br);
+    br->no_splice = 1;
+  }
+
+  while (br->remaining > 0) {
+    int want = br->remaining < br->size ? br->remaining : br->size;
+    int k;
+
+    do {
+      k = body_recv(br, br->buf, want);
+    } while (k < 0 && errno == EINTR);
+
+    if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return BODY_AGAIN;
+    }
+    if (k <= 0) {
+      return -1;
+    }
+
+    br->start = br->end = 0;
+    if ((rv = sink->write(sink->arg, br->buf, k)) == -1) {
+      return -1;
+    }
+    br->remaining -= k;
+    br->total += k;
+    if (rv == BODY_AGAIN) {
+      return BODY_AGAIN;
+    }
+  }
+
+  return 0;
+}
+
+/* Pass everything up to the end of a framed input to the sink */
+static int stream_to_end(struct body_reader *br, struct body_sink *sink) {
+  int rv;
+
+  if (br->start < br->end) {
+    if ((rv = sink->write(sink->arg, br->buf + br->start,
+                          br->end - br->start)) == -1) {
+      return -1;
+    }
+    br->total += br->end - br->start;
+    br->start = br->end = 0;
+    if (rv == BODY_AGAIN) {
+      return BODY_AGAIN;
+    }
+  }
+
+  while (1) {
+    int k;
+
+    do {
+      k = body_recv(br, br->buf, br->size);
+    } while (k < 0 && errno == EINTR);
+
+    if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return BODY_AGAIN;
+    }
+    if (k <= 0) {
+      return k;
+    }
+
+    if ((rv = sink->write(sink->arg, br->buf, k)) == -1) {
+      return -1;
+    }
+    br->total += k;
+    if (rv == BODY_AGAIN) {
+      return BODY_AGAIN;
+    }
+  }
+}
+
+/* Run the body framing state machine as far as the input allows */
+static int step(struct body_reader *br, struct body_sink *sink) {
+  char *line;
+  int rv;
+
+  while (br->state != BODY_DONE) {
+    switch (br->state) {
+    case BODY_DATA:
+      if ((rv = stream_remaining(br, sink)) < 0) {
+        return rv;
+      }
+      br->state = BODY_DONE;
+      break;
+
+    case BODY_CHUNK_SIZE:
+      if ((rv = read_line(br, &line)) < 0) {
+        return rv;
+      }
+      if ((br->remaining = parse_chunk_size(line)) < 0) {
+        return -1;
+      }
+      br->state = br->remaining > 0 ? BODY_CHUNK_DATA : BODY_TRAILER;
+      break;
+
+    case BODY_CHUNK_DATA:
+      if ((rv = stream_remaining(br, sink)) < 0) {
+        return rv;
+      }
+      br->state = BODY_CHUNK_END;
+      break;
+
+    case BODY_CHUNK_END:
+      // Each chunk's data is followed by a bare CRLF
+      if ((rv = read_line(br, &line)) < 0) {
+        return rv;
+      }
+      if (*line != '\0') {
+        return -1;
+      }
+      br->state = BODY_CHUNK_SIZE;
+      break;
+
+    case BODY_TRAILER:
+      // Skip any trailer fields up to the terminating empty line
+      if ((rv = read_line(br, &line)) < 0) {
+        return rv;
+      }
+      if (*line == '\0') {
+        br->state = BODY_DONE;
+      }
+      break;
+
+    case BODY_TO_END:
+      if ((rv = stream_to_end(br, sink)) < 0) {
+        return rv;
+      }
+      br->state = BODY_DONE;
+      break;
+    }
+  }
+
+  return 0;
+}
+
+/* Set up a reader for the body of the request in buf
+ *
+ * buf holds the request as received so far: the headers, scanned into
+ * head, end at body_offset and buf_len bytes are valid. The reader reuses
+ * the whole buffer (size bytes) for I/O, so the headers are clobbered once
+ * streaming starts.
+ *
+ * A request with neither Content-Length nor chunked encoding has an empty
+ * body, unless its I/O is framed, when the body is whatever the input holds
+ * until it ends. Answers "Expect: 100-continue" if the client is waiting for it.
+ *
+ * Returns -1 if the framing headers are invalid
+ */
+int body_reader_init(struct body_reader *br, int fd, char *buf, int size,
+                     struct http_head *head, int body_offset, int buf_len) {
+  char *v;
+  int len;
+
+  br->fd = fd;
+  br->buf = buf;
+  br->size = size;
+  br->start = body_offset;
+  br->end = buf_len;
+  br->chunked = 0;
+  br->length = 0;
+  br->state = BODY_DATA;
+  br->total = 0;
+  br->pipefd[0] = br->pipefd[1] = -1;
+  br->no_splice = br->io != NULL && br->io->recv != NULL;
+
+  if ((v = http_head_field(head, buf, "Transfer-Encoding", &len)) != NULL) {
+    // chunked must be the final coding; anything else can't be framed
+    if (len < 7 || strncasecmp(v + len - 7, "chunked", 7) != 0) {
+      return -1;
+    }
+    br->chunked = 1;
+    br->length = -1;
+    br->state = BODY_CHUNK_SIZE;
+  } else if ((v = http_head_field(head, buf, "Content-Length", &len)) !=
+             NULL) {
+    for (int i = 0; i < len; i++) {
+      if (!isdigit((unsigned char)v[i]) || i == 18) {
+        return -1;
+      }
+      br->length = br->length * 10 + (v[i] - '0');
+    }
+  } else if (br->io != NULL && br->io->framed) {
+    br->length = -1;
+    br->state = BODY_TO_END;
+  }
+
+  br->remaining = br->length > 0 ? br->length : 0;
+
+  if (br->start == br->end && br->length != 0 &&
+      (v = http_head_field(head, buf, "Expect", &len)) != NULL &&
+      len == 12 && strncasecmp(v, "100-continue", 12) == 0 &&
+      br->io != NULL) {
+    char *cont = "HTTP/1.1 100 Continue\r\n\r\n";
+
+    br->io->send(br->io->arg, cont, strlen(cont)); // A failure shows later
+  }
+
+  return 0;
+}
+
+/* Stream the request body into the sink
+ *
+ * Returns the number of body bytes delivered once the whole body is in,
+ * BODY_AGAIN if a non-blocking socket ran dry (call again when it is
+ * readable), or -1 if the body was malformed, the client went away, or the
+ * sink failed. The reader is closed when this returns anything but
+ * BODY_AGAIN.
+ */
+long long body_stream(struct body_reader *br, struct body_sink *sink) {
+  int rv;
+
+  if (br->pipefd[0] < 0 && !br->no_splice && sink->splice != NULL &&
+      pipe2(br->pipefd, O_CLOEXEC) < 0) {
+    br->pipefd[0] = br->pipefd[1] = -1;
+    br->no_splice = 1;
+  }
+
+  if ((rv = step(br, sink)) == BODY_AGAIN) {
+    return BODY_AGAIN;
+  }
+
+  body_reader_close(br);
+
+  return rv < 0 ? -1 : br->total;
+}
+
+/* Release what a reader holds; safe to call more than once */
+void body_reader_close(struct body_reader *br) {
+  if (br->pipefd[0] >= 0) {
+    close(br->pipefd[0]);
+    close(br->pipefd[1]);
+    br->pipefd[0] = br->pipefd[1] = -1;
+  }
+}
@@ -0,0 +1,53 @@
+#ifndef _BODY_H_
+#define _BODY_H_
+
+#define BODY_AGAIN -2 // body_stream() needs more input, or the sink a break
+
+// Where a request body goes as it arrives. Either callback may instead take
+// the data and return BODY_AGAIN, to have body_stream() return BODY_AGAIN
+// straight away and leave the buffer or pipe alone until called again.
+struct body_sink {
+  // Consume size bytes of body data; return -1 to abort
+  int (*write)(void *arg, void *data, int size);
+  // Optional: drain exactly size bytes from pipefd; return -1 to abort
+  int (*splice)(void *arg, int pipefd, int size);
+  void *arg;
+};
+
+// How a body reader gets at its connection: what it says back, and how it
+// reads one whose socket can't be read directly (TLS, HTTP/2)
+struct body_io {
+  int (*recv)(void *arg, void *buf, int len); // As recv(); NULL for the fd
+  int (*send)(void *arg, void *buf, int len); // All of it, or queued; or -1
+  void *arg;
+  int framed; // recv() returns 0 at the end of the body (an HTTP/2 stream)
+};
+
+// Streaming request body reader
+struct body_reader {
+  int fd;
+  struct body_io *io; // NULL if there's no one to answer; kept by init
+  char *buf; // I/O buffer, initially holding the request headers
+  int size;
+  int start, end; // Buffered body bytes are buf[start..end)
+
+  int chunked;
+  long long length; // Content-Length, or -1 if chunked or framed by io
+
+  // Progress, so streaming can resume when more input arrives
+  int state;
+  long long remaining; // Bytes left in the body or the current chunk
+  long long total;     // Body bytes delivered so far
+  int pipefd[2];       // For splicing, or -1
+  int no_splice;       // The socket or sink can't splice
+};
+
+struct http_head;
+
+extern int body_reader_init(struct body_reader *br, int fd, char *buf,
+                            int size, struct http_head *head, int body_offset,
+                            int buf_len);
+extern long long body_stream(struct body_reader *br, struct body_sink *sink);
+extern void body_reader_close(struct body_reader *br);
+
+#endif
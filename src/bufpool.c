@@ -0,0 +1,56 @@
+/* Pool of fixed-size I/O buffers
+ *
+ * Connections borrow a buffer only while data is actually in flight -- a
+ * request being read, a response the socket wasn't ready for -- and hand it
+ * back as soon as it's empty, so an idle keep-alive connection holds none.
+ * Returned buffers are kept on a free list for the next borrower instead of
+ * going back to malloc(), up to BUFPOOL_MAX_SPARE of them.
+ *
+ * The pool is per thread, so a loop never contends with another for it.
+ */
+
+#include "bufpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// A spare buffer's first bytes link it into the free list
+struct spare {
+  struct spare *next;
+};
+
+static __thread struct spare *spares;
+static __thread int nspares;
+
+/* A buffer of BUFPOOL_SIZE bytes; NULL on error */
+char *bufpool_get(void) {
+  struct spare *s = spares;
+
+  if (s != NULL) {
+    spares = s->next;
+    nspares--;
+    return (char *)s;
+  }
+
+  char *buf = malloc(BUFPOOL_SIZE);
+
+  if (buf == NULL) {
+    perror("malloc");
+  }
+  return buf;
+}
+
+/* Give back a buffer from bufpool_get(); NULL is ignored */
+void bufpool_put(char *buf) {
+  struct spare *s = (struct spare *)buf;
+
+  if (buf == NULL) {
+    return;
+  }
+  if (nspares >= BUFPOOL_MAX_SPARE) {
+    free(buf);
+    return;
+  }
+  s->next = spares;
+  spares = s;
+  nspares++;
+}
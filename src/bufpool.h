@@ -0,0 +1,10 @@
+#ifndef _BUFPOOL_H_
+#define _BUFPOOL_H_
+
+#define BUFPOOL_SIZE 65536     // Every buffer is this big
+#define BUFPOOL_MAX_SPARE 64   // Returned buffers kept for reuse, per thread
+
+extern char *bufpool_get(void);
+extern void bufpool_put(char *buf);
+
+#endif
@@ -1,8 +1,20 @@
 #include "cache.h"
 #include "hashtable.h"
+#include "list.h"
+#include "segstore.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+/* Current monotonic time in ms, at clock tick resolution */
+static long long now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
 /* Allocate a cache entry */
 struct cache_entry *alloc_entry(char *path, char *content_type, void *content,
@@ -20,6 +32,11 @@ struct cache_entry *alloc_entry(char *path, char *content_type, void *content,
   ce->content = malloc(content_length);
   memcpy(ce->content, content, content_length);
 
+  ce->used_ms = now_ms();
+  ce->expires_ms = 0;
+  ce->refresh_ms = 0;
+  ce->version = 0;
+
   return ce;
 }
 
@@ -31,60 +48,29 @@ void free_entry(struct cache_entry *entry) {
   free(entry);
 }
 
-/* Insert a cache entry at the head of a linked list */
-void dllist_insert_head(struct cache *cache, struct cache_entry *ce) {
-  // Insert at the head of the list
-  if (cache->head == NULL) {
-    cache->head = cache->tail = ce;
-    ce->prev = ce->next = NULL;
-  } else {
-    cache->head->prev = ce;
-    ce->next = cache->head;
-    ce->prev = NULL;
-    cache->head = ce;
-  }
-}
-
-/* Move a cache entry to the head of the list */
-void dllist_move_to_head(struct cache *cache, struct cache_entry *ce) {
-  if (ce != cache->head) {
-    if (ce == cache->tail) {
-      // We're the tail
-      cache->tail = ce->prev;
-      cache->tail->next = NULL;
-    } else {
-      // We're neither the head nor the tail
-      ce->prev->next = ce->next;
-      ce->next->prev = ce->prev;
-    }
-    ce->next = cache->head;
-    cache->head->prev = ce;
-    ce->prev = NULL;
-    cache->head = ce;
-  }
-}
-
-/* Remove the tail from the list and return it
+/* Clean LRU entries if the cache is oversized, in entries or bytes
  *
- *
- * NOTE: does not deallocate the tail
+ * With a disk tier, entries that never go stale are moved down to it.
  */
-struct cache_entry *dllist_remove_tail(struct cache *cache) {
-  struct cache_entry *oldtail = cache->tail;
-  cache->tail = oldtail->prev;
-  cache->tail->next = NULL;
+void clean_lru(struct cache *cache) {
+  while (cache->cur_size > cache->max_size ||
+         (cache->max_bytes > 0 && cache->cur_bytes > cache->max_bytes)) {
+    struct cache_entry *oldtail = cache->tail;
 
-  cache->cur_size--;
-  return oldtail;
-}
+    DLIST_REMOVE(cache->head, cache->tail, oldtail);
+    cache->cur_size--;
+    cache->cur_bytes -= oldtail->content_length;
 
-/* Clean LRU entries if the cache is oversized */
-void clean_lru(struct cache *cache) {
-  while (cache->cur_size > cache->max_size) {
-    struct cache_entry *oldtail = dllist_remove_tail(cache);
+    TRACE2(cache_evict, oldtail->path, oldtail->content_length);
 
     hashtable_delete(cache->index, oldtail->path);
+    if (cache->disk != NULL && oldtail->expires_ms == 0) {
+      segstore_put(cache->disk, oldtail->path, oldtail->content_type,
+                   oldtail->content, oldtail->content_length,
+                   oldtail->version);
+    }
     free_entry(oldtail);
+    cache->evictions++;
   }
 }
 
@@ -99,6 +85,14 @@ struct cache *cache_create(int max_size, int hashsize) {
   cache->index = hashtable_create(hashsize, NULL);
   cache->max_size = max_size;
   cache->cur_size = 0;
+  cache->cur_bytes = 0;
+  cache->max_bytes = 0;
+  cache->hits = cache->misses = 0;
+  cache->insertions = cache->evictions = 0;
+  cache->disk = NULL;
+  cache->disk_hits = 0;
+  cache->hot = NULL;
+  cache->hot_size = 0;
 
   return cache;
 }
@@ -112,43 +106,312 @@ void cache_free(struct cache *cache) {
     free_entry(cur_entry);
     cur_entry = next_entry;
   }
+
+  for (int i = 0; i < cache->hot_size; i++) {
+    free(cache->hot[i].path);
+  }
+  free(cache->hot);
+
   free(cache);
 }
 
 /* Store an entry in the cache
  *
- * This will also remove the least-recently-used items as necessary
+ * This will also remove the least-recently-used items as necessary. An
+ * entry larger than the whole byte limit isn't stored.
  *
  * NOTE: doesn't check for duplicate cache entries
  */
 void cache_put(struct cache *cache, char *path, char *content_type,
                void *content, int content_length) {
-  struct cache_entry *ce =
-      alloc_entry(path, content_type, content, content_length);
+  struct cache_entry *ce;
+
+  if (cache->max_bytes > 0 && content_length > cache->max_bytes) {
+    return;
+  }
+
+  ce = alloc_entry(path, content_type, content, content_length);
 
-  dllist_insert_head(cache, ce);
+  DLIST_INSERT_HEAD(cache->head, cache->tail, ce);
   hashtable_put(cache->index, path, ce);
   cache->cur_size++;
+  cache->cur_bytes += content_length;
+  cache->insertions++;
+
+  clean_lru(cache);
+}
+
+/* Store an entry that goes stale ttl_ms from now, in place of any entry
+ * already stored under path
+ *
+ * A stale entry is dropped by the next cache_get() for it.
+ */
+void cache_put_ttl(struct cache *cache, char *path, char *content_type,
+                   void *content, int content_length, int ttl_ms) {
+  cache_remove(cache, path);
+  cache_put(cache, path, content_type, content, content_length);
+  if (cache->head != NULL && strcmp(cache->head->path, path) == 0) {
+    cache->head->expires_ms = cache->head->used_ms + ttl_ms;
+  }
+}
+
+/* Store an entry that is fresh for ttl_ms from now and may then be served
+ * stale for stale_ms more, in place of any entry already stored under path
+ *
+ * For cache_get_swr().
+ */
+void cache_put_swr(struct cache *cache, char *path, char *content_type,
+                   void *content, int content_length, int ttl_ms,
+                   int stale_ms) {
+  cache_put_ttl(cache, path, content_type, content, content_length,
+                ttl_ms + stale_ms);
+  if (cache->head != NULL && strcmp(cache->head->path, path) == 0) {
+    cache->head->refresh_ms = cache->head->used_ms + ttl_ms;
+  }
+}
 
+/* Store an entry made from the given version of its source, in place of
+ * any entry already stored under path
+ *
+ * The caller compares that with the source's version on a hit.
+ */
+void cache_put_version(struct cache *cache, char *path, char *content_type,
+                       void *content, int content_length, uint64_t version) {
+  cache_remove(cache, path);
+  cache_put(cache, path, content_type, content, content_length);
+  if (cache->head != NULL && strcmp(cache->head->path, path) == 0) {
+    cache->head->version = version;
+  }
+}
+
+/* Limit the content bytes the cache holds, evicting down to it now
+ *
+ * The entry limit still applies; a partition of a shared cache gets both.
+ */
+void cache_limit_bytes(struct cache *cache, long max_bytes) {
+  cache->max_bytes = max_bytes;
   clean_lru(cache);
 }
 
+/* Move entries evicted from now on down to disk, and look there on a miss
+ *
+ * The store isn't owned by the cache, and should serve only this one.
+ */
+void cache_use_disk(struct cache *cache, struct segstore *disk) {
+  cache->disk = disk;
+}
+
+/* Bring the entry stored under path back up from disk, if it's there */
+static struct cache_entry *promote(struct cache *cache, char *path) {
+  char *content_type;
+  void *content;
+  int content_length;
+  uint64_t version;
+
+  if (segstore_get(cache->disk, path, &content_type, &content,
+                   &content_length, &version) < 0) {
+    return NULL;
+  }
+
+  // Copied before anything else is evicted to disk
+  cache_put(cache, path, content_type, content, content_length);
+  segstore_delete(cache->disk, path);
+
+  if (cache->head == NULL || strcmp(cache->head->path, path) != 0) {
+    return NULL;
+  }
+  cache->head->version = version;
+  cache->disk_hits++;
+  return cache->head;
+}
+
+/* Count a lookup in the hot-key tracker
+ *
+ * Space-saving: a key already tracked is bumped; otherwise it takes the slot
+ * of the least-counted key and inherits its count as the error bound. Any
+ * key looked up more than 1/hot_size of the time is guaranteed a slot.
+ */
+static void hot_observe(struct cache *cache, char *path) {
+  struct cache_hot_key *min = NULL;
+
+  for (int i = 0; i < cache->hot_size; i++) {
+    struct cache_hot_key *hk = &cache->hot[i];
+
+    if (hk->path == NULL) {
+      hk->path = strdup(path);
+      hk->count = 1;
+      hk->error = 0;
+      return;
+    }
+    if (strcmp(hk->path, path) == 0) {
+      hk->count++;
+      return;
+    }
+    if (min == NULL || hk->count < min->count) {
+      min = hk;
+    }
+  }
+
+  free(min->path);
+  min->path = strdup(path);
+  min->error = min->count;
+  min->count++;
+}
+
 /* Retrieve an entry from the cache */
 struct cache_entry *cache_get(struct cache *cache, char *path) {
   struct cache_entry *ce;
 
+  if (cache->hot != NULL) {
+    hot_observe(cache, path);
+  }
+
   ce = hashtable_get(cache->index, path);
+  if (ce != NULL && ce->expires_ms != 0 && now_ms() >= ce->expires_ms) {
+    cache_remove(cache, path);
+    ce = NULL;
+  }
+  if (ce == NULL && cache->disk != NULL) {
+    ce = promote(cache, path);
+  }
   if (ce == NULL) {
+    TRACE1(cache_miss, path);
+    cache->misses++;
     return NULL;
   }
 
-  dllist_move_to_head(cache, ce);
+  TRACE1(cache_hit, path);
+  cache->hits++;
+  ce->used_ms = now_ms();
+  DLIST_MOVE_TO_HEAD(cache->head, cache->tail, ce);
+
+  return ce;
+}
+
+/* Retrieve an entry stored with cache_put_swr(), fresh or stale
+ *
+ * Sets *refresh if the caller should compute the entry anew: when there is
+ * none, or it is stale and no other caller is on it. A stale entry is left
+ * to one caller at a time for lease_ms; the rest get it as it is meanwhile.
+ */
+struct cache_entry *cache_get_swr(struct cache *cache, char *path,
+                                  int lease_ms, int *refresh) {
+  struct cache_entry *ce = cache_get(cache, path);
+  long long now;
+
+  *refresh = ce == NULL;
+  if (ce != NULL && ce->refresh_ms != 0 && (now = now_ms()) >= ce->refresh_ms) {
+    ce->refresh_ms = now + lease_ms;
+    *refresh = 1;
+  }
 
   return ce;
 }
 
+/* Fill in the cache's counters and sizes */
+void cache_stats(struct cache *cache, struct cache_stats *stats) {
+  stats->hits = cache->hits;
+  stats->misses = cache->misses;
+  stats->insertions = cache->insertions;
+  stats->evictions = cache->evictions;
+  stats->entries = cache->cur_size;
+  stats->bytes = cache->cur_bytes;
+  stats->avg_entry_size =
+      cache->cur_size > 0 ? (double)cache->cur_bytes / cache->cur_size : 0;
+  stats->tail_age =
+      cache->tail != NULL ? (now_ms() - cache->tail->used_ms) / 1000.0 : 0;
+
+  stats->disk_hits = cache->disk_hits;
+  stats->disk_entries = 0;
+  stats->disk_bytes = 0;
+  if (cache->disk != NULL) {
+    struct segstore_stats disk;
+
+    segstore_stats(cache->disk, &disk);
+    stats->disk_entries = disk.entries;
+    stats->disk_bytes = disk.bytes;
+  }
+}
+
+/* Start counting lookups per key in a tracker of size slots
+ *
+ * Every cache_get() then scans the tracker, so keep size small.
+ *
+ * Return 0, or -1 on error.
+ */
+int cache_track_hot(struct cache *cache, int size) {
+  if (cache->hot != NULL || size <= 0) {
+    return -1;
+  }
+
+  cache->hot = calloc(size, sizeof *cache->hot);
+
+  if (cache->hot == NULL) {
+    return -1;
+  }
+
+  cache->hot_size = size;
+
+  return 0;
+}
+
+static int hot_key_cmp(const void *a, const void *b) {
+  const struct cache_hot_key *ka = a, *kb = b;
+
+  return (ka->count < kb->count) - (ka->count > kb->count);
+}
+
+/* Copy up to n of the most looked-up keys into keys, hottest first
+ *
+ * The paths stay owned by the cache and are valid until the next lookup.
+ *
+ * Return the number of keys copied.
+ */
+int cache_hot_keys(struct cache *cache, struct cache_hot_key *keys, int n) {
+  struct cache_hot_key *sorted;
+  int count = 0;
+
+  if (cache->hot == NULL ||
+      (sorted = malloc(cache->hot_size * sizeof *sorted)) == NULL) {
+    return 0;
+  }
+
+  for (int i = 0; i < cache->hot_size; i++) {
+    if (cache->hot[i].path != NULL) {
+      sorted[count++] = cache->hot[i];
+    }
+  }
+
+  qsort(sorted, count, sizeof *sorted, hot_key_cmp);
+
+  if (count > n) {
+    count = n;
+  }
+  for (int i = 0; i < count; i++) {
+    sorted[i].cached = hashtable_get(cache->index, sorted[i].path) != NULL;
+  }
+  memcpy(keys, sorted, count * sizeof *keys);
+  free(sorted);
+
+  return count;
+}
+
+/* Drop the entry stored under path
+ *
+ * Return 0, or -1 if there was none.
+ */
 int cache_remove(struct cache *cache, char *path) {
-  (void)cache;
-  (void)path;
+  struct cache_entry *ce = hashtable_delete(cache->index, path);
+  int on_disk = cache->disk != NULL && segstore_delete(cache->disk, path) == 0;
+
+  if (ce == NULL) {
+    return on_disk ? 0 : -1;
+  }
+
+  DLIST_REMOVE(cache->head, cache->tail, ce);
+  cache->cur_size--;
+  cache->cur_bytes -= ce->content_length;
+  free_entry(ce);
+
   return 0;
 }
\ No newline at end of file
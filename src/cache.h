@@ -1,22 +1,64 @@
 #ifndef _WEBCACHE_H_
 #define _WEBCACHE_H_
 
+#include <stdint.h>
+
 // Individual hash table entry
 struct cache_entry {
   char *path; // Endpoint path-- key to the cache
   char *content_type;
   int content_length;
   void *content;
+  long long used_ms; // Last put or hit, monotonic ms
+  long long expires_ms; // When it goes stale, monotonic ms; 0 for never
+  long long refresh_ms; // When it wants computing anew, if sooner; 0 if not
+  uint64_t version;     // Of what it was made from, if its putter says; or 0
 
   struct cache_entry *prev, *next; // Doubly-linked list
 };
 
+// A key in the hot-key tracker
+struct cache_hot_key {
+  char *path;
+  unsigned long count; // Lookups counted, an overestimate by at most error
+  unsigned long error;
+  int cached; // Whether the key is in the cache, set by cache_hot_keys()
+};
+
+// Counters and sizes reported by cache_stats()
+struct cache_stats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long insertions;
+  unsigned long evictions; // Entries dropped by clean_lru()
+  int entries;
+  long bytes;              // Content bytes resident
+  double avg_entry_size;   // Content bytes per entry
+  double tail_age;         // Seconds since the LRU tail was last used
+
+  unsigned long disk_hits; // Entries promoted back from the disk tier
+  int disk_entries;
+  long disk_bytes;         // Record bytes there
+};
+
+struct segstore;
+
 // A cache
 struct cache {
   struct hashtable *index;
   struct cache_entry *head, *tail; // Doubly-linked list
   int max_size;                    // Maximum number of entries
   int cur_size;                    // Current number of entries
+  long cur_bytes;                  // Content bytes resident
+  long max_bytes;                  // Content bytes allowed; 0 for no limit
+
+  unsigned long hits, misses, insertions, evictions;
+
+  struct segstore *disk; // Where evicted entries go, NULL if nowhere
+  unsigned long disk_hits;
+
+  struct cache_hot_key *hot; // Hot-key tracker, NULL if not enabled
+  int hot_size;
 };
 
 extern struct cache_entry *alloc_entry(char *path, char *content_type,
@@ -26,6 +68,23 @@ extern struct cache *cache_create(int max_size, int hashsize);
 extern void cache_free(struct cache *cache);
 extern void cache_put(struct cache *cache, char *path, char *content_type,
                       void *content, int content_length);
+extern void cache_put_ttl(struct cache *cache, char *path, char *content_type,
+                          void *content, int content_length, int ttl_ms);
+extern void cache_put_swr(struct cache *cache, char *path, char *content_type,
+                          void *content, int content_length, int ttl_ms,
+                          int stale_ms);
+extern void cache_put_version(struct cache *cache, char *path,
+                              char *content_type, void *content,
+                              int content_length, uint64_t version);
 extern struct cache_entry *cache_get(struct cache *cache, char *path);
+extern struct cache_entry *cache_get_swr(struct cache *cache, char *path,
+                                         int lease_ms, int *refresh);
+extern int cache_remove(struct cache *cache, char *path);
+extern void cache_stats(struct cache *cache, struct cache_stats *stats);
+extern void cache_limit_bytes(struct cache *cache, long max_bytes);
+extern void cache_use_disk(struct cache *cache, struct segstore *disk);
+extern int cache_track_hot(struct cache *cache, int size);
+extern int cache_hot_keys(struct cache *cache, struct cache_hot_key *keys,
+                          int n);
 
 #endif
\ No newline at end of file
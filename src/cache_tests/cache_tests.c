@@ -1,9 +1,12 @@
 #include "../cache.h"
 #include "../hashtable.h"
+#include "../segstore.h"
 #include "minunit.h"
 #include "utils.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 char *test_cache_create() {
   int max_size = 10;
@@ -47,7 +50,8 @@ char *test_cache_alloc_entry() {
   mu_assert(check_strings(ce->content_type, content_type) == 0,
             "Your alloc_entry function did not allocate the content_type field "
             "to the expected string");
-  mu_assert(check_strings(ce->content, content) == 0,
+  // content_length bytes, without a NUL after them
+  mu_assert(memcmp(ce->content, content, strlen(content)) == 0,
             "Your alloc_entry function did not allocate the content field to "
             "the expected string");
   mu_assert(ce->content_length == strlen(content),
@@ -242,6 +246,362 @@ char *test_cache_get() {
   return NULL;
 }
 
+char *test_cache_stats() {
+  // Create a cache with 2 slots
+  struct cache *cache = cache_create(2, 0);
+  struct cache_stats stats;
+  struct cache_hot_key hot[4];
+  int n;
+
+  mu_assert(cache_track_hot(cache, 2) == 0,
+            "cache_track_hot did not enable the hot-key tracker");
+
+  cache_put(cache, "/1", "text/plain", "11", 2);
+  cache_put(cache, "/2", "text/plain", "2222", 4);
+  cache_get(cache, "/1");
+  cache_get(cache, "/1");
+  cache_get(cache, "/missing");
+  // Evicts /2, the least recently used
+  cache_put(cache, "/3", "text/plain", "333333", 6);
+
+  cache_stats(cache, &stats);
+  mu_assert(stats.hits == 2, "cache_stats did not count cache hits");
+  mu_assert(stats.misses == 1, "cache_stats did not count cache misses");
+  mu_assert(stats.insertions == 3, "cache_stats did not count insertions");
+  mu_assert(stats.evictions == 1, "cache_stats did not count evictions");
+  mu_assert(stats.entries == 2 && stats.bytes == 8,
+            "cache_stats did not report the resident entries and bytes");
+  mu_assert(stats.avg_entry_size == 4,
+            "cache_stats did not report the average entry size");
+  mu_assert(stats.tail_age >= 0 && stats.tail_age < 60,
+            "cache_stats did not report the age of the LRU tail");
+
+  // /1 was looked up twice; /missing replaced nothing yet
+  n = cache_hot_keys(cache, hot, 4);
+  mu_assert(n == 2, "cache_hot_keys did not return every tracked key");
+  mu_assert(check_strings(hot[0].path, "/1") == 0 && hot[0].count == 2 &&
+                hot[0].error == 0 && hot[0].cached,
+            "cache_hot_keys did not put the hottest key first");
+  mu_assert(check_strings(hot[1].path, "/missing") == 0 && !hot[1].cached,
+            "cache_hot_keys did not report an uncached key");
+
+  // A third key takes the least-counted slot and inherits its count
+  cache_get(cache, "/3");
+  n = cache_hot_keys(cache, hot, 4);
+  mu_assert(n == 2 && check_strings(hot[1].path, "/3") == 0 &&
+                hot[1].count == 2 && hot[1].error == 1,
+            "The hot-key tracker did not replace the least-counted key");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_limit_bytes() {
+  // Room for plenty of entries, but only 10 bytes of content
+  struct cache *cache = cache_create(10, 0);
+  struct cache_stats stats;
+
+  cache_limit_bytes(cache, 10);
+
+  cache_put(cache, "/1", "text/plain", "1111", 4);
+  cache_put(cache, "/2", "text/plain", "2222", 4);
+  cache_get(cache, "/1");
+  // Evicts /2, the least recently used, to stay within the limit
+  cache_put(cache, "/3", "text/plain", "333333", 6);
+
+  mu_assert(cache_get(cache, "/2") == NULL,
+            "cache_put did not evict down to the byte limit");
+  mu_assert(cache_get(cache, "/1") != NULL && cache_get(cache, "/3") != NULL,
+            "cache_put evicted more than the byte limit needed");
+
+  // Too big to fit at all; nothing is evicted for it
+  cache_put(cache, "/4", "text/plain", "44444444444", 11);
+  mu_assert(cache_get(cache, "/4") == NULL,
+            "cache_put stored an entry larger than the byte limit");
+
+  // Lowering the limit evicts right away, down to an empty cache
+  cache_limit_bytes(cache, 5);
+  cache_limit_bytes(cache, 1);
+  cache_stats(cache, &stats);
+  mu_assert(stats.entries == 0 && stats.bytes == 0 && cache->head == NULL &&
+                cache->tail == NULL,
+            "cache_limit_bytes did not evict down to the new limit");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+static void count_entry(void *data, void *arg) {
+  (void)data;
+  (*(int *)arg)++;
+}
+
+char *test_hashtable() {
+  // One bucket, so every key shares a chain
+  struct hashtable *ht = hashtable_create(1, NULL);
+  int one = 1, two = 2, three = 3, again = 4, count = 0;
+
+  hashtable_put(ht, "/1", &one);
+  hashtable_put(ht, "/2", &two);
+  hashtable_put(ht, "/3", &three);
+  mu_assert(ht->num_entries == 3, "hashtable_put did not count its entries");
+  mu_assert(hashtable_get(ht, "/1") == &one &&
+                hashtable_get(ht, "/2") == &two &&
+                hashtable_get(ht, "/3") == &three,
+            "hashtable_get did not find every key in a chain");
+  mu_assert(hashtable_get(ht, "/4") == NULL && hashtable_get(ht, "/") == NULL,
+            "hashtable_get found a key that isn't there");
+
+  // Deleting from the middle of the chain leaves the rest
+  mu_assert(hashtable_delete(ht, "/2") == &two,
+            "hashtable_delete did not return the deleted data");
+  mu_assert(hashtable_get(ht, "/2") == NULL &&
+                hashtable_get(ht, "/1") == &one &&
+                hashtable_get(ht, "/3") == &three && ht->num_entries == 2,
+            "hashtable_delete did not unlink just the one entry");
+  mu_assert(hashtable_delete(ht, "/2") == NULL,
+            "hashtable_delete deleted a key that isn't there");
+
+  // A key put twice is found, and deleted, oldest first
+  hashtable_put(ht, "/1", &again);
+  mu_assert(hashtable_get(ht, "/1") == &one,
+            "hashtable_get did not find the older of two duplicate keys");
+  mu_assert(hashtable_delete(ht, "/1") == &one &&
+                hashtable_get(ht, "/1") == &again,
+            "hashtable_delete did not delete the older duplicate first");
+
+  hashtable_foreach(ht, count_entry, &count);
+  mu_assert(count == 2, "hashtable_foreach did not visit every entry");
+
+  hashtable_destroy(ht);
+
+  return NULL;
+}
+
+char *test_cache_ttl() {
+  struct cache *cache = cache_create(10, 0);
+  struct cache_entry *entry;
+
+  cache_put_ttl(cache, "/t", "text/plain", "tttt", 5, 200);
+  cache_put(cache, "/forever", "text/plain", "ffff", 5);
+
+  entry = cache_get(cache, "/t");
+  mu_assert(entry != NULL && check_strings(entry->content, "tttt") == 0,
+            "cache_get did not serve an entry before its TTL ran out");
+
+  // Putting it again replaces it, with a new TTL
+  cache_put_ttl(cache, "/t", "text/plain", "TTTT", 5, 200);
+  entry = cache_get(cache, "/t");
+  mu_assert(entry != NULL && check_strings(entry->content, "TTTT") == 0 &&
+                cache->cur_size == 2,
+            "cache_put_ttl did not replace the entry already stored");
+
+  usleep(400000);
+  mu_assert(cache_get(cache, "/t") == NULL,
+            "cache_get served an entry after its TTL ran out");
+  mu_assert(cache->cur_size == 1 && hashtable_get(cache->index, "/t") == NULL,
+            "cache_get did not remove the expired entry");
+  mu_assert(cache_get(cache, "/forever") != NULL,
+            "An entry without a TTL expired");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_swr() {
+  struct cache *cache = cache_create(10, 0);
+  struct cache_entry *entry;
+  int refresh;
+
+  // A miss is for the caller to fill
+  mu_assert(cache_get_swr(cache, "/r", 200, &refresh) == NULL && refresh == 1,
+            "cache_get_swr did not ask for a missing entry to be computed");
+
+  // Fresh for 200 ms, then served stale for 1000 ms more
+  cache_put_swr(cache, "/r", "text/plain", "rrrr", 5, 200, 1000);
+  entry = cache_get_swr(cache, "/r", 200, &refresh);
+  mu_assert(entry != NULL && check_strings(entry->content, "rrrr") == 0 &&
+                refresh == 0,
+            "cache_get_swr asked for a fresh entry to be computed anew");
+
+  // Stale: one caller gets the refresh, the rest the stale entry meanwhile
+  usleep(300000);
+  entry = cache_get_swr(cache, "/r", 200, &refresh);
+  mu_assert(entry != NULL && refresh == 1,
+            "cache_get_swr did not hand out a refresh for a stale entry");
+  entry = cache_get_swr(cache, "/r", 200, &refresh);
+  mu_assert(entry != NULL && refresh == 0,
+            "cache_get_swr handed out a second refresh during the lease");
+
+  // The lease ran out without a new entry: one more refresh, once
+  usleep(300000);
+  entry = cache_get_swr(cache, "/r", 200, &refresh);
+  mu_assert(entry != NULL && refresh == 1,
+            "cache_get_swr did not hand out a refresh once the lease ran out");
+  entry = cache_get_swr(cache, "/r", 200, &refresh);
+  mu_assert(entry != NULL && refresh == 0,
+            "cache_get_swr handed out a second refresh during the lease");
+
+  // Past ttl + stale the entry is gone
+  usleep(700000);
+  mu_assert(cache_get_swr(cache, "/r", 200, &refresh) == NULL && refresh == 1,
+            "cache_get_swr served an entry past its stale period");
+  mu_assert(cache->cur_size == 0 && hashtable_get(cache->index, "/r") == NULL,
+            "cache_get_swr did not drop the expired entry");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_disk() {
+  char dir[] = "/tmp/cache_tests.XXXXXX";
+  struct segstore *disk;
+  struct cache *cache = cache_create(1, 0);
+  struct cache_entry *entry;
+  struct cache_stats stats;
+
+  mu_assert(mkdtemp(dir) != NULL, "Could not make a directory for segments");
+  disk = segstore_create(dir, 0);
+  mu_assert(disk != NULL, "segstore_create did not open its directory");
+  cache_use_disk(cache, disk);
+
+  // Room for one entry: /1 is evicted down to disk
+  cache_put_version(cache, "/1", "text/plain", "1111", 5, 7);
+  cache_put(cache, "/2", "text/html", "2222", 5);
+  cache_stats(cache, &stats);
+  mu_assert(stats.entries == 1 && stats.evictions == 1 &&
+                stats.disk_entries == 1 && stats.disk_bytes > 5,
+            "clean_lru did not move the evicted entry to disk");
+
+  // A hit on disk brings it back up, and /2 goes down in its place
+  entry = cache_get(cache, "/1");
+  mu_assert(entry != NULL && check_strings(entry->content, "1111") == 0 &&
+                check_strings(entry->content_type, "text/plain") == 0 &&
+                entry->content_length == 5 && entry->version == 7,
+            "cache_get did not promote the entry from disk");
+  cache_stats(cache, &stats);
+  mu_assert(stats.hits == 1 && stats.disk_hits == 1 &&
+                stats.disk_entries == 1 && cache->head == entry,
+            "cache_get did not count the promotion, or left the entry on "
+            "disk");
+
+  // Removing an entry that is only on disk drops it there
+  mu_assert(cache_remove(cache, "/2") == 0,
+            "cache_remove did not find the entry on disk");
+  mu_assert(cache_get(cache, "/2") == NULL,
+            "cache_remove left the entry on disk");
+
+  // Entries that go stale aren't kept on disk
+  cache_put_ttl(cache, "/3", "text/plain", "3333", 5, 60000);
+  cache_put(cache, "/4", "text/plain", "4444", 5);
+  cache_stats(cache, &stats);
+  mu_assert(stats.disk_entries == 1 && cache_get(cache, "/3") == NULL,
+            "clean_lru moved an entry with a TTL to disk");
+
+  cache_free(cache);
+  segstore_free(disk);
+  rmdir(dir);
+
+  return NULL;
+}
+
+char *test_segstore() {
+  char dir[] = "/tmp/cache_tests.XXXXXX";
+  // Fifteen records of a little over 1/16 of a segment fit in each
+  int size = SEGSTORE_SEGMENT_SIZE / 16, length;
+  char *content = calloc(1, SEGSTORE_MAX_RECORD), *content_type, path[16];
+  void *stored;
+  uint64_t version;
+  struct segstore *store;
+  struct segstore_stats stats;
+
+  mu_assert(mkdtemp(dir) != NULL, "Could not make a directory for segments");
+  store = segstore_create(dir, 2 * SEGSTORE_SEGMENT_SIZE);
+  mu_assert(store != NULL, "segstore_create did not open its directory");
+
+  // Fill the budget, two segments: /0 to /14 and /15 to /29. The writer
+  // is let catch up each time, or puts would be refused
+  for (int i = 0; i < 30; i++) {
+    sprintf(path, "/%d", i);
+    content[0] = i;
+    mu_assert(segstore_put(store, path, "text/plain", content, size, i) == 0,
+              "segstore_put did not store a record");
+    segstore_flush(store);
+  }
+
+  // With the first segment mostly dead, starting a third compacts it
+  for (int i = 0; i < 12; i++) {
+    sprintf(path, "/%d", i);
+    segstore_delete(store, path);
+  }
+  segstore_put(store, "/30", "text/plain", content, size, 30);
+  segstore_flush(store);
+  segstore_stats(store, &stats);
+  mu_assert(stats.compactions == 1 && stats.drops == 0 &&
+                stats.entries == 19,
+            "Starting a segment did not compact the mostly-dead one");
+  mu_assert(segstore_get(store, "/12", &content_type, &stored, &length,
+                         &version) == 0 &&
+                ((char *)stored)[0] == 12 && length == size &&
+                strcmp(content_type, "text/plain") == 0 && version == 12,
+            "Compacting did not copy the live records forward intact");
+  mu_assert(segstore_get(store, "/0", &content_type, &stored, &length,
+                         &version) < 0,
+            "segstore_get found a deleted record");
+  mu_assert(stats.disk_bytes == 2 * SEGSTORE_SEGMENT_SIZE,
+            "Compacting did not give the segment back");
+
+  // Once the third fills up, the fuller of the two is reclaimed: it is
+  // mostly live, so its entries are dropped instead of copied
+  segstore_delete(store, "/29");
+  for (int i = 31; i <= 42; i++) {
+    sprintf(path, "/%d", i);
+    segstore_put(store, path, "text/plain", content, size, i);
+    segstore_flush(store);
+    segstore_stats(store, &stats);
+    mu_assert(stats.disk_bytes <= 2 * SEGSTORE_SEGMENT_SIZE,
+              "The store went over its budget");
+  }
+  mu_assert(stats.compactions == 1 && stats.drops == 14,
+            "Starting a segment did not drop the mostly-live one");
+  mu_assert(segstore_get(store, "/15", &content_type, &stored, &length,
+                         &version) < 0 &&
+                segstore_get(store, "/12", &content_type, &stored, &length,
+                             &version) == 0,
+            "Dropping a segment lost the wrong entries");
+
+  // A record can be read back before the writer gets to it, and after
+  content[0] = 43;
+  mu_assert(segstore_put(store, "/43", "text/plain", content, size, 43) == 0 &&
+                segstore_get(store, "/43", &content_type, &stored, &length,
+                             &version) == 0 &&
+                ((char *)stored)[0] == 43 && version == 43,
+            "segstore_get did not find a record still being written");
+  segstore_flush(store);
+  mu_assert(segstore_get(store, "/43", &content_type, &stored, &length,
+                         &version) == 0 &&
+                ((char *)stored)[0] == 43 && version == 43,
+            "segstore_get did not find the record once written");
+
+  // No record may take up more than half a segment
+  mu_assert(segstore_put(store, "/big", "text/plain", content,
+                         SEGSTORE_MAX_RECORD, 0) < 0,
+            "segstore_put stored a record over SEGSTORE_MAX_RECORD");
+  mu_assert(segstore_get(store, "/big", &content_type, &stored, &length,
+                         &version) < 0,
+            "segstore_get found a record that was refused");
+
+  segstore_free(store);
+  free(content);
+  rmdir(dir);
+
+  return NULL;
+}
+
 char *all_tests() {
   mu_suite_start();
 
@@ -249,6 +609,13 @@ char *all_tests() {
   mu_run_test(test_cache_alloc_entry);
   mu_run_test(test_cache_put);
   mu_run_test(test_cache_get);
+  mu_run_test(test_cache_stats);
+  mu_run_test(test_cache_limit_bytes);
+  mu_run_test(test_hashtable);
+  mu_run_test(test_cache_ttl);
+  mu_run_test(test_cache_swr);
+  mu_run_test(test_cache_disk);
+  mu_run_test(test_segstore);
 
   return NULL;
 }
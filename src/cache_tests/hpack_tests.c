@@ -0,0 +1,167 @@
+#include "../hpack.h"
+#include "minunit.h"
+#include <string.h>
+
+// The fields a header block decoded to, NUL-terminated
+struct fields {
+  int n;
+  char name[8][128];
+  char value[8][128];
+};
+
+static int collect(void *arg, char *name, int name_len, char *value,
+                   int value_len) {
+  struct fields *f = arg;
+
+  if (f->n == 8 || name_len >= 128 || value_len >= 128) {
+    return -1;
+  }
+  memcpy(f->name[f->n], name, name_len);
+  f->name[f->n][name_len] = '\0';
+  memcpy(f->value[f->n], value, value_len);
+  f->value[f->n][value_len] = '\0';
+  f->n++;
+  return 0;
+}
+
+static int decode(struct hpack_table *t, unsigned char *in, int len,
+                  struct fields *f) {
+  memset(f, 0, sizeof *f);
+  return hpack_decode(t, in, len, collect, f);
+}
+
+static int is_field(struct fields *f, int i, char *name, char *value) {
+  return i < f->n && strcmp(f->name[i], name) == 0 &&
+         strcmp(f->value[i], value) == 0;
+}
+
+char *test_hpack_huffman() {
+  struct hpack_table t;
+  struct fields f;
+  // RFC 7541 C.4.1: a request with a Huffman-coded :authority
+  unsigned char request[] = {0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3,
+                             0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab,
+                             0x90, 0xf4, 0xff};
+  // "a" is 00011, then padding: the top bits of EOS, or something else
+  unsigned char padded[] = {0x00, 0x01, 'x', 0x81, 0x1f};
+  unsigned char zero_padded[] = {0x00, 0x01, 'x', 0x81, 0x18};
+  unsigned char long_padded[] = {0x00, 0x01, 'x', 0x82, 0x1f, 0xff};
+  // EOS itself, 30 ones, padded to 32 bits
+  unsigned char eos[] = {0x00, 0x01, 'x', 0x84, 0xff, 0xff, 0xff, 0xff};
+
+  hpack_init(&t, HPACK_TABLE_SIZE);
+
+  mu_assert(decode(&t, request, sizeof request, &f) == 0 && f.n == 4 &&
+                is_field(&f, 0, ":method", "GET") &&
+                is_field(&f, 1, ":scheme", "http") &&
+                is_field(&f, 2, ":path", "/") &&
+                is_field(&f, 3, ":authority", "www.example.com"),
+            "hpack_decode did not decode the RFC's Huffman-coded request");
+  mu_assert(t.count == 1 && t.size == 57,
+            "hpack_decode did not index the literal field");
+
+  mu_assert(decode(&t, padded, sizeof padded, &f) == 0 &&
+                is_field(&f, 0, "x", "a"),
+            "hpack_decode refused a string padded with the top bits of EOS");
+  mu_assert(decode(&t, zero_padded, sizeof zero_padded, &f) < 0,
+            "hpack_decode accepted padding that isn't all ones");
+  mu_assert(decode(&t, long_padded, sizeof long_padded, &f) < 0,
+            "hpack_decode accepted more than seven bits of padding");
+  mu_assert(decode(&t, eos, sizeof eos, &f) < 0,
+            "hpack_decode accepted EOS in a string");
+
+  hpack_free(&t);
+
+  return NULL;
+}
+
+char *test_hpack_eviction() {
+  struct hpack_table t;
+  struct fields f;
+  // Indexed literal "x-name: v", 39 octets in the table
+  unsigned char first[] = {0x40, 0x06, 'x', '-', 'n', 'a', 'm', 'e',
+                           0x01, 'v'};
+  // Indexed literal named by entry 62, that same entry, with a value too
+  // big for both to fit: the entry naming it is evicted to make room
+  unsigned char second[2 + 40] = {0x40 | 62, 40};
+  unsigned char indexed[] = {0x80 | 62};
+  unsigned char beyond[] = {0x80 | 63};
+  unsigned char huge[4 + 80];
+
+  memset(second + 2, 'w', 40);
+  hpack_init(&t, 100);
+
+  mu_assert(decode(&t, first, sizeof first, &f) == 0 && t.count == 1 &&
+                t.size == 39,
+            "hpack_decode did not add the field to the table");
+  mu_assert(decode(&t, second, sizeof second, &f) == 0 &&
+                is_field(&f, 0, "x-name",
+                         "wwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwww"),
+            "hpack_decode did not decode a field named by the table");
+  mu_assert(t.count == 1 && t.size == 6 + 40 + 32,
+            "hpack_decode did not evict the oldest entry to make room");
+  mu_assert(decode(&t, indexed, 1, &f) == 0 &&
+                is_field(&f, 0, "x-name",
+                         "wwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwwww"),
+            "The new entry did not keep the evicted entry's name");
+  mu_assert(decode(&t, beyond, 1, &f) < 0,
+            "hpack_decode found an index past the end of the table");
+
+  // An entry bigger than the whole table just empties it
+  huge[0] = 0x40;
+  huge[1] = 0x01;
+  huge[2] = 'a';
+  huge[3] = 80;
+  memset(huge + 4, 'h', 80);
+  mu_assert(decode(&t, huge, sizeof huge, &f) == 0 && f.n == 1 &&
+                t.count == 0 && t.size == 0,
+            "An entry bigger than the table did not empty it");
+
+  hpack_free(&t);
+
+  return NULL;
+}
+
+char *test_hpack_size_update() {
+  struct hpack_table t;
+  struct fields f;
+  unsigned char first[] = {0x40, 0x01, 'a', 0x01, 'b'};
+  unsigned char to_zero[] = {0x20};
+  unsigned char to_100[] = {0x3f, 0x45}; // 31 + 69
+  unsigned char too_big[] = {0x3f, 0x46}; // 101, over the limit
+  unsigned char indexed[] = {0x80 | 62};
+
+  hpack_init(&t, 100);
+  decode(&t, first, sizeof first, &f);
+
+  mu_assert(decode(&t, to_zero, 1, &f) == 0 && t.count == 0 &&
+                t.size == 0 && t.max_size == 0,
+            "A table size update to 0 did not empty the table");
+  mu_assert(decode(&t, indexed, 1, &f) < 0,
+            "hpack_decode found an entry in an emptied table");
+  mu_assert(decode(&t, first, sizeof first, &f) == 0 && t.count == 0,
+            "hpack_decode added an entry to a table of size 0");
+
+  mu_assert(decode(&t, to_100, sizeof to_100, &f) == 0 && t.max_size == 100,
+            "A table size update back up to the limit was refused");
+  mu_assert(decode(&t, first, sizeof first, &f) == 0 && t.count == 1,
+            "hpack_decode did not add an entry once the table had room");
+  mu_assert(decode(&t, too_big, sizeof too_big, &f) < 0,
+            "A table size update over the limit was accepted");
+
+  hpack_free(&t);
+
+  return NULL;
+}
+
+char *all_tests() {
+  mu_suite_start();
+
+  mu_run_test(test_hpack_huffman);
+  mu_run_test(test_hpack_eviction);
+  mu_run_test(test_hpack_size_update);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
@@ -0,0 +1,63 @@
+#include "../mime.h"
+#include "minunit.h"
+#include <string.h>
+
+char *test_mime_known() {
+  mu_assert(strcmp(mime_type_get("index.html"), "text/html") == 0 &&
+                strcmp(mime_type_get("/a/b/style.css"), "text/css") == 0 &&
+                strcmp(mime_type_get("photo.jpeg"), "image/jpeg") == 0 &&
+                strcmp(mime_type_get("notes.txt"), "text/plain") == 0,
+            "mime_type_get did not find a listed extension");
+  mu_assert(strcmp(mime_type_get("archive.tar.htm"), "text/html") == 0,
+            "mime_type_get did not go by the last extension");
+
+  return NULL;
+}
+
+char *test_mime_case() {
+  mu_assert(strcmp(mime_type_get("INDEX.HTML"), "text/html") == 0 &&
+                strcmp(mime_type_get("Photo.JpG"), "image/jpeg") == 0 &&
+                strcmp(mime_type_get("notes.Txt"), "text/plain") == 0,
+            "mime_type_get did not match an extension case-insensitively");
+
+  return NULL;
+}
+
+char *test_mime_default() {
+  char *fallback = "application/octet-stream";
+
+  mu_assert(strcmp(mime_type_get("file.nosuchext"), fallback) == 0 &&
+                strcmp(mime_type_get("file.htmlx"), fallback) == 0 &&
+                strcmp(mime_type_get("file.ht"), fallback) == 0,
+            "mime_type_get did not fall back for an unknown extension");
+  mu_assert(strcmp(mime_type_get("README"), fallback) == 0 &&
+                strcmp(mime_type_get("dir.html/README"), fallback) == 0 &&
+                strcmp(mime_type_get("file."), fallback) == 0,
+            "mime_type_get did not fall back for a name without an "
+            "extension");
+
+  return NULL;
+}
+
+char *test_mime_unmodified() {
+  char filename[] = "/Some/Dir.d/Page.HTML";
+
+  mime_type_get(filename);
+  mu_assert(strcmp(filename, "/Some/Dir.d/Page.HTML") == 0,
+            "mime_type_get modified the filename it was given");
+
+  return NULL;
+}
+
+char *all_tests() {
+  mu_suite_start();
+
+  mu_run_test(test_mime_known);
+  mu_run_test(test_mime_case);
+  mu_run_test(test_mime_default);
+  mu_run_test(test_mime_unmodified);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
@@ -0,0 +1,1164 @@
+/* Connection event loop
+ *
+ * Every socket is non-blocking and watched by one epoll instance, so a slow
+ * or idle client never holds up anyone else. A connection is always in one
+ * of a few states, each with a deadline on the timing wheel:
+ *
+ *    HANDSHAKE  a TLS handshake, on HTTPS             part of HEADER_TIMEOUT
+ *    HEADERS    reading a request's header block      HEADER_TIMEOUT in all
+ *    BODY       a handler is waiting for more body    BODY_TIMEOUT per piece,
+ *               or for the client to take what it     or WRITE_STALL_TIMEOUT
+ *               has sent so far
+ *    WRITING    the client isn't taking the response  WRITE_STALL_TIMEOUT
+ *    IDLE       kept alive between requests           KEEPALIVE_TIMEOUT
+ *    H2         HTTP/2, any number of streams         KEEPALIVE_TIMEOUT with
+ *                                                     none open, else as BODY
+ *                                                     or WRITING
+ *
+ * The header deadline counts from the first byte and is never extended, so
+ * trickling a request a byte at a time (slowloris) buys nothing. When a
+ * deadline passes the connection is simply closed.
+ *
+ * Connections accepted on a TLS listener do their I/O through tls.c. OpenSSL
+ * may decrypt more than was asked for, which epoll can't see, so such a
+ * connection is put straight on the ready list while input is pending.
+ *
+ * A connection switches to HTTP/2 (h2.c) when it opens with the HTTP/2
+ * preface, when a cleartext request asks with "Upgrade: h2c", or when the
+ * client picks "h2" during the TLS handshake. The session then reads and
+ * writes through conn_recv() and conn_send() like any handler would.
+ *
+ * A request and its I/O buffer are only allocated once bytes arrive, so
+ * idle connections cost a small struct each. Response bytes the socket
+ * can't take right away are copied aside and sent as it drains.
+ *
+ * Each request is stamped with when it was (at the latest) ready to be
+ * handled, so admission control can see how far behind the loop is.
+ *
+ * A draining loop has stopped accepting: every response says "Connection:
+ * close", and the loop returns once the last connection is gone.
+ */
+
+#define _GNU_SOURCE
+#include "conn.h"
+#include "h2.h"
+#include "net.h"
+#include "timerwheel.h"
+#include "tls.h"
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+#define MAX_LISTENERS 4
+#define TLS_COALESCE_SIZE 16384 // One record's worth of response pieces
+
+enum conn_state {
+  CONN_HANDSHAKE,
+  CONN_HEADERS,
+  CONN_BODY,
+  CONN_WRITING,
+  CONN_IDLE,
+  CONN_H2
+};
+
+struct listener {
+  struct conn_watch watch;
+  struct conn_loop *loop;
+  struct tls *tls; // HTTPS, or NULL
+};
+
+struct conn_loop {
+  int epfd;
+  struct listener listeners[MAX_LISTENERS];
+  int nlisteners;
+  struct timerwheel wheel;
+  conn_handler handler;
+  void *arg;
+  int conns;
+  struct conn *ready; // To be run this iteration; see schedule()
+
+  uint64_t polled;      // When the last epoll_wait() returned
+  uint64_t ready_since; // This batch of events has waited since then
+
+  int draining;
+  uint64_t drain_deadline; // ms
+};
+
+// epoll data for a conn_watch is its address with the low bit set
+#define WATCH_TAG 1
+
+struct conn {
+  int fd;
+  enum conn_state state;
+  char addr[INET6_ADDRSTRLEN];
+  struct conn_loop *loop;
+  struct timer timer;
+  unsigned int events; // What epoll is watching for
+  int watched;         // Registered with epoll
+  int paused;          // Waiting for conn_wake()
+  int failed;          // A write failed; close once the handler returns
+  int queued;          // On the loop's ready list
+  struct conn *ready_next;
+
+  struct tls_conn *tls; // NULL for plain HTTP
+  struct body_io body_io;
+  struct h2 *h2; // Once the connection has switched to HTTP/2
+
+  struct request *req; // NULL between requests
+
+  // Response data the socket wasn't ready for; a pooled buffer unless it
+  // outgrew one
+  char *out;
+  int out_len, out_size, out_sent;
+  int out_pooled;
+  int file_fd; // A file to sendfile() after out, or -1
+  off_t file_offset, file_end;
+};
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void arm(struct conn *c, int timeout_ms) {
+  timer_arm(&c->loop->wheel, &c->timer, now_ms() + timeout_ms);
+}
+
+/* Watch the socket for events, or for nothing at all if events is 0 */
+static int watch(struct conn *c, unsigned int events) {
+  struct epoll_event ev = {.events = events, .data.ptr = c};
+  int rv = 0;
+
+  if (events == 0) {
+    if (c->watched) {
+      rv = epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+      c->watched = 0;
+    }
+  } else if (!c->watched) {
+    rv = epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    c->watched = 1;
+  } else if (events != c->events) {
+    rv = epoll_ctl(c->loop->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+  }
+
+  if (rv < 0) {
+    perror("epoll_ctl");
+  }
+  c->events = events;
+  return rv;
+}
+
+/* Run the connection this iteration, as if it had an event */
+static void schedule(struct conn *c) {
+  if (!c->queued) {
+    c->queued = 1;
+    c->ready_next = c->loop->ready;
+    c->loop->ready = c;
+  }
+}
+
+/* Wait for input; a TLS connection may have some decrypted already */
+static void wait_input(struct conn *c) {
+  watch(c, EPOLLIN);
+  if (c->tls != NULL && tls_pending(c->tls)) {
+    schedule(c);
+  }
+}
+
+static int io_recv(struct conn *c, void *buf, int len) {
+  if (c->tls != NULL) {
+    return tls_recv(c->tls, buf, len);
+  }
+  return recv(c->fd, buf, len, 0);
+}
+
+/* As sendmsg(); flags only matter for plain sockets */
+static int io_send(struct conn *c, struct iovec *iov, int iovcnt, int flags) {
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+  char buf[TLS_COALESCE_SIZE];
+  int sent = 0;
+
+  if (c->tls == NULL) {
+    return sendmsg(c->fd, &msg, flags | MSG_NOSIGNAL);
+  }
+
+  for (int i = 0, off = 0; i < iovcnt;) {
+    char *p = (char *)iov[i].iov_base + off;
+    int len = iov[i].iov_len - off, n;
+
+    if (len < (int)sizeof buf) {
+      // Pack small pieces (headers, HTTP/2 frame headers) into one record
+      // with whatever follows them
+      for (len = 0; i < iovcnt && len < (int)sizeof buf;) {
+        int k = iov[i].iov_len - off;
+
+        if (k > (int)sizeof buf - len) {
+          k = sizeof buf - len;
+        }
+        memcpy(buf + len, (char *)iov[i].iov_base + off, k);
+        len += k;
+        if ((off += k) == (int)iov[i].iov_len) {
+          i++;
+          off = 0;
+        }
+      }
+      p = buf;
+    } else {
+      i++;
+      off = 0;
+    }
+
+    if (len == 0) {
+      continue;
+    }
+    if ((n = tls_send(c->tls, p, len)) < 0) {
+      return sent > 0 ? sent : -1;
+    }
+    sent += n;
+    if (n < len) {
+      break;
+    }
+  }
+  return sent;
+}
+
+static ssize_t io_sendfile(struct conn *c, int filefd, off_t *offset,
+                           size_t len) {
+  if (c->tls != NULL) {
+    return tls_sendfile(c->tls, filefd, offset, len);
+  }
+  return sendfile(c->fd, filefd, offset, len);
+}
+
+// How a body reader gets at the connection; a plain socket it reads itself
+static int body_io_recv(void *arg, void *buf, int len) {
+  return tls_recv(((struct conn *)arg)->tls, buf, len);
+}
+
+static int body_io_send(void *arg, void *buf, int len) {
+  struct iovec iov = {buf, len};
+
+  return conn_send(arg, &iov, 1, 0);
+}
+
+static void free_request(struct conn *c) {
+  if (c->req != NULL) {
+    conn_request_free(c->req);
+    c->req = NULL;
+  }
+}
+
+/* Give the send queue's buffer back */
+static void free_out(struct conn *c) {
+  if (c->out_pooled) {
+    bufpool_put(c->out);
+  } else {
+    free(c->out);
+  }
+  c->out = NULL;
+  c->out_len = c->out_size = c->out_sent = 0;
+  c->out_pooled = 0;
+}
+
+static void conn_close(struct conn *c) {
+  struct request *req = c->req;
+
+  // Let a handler that is still waiting clean up after itself
+  if (req != NULL && req->resume != NULL) {
+    c->failed = 1;
+    req->aborted = 1;
+    c->loop->handler(req, c->loop->arg);
+  }
+  if (c->h2 != NULL) {
+    c->failed = 1;
+    h2_close(c->h2);
+  }
+
+  if (c->queued) {
+    struct conn **p = &c->loop->ready;
+
+    while (*p != c) {
+      p = &(*p)->ready_next;
+    }
+    *p = c->ready_next;
+  }
+
+  timer_cancel(&c->timer);
+  if (c->tls != NULL) {
+    tls_close(c->tls);
+  }
+  close(c->fd);
+  free_request(c);
+  free_out(c);
+  if (c->file_fd >= 0) {
+    close(c->file_fd);
+  }
+
+  c->loop->conns--;
+  metrics_connections(-1);
+  free(c);
+}
+
+static void expired(struct timer *timer) {
+  conn_close((struct conn *)((char *)timer - offsetof(struct conn, timer)));
+}
+
+/* Start the clocks on a request whose first bytes are in */
+static void begin_request(struct conn *c) {
+  metrics_begin(&c->req->metrics, metrics_now());
+  accesslog_begin(&c->req->log, c->addr);
+  c->state = CONN_HEADERS;
+  arm(c, HEADER_TIMEOUT);
+}
+
+static struct request *alloc_request(void) {
+  struct request *req = malloc(sizeof *req);
+
+  if (req == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+  if ((req->buf = bufpool_get()) == NULL) {
+    free(req);
+    return NULL;
+  }
+  arena_init(&req->arena);
+  return req;
+}
+
+static void init_request(struct conn *c, struct request *req, int len) {
+  req->fd = c->fd;
+  req->conn = c;
+  req->stream = NULL;
+  req->buf_size = REQUEST_BUFFER_SIZE;
+  req->body_offset = 0;
+  req->buf_len = len;
+  http_head_init(&req->head);
+  req->keep_alive = 0;
+  req->body_unread = 0;
+  req->body.pipefd[0] = req->body.pipefd[1] = -1;
+  req->body.io = &c->body_io;
+  req->resume = NULL;
+  req->aborted = 0;
+  req->proxy = NULL;
+  req->upload = NULL;
+  req->route = NULL;
+  req->cache_key = NULL;
+  req->admitted = 0;
+  req->next = NULL;
+}
+
+/* Set up c->req for a new request with len bytes already in its buffer */
+static int reset_request(struct conn *c, int len) {
+  if (c->req != NULL) {
+    arena_reset(&c->req->arena);
+  } else if ((c->req = alloc_request()) == NULL) {
+    return -1;
+  }
+  init_request(c, c->req, len);
+  return 0;
+}
+
+/* Decide what the connection waits for after the handler has returned
+ *
+ * Returns -1 if the connection was closed.
+ */
+static int handled(struct conn *c) {
+  struct request *req = c->req;
+
+  if (c->failed) {
+    conn_close(c);
+    return -1;
+  }
+
+  if (req->resume != NULL) {
+    c->state = CONN_BODY;
+    if (c->paused) {
+      // Nothing to watch; conn_wake() brings it back
+      timer_cancel(&c->timer);
+      watch(c, 0);
+    } else if (conn_queued(c)) {
+      // A response streaming out; carry on once the client has taken it
+      arm(c, WRITE_STALL_TIMEOUT);
+      watch(c, EPOLLOUT);
+    } else {
+      arm(c, BODY_TIMEOUT);
+      wait_input(c);
+    }
+    return 0;
+  }
+
+  if (c->out_len > c->out_sent || c->file_fd >= 0) {
+    c->state = CONN_WRITING;
+    arm(c, WRITE_STALL_TIMEOUT);
+    watch(c, EPOLLOUT);
+    return 0;
+  }
+
+  if (!req->keep_alive || c->loop->draining) {
+    conn_close(c);
+    return -1;
+  }
+
+  int left = req->buf_len - req->body_offset;
+
+  body_reader_close(&req->body);
+
+  if (left > 0) {
+    // A pipelined request is already waiting in the buffer
+    memmove(req->buf, req->buf + req->body_offset, left);
+    reset_request(c, left);
+    begin_request(c);
+  } else {
+    free_request(c);
+    c->state = CONN_IDLE;
+    arm(c, KEEPALIVE_TIMEOUT);
+  }
+  wait_input(c);
+
+  return 0;
+}
+
+/* Switch to HTTP/2
+ *
+ * Whatever is in c->req's buffer is the start of the session's input, or,
+ * given the HTTP2-Settings of an upgrade request, what followed that
+ * request; the request itself is then answered as stream 1.
+ *
+ * Returns -1 if the connection was closed.
+ */
+static int start_h2(struct conn *c, char *settings, int settings_len) {
+  struct request *req = c->req;
+  char *input = req != NULL ? req->buf : NULL;
+  int len = req != NULL ? req->buf_len : 0, rv;
+
+  if ((c->h2 = h2_create(c, c->loop->handler, c->loop->arg)) == NULL) {
+    conn_close(c);
+    return -1;
+  }
+  c->state = CONN_H2;
+
+  if (settings != NULL) {
+    char *ok = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\n"
+               "Upgrade: h2c\r\n\r\n";
+    struct iovec iov = {ok, strlen(ok)};
+
+    conn_send(c, &iov, 1, 0); // A failure shows in h2_start()
+    input += req->body_offset;
+    len -= req->body_offset;
+    c->req = NULL;
+  }
+
+  rv = h2_start(c->h2, input, len, settings != NULL ? req : NULL, settings,
+                settings_len);
+  free_request(c);
+
+  if (rv < 0) {
+    conn_close(c);
+    return -1;
+  }
+  schedule(c); // To read what follows and settle what to wait for
+  return 0;
+}
+
+/* Answer every complete request in the buffer, in order
+ *
+ * Returns -1 if the connection was closed.
+ */
+static int process(struct conn *c) {
+  while (c->state == CONN_HEADERS && c->req != NULL) {
+    struct request *req = c->req;
+    char *settings;
+    int rv, settings_len, end;
+
+    req->buf[req->buf_len] = '\0';
+
+    // An HTTP/2 client with prior knowledge opens with the preface
+    if ((rv = h2_preface(req->buf, req->buf_len)) != 0) {
+      return rv < 0 ? 0 : start_h2(c, NULL, 0);
+    }
+
+    if ((end = http_head_scan(req->buf, req->buf_len, &req->head)) == 0) {
+      if (req->buf_len == REQUEST_BUFFER_SIZE - 1) {
+        fprintf(stderr, "Request headers too large\n");
+        conn_close(c);
+        return -1;
+      }
+      return 0;
+    }
+
+    req->body_offset = end;
+    req->ready_ns = c->loop->ready_since;
+    timer_cancel(&c->timer);
+
+    if (c->tls == NULL && h2_upgrade_wanted(&req->head, req->buf, &settings,
+                                            &settings_len)) {
+      return start_h2(c, settings, settings_len);
+    }
+
+    c->loop->handler(req, c->loop->arg);
+
+    if (handled(c) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Read more of a request's headers */
+static void read_headers(struct conn *c) {
+  if (c->req == NULL && reset_request(c, 0) < 0) {
+    conn_close(c);
+    return;
+  }
+
+  struct request *req = c->req;
+  int n = io_recv(c, req->buf + req->buf_len,
+                  REQUEST_BUFFER_SIZE - 1 - req->buf_len);
+
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    if (req->buf_len == 0) {
+      free_request(c); // Nothing in flight; don't hold a buffer for it
+    }
+    return;
+  }
+  if (n <= 0) {
+    conn_close(c); // Hung up, or reset, before finishing the headers
+    return;
+  }
+
+  if (req->buf_len == 0) {
+    if (c->state == CONN_IDLE) {
+      begin_request(c);
+    } else {
+      // The header deadline has been running since the accept
+      metrics_begin(&req->metrics, metrics_now());
+      accesslog_begin(&req->log, c->addr);
+    }
+  }
+
+  req->buf_len += n;
+  metrics_bytes(n, 0);
+
+  if (process(c) == 0 && c->state == CONN_HEADERS) {
+    wait_input(c); // The buffer may have filled before the record ran out
+  }
+}
+
+/* Send what has been queued
+ *
+ * Returns 1 once everything is out, 0 if the socket is full, -1 on error.
+ */
+static int flush(struct conn *c) {
+  while (c->out_sent < c->out_len) {
+    struct iovec iov = {c->out + c->out_sent, c->out_len - c->out_sent};
+    int n = io_send(c, &iov, 1, c->file_fd >= 0 ? MSG_MORE : 0);
+
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return 0;
+      }
+      return -1;
+    }
+    c->out_sent += n;
+  }
+
+  free_out(c);
+
+  while (c->file_fd >= 0 && c->file_offset < c->file_end) {
+    ssize_t n = io_sendfile(c, c->file_fd, &c->file_offset,
+                            c->file_end - c->file_offset);
+
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return 0;
+      }
+      perror("sendfile");
+      return -1;
+    }
+    if (n == 0) {
+      return -1; // The file shrank
+    }
+  }
+
+  if (c->file_fd >= 0) {
+    close(c->file_fd);
+    c->file_fd = -1;
+  }
+
+  return 1;
+}
+
+static void write_response(struct conn *c) {
+  int rv = flush(c);
+
+  if (rv < 0) {
+    conn_close(c);
+  } else if (rv == 0) {
+    arm(c, WRITE_STALL_TIMEOUT); // Made progress, or was told it could
+  } else if (handled(c) == 0) {
+    process(c);
+  }
+}
+
+/* Give a waiting handler another go, once any output it queued is out */
+static void resume(struct conn *c) {
+  int rv = conn_queued(c) ? flush(c) : 1;
+
+  if (rv < 0) {
+    conn_close(c);
+    return;
+  }
+  if (rv == 0) {
+    arm(c, WRITE_STALL_TIMEOUT);
+    return;
+  }
+
+  c->loop->handler(c->req, c->loop->arg);
+
+  if (handled(c) == 0) {
+    process(c);
+  }
+}
+
+/* Run an HTTP/2 session, and decide what it waits for next */
+static void serve_h2(struct conn *c) {
+  int streams, paused;
+
+  if (flush(c) < 0 || h2_run(c->h2) < 0 || c->failed) {
+    conn_close(c);
+    return;
+  }
+
+  if (c->loop->draining) {
+    h2_goaway(c->h2);
+  }
+  streams = h2_streams(c->h2, &paused);
+
+  if (conn_queued(c)) {
+    arm(c, WRITE_STALL_TIMEOUT);
+    watch(c, EPOLLOUT);
+    return;
+  }
+  if (h2_done(c->h2)) {
+    conn_close(c);
+    return;
+  }
+
+  if (streams == 0) {
+    arm(c, KEEPALIVE_TIMEOUT);
+  } else if (streams > paused) {
+    arm(c, BODY_TIMEOUT); // Waiting for request bodies or window updates
+  } else {
+    timer_cancel(&c->timer);
+  }
+  wait_input(c);
+}
+
+/* Carry on with a TLS handshake */
+static void handshake(struct conn *c) {
+  switch (tls_handshake(c->tls)) {
+  case TLS_DONE:
+    if (tls_alpn_h2(c->tls)) {
+      start_h2(c, NULL, 0);
+      break;
+    }
+    c->state = CONN_HEADERS; // Still due by the deadline set at accept
+    wait_input(c);
+    break;
+  case TLS_WANT_READ:
+    watch(c, EPOLLIN);
+    break;
+  case TLS_WANT_WRITE:
+    watch(c, EPOLLOUT);
+    break;
+  default:
+    conn_close(c);
+  }
+}
+
+/* The socket is ready, or input is pending in TLS */
+static void on_event(struct conn *c) {
+  switch (c->state) {
+  case CONN_HANDSHAKE:
+    handshake(c);
+    break;
+  case CONN_WRITING:
+    write_response(c);
+    break;
+  case CONN_BODY:
+    resume(c);
+    break;
+  case CONN_H2:
+    serve_h2(c);
+    break;
+  default:
+    read_headers(c);
+  }
+}
+
+static void accept_connections(struct conn_watch *w) {
+  struct listener *l =
+      (struct listener *)((char *)w - offsetof(struct listener, watch));
+  struct conn_loop *loop = l->loop;
+  int one = 1;
+
+  while (1) {
+    struct sockaddr_storage their_addr;
+    socklen_t sin_size = sizeof their_addr;
+    int fd = accept4(w->fd, (struct sockaddr *)&their_addr, &sin_size,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept");
+      }
+      return;
+    }
+
+    TRACE1(accept, fd);
+
+    // Writes that must wait are held with MSG_MORE; the rest go out now,
+    // not after Nagle waits on the client's delayed ACK
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    struct conn *c = calloc(1, sizeof *c);
+
+    if (c == NULL) {
+      perror("calloc");
+      close(fd);
+      continue;
+    }
+
+    c->fd = fd;
+    c->loop = loop;
+    c->file_fd = -1;
+    c->timer.expired = expired;
+    get_in_addr((struct sockaddr *)&their_addr, c->addr, sizeof c->addr);
+
+    if (l->tls != NULL) {
+      if ((c->tls = tls_accept(l->tls, fd)) == NULL) {
+        close(fd);
+        free(c);
+        continue;
+      }
+    }
+    c->body_io = (struct body_io){c->tls != NULL ? body_io_recv : NULL,
+                                  body_io_send, c, 0};
+
+    if (watch(c, EPOLLIN) < 0) {
+      if (c->tls != NULL) {
+        tls_close(c->tls);
+      }
+      close(fd);
+      free(c);
+      continue;
+    }
+
+    loop->conns++;
+    metrics_connections(1);
+
+    // The handshake and whole header block are due within HEADER_TIMEOUT of
+    // the accept
+    c->state = c->tls != NULL ? CONN_HANDSHAKE : CONN_HEADERS;
+    arm(c, HEADER_TIMEOUT);
+  }
+}
+
+/**
+ * Set up a loop to pass each request on its connections to handler along
+ * with arg
+ *
+ * Returns NULL on error.
+ */
+struct conn_loop *conn_loop_create(conn_handler handler, void *arg) {
+  struct conn_loop *loop = calloc(1, sizeof *loop);
+
+  if (loop == NULL) {
+    return NULL;
+  }
+
+  loop->handler = handler;
+  loop->arg = arg;
+  loop->polled = metrics_now();
+  timerwheel_init(&loop->wheel, now_ms());
+
+  if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("conn_loop_create");
+    free(loop);
+    return NULL;
+  }
+
+  return loop;
+}
+
+/**
+ * Accept connections on listenfd, speaking TLS on them if tls isn't NULL
+ *
+ * Returns -1 on error.
+ */
+int conn_loop_listen(struct conn_loop *loop, int listenfd, struct tls *tls) {
+  struct listener *l;
+
+  if (loop->nlisteners == MAX_LISTENERS) {
+    fprintf(stderr, "conn_loop_listen: too many listeners\n");
+    return -1;
+  }
+  l = &loop->listeners[loop->nlisteners];
+
+  if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) < 0) {
+    perror("conn_loop_listen");
+    return -1;
+  }
+
+  l->loop = loop;
+  l->tls = tls;
+  l->watch.ready = accept_connections;
+
+  if (conn_watch(loop, &l->watch, listenfd) < 0) {
+    return -1;
+  }
+
+  loop->nlisteners++;
+  return 0;
+}
+
+/**
+ * Run the loop
+ *
+ * Returns 0 once a drain has finished, or -1 on a fatal error.
+ */
+int conn_loop_run(struct conn_loop *loop) {
+  struct epoll_event events[MAX_EVENTS];
+
+  while (!loop->draining ||
+         (loop->conns > 0 && now_ms() < loop->drain_deadline)) {
+    int n = epoll_wait(loop->epfd, events, MAX_EVENTS, 0);
+    int slept = 0;
+
+    if (n == 0 && loop->ready == NULL) {
+      // Wake up every tick while there are deadlines to run
+      n = epoll_wait(loop->epfd, events, MAX_EVENTS,
+                     loop->conns > 0 ? TIMERWHEEL_TICK_MS : -1);
+      slept = 1;
+    }
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      return -1;
+    }
+
+    // Events that were already waiting may have been ready since the last
+    // poll; count their queue delay from then
+    uint64_t now = metrics_now();
+
+    loop->ready_since = slept ? now : loop->polled;
+    loop->polled = now;
+
+    for (int i = 0; i < n; i++) {
+      struct conn *c = events[i].data.ptr;
+
+      if (events[i].data.u64 & WATCH_TAG) {
+        struct conn_watch *w =
+            (struct conn_watch *)(uintptr_t)(events[i].data.u64 & ~WATCH_TAG);
+
+        w->ready(w);
+      } else {
+        on_event(c);
+      }
+    }
+
+    while (loop->ready != NULL) {
+      struct conn *c = loop->ready;
+
+      loop->ready = c->ready_next;
+      c->queued = 0;
+      on_event(c);
+    }
+
+    timerwheel_advance(&loop->wheel, now_ms());
+  }
+
+  return 0;
+}
+
+/**
+ * Stop accepting connections and let the ones open finish
+ *
+ * conn_loop_run() returns once they have, or after DRAIN_TIMEOUT.
+ */
+void conn_loop_drain(struct conn_loop *loop) {
+  if (loop->draining) {
+    return;
+  }
+
+  loop->draining = 1;
+  loop->drain_deadline = now_ms() + DRAIN_TIMEOUT;
+
+  for (int i = 0; i < loop->nlisteners; i++) {
+    conn_unwatch(loop, &loop->listeners[i].watch);
+    close(loop->listeners[i].watch.fd);
+  }
+  loop->nlisteners = 0;
+}
+
+/* Whether responses on this connection should be the last */
+int conn_draining(struct conn *c) { return c->loop->draining; }
+
+/* Have the loop call w->ready() whenever fd is readable */
+int conn_watch(struct conn_loop *loop, struct conn_watch *w, int fd) {
+  struct epoll_event ev = {.events = EPOLLIN,
+                           .data.u64 = (uintptr_t)w | WATCH_TAG};
+
+  w->fd = fd;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("epoll_ctl");
+    return -1;
+  }
+  w->events = EPOLLIN;
+  return 0;
+}
+
+void conn_unwatch(struct conn_loop *loop, struct conn_watch *w) {
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+  w->events = 0;
+}
+
+/* Watch w->fd for events instead (EPOLLIN, EPOLLOUT), or for nothing if 0 */
+int conn_watch_events(struct conn_loop *loop, struct conn_watch *w,
+                      unsigned int events) {
+  struct epoll_event ev = {.events = events,
+                           .data.u64 = (uintptr_t)w | WATCH_TAG};
+  int rv = 0;
+
+  if (events == w->events) {
+    return 0;
+  }
+  if (events == 0) {
+    rv = epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+  } else {
+    rv = epoll_ctl(loop->epfd, w->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                   w->fd, &ev);
+  }
+
+  if (rv < 0) {
+    perror("epoll_ctl");
+    return -1;
+  }
+  w->events = events;
+  return 0;
+}
+
+/* Run timer->expired() from the loop in timeout_ms, unless timer_cancel()ed
+ * first */
+void conn_timer(struct conn_loop *loop, struct timer *timer, int timeout_ms) {
+  timer_arm(&loop->wheel, timer, now_ms() + timeout_ms);
+}
+
+/**
+ * Send a response, or as much of it as the socket will take now
+ *
+ * Whatever doesn't fit is copied and sent by the loop, after anything
+ * queued before it. flags are as for send().
+ *
+ * Returns the number of bytes sent or queued, or -1 if the connection
+ * failed; it is closed once the handler returns.
+ */
+int conn_send(struct conn *c, struct iovec *iov, int iovcnt, int flags) {
+  int total = 0, n = 0;
+
+  if (c->failed) {
+    return -1;
+  }
+
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+
+  if (c->out_len == c->out_sent && c->file_fd < 0) {
+    do {
+      n = io_send(c, iov, iovcnt, flags);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("send");
+      c->failed = 1;
+      return -1;
+    }
+    if (n < 0) {
+      n = 0;
+    }
+  }
+
+  if (n == total) {
+    return total;
+  }
+
+  if (c->out == NULL && c->out_len + total - n <= BUFPOOL_SIZE) {
+    if ((c->out = bufpool_get()) == NULL) {
+      c->failed = 1;
+      return -1;
+    }
+    c->out_size = BUFPOOL_SIZE;
+    c->out_pooled = 1;
+  }
+
+  if (c->out_len + total - n > c->out_size) {
+    int size = c->out_len + total - n;
+    char *out = realloc(c->out_pooled ? NULL : c->out, size);
+
+    if (out == NULL) {
+      perror("realloc");
+      c->failed = 1;
+      return -1;
+    }
+    if (c->out_pooled) {
+      // Outgrew the pooled buffer
+      memcpy(out, c->out, c->out_len);
+      bufpool_put(c->out);
+      c->out_pooled = 0;
+    }
+    c->out = out;
+    c->out_size = size;
+  }
+
+  // Copy out the unsent tail of the iovecs
+  for (int i = 0; i < iovcnt; i++) {
+    int len = iov[i].iov_len;
+
+    if (n >= len) {
+      n -= len;
+      continue;
+    }
+    memcpy(c->out + c->out_len, (char *)iov[i].iov_base + n, len - n);
+    c->out_len += len - n;
+    n = 0;
+  }
+
+  return total;
+}
+
+/**
+ * Send len bytes of an open file from offset, after anything already sent
+ *
+ * The file's own offset is left alone. If the socket fills up, the loop
+ * carries on from a duplicate of filefd, so the caller may close it.
+ *
+ * Returns len, or -1 if the connection failed.
+ */
+off_t conn_sendfile(struct conn *c, int filefd, off_t offset, off_t len) {
+  off_t end = offset + len;
+
+  if (c->failed) {
+    return -1;
+  }
+
+  while (c->out_len == c->out_sent && offset < end) {
+    ssize_t n = io_sendfile(c, filefd, &offset, end - offset);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      perror("sendfile");
+      c->failed = 1;
+      return -1;
+    }
+  }
+
+  if (offset < end) {
+    if ((c->file_fd = fcntl(filefd, F_DUPFD_CLOEXEC, 0)) < 0) {
+      perror("dup");
+      c->failed = 1;
+      return -1;
+    }
+    c->file_offset = offset;
+    c->file_end = end;
+  }
+
+  return len;
+}
+
+/* As recv(), for a protocol that frames its own input (HTTP/2) */
+int conn_recv(struct conn *c, void *buf, int len) {
+  return io_recv(c, buf, len);
+}
+
+/* Whether response data is waiting for the socket */
+int conn_queued(struct conn *c) {
+  return c->out_len > c->out_sent || c->file_fd >= 0;
+}
+
+/**
+ * A new request of its own for one of the connection's HTTP/2 streams
+ *
+ * The caller fills in the buffer. Returns NULL on error.
+ */
+struct request *conn_request(struct conn *c) {
+  struct request *req = alloc_request();
+
+  if (req != NULL) {
+    init_request(c, req, 0);
+    req->ready_ns = c->loop->ready_since;
+    metrics_begin(&req->metrics, metrics_now());
+    accesslog_begin(&req->log, c->addr);
+  }
+  return req;
+}
+
+/* Free a request from conn_request(), its buffer and scratch included */
+void conn_request_free(struct request *req) {
+  body_reader_close(&req->body);
+  arena_reset(&req->arena);
+  bufpool_put(req->buf);
+  free(req);
+}
+
+/**
+ * Stop watching for a request's input until conn_wake()
+ *
+ * For a handler that has to wait its turn for something other than input;
+ * it must also set req->resume. No deadline runs while paused. Only the
+ * request's own stream is paused on HTTP/2.
+ */
+void conn_pause(struct request *req) {
+  if (req->stream != NULL) {
+    h2_pause(req->stream);
+  } else {
+    req->conn->paused = 1;
+  }
+}
+
+/* Have the loop call the resume handler of a paused request */
+void conn_wake(struct request *req) {
+  if (req->stream != NULL) {
+    h2_wake(req->stream);
+  } else {
+    req->conn->paused = 0;
+  }
+  schedule(req->conn);
+}
@@ -0,0 +1,57 @@
+#ifndef _CONN_H_
+#define _CONN_H_
+
+#include "bufpool.h"
+#include "request.h"
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define REQUEST_BUFFER_SIZE BUFPOOL_SIZE // Headers must fit; reused for bodies
+
+// Deadlines, in ms
+#define HEADER_TIMEOUT 10000      // Whole header block, from its first byte
+#define BODY_TIMEOUT 10000        // Between pieces of a request body
+#define KEEPALIVE_TIMEOUT 5000    // Idle between requests
+#define WRITE_STALL_TIMEOUT 10000 // Client not reading the response
+#define DRAIN_TIMEOUT 30000       // Longest wait for connections to finish
+
+struct conn;
+struct conn_loop;
+struct timer;
+struct tls;
+
+// Another fd for the loop to watch; embed it in whatever owns the fd
+struct conn_watch {
+  int fd;
+  void (*ready)(struct conn_watch *w); // Called when fd is ready
+  unsigned int events; // What epoll is watching for; 0 if not watched
+};
+
+/* Called once a request's headers are in, and again each time a request
+ * waiting in req->resume can make progress */
+typedef void (*conn_handler)(struct request *req, void *arg);
+
+extern struct conn_loop *conn_loop_create(conn_handler handler, void *arg);
+extern int conn_loop_listen(struct conn_loop *loop, int listenfd,
+                            struct tls *tls);
+extern int conn_loop_run(struct conn_loop *loop);
+extern void conn_loop_drain(struct conn_loop *loop);
+extern int conn_watch(struct conn_loop *loop, struct conn_watch *w, int fd);
+extern void conn_unwatch(struct conn_loop *loop, struct conn_watch *w);
+extern int conn_watch_events(struct conn_loop *loop, struct conn_watch *w,
+                             unsigned int events);
+extern void conn_timer(struct conn_loop *loop, struct timer *timer,
+                       int timeout_ms);
+extern int conn_send(struct conn *conn, struct iovec *iov, int iovcnt,
+                     int flags);
+extern off_t conn_sendfile(struct conn *conn, int filefd, off_t offset,
+                           off_t len);
+extern int conn_recv(struct conn *conn, void *buf, int len);
+extern int conn_queued(struct conn *conn);
+extern struct request *conn_request(struct conn *conn);
+extern void conn_request_free(struct request *req);
+extern void conn_pause(struct request *req);
+extern void conn_wake(struct request *req);
+extern int conn_draining(struct conn *conn);
+
+#endif
@@ -0,0 +1,262 @@
+/* Open-file-descriptor cache
+ *
+ * Paths are resolved relative to a directory fd opened once at startup, so
+ * a lookup never re-walks the root's own path, and the resulting fd and its
+ * stat() result are kept in a bounded LRU. Misses are remembered as well,
+ * which lets "try the path, then path/index.html" cost one hash lookup per
+ * attempt on a warm cache.
+ *
+ * Entries are re-checked against the disk at most every FDCACHE_TTL seconds
+ * so replaced and newly created files are noticed. An entry's version is
+ * taken from the file's identity, size and modification time, so whoever
+ * keeps a copy of its content can keep the version with it and tell, from
+ * any path that leads to the file, whether the copy is still good.
+ */
+
+#define _GNU_SOURCE
+#include "fdcache.h"
+#include "hashtable.h"
+#include "mime.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+#define FDCACHE_TTL 2 // Seconds between checks that a path still resolves
+
+/* Insert an entry at the head of the LRU list */
+static void fdlist_insert_head(struct fdcache *fdc, struct fdcache_entry *fe) {
+  fe->prev = NULL;
+  fe->next = fdc->head;
+
+  if (fdc->head == NULL) {
+    fdc->tail = fe;
+  } else {
+    fdc->head->prev = fe;
+  }
+  fdc->head = fe;
+}
+
+/* Unlink an entry from the LRU list */
+static void fdlist_unlink(struct fdcache *fdc, struct fdcache_entry *fe) {
+  if (fe->prev == NULL) {
+    fdc->head = fe->next;
+  } else {
+    fe->prev->next = fe->next;
+  }
+
+  if (fe->next == NULL) {
+    fdc->tail = fe->prev;
+  } else {
+    fe->next->prev = fe->prev;
+  }
+}
+
+/* Close and deallocate an entry */
+static void fdcache_entry_free(struct fdcache_entry *fe) {
+  if (fe->fd >= 0) {
+    close(fe->fd);
+  }
+  free(fe->path);
+  free(fe);
+}
+
+/* Drop an entry from the cache */
+static void fdcache_remove(struct fdcache *fdc, struct fdcache_entry *fe) {
+  fdlist_unlink(fdc, fe);
+  hashtable_delete(fdc->index, fe->path);
+  fdc->cur_size--;
+  fdcache_entry_free(fe);
+}
+
+/* Return true if any component of path is ".." */
+static int escapes_root(char *path) {
+  for (char *p = path; p != NULL; p = strchr(p, '/')) {
+    while (*p == '/') {
+      p++;
+    }
+    if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Open a path for reading without letting it resolve outside the root
+ *
+ * O_NONBLOCK keeps a FIFO in the tree from hanging the open; it makes no
+ * difference to regular files.
+ */
+static int open_beneath(int rootfd, char *path) {
+  int flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK;
+
+#ifdef SYS_openat2
+  struct open_how how;
+
+  memset(&how, 0, sizeof how);
+  how.flags = flags;
+  how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+  int fd = syscall(SYS_openat2, rootfd, path, &how, sizeof how);
+
+  if (fd >= 0 || errno != ENOSYS) {
+    return fd;
+  }
+#endif
+
+  // Older kernel: at least refuse to walk up out of the root
+  if (escapes_root(path)) {
+    errno = EACCES;
+    return -1;
+  }
+
+  return openat(rootfd, path, flags);
+}
+
+/* Identify one state of a file: FNV-1a over what changes when it does */
+static uint64_t file_version(struct stat *st) {
+  uint64_t fields[] = {st->st_dev, st->st_ino, st->st_size,
+                       st->st_mtim.tv_sec, st->st_mtim.tv_nsec};
+  unsigned char *p = (unsigned char *)fields;
+  uint64_t h = 14695981039346656037ull;
+
+  for (size_t i = 0; i < sizeof fields; i++) {
+    h = (h ^ p[i]) * 1099511628211ull;
+  }
+  return h != 0 ? h : 1; // 0 is no version at all
+}
+
+/* Resolve a path into a new (unlinked) entry */
+static struct fdcache_entry *fdcache_resolve(struct fdcache *fdc, char *path,
+                                             time_t now) {
+  struct fdcache_entry *fe = malloc(sizeof *fe);
+
+  fe->path = strdup(path);
+  fe->content_type = mime_type_get(path);
+  fe->verified = now;
+  fe->fd = open_beneath(fdc->rootfd, path);
+
+  // Only regular files are served
+  if (fe->fd >= 0 && (fstat(fe->fd, &fe->st) < 0 || !S_ISREG(fe->st.st_mode))) {
+    close(fe->fd);
+    fe->fd = -1;
+  }
+  fe->version = fe->fd >= 0 ? file_version(&fe->st) : 0;
+
+  return fe;
+}
+
+/* Check whether an entry still describes what its path resolves to
+ *
+ * Refreshes the stat data and version of files that changed in place.
+ */
+static int fdcache_still_valid(struct fdcache *fdc, struct fdcache_entry *fe) {
+  struct stat st;
+
+  if (fstatat(fdc->rootfd, fe->path, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+    return fe->fd < 0;
+  }
+
+  if (fe->fd < 0 || st.st_dev != fe->st.st_dev || st.st_ino != fe->st.st_ino) {
+    return 0;
+  }
+
+  fe->st = st;
+  fe->version = file_version(&st);
+  return 1;
+}
+
+/* Close LRU entries if the cache is oversized */
+static void fdcache_clean_lru(struct fdcache *fdc) {
+  while (fdc->cur_size > fdc->max_size) {
+    fdcache_remove(fdc, fdc->tail);
+  }
+}
+
+/* Create a new fd cache
+ *
+ * root:     directory that all paths are resolved under
+ * max_size: maximum number of entries (and so open fds) in the cache
+ *
+ * Returns NULL if root can't be opened
+ */
+struct fdcache *fdcache_create(char *root, int max_size) {
+  int rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (rootfd < 0) {
+    perror(root);
+    return NULL;
+  }
+
+  struct fdcache *fdc = malloc(sizeof *fdc);
+  fdc->rootfd = rootfd;
+  fdc->index = hashtable_create(0, NULL);
+  fdc->head = fdc->tail = NULL;
+  fdc->max_size = max_size;
+  fdc->cur_size = 0;
+
+  return fdc;
+}
+
+void fdcache_free(struct fdcache *fdc) {
+  struct fdcache_entry *fe = fdc->head;
+  hashtable_destroy(fdc->index);
+
+  while (fe != NULL) {
+    struct fdcache_entry *next = fe->next;
+    fdcache_entry_free(fe);
+    fe = next;
+  }
+  close(fdc->rootfd);
+  free(fdc);
+}
+
+/* Look up a file under the root
+ *
+ * Leading slashes are ignored, so request paths can be passed directly.
+ *
+ * Returns NULL if the path isn't a regular file inside the root. The entry
+ * (and its fd) stays valid until the next call.
+ */
+struct fdcache_entry *fdcache_open(struct fdcache *fdc, char *path) {
+  time_t now = time(NULL);
+
+  while (*path == '/') {
+    path++;
+  }
+  if (*path == '\0') {
+    path = ".";
+  }
+
+  struct fdcache_entry *fe = hashtable_get(fdc->index, path);
+
+  if (fe != NULL && now - fe->verified >= FDCACHE_TTL) {
+    if (fdcache_still_valid(fdc, fe)) {
+      fe->verified = now;
+    } else {
+      // The file changed or appeared: look it up again
+      fdcache_remove(fdc, fe);
+      fe = NULL;
+    }
+  }
+
+  if (fe == NULL) {
+    fe = fdcache_resolve(fdc, path, now);
+    hashtable_put(fdc->index, fe->path, fe);
+    fdc->cur_size++;
+  } else {
+    fdlist_unlink(fdc, fe);
+  }
+
+  fdlist_insert_head(fdc, fe);
+  fdcache_clean_lru(fdc);
+
+  return fe->fd >= 0 ? fe : NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef _FDCACHE_H_
+#define _FDCACHE_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// An open file (or a remembered miss) under the cache's root
+struct fdcache_entry {
+  char *path;         // Path relative to the root-- key to the cache
+  int fd;             // -1 if the path is not a regular file
+  struct stat st;     // Valid if fd >= 0
+  char *content_type; // MIME type, looked up once when the path is resolved
+  time_t verified;    // When the path last resolved to this file
+  uint64_t version;   // Of the file as last seen; changes whenever it does
+
+  struct fdcache_entry *prev, *next; // Doubly-linked list
+};
+
+// A bounded LRU of open file descriptors
+struct fdcache {
+  int rootfd;
+  struct hashtable *index;
+  struct fdcache_entry *head, *tail; // Doubly-linked list
+  int max_size;                      // Maximum number of entries
+  int cur_size;                      // Current number of entries
+};
+
+extern struct fdcache *fdcache_create(char *root, int max_size);
+extern void fdcache_free(struct fdcache *fdc);
+extern struct fdcache_entry *fdcache_open(struct fdcache *fdc, char *path);
+
+#endif
@@ -1,7 +1,9 @@
 #include "file.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 /* Loads a file into memory and returns a pointer to the data
  *
@@ -12,6 +14,8 @@ struct file_data *file_load(char *filename) {
   struct stat buf;
   int bytes_read, bytes_remaining, total_bytes = 0;
 
+  TRACE1(file_load_start, filename);
+
   // Get the file size
   if (stat(filename, &buf) == -1) {
     return NULL;
@@ -34,6 +38,7 @@ struct file_data *file_load(char *filename) {
   p = buffer = malloc(bytes_remaining);
 
   if (buffer == NULL) {
+    fclose(fp);
     return NULL;
   }
 
@@ -42,6 +47,7 @@ struct file_data *file_load(char *filename) {
          bytes_read != 0 && bytes_remaining > 0) {
     if (bytes_read == -1) {
       free(buffer);
+      fclose(fp);
       return NULL;
     }
     bytes_remaining -= bytes_read;
@@ -49,6 +55,8 @@ struct file_data *file_load(char *filename) {
     total_bytes += bytes_read;
   }
 
+  fclose(fp);
+
   // Allocate the file data struct
   struct file_data *filedata = malloc(sizeof *filedata);
 
@@ -60,10 +68,55 @@ struct file_data *file_load(char *filename) {
   filedata->data = buffer;
   filedata->size = total_bytes;
 
+  TRACE2(file_load_end, filename, total_bytes);
+
+  return filedata;
+}
+
+/* Loads size bytes of an already-open file into memory
+ *
+ * Reads with pread(), so the fd's offset is left alone and the fd can be
+ * shared. Buffer is not NUL-terminated
+ */
+struct file_data *file_load_fd(int fd, int size) {
+  char *buffer = malloc(size > 0 ? size : 1);
+  int total_bytes = 0;
+
+  TRACE1(file_load_start, NULL);
+
+  if (buffer == NULL) {
+    return NULL;
+  }
+
+  while (total_bytes < size) {
+    ssize_t bytes_read = pread(fd, buffer + total_bytes, size - total_bytes,
+                               total_bytes);
+    if (bytes_read < 0) {
+      free(buffer);
+      return NULL;
+    }
+    if (bytes_read == 0) {
+      break; // File shrank underneath us
+    }
+    total_bytes += bytes_read;
+  }
+
+  struct file_data *filedata = malloc(sizeof *filedata);
+
+  if (filedata == NULL) {
+    free(buffer);
+    return NULL;
+  }
+
+  filedata->data = buffer;
+  filedata->size = total_bytes;
+
+  TRACE2(file_load_end, NULL, total_bytes);
+
   return filedata;
 }
 
-/* Free memory allocated by file_load() */
+/* Free memory allocated by file_load() or file_load_fd() */
 void file_free(struct file_data *filedata) {
   free(filedata->data);
   free(filedata);
@@ -7,6 +7,7 @@ struct file_data {
 };
 
 extern struct file_data *file_load(char *filename);
+extern struct file_data *file_load_fd(int fd, int size);
 extern void file_free(struct file_data *filedata);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1565 @@
+/* HTTP/2
+ *
+ * One session per connection, driven by the connection loop. Input is read
+ * into a buffer and acted on a frame at a time. Each request's header block
+ * is decoded (hpack.c) into the header block an HTTP/1.1 client would have
+ * sent, so handlers answer HTTP/2 requests without knowing it; every stream
+ * gets a struct request of its own, and any number are in flight at once.
+ *
+ * Clients get here by sending the connection preface straight away (prior
+ * knowledge), by asking with "Upgrade: h2c" on a cleartext HTTP/1.1
+ * request, or by choosing "h2" with ALPN in the TLS handshake.
+ *
+ * A DATA frame's header and its slice of the body go out together in one
+ * sendmsg(), straight from the caller's memory (typically a cache entry),
+ * so a body is only copied once the client's window or the socket can't
+ * take the rest. Files are framed with sendfile() between frame headers.
+ * Streams with more to send take turns a frame at a time, and nothing more
+ * is framed while the socket is full. A body that isn't all at hand (a
+ * proxied response) is written piece by piece, and its handler is woken
+ * each time what it wrote has gone out.
+ *
+ * Request bodies are buffered per stream up to the stream's window, which is
+ * reopened as the handler reads, so a slow upload holds back only itself.
+ */
+
+#define _GNU_SOURCE
+#include "h2.h"
+#include "bufpool.h"
+#include "hpack.h"
+#include "metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define FRAME_HEADER 9
+#define MAX_FRAME 16384        // Largest frame payload we take (the minimum)
+#define MAX_STREAMS 100        // Streams a client may have open at once
+#define DEFAULT_WINDOW 65535   // Flow-control window before any SETTINGS
+#define STREAM_WINDOW 65535    // Request body buffered per stream
+#define CONN_WINDOW (1 << 20)  // Request body in flight per connection
+#define MAX_WINDOW 0x7fffffff
+#define MAX_HEADER_BLOCK BUFPOOL_SIZE // HEADERS plus CONTINUATION, compressed
+#define RESPONSE_BLOCK 16384   // Encoded response header fields; one frame
+#define WRITE_BATCH 16         // DATA frames per sendmsg()
+#define LINE_ROOM (32 + REQUEST_PATH_MAX) // Request line, ahead of the fields
+#define INPUT_SIZE (FRAME_HEADER + MAX_FRAME) // Room for a whole frame
+
+enum frame_type {
+  FRAME_DATA,
+  FRAME_HEADERS,
+  FRAME_PRIORITY,
+  FRAME_RST_STREAM,
+  FRAME_SETTINGS,
+  FRAME_PUSH_PROMISE,
+  FRAME_PING,
+  FRAME_GOAWAY,
+  FRAME_WINDOW_UPDATE,
+  FRAME_CONTINUATION
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum h2_error {
+  ERR_NONE,
+  ERR_PROTOCOL,
+  ERR_INTERNAL,
+  ERR_FLOW_CONTROL,
+  ERR_SETTINGS_TIMEOUT,
+  ERR_STREAM_CLOSED,
+  ERR_FRAME_SIZE,
+  ERR_REFUSED_STREAM,
+  ERR_CANCEL,
+  ERR_COMPRESSION,
+  ERR_CONNECT,
+  ERR_ENHANCE_YOUR_CALM
+};
+
+enum h2_setting {
+  SETTINGS_HEADER_TABLE_SIZE = 1,
+  SETTINGS_ENABLE_PUSH,
+  SETTINGS_MAX_CONCURRENT_STREAMS,
+  SETTINGS_INITIAL_WINDOW_SIZE,
+  SETTINGS_MAX_FRAME_SIZE,
+  SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+struct h2_stream {
+  uint32_t id;
+  struct h2 *h2;
+  struct request *req; // Until the handler is done with it
+  struct body_io io;   // How req's body reader gets at the DATA
+  int remote_closed;   // The client has sent END_STREAM
+  int local_closed;    // So have we
+  int responded;       // HEADERS sent
+  int reset;           // RST_STREAM sent or received
+  int paused;          // Waiting for h2_wake()
+
+  // Request body received but not read yet
+  char *in;
+  int in_start, in_end;
+  int recv_window;
+  int unacked; // Read since the window was last reopened
+
+  // Response body not sent yet: memory, or a file if file_fd >= 0
+  long send_window;
+  char *body;
+  long body_len, body_sent;
+  int body_owned; // A copy, freed when sent
+  int file_fd;
+  off_t file_offset, file_end;
+  int file_owned; // A duplicate, closed when sent
+  int streaming;  // More body is to come through h2_write()
+
+  struct h2_stream *next;
+  struct h2_stream *send_next; // Taking turns to send DATA
+  int sending;
+  struct h2_stream *woken_next; // Resumed by the next h2_run()
+  int woken;
+};
+
+struct h2 {
+  struct conn *conn;
+  conn_handler handler;
+  void *arg;
+  struct hpack_table decoder, encoder;
+
+  unsigned char *in; // INPUT_SIZE from the buffer pool, while in_len > 0
+  int in_len;
+  int preface;      // How much of the client's preface has arrived
+  int got_settings; // The client's first frame must be SETTINGS
+
+  // A header block split over HEADERS and CONTINUATION frames, in a pooled
+  // buffer until it ends
+  unsigned char *block;
+  int block_len;
+  uint32_t block_stream; // 0 when not in a block
+  int block_end_stream;
+
+  long send_window; // For our DATA
+  int recv_window;  // For the client's
+  long initial_window; // Client's SETTINGS_INITIAL_WINDOW_SIZE
+  int max_frame;       // Client's SETTINGS_MAX_FRAME_SIZE
+
+  uint32_t last_stream; // Highest stream id the client has used
+  struct h2_stream *streams;
+  int nstreams, npaused;
+  struct h2_stream *send_head, *send_tail;
+  struct h2_stream *woken;
+
+  int sent_goaway;
+  int closing; // GOAWAY sent or received: no new streams
+  int failed;
+};
+
+static uint32_t get32(unsigned char *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static unsigned char *put32(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+  return p + 4;
+}
+
+static unsigned char *put_setting(unsigned char *p, int id, uint32_t value) {
+  p[0] = id >> 8;
+  p[1] = id;
+  return put32(p + 2, value);
+}
+
+static void frame_header(unsigned char *p, int len, int type, int flags,
+                         uint32_t id) {
+  p[0] = len >> 16;
+  p[1] = len >> 8;
+  p[2] = len;
+  p[3] = type;
+  p[4] = flags;
+  put32(p + 5, id);
+}
+
+static int send_frame(struct h2 *h2, int type, int flags, uint32_t id,
+                      void *payload, int len) {
+  unsigned char header[FRAME_HEADER];
+  struct iovec iov[2] = {{header, FRAME_HEADER}, {payload, len}};
+
+  frame_header(header, len, type, flags, id);
+  return conn_send(h2->conn, iov, len > 0 ? 2 : 1, 0);
+}
+
+static int send_rst(struct h2 *h2, uint32_t id, int error) {
+  unsigned char p[4];
+
+  put32(p, error);
+  return send_frame(h2, FRAME_RST_STREAM, 0, id, p, sizeof p);
+}
+
+static int send_window_update(struct h2 *h2, uint32_t id, uint32_t inc) {
+  unsigned char p[4];
+
+  put32(p, inc);
+  return send_frame(h2, FRAME_WINDOW_UPDATE, 0, id, p, sizeof p);
+}
+
+static void send_goaway(struct h2 *h2, int error) {
+  unsigned char p[8];
+
+  if (!h2->sent_goaway) {
+    put32(put32(p, h2->last_stream), error);
+    send_frame(h2, FRAME_GOAWAY, 0, 0, p, sizeof p);
+    h2->sent_goaway = h2->closing = 1;
+  }
+}
+
+/* Say why, and have the connection closed */
+static int connection_error(struct h2 *h2, int error) {
+  send_goaway(h2, error);
+  return -1;
+}
+
+static struct h2_stream *find(struct h2 *h2, uint32_t id) {
+  struct h2_stream *s;
+
+  for (s = h2->streams; s != NULL && s->id != id; s = s->next) {
+  }
+  return s;
+}
+
+/* Response body bytes still to go out */
+static long unsent(struct h2_stream *s) {
+  if (s->file_fd >= 0) {
+    return s->file_end - s->file_offset;
+  }
+  return s->body_len - s->body_sent;
+}
+
+/* Give the stream a turn at sending */
+static void queue(struct h2_stream *s) {
+  struct h2 *h2 = s->h2;
+
+  if (!s->sending) {
+    s->sending = 1;
+    s->send_next = NULL;
+    if (h2->send_tail == NULL) {
+      h2->send_head = s;
+    } else {
+      h2->send_tail->send_next = s;
+    }
+    h2->send_tail = s;
+  }
+}
+
+static struct h2_stream *dequeue(struct h2 *h2) {
+  struct h2_stream *s = h2->send_head;
+
+  if ((h2->send_head = s->send_next) == NULL) {
+    h2->send_tail = NULL;
+  }
+  s->sending = 0;
+  return s;
+}
+
+static void release_body(struct h2_stream *s) {
+  if (s->body_owned) {
+    free(s->body);
+  }
+  if (s->file_owned) {
+    close(s->file_fd);
+  }
+  s->body = NULL;
+  s->body_len = s->body_sent = 0;
+  s->body_owned = s->file_owned = 0;
+  s->file_fd = -1;
+}
+
+static void free_stream(struct h2_stream *s) {
+  struct h2 *h2 = s->h2;
+  struct h2_stream **p;
+
+  for (p = &h2->streams; *p != s; p = &(*p)->next) {
+  }
+  *p = s->next;
+
+  if (s->sending) {
+    struct h2_stream *prev = NULL;
+
+    for (p = &h2->send_head; *p != s; p = &(*p)->send_next) {
+      prev = *p;
+    }
+    *p = s->send_next;
+    if (h2->send_tail == s) {
+      h2->send_tail = prev;
+    }
+  }
+
+  if (s->woken) {
+    for (p = &h2->woken; *p != s; p = &(*p)->woken_next) {
+    }
+    *p = s->woken_next;
+  }
+
+  if (s->paused) {
+    h2->npaused--;
+  }
+  h2->nstreams--;
+
+  release_body(s);
+  free(s->in);
+  free(s);
+}
+
+/* Done with in both directions; if the request body isn't all in, tell
+ * the client to stop sending it */
+static void close_stream(struct h2_stream *s) {
+  if (!s->remote_closed && !s->reset) {
+    send_rst(s->h2, s->id, ERR_NONE);
+  }
+  free_stream(s);
+}
+
+/* The handler is finished with the request */
+static void request_done(struct h2_stream *s) {
+  conn_request_free(s->req);
+  s->req = NULL;
+
+  if (!s->responded) {
+    // Nothing to say; shouldn't happen
+    s->reset = 1;
+    send_rst(s->h2, s->id, ERR_INTERNAL);
+    free_stream(s);
+  } else if (s->local_closed) {
+    close_stream(s);
+  }
+}
+
+/* Hand the stream's request to the handler, or back to it; s may be gone
+ * afterwards */
+static void run(struct h2_stream *s) {
+  s->h2->handler(s->req, s->h2->arg);
+
+  if (s->req->resume == NULL) {
+    request_done(s);
+  }
+}
+
+/* The stream is gone: let a handler still waiting on it give up */
+static void abort_stream(struct h2_stream *s) {
+  struct request *req = s->req;
+
+  s->reset = 1;
+  if (req != NULL) {
+    if (req->resume != NULL) {
+      req->aborted = 1;
+      s->h2->handler(req, s->h2->arg);
+    }
+    conn_request_free(req);
+    s->req = NULL;
+  }
+  free_stream(s);
+}
+
+static int reset_stream(struct h2_stream *s, int error) {
+  struct h2 *h2 = s->h2;
+
+  if (send_rst(h2, s->id, error) < 0) {
+    return -1;
+  }
+  abort_stream(s);
+  return 0;
+}
+
+/* More of a request body is in, or all of it; or what the handler wrote so
+ * far has gone out */
+static void body_arrived(struct h2_stream *s) {
+  if (s->req != NULL && s->req->resume != NULL && !s->paused &&
+      unsent(s) == 0) {
+    run(s);
+  }
+}
+
+/* A body reader's recv(): what DATA has brought so far */
+static int stream_recv(void *arg, void *buf, int len) {
+  struct h2_stream *s = arg;
+  int n = s->in_end - s->in_start;
+
+  if (n == 0) {
+    if (s->remote_closed) {
+      return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (n > len) {
+    n = len;
+  }
+  memcpy(buf, s->in + s->in_start, n);
+  s->in_start += n;
+
+  // Let the client send more once half the window has been read
+  s->unacked += n;
+  if (s->unacked >= STREAM_WINDOW / 2 && !s->remote_closed) {
+    send_window_update(s->h2, s->id, s->unacked);
+    s->recv_window += s->unacked;
+    s->unacked = 0;
+  }
+
+  return n;
+}
+
+/* A body reader only ever sends "100 Continue": an interim HEADERS here */
+static int stream_send(void *arg, void *buf, int len) {
+  struct h2_stream *s = arg;
+  unsigned char block[16];
+  int n = hpack_encode(&s->h2->encoder, block, sizeof block, ":status", "100",
+                       3, 0);
+
+  (void)buf;
+  if (n < 0 ||
+      send_frame(s->h2, FRAME_HEADERS, FLAG_END_HEADERS, s->id, block, n) < 0) {
+    return -1;
+  }
+  return len;
+}
+
+static struct h2_stream *new_stream(struct h2 *h2, uint32_t id) {
+  struct h2_stream *s = calloc(1, sizeof *s);
+
+  if (s == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+
+  s->id = id;
+  s->h2 = h2;
+  s->io = (struct body_io){stream_recv, stream_send, s, 1};
+  s->recv_window = STREAM_WINDOW;
+  s->send_window = h2->initial_window;
+  s->file_fd = -1;
+
+  s->next = h2->streams;
+  h2->streams = s;
+  h2->nstreams++;
+  return s;
+}
+
+/* Give the stream's request to the handler */
+static void start_request(struct h2_stream *s, struct request *req) {
+  s->req = req;
+  req->stream = s;
+  req->body.io = &s->io;
+  run(s);
+}
+
+/* All the body written so far has gone out: let the handler write more */
+static void drained(struct h2_stream *s) {
+  release_body(s);
+  if (s->req != NULL && s->req->resume != NULL) {
+    conn_wake(s->req);
+  }
+}
+
+/* The last of the body has gone out (or been queued on the connection) */
+static void sent(struct h2_stream *s) {
+  release_body(s);
+  s->local_closed = 1;
+
+  if (s->req == NULL) {
+    close_stream(s);
+  }
+}
+
+static int send_batch(struct h2 *h2, struct iovec *iov, int *frames) {
+  int n = *frames;
+
+  *frames = 0;
+  return n > 0 ? conn_send(h2->conn, iov, 2 * n, 0) : 0;
+}
+
+/**
+ * Send DATA frames while the windows allow and the socket keeps up, a frame
+ * per stream in turn
+ *
+ * Frames from memory are batched into one sendmsg(). The body of the last
+ * frame of a stream is released, so the batch is sent first.
+ *
+ * After an upgrade nothing is framed until the client's preface is in:
+ * clients only have so much room for what follows the 101.
+ *
+ * Returns -1 if the connection failed.
+ */
+static int write_frames(struct h2 *h2) {
+  unsigned char headers[WRITE_BATCH][FRAME_HEADER];
+  struct iovec iov[2 * WRITE_BATCH];
+  int frames = 0;
+
+  while (h2->got_settings && h2->send_head != NULL && h2->send_window > 0 &&
+         !conn_queued(h2->conn)) {
+    struct h2_stream *s = dequeue(h2);
+    long left = unsent(s), n = left;
+
+    if (n > s->send_window) {
+      n = s->send_window;
+    }
+    if (n > h2->send_window) {
+      n = h2->send_window;
+    }
+    if (n > h2->max_frame) {
+      n = h2->max_frame;
+    }
+    if (n <= 0) {
+      continue; // A WINDOW_UPDATE queues it again
+    }
+
+    int flags = n == left && !s->streaming ? FLAG_END_STREAM : 0;
+
+    s->send_window -= n;
+    h2->send_window -= n;
+
+    if (s->file_fd >= 0) {
+      struct iovec iov1 = {headers[0], FRAME_HEADER};
+
+      if (send_batch(h2, iov, &frames) < 0) {
+        return -1;
+      }
+      frame_header(headers[0], n, FRAME_DATA, flags, s->id);
+      if (conn_send(h2->conn, &iov1, 1, MSG_MORE) < 0 ||
+          conn_sendfile(h2->conn, s->file_fd, s->file_offset, n) < 0) {
+        return -1;
+      }
+      s->file_offset += n;
+    } else {
+      frame_header(headers[frames], n, FRAME_DATA, flags, s->id);
+      iov[2 * frames] = (struct iovec){headers[frames], FRAME_HEADER};
+      iov[2 * frames + 1] = (struct iovec){s->body + s->body_sent, n};
+      s->body_sent += n;
+      frames++;
+    }
+
+    if (n == left) {
+      if (send_batch(h2, iov, &frames) < 0) {
+        return -1;
+      }
+      if (flags & FLAG_END_STREAM) {
+        sent(s);
+      } else {
+        drained(s);
+      }
+    } else {
+      queue(s);
+    }
+
+    if (frames == WRITE_BATCH && send_batch(h2, iov, &frames) < 0) {
+      return -1;
+    }
+  }
+
+  return send_batch(h2, iov, &frames) < 0 ? -1 : 0;
+}
+
+/* Strip a frame's padding; -1 if it claims more than the frame */
+static int unpad(int flags, unsigned char **p, int *len) {
+  if (flags & FLAG_PADDED) {
+    if (*len < 1 || (*p)[0] >= *len) {
+      return -1;
+    }
+    *len -= 1 + (*p)[0];
+    (*p)++;
+  }
+  return 0;
+}
+
+static int apply_settings(struct h2 *h2, unsigned char *p, int len) {
+  for (; len >= 6; p += 6, len -= 6) {
+    uint32_t value = get32(p + 2);
+
+    switch (p[0] << 8 | p[1]) {
+    case SETTINGS_HEADER_TABLE_SIZE:
+      hpack_set_max(&h2->encoder,
+                    value > HPACK_TABLE_SIZE ? HPACK_TABLE_SIZE : (int)value);
+      break;
+
+    case SETTINGS_ENABLE_PUSH:
+      if (value > 1) {
+        return ERR_PROTOCOL;
+      }
+      break;
+
+    case SETTINGS_INITIAL_WINDOW_SIZE:
+      if (value > MAX_WINDOW) {
+        return ERR_FLOW_CONTROL;
+      }
+      // Applies to the streams already open too
+      for (struct h2_stream *s = h2->streams; s != NULL; s = s->next) {
+        s->send_window += (long)value - h2->initial_window;
+        if (s->send_window > 0 && unsent(s) > 0) {
+          queue(s);
+        }
+      }
+      h2->initial_window = value;
+      break;
+
+    case SETTINGS_MAX_FRAME_SIZE:
+      if (value < MAX_FRAME || value > 0xffffff) {
+        return ERR_PROTOCOL;
+      }
+      h2->max_frame = value;
+      break;
+    }
+  }
+
+  return ERR_NONE;
+}
+
+static int on_settings(struct h2 *h2, int flags, uint32_t id,
+                       unsigned char *p, int len) {
+  int error;
+
+  if (id != 0) {
+    return connection_error(h2, ERR_PROTOCOL);
+  }
+  if (flags & FLAG_ACK) {
+    return len == 0 ? 0 : connection_error(h2, ERR_FRAME_SIZE);
+  }
+  if (len % 6 != 0) {
+    return connection_error(h2, ERR_FRAME_SIZE);
+  }
+  if ((error = apply_settings(h2, p, len)) != ERR_NONE) {
+    return connection_error(h2, error);
+  }
+
+  h2->got_settings = 1;
+  return send_frame(h2, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0) < 0 ? -1 : 0;
+}
+
+static int on_ping(struct h2 *h2, int flags, uint32_t id, unsigned char *p,
+                   int len) {
+  if (id != 0) {
+    return connection_error(h2, ERR_PROTOCOL);
+  }
+  if (len != 8) {
+    return connection_error(h2, ERR_FRAME_SIZE);
+  }
+  if (flags & FLAG_ACK) {
+    return 0;
+  }
+  return send_frame(h2, FRAME_PING, FLAG_ACK, 0, p, len) < 0 ? -1 : 0;
+}
+
+static int on_window_update(struct h2 *h2, uint32_t id, unsigned char *p,
+                            int len) {
+  struct h2_stream *s;
+  long inc;
+
+  if (len != 4) {
+    return connection_error(h2, ERR_FRAME_SIZE);
+  }
+  inc = get32(p) & MAX_WINDOW;
+
+  if (id == 0) {
+    if (inc == 0) {
+      return connection_error(h2, ERR_PROTOCOL);
+    }
+    if (h2->send_window + inc > MAX_WINDOW) {
+      return connection_error(h2, ERR_FLOW_CONTROL);
+    }
+    h2->send_window += inc;
+    return 0;
+  }
+
+  if ((s = find(h2, id)) == NULL) {
+    return 0; // Done with, or reset
+  }
+  if (inc == 0) {
+    return reset_stream(s, ERR_PROTOCOL);
+  }
+  if (s->send_window + inc > MAX_WINDOW) {
+    return reset_stream(s, ERR_FLOW_CONTROL);
+  }
+
+  s->send_window += inc;
+  if (unsent(s) > 0) {
+    queue(s);
+  }
+  return 0;
+}
+
+static int on_rst_stream(struct h2 *h2, uint32_t id, int len) {
+  struct h2_stream *s;
+
+  if (len != 4) {
+    return connection_error(h2, ERR_FRAME_SIZE);
+  }
+  if (id == 0 || id > h2->last_stream) {
+    return connection_error(h2, ERR_PROTOCOL);
+  }
+  if ((s = find(h2, id)) != NULL) {
+    abort_stream(s);
+  }
+  return 0;
+}
+
+static int on_data(struct h2 *h2, int flags, uint32_t id, unsigned char *p,
+                   int len) {
+  struct h2_stream *s = find(h2, id);
+  int frame_len = len;
+
+  if (id == 0 || (s == NULL && id > h2->last_stream)) {
+    return connection_error(h2, ERR_PROTOCOL);
+  }
+  if (unpad(flags, &p, &len) < 0) {
+    return connection_error(h2, ERR_PROTOCOL);
+  }
+
+  // Whatever arrives is buffered against its stream's window or dropped, so
+  // the connection's window can be reopened straight away
+  if ((h2->recv_window -= frame_len) < 0) {
+    return connection_error(h2, ERR_FLOW_CONTROL);
+  }
+  if (h2->recv_window <= CONN_WINDOW / 2) {
+    if (send_window_update(h2, 0, CONN_WINDOW - h2->recv_window) < 0) {
+      return -1;
+    }
+    h2->recv_window = CONN_WINDOW;
+  }
+
+  if (s == NULL) {
+    return 0; // Reset, or answered and closed
+  }
+  if (s->remote_closed) {
+    return reset_stream(s, ERR_STREAM_CLOSED);
+  }
+  if ((s->recv_window -= frame_len) < 0) {
+    return reset_stream(s, ERR_FLOW_CONTROL);
+  }
+  s->unacked += frame_len - len; // Padding is never read
+
+  if (s->req != NULL && len > 0) {
+    if (s->in == NULL && (s->in = malloc(STREAM_WINDOW)) == NULL) {
+      perror("malloc");
+      return reset_stream(s, ERR_INTERNAL);
+    }
+    if (s->in_start > 0) {
+      memmove(s->in, s->in + s->in_start, s->in_end - s->in_start);
+      s->in_end -= s->in_start;
+      s->in_start = 0;
+    }
+    memcpy(s->in + s->in_end, p, len);
+    s->in_end += len;
+  }
+
+  if (flags & FLAG_END_STREAM) {
+    s->remote_closed = 1;
+  }
+  body_arrived(s);
+  return 0;
+}
+
+// A request's header block as it is decoded, written out as HTTP/1.1
+struct build {
+  char method[16];
+  int method_len;
+  char path[REQUEST_PATH_MAX];
+  int path_len;
+  char *p, *end; // Header lines, from LINE_ROOM on in the request buffer
+  int regular;   // Past the pseudo-header fields
+  int bad;       // Malformed (RFC 9113 8.1.1)
+};
+
+static int is(char *name, int len, char *s) {
+  return len == (int)strlen(s) && memcmp(name, s, len) == 0;
+}
+
+/* Whether s has a byte that would break the HTTP/1.1 rendering */
+static int unsafe(char *s, int len, int space_ok) {
+  for (int i = 0; i < len; i++) {
+    if (s[i] == '\r' || s[i] == '\n' || s[i] == '\0' ||
+        (s[i] == ' ' && !space_ok)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void add_line(struct build *b, char *name, int name_len, char *value,
+                     int value_len) {
+  if (b->end - b->p < name_len + value_len + 4 ||
+      unsafe(name, name_len, 0) || memchr(name, ':', name_len) != NULL ||
+      unsafe(value, value_len, 1)) {
+    b->bad = 1;
+    return;
+  }
+
+  memcpy(b->p, name, name_len);
+  b->p += name_len;
+  *b->p++ = ':';
+  *b->p++ = ' ';
+  memcpy(b->p, value, value_len);
+  b->p += value_len;
+  *b->p++ = '\r';
+  *b->p++ = '\n';
+}
+
+/* Decoder callback: never stops, so the table stays in step */
+static int add_field(void *arg, char *name, int name_len, char *value,
+                     int value_len) {
+  struct build *b = arg;
+
+  if (name_len > 0 && name[0] == ':') {
+    if (b->regular) {
+      b->bad = 1;
+    } else if (is(name, name_len, ":method")) {
+      if (value_len == 0 || value_len >= (int)sizeof b->method ||
+          unsafe(value, value_len, 0)) {
+        b->bad = 1;
+      } else {
+        memcpy(b->method, value, value_len);
+        b->method_len = value_len;
+      }
+    } else if (is(name, name_len, ":path")) {
+      if (value_len == 0 || value_len > (int)sizeof b->path ||
+          unsafe(value, value_len, 0)) {
+        b->bad = 1;
+      } else {
+        memcpy(b->path, value, value_len);
+        b->path_len = value_len;
+      }
+    } else if (is(name, name_len, ":authority")) {
+      add_line(b, "host", 4, value, value_len);
+    } else if (!is(name, name_len, ":scheme")) {
+      b->bad = 1;
+    }
+    return 0;
+  }
+
+  b->regular = 1;
+
+  // Connection-specific fields have no place here (RFC 9113 8.2.2)
+  if (is(name, name_len, "connection") || is(name, name_len, "keep-alive") ||
+      is(name, name_len, "proxy-connection") ||
+      is(name, name_len, "transfer-encoding") ||
+      is(name, name_len, "upgrade")) {
+    b->bad = 1;
+    return 0;
+  }
+
+  add_line(b, name, name_len, value, value_len);
+  return 0;
+}
+
+static int ignore_field(void *arg, char *name, int name_len, char *value,
+                        int value_len) {
+  (void)arg;
+  (void)name;
+  (void)name_len;
+  (void)value;
+  (void)value_len;
+  return 0;
+}
+
+/* Put the request line in front of the header lines, and end the block */
+static void finish_request(struct build *b, struct request *req) {
+  char *lines = req->buf + LINE_ROOM;
+  int lines_len = b->p - lines;
+  int n = sprintf(req->buf, "%.*s %.*s HTTP/2\r\n", b->method_len, b->method,
+                  b->path_len, b->path);
+
+  memmove(req->buf + n, lines, lines_len);
+  memcpy(req->buf + n + lines_len, "\r\n", 2);
+  req->buf_len = req->body_offset = n + lines_len + 2;
+  req->buf[req->buf_len] = '\0';
+  http_head_init(&req->head);
+  http_head_scan(req->buf, req->buf_len, &req->head);
+}
+
+/* A complete header block: a new request, or a request's trailers */
+static int end_headers(struct h2 *h2, uint32_t id, int end_stream,
+                       unsigned char *block, int len) {
+  struct h2_stream *s = find(h2, id);
+  struct request *req;
+  struct build b;
+
+  // Decoded whatever happens, to keep the table in step with the client
+  if (s != NULL || id <= h2->last_stream) {
+    if (hpack_decode(&h2->decoder, block, len, ignore_field, NULL) < 0) {
+      return connection_error(h2, ERR_COMPRESSION);
+    }
+    if (s == NULL) {
+      return 0; // Reset, or answered and closed
+    }
+    if (!end_stream || s->remote_closed) {
+      return reset_stream(s, ERR_PROTOCOL);
+    }
+    s->remote_closed = 1;
+    body_arrived(s);
+    return 0;
+  }
+
+  h2->last_stream = id;
+
+  if (h2->closing || h2->nstreams >= MAX_STREAMS ||
+      (req = conn_request(h2->conn)) == NULL) {
+    if (hpack_decode(&h2->decoder, block, len, ignore_field, NULL) < 0) {
+      return connection_error(h2, ERR_COMPRESSION);
+    }
+    return send_rst(h2, id, ERR_REFUSED_STREAM) < 0 ? -1 : 0;
+  }
+
+  memset(&b, 0, sizeof b);
+  b.p = req->buf + LINE_ROOM;
+  b.end = req->buf + req->buf_size - 3; // Room for the blank line and a NUL
+
+  if (hpack_decode(&h2->decoder, block, len, add_field, &b) < 0) {
+    conn_request_free(req);
+    return connection_error(h2, ERR_COMPRESSION);
+  }
+  if (b.bad || b.method_len == 0 || b.path_len == 0) {
+    conn_request_free(req);
+    return send_rst(h2, id, ERR_PROTOCOL) < 0 ? -1 : 0;
+  }
+  if ((s = new_stream(h2, id)) == NULL) {
+    conn_request_free(req);
+    return send_rst(h2, id, ERR_INTERNAL) < 0 ? -1 : 0;
+  }
+
+  finish_request(&b, req);
+  s->remote_closed = end_stream;
+  start_request(s, req);
+  return 0;
+}
+
+static int add_block(struct h2 *h2, int flags, unsigned char *p, int len) {
+  if (h2->block_len + len > MAX_HEADER_BLOCK) {
+    return connection_error(h2, ERR_ENHANCE_YOUR_CALM);
+  }
+  if (h2->block == NULL &&
+      (h2->block = (unsigned char *)bufpool_get()) == NULL) {
+    return connection_error(h2, ERR_INTERNAL);
+  }
+
+  memcpy(h2->block + h2->block_len, p, len);
+  h2->block_len += len;
+
+  if (!(flags & FLAG_END_HEADERS)) {
+    return 0;
+  }
+
+  uint32_t id = h2->block_stream;
+  int rv;
+
+  h2->block_stream = 0;
+  rv = end_headers(h2, id, h2->block_end_stream, h2->block, h2->block_len);
+  bufpool_put((char *)h2->block);
+  h2->block = NULL;
+  return rv;
+}
+
+static int on_headers(struct h2 *h2, int flags, uint32_t id, unsigned char *p,
+                      int len) {
+  if (id == 0 || id % 2 == 0 || unpad(flags, &p, &len) < 0) {
+    return connection_error(h2, ERR_PROTOCOL);
+  }
+  if (flags & FLAG_PRIORITY) {
+    if (len < 5) {
+      return connection_error(h2, ERR_FRAME_SIZE);
+    }
+    p += 5;
+    len -= 5;
+  }
+
+  // Usually the whole block is in this frame, and is decoded from it
+  if (flags & FLAG_END_HEADERS) {
+    return end_headers(h2, id, flags & FLAG_END_STREAM, p, len);
+  }
+
+  h2->block_stream = id;
+  h2->block_end_stream = flags & FLAG_END_STREAM;
+  h2->block_len = 0;
+  return add_block(h2, flags, p, len);
+}
+
+static int frame(struct h2 *h2, int type, int flags, uint32_t id,
+                 unsigned char *p, int len) {
+  if (!h2->got_settings && type != FRAME_SETTINGS) {
+    return connection_error(h2, ERR_PROTOCOL);
+  }
+  if (h2->block_stream != 0 &&
+      (type != FRAME_CONTINUATION || id != h2->block_stream)) {
+    return connection_error(h2, ERR_PROTOCOL);
+  }
+
+  switch (type) {
+  case FRAME_DATA:
+    return on_data(h2, flags, id, p, len);
+  case FRAME_HEADERS:
+    return on_headers(h2, flags, id, p, len);
+  case FRAME_PRIORITY:
+    return 0; // Streams are answered as they come; nothing to reorder
+  case FRAME_RST_STREAM:
+    return on_rst_stream(h2, id, len);
+  case FRAME_SETTINGS:
+    return on_settings(h2, flags, id, p, len);
+  case FRAME_PUSH_PROMISE:
+    return connection_error(h2, ERR_PROTOCOL);
+  case FRAME_PING:
+    return on_ping(h2, flags, id, p, len);
+  case FRAME_GOAWAY:
+    h2->closing = 1; // Streams already open are still answered
+    return 0;
+  case FRAME_WINDOW_UPDATE:
+    return on_window_update(h2, id, p, len);
+  case FRAME_CONTINUATION:
+    if (h2->block_stream == 0) {
+      return connection_error(h2, ERR_PROTOCOL);
+    }
+    return add_block(h2, flags, p, len);
+  default:
+    return 0; // Unknown types are ignored
+  }
+}
+
+/* Borrow the input buffer for reading into; -1 on error */
+static int borrow_input(struct h2 *h2) {
+  if (h2->in == NULL && (h2->in = (unsigned char *)bufpool_get()) == NULL) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Hand the input buffer back if nothing is left in it */
+static void release_input(struct h2 *h2) {
+  if (h2->in != NULL && h2->in_len == 0) {
+    bufpool_put((char *)h2->in);
+    h2->in = NULL;
+  }
+}
+
+/**
+ * Act on each complete frame in the input buffer
+ *
+ * Returns -1 once the connection should close.
+ */
+static int parse(struct h2 *h2) {
+  if (h2->in == NULL) {
+    return 0; // Nothing has come
+  }
+
+  unsigned char *p = h2->in, *end = h2->in + h2->in_len;
+
+  if (h2->preface < H2_PREFACE_LEN) {
+    int n = H2_PREFACE_LEN - h2->preface;
+
+    if (n > end - p) {
+      n = end - p;
+    }
+    if (memcmp(p, H2_PREFACE + h2->preface, n) != 0) {
+      return -1;
+    }
+    h2->preface += n;
+    p += n;
+  }
+
+  while (end - p >= FRAME_HEADER) {
+    int len = p[0] << 16 | p[1] << 8 | p[2];
+
+    if (len > MAX_FRAME) {
+      return connection_error(h2, ERR_FRAME_SIZE);
+    }
+    if (end - p < FRAME_HEADER + len) {
+      break;
+    }
+    if (frame(h2, p[3], p[4], get32(p + 5) & MAX_WINDOW, p + FRAME_HEADER,
+              len) < 0) {
+      return -1;
+    }
+    p += FRAME_HEADER + len;
+  }
+
+  h2->in_len = end - p;
+  memmove(h2->in, p, h2->in_len);
+  release_input(h2);
+  return 0;
+}
+
+/**
+ * Whether buf starts with the HTTP/2 connection preface
+ *
+ * Returns 1 if it does, -1 if it might once more arrives, 0 if not.
+ */
+int h2_preface(char *buf, int len) {
+  int n = len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN;
+
+  if (memcmp(buf, H2_PREFACE, n) != 0) {
+    return 0;
+  }
+  return n == H2_PREFACE_LEN ? 1 : -1;
+}
+
+/**
+ * Whether an HTTP/1.1 request asks to carry on in HTTP/2 ("Upgrade: h2c")
+ *
+ * Only a request without a body is taken up on it. Points *settings at the
+ * request's HTTP2-Settings. head is the request's, scanned from buf.
+ */
+int h2_upgrade_wanted(struct http_head *head, char *buf, char **settings,
+                      int *settings_len) {
+  int len, found = 0;
+  char *v = http_head_field(head, buf, "Upgrade", &len);
+
+  for (int i = 0; v != NULL && i + 3 <= len; i++) {
+    if (strncasecmp(v + i, "h2c", 3) == 0 && (i == 0 || v[i - 1] == ' ' ||
+                                              v[i - 1] == ',') &&
+        (i + 3 == len || v[i + 3] == ' ' || v[i + 3] == ',')) {
+      found = 1;
+    }
+  }
+
+  if (!found || (*settings = http_head_field(head, buf, "HTTP2-Settings",
+                                             settings_len)) == NULL) {
+    return 0;
+  }
+  if (http_head_field(head, buf, "Transfer-Encoding", &len) != NULL) {
+    return 0;
+  }
+
+  v = http_head_field(head, buf, "Content-Length", &len);
+  return v == NULL || (len == 1 && *v == '0');
+}
+
+/* Decode base64url (RFC 4648 5), padded or not; -1 if invalid or too long */
+static int base64url_decode(char *in, int len, unsigned char *out, int size) {
+  unsigned int bits = 0;
+  int nbits = 0, n = 0;
+
+  for (int i = 0; i < len && in[i] != '='; i++) {
+    char c = in[i];
+    int v;
+
+    if (c >= 'A' && c <= 'Z') {
+      v = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      v = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      v = c - '0' + 52;
+    } else if (c == '-') {
+      v = 62;
+    } else if (c == '_') {
+      v = 63;
+    } else {
+      return -1;
+    }
+
+    bits = (bits << 6 | v) & 0xfff;
+    if ((nbits += 6) >= 8) {
+      if (n == size) {
+        return -1;
+      }
+      nbits -= 8;
+      out[n++] = bits >> nbits;
+    }
+  }
+
+  return n;
+}
+
+/**
+ * Start a session on conn, passing requests to handler along with arg
+ *
+ * Returns NULL on error.
+ */
+struct h2 *h2_create(struct conn *conn, conn_handler handler, void *arg) {
+  struct h2 *h2 = calloc(1, sizeof *h2);
+
+  if (h2 == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+
+  if (hpack_init(&h2->decoder, HPACK_TABLE_SIZE) < 0 ||
+      hpack_init(&h2->encoder, HPACK_TABLE_SIZE) < 0) {
+    hpack_free(&h2->decoder);
+    free(h2);
+    return NULL;
+  }
+
+  h2->conn = conn;
+  h2->handler = handler;
+  h2->arg = arg;
+  h2->send_window = h2->recv_window = h2->initial_window = DEFAULT_WINDOW;
+  h2->max_frame = MAX_FRAME;
+  return h2;
+}
+
+/**
+ * Send our preface, take on the request that asked to upgrade (if any) as
+ * stream 1, and act on the input that came with the switch
+ *
+ * settings is the upgraded request's HTTP2-Settings. The session owns
+ * upgraded from here on. Returns -1 if the connection should close.
+ */
+int h2_start(struct h2 *h2, char *input, int len, struct request *upgraded,
+             char *settings, int settings_len) {
+  unsigned char p[12], *q = p;
+  struct h2_stream *s;
+
+  q = put_setting(q, SETTINGS_MAX_CONCURRENT_STREAMS, MAX_STREAMS);
+  q = put_setting(q, SETTINGS_MAX_HEADER_LIST_SIZE,
+                  REQUEST_BUFFER_SIZE - LINE_ROOM);
+
+  if (send_frame(h2, FRAME_SETTINGS, 0, 0, p, q - p) < 0 ||
+      send_window_update(h2, 0, CONN_WINDOW - h2->recv_window) < 0) {
+    if (upgraded != NULL) {
+      conn_request_free(upgraded);
+    }
+    return -1;
+  }
+  h2->recv_window = CONN_WINDOW;
+
+  if (upgraded != NULL) {
+    unsigned char decoded[256];
+    int n = base64url_decode(settings, settings_len, decoded, sizeof decoded);
+
+    // The rest of the buffer goes with the request
+    if (len > INPUT_SIZE || n < 0 || n % 6 != 0 ||
+        apply_settings(h2, decoded, n) != ERR_NONE ||
+        (s = new_stream(h2, 1)) == NULL || borrow_input(h2) < 0) {
+      conn_request_free(upgraded);
+      return -1;
+    }
+    memcpy(h2->in, input, len);
+    h2->in_len = len;
+    len = 0;
+
+    h2->last_stream = 1;
+    s->remote_closed = 1;
+    start_request(s, upgraded);
+  }
+
+  // In pieces, if more came than the buffer holds
+  while (len > 0) {
+    int n = INPUT_SIZE - h2->in_len;
+
+    if (borrow_input(h2) < 0) {
+      return -1;
+    }
+    if (n > len) {
+      n = len;
+    }
+    memcpy(h2->in + h2->in_len, input, n);
+    h2->in_len += n;
+    input += n;
+    len -= n;
+
+    if (parse(h2) < 0) {
+      return -1;
+    }
+  }
+
+  return parse(h2);
+}
+
+/**
+ * Do what the connection is ready for: resume woken streams, act on the
+ * input, and send what flow control allows
+ *
+ * No input is read while responses are waiting for the socket, so a client
+ * that doesn't read can't pile up more of them. Returns -1 once the
+ * connection should close.
+ */
+int h2_run(struct h2 *h2) {
+  struct h2_stream *s;
+
+  while ((s = h2->woken) != NULL) {
+    h2->woken = s->woken_next;
+    s->woken = 0;
+    body_arrived(s);
+  }
+
+  if (!conn_queued(h2->conn)) {
+    if (borrow_input(h2) < 0) {
+      return -1;
+    }
+
+    int n = conn_recv(h2->conn, h2->in + h2->in_len, INPUT_SIZE - h2->in_len);
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                   errno != EINTR)) {
+      return -1;
+    }
+    if (n > 0) {
+      metrics_bytes(n, 0);
+      h2->in_len += n;
+      if (parse(h2) < 0) {
+        return -1;
+      }
+    }
+    release_input(h2);
+  }
+
+  return h2->failed || write_frames(h2) < 0 ? -1 : 0;
+}
+
+/* How many streams are open, and how many of those are paused */
+int h2_streams(struct h2 *h2, int *paused) {
+  *paused = h2->npaused;
+  return h2->nstreams;
+}
+
+/* Take no new streams; those open are still answered */
+void h2_goaway(struct h2 *h2) { send_goaway(h2, ERR_NONE); }
+
+/* Whether the session is over */
+int h2_done(struct h2 *h2) { return h2->closing && h2->nstreams == 0; }
+
+/* Free the session, first letting handlers still waiting give up */
+void h2_close(struct h2 *h2) {
+  while (h2->streams != NULL) {
+    abort_stream(h2->streams);
+  }
+  hpack_free(&h2->decoder);
+  hpack_free(&h2->encoder);
+  bufpool_put((char *)h2->in);
+  bufpool_put((char *)h2->block);
+  free(h2);
+}
+
+/* See conn_pause() */
+void h2_pause(struct h2_stream *s) {
+  if (!s->paused) {
+    s->paused = 1;
+    s->h2->npaused++;
+  }
+}
+
+/* See conn_wake(); the connection has to be run for it to happen */
+void h2_wake(struct h2_stream *s) {
+  struct h2 *h2 = s->h2;
+
+  if (s->paused) {
+    s->paused = 0;
+    h2->npaused--;
+  }
+  if (!s->woken) {
+    s->woken = 1;
+    s->woken_next = h2->woken;
+    h2->woken = s;
+  }
+}
+
+/* Send the response HEADERS; END_STREAM too if there's no body. A length
+ * of -1 leaves out content-length. */
+static int send_headers(struct h2_stream *s, int status,
+                        struct h2_field *fields, int nfields, long length) {
+  struct h2 *h2 = s->h2;
+  unsigned char block[RESPONSE_BLOCK];
+  char digits[24];
+  int n, k;
+
+  if (s->reset || s->responded) {
+    return -1;
+  }
+
+  k = sprintf(digits, "%d", status);
+  n = hpack_encode(&h2->encoder, block, sizeof block, ":status", digits, k, 1);
+
+  for (int i = 0; i < nfields && n >= 0; i++) {
+    k = hpack_encode(&h2->encoder, block + n, sizeof block - n, fields[i].name,
+                     fields[i].value, strlen(fields[i].value),
+                     fields[i].index);
+    n = k < 0 ? -1 : n + k;
+  }
+
+  if (n >= 0 && length >= 0) {
+    k = sprintf(digits, "%ld", length);
+    k = hpack_encode(&h2->encoder, block + n, sizeof block - n,
+                     "content-length", digits, k, 0);
+    n = k < 0 ? -1 : n + k;
+  }
+
+  if (n < 0) {
+    // The encoder's table has moved on without the client's
+    h2->failed = 1;
+    return -1;
+  }
+
+  s->responded = 1;
+  if (send_frame(h2, FRAME_HEADERS,
+                 FLAG_END_HEADERS | (length == 0 ? FLAG_END_STREAM : 0),
+                 s->id, block, n) < 0) {
+    return -1;
+  }
+  if (length == 0) {
+    s->local_closed = 1;
+  }
+  return FRAME_HEADER + n;
+}
+
+/* The body can't be sent after all */
+static int give_up(struct h2_stream *s) {
+  release_body(s);
+  s->reset = s->local_closed = 1;
+  send_rst(s->h2, s->id, ERR_INTERNAL);
+  return -1;
+}
+
+/**
+ * Answer a stream with status, fields and len bytes of body
+ *
+ * As much of the body as flow control and the socket allow is sent from
+ * the caller's memory; only the rest is copied.
+ *
+ * Returns the number of header and body bytes, or -1 on error.
+ */
+int h2_respond(struct h2_stream *s, int status, struct h2_field *fields,
+               int nfields, void *body, long len) {
+  int n;
+
+  if ((n = send_headers(s, status, fields, nfields, len)) < 0 || len == 0) {
+    return n;
+  }
+
+  s->body = body;
+  s->body_len = len;
+  queue(s);
+
+  if (write_frames(s->h2) < 0) {
+    return -1;
+  }
+
+  if (s->body != NULL) {
+    long left = s->body_len - s->body_sent;
+    char *copy = malloc(left);
+
+    if (copy == NULL) {
+      perror("malloc");
+      return give_up(s);
+    }
+    memcpy(copy, s->body + s->body_sent, left);
+    s->body = copy;
+    s->body_len = left;
+    s->body_sent = 0;
+    s->body_owned = 1;
+  }
+
+  return n + len;
+}
+
+/**
+ * Answer a stream with status, fields and the first len bytes of an open
+ * file, as for conn_sendfile()
+ *
+ * Returns the number of header bytes, or -1 on error.
+ */
+int h2_respond_file(struct h2_stream *s, int status, struct h2_field *fields,
+                    int nfields, int filefd, off_t len) {
+  int n;
+
+  if ((n = send_headers(s, status, fields, nfields, len)) < 0 || len == 0) {
+    return n;
+  }
+
+  s->file_fd = filefd;
+  s->file_offset = 0;
+  s->file_end = len;
+  queue(s);
+
+  if (write_frames(s->h2) < 0) {
+    return -1;
+  }
+
+  if (s->file_fd >= 0) {
+    if ((s->file_fd = fcntl(filefd, F_DUPFD_CLOEXEC, 0)) < 0) {
+      perror("dup");
+      return give_up(s);
+    }
+    s->file_owned = 1;
+  }
+
+  return n;
+}
+
+/**
+ * Start answering a stream whose body will follow through h2_write(), as
+ * it comes; len is its length if known, else -1
+ *
+ * Returns the number of header bytes, or -1 on error.
+ */
+int h2_respond_stream(struct h2_stream *s, int status, struct h2_field *fields,
+                      int nfields, long len) {
+  int n = send_headers(s, status, fields, nfields, len);
+
+  if (n >= 0 && len != 0) {
+    s->streaming = 1;
+  }
+  return n;
+}
+
+/**
+ * Send the next len bytes of a streamed body; last ends the stream
+ *
+ * Whatever flow control and the socket won't take now is copied. Once it
+ * has all gone out, a handler waiting in req->resume is woken to write
+ * more, so check h2_pending() before writing again.
+ *
+ * Returns len, or -1 if the stream is gone.
+ */
+long h2_write(struct h2_stream *s, void *data, long len, int last) {
+  long left = unsent(s);
+
+  if (s->reset || s->local_closed || !s->streaming) {
+    return -1;
+  }
+
+  if (len > 0) {
+    char *body = malloc(left + len);
+
+    if (body == NULL) {
+      perror("malloc");
+      return give_up(s);
+    }
+    memcpy(body, s->body + s->body_sent, left);
+    memcpy(body + left, data, len);
+    release_body(s);
+    s->body = body;
+    s->body_len = left + len;
+    s->body_owned = 1;
+  }
+
+  if (last) {
+    s->streaming = 0;
+    if (unsent(s) == 0) {
+      // Nothing left to carry the end of the stream
+      if (send_frame(s->h2, FRAME_DATA, FLAG_END_STREAM, s->id, NULL, 0) < 0) {
+        return -1;
+      }
+      sent(s);
+      return len;
+    }
+  }
+
+  queue(s);
+  return write_frames(s->h2) < 0 ? -1 : len;
+}
+
+/* Body bytes written with h2_write() that haven't gone out yet */
+long h2_pending(struct h2_stream *s) { return unsent(s); }
+
+/* Give up on a streamed response part way; the client sees the stream
+ * reset */
+void h2_cancel(struct h2_stream *s) {
+  if (!s->reset && !s->local_closed) {
+    give_up(s);
+  }
+}
@@ -0,0 +1,47 @@
+#ifndef _H2_H_
+#define _H2_H_
+
+#include "conn.h"
+#include <sys/types.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+struct h2;        // One HTTP/2 connection's session
+struct h2_stream; // One request/response exchange on it
+struct http_head;
+
+// A response header field other than :status and content-length
+struct h2_field {
+  char *name; // Lower case
+  char *value;
+  int index;  // Likely to repeat, so worth a slot in the client's table
+};
+
+extern int h2_preface(char *buf, int len);
+extern int h2_upgrade_wanted(struct http_head *head, char *buf,
+                             char **settings, int *settings_len);
+extern struct h2 *h2_create(struct conn *conn, conn_handler handler,
+                            void *arg);
+extern int h2_start(struct h2 *h2, char *input, int len,
+                    struct request *upgraded, char *settings,
+                    int settings_len);
+extern int h2_run(struct h2 *h2);
+extern int h2_streams(struct h2 *h2, int *paused);
+extern void h2_goaway(struct h2 *h2);
+extern int h2_done(struct h2 *h2);
+extern void h2_close(struct h2 *h2);
+extern void h2_pause(struct h2_stream *s);
+extern void h2_wake(struct h2_stream *s);
+extern int h2_respond(struct h2_stream *s, int status, struct h2_field *fields,
+                      int nfields, void *body, long len);
+extern int h2_respond_file(struct h2_stream *s, int status,
+                           struct h2_field *fields, int nfields, int filefd,
+                           off_t len);
+extern int h2_respond_stream(struct h2_stream *s, int status,
+                             struct h2_field *fields, int nfields, long len);
+extern long h2_write(struct h2_stream *s, void *data, long len, int last);
+extern long h2_pending(struct h2_stream *s);
+extern void h2_cancel(struct h2_stream *s);
+
+#endif
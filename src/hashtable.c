@@ -32,7 +32,7 @@ printf("%d %s\n", q->bar, q->baz); // 12 Hello
 */
 
 #include "hashtable.h"
-#include "llist.h"
+#include "list.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,18 +40,16 @@ printf("%d %s\n", q->bar, q->baz); // 12 Hello
 #define DEFAULT_SIZE 128
 #define DEFAULT_GROW_FACTOR 2
 
-/* Hash table entry */
+/* Hash table entry
+ *
+ * Chained into its bucket through node, with the key copied in after it,
+ * so an entry is one allocation and a lookup touches nothing else.
+ */
 struct htent {
-  void *key;
+  struct hlist_node node;
   int key_size;
-  int hashed_key;
   void *data;
-};
-
-/* Used to clean up the linked lists */
-struct foreach_callback_payload {
-  void *arg;
-  void (*f)(void *, void *);
+  unsigned char key[];
 };
 
 /* Change the entry count, maintain load metrics */
@@ -90,34 +88,30 @@ struct hashtable *hashtable_create(int size, int (*hashf)(void *, int, int)) {
   ht->size = size;
   ht->num_entries = 0;
   ht->load = 0;
-  ht->bucket = malloc(size * sizeof(struct llist *));
+  ht->bucket = calloc(size, sizeof *ht->bucket);
   ht->hashf = hashf;
 
-  for (int i = 0; i < size; i++) {
-    ht->bucket[i] = llist_create();
+  if (ht->bucket == NULL) {
+    free(ht);
+    return NULL;
   }
 
   return ht;
 }
 
-/* Free an htent */
-void htent_free(void *htent, void *arg) {
-  (void)arg;
-
-  free(htent);
-}
-
 /* Destroy a hashtable
  *
  * NOTE: does *not* free the data pointer
  */
 void hashtable_destroy(struct hashtable *ht) {
-  for (int i = 0; i < ht->size; i++) {
-    struct llist *llist = ht->bucket[i];
+  struct hlist_node *n, *next;
 
-    llist_foreach(llist, htent_free, NULL);
-    llist_destroy(llist);
+  for (int i = 0; i < ht->size; i++) {
+    HLIST_FOR_EACH(n, next, &ht->bucket[i]) {
+      free(container_of(n, struct htent, node));
+    }
   }
+  free(ht->bucket);
   free(ht);
 }
 
@@ -126,37 +120,44 @@ void *hashtable_put(struct hashtable *ht, char *key, void *data) {
   return hashtable_put_bin(ht, key, strlen(key), data);
 }
 
-/* Put to hash table with a binary key */
+/* Put to hash table with a binary key
+ *
+ * Appended to its chain, so a key put twice is found, and deleted, oldest
+ * first, as the cache's LRU eviction expects.
+ */
 void *hashtable_put_bin(struct hashtable *ht, void *key, int key_size,
                         void *data) {
   int index = ht->hashf(key, key_size, ht->size);
-  struct llist *llist = ht->bucket[index];
-  struct htent *ent = malloc(sizeof *ent);
-  ent->key = malloc(key_size);
-  memcpy(ent->key, key, key_size);
-  ent->key_size = key_size;
-  ent->hashed_key = index;
-  ent->data = data;
+  struct htent *ent = malloc(sizeof *ent + key_size);
 
-  if (llist_append(llist, ent) == NULL) {
-    free(ent->key);
-    free(ent);
+  if (ent == NULL) {
     return NULL;
   }
 
+  memcpy(ent->key, key, key_size);
+  ent->key_size = key_size;
+  ent->data = data;
+  hlist_add_tail(&ht->bucket[index], &ent->node);
+
   add_entry_count(ht, +1);
 
   return data;
 }
 
-/* Comparison function for hashtable entries */
-int htcmp(void *a, void *b) {
-  struct htent *entA = a, *entB = b;
-  int size_diff = entB->key_size - entA->key_size;
-  if (size_diff) {
-    return size_diff;
+/* Find the entry for a key in its bucket */
+static struct htent *find(struct hashtable *ht, void *key, int key_size) {
+  int index = ht->hashf(key, key_size, ht->size);
+  struct hlist_node *n, *next;
+
+  HLIST_FOR_EACH(n, next, &ht->bucket[index]) {
+    struct htent *ent = container_of(n, struct htent, node);
+
+    if (ent->key_size == key_size && memcmp(ent->key, key, key_size) == 0) {
+      return ent;
+    }
   }
-  return memcmp(entA->key, entB->key, entA->key_size);
+
+  return NULL;
 }
 
 /* Get from the hash table with a string key */
@@ -166,21 +167,13 @@ void *hashtable_get(struct hashtable *ht, char *key) {
 
 /* Get from the hash table with a binary data key */
 void *hashtable_get_bin(struct hashtable *ht, void *key, int key_size) {
-  int index = ht->hashf(key, key_size, ht->size);
-
-  struct llist *llist = ht->bucket[index];
-
-  struct htent cmpent;
-  cmpent.key = key;
-  cmpent.key_size = key_size;
-
-  struct htent *n = llist_find(llist, &cmpent, htcmp);
+  struct htent *ent = find(ht, key, key_size);
 
-  if (n == NULL) {
+  if (ent == NULL) {
     return NULL;
   }
 
-  return n->data;
+  return ent->data;
 }
 
 /* Delete from the hashtable by string key */
@@ -193,14 +186,7 @@ void *hashtable_delete(struct hashtable *ht, char *key) {
  * NOTE: does *not* free the data - just frees the table entry
  */
 void *hashtable_delete_bin(struct hashtable *ht, void *key, int key_size) {
-  int index = ht->hashf(key, key_size, ht->size);
-  struct llist *llist = ht->bucket[index];
-
-  struct htent cmpent;
-  cmpent.key = key;
-  cmpent.key_size = key_size;
-
-  struct htent *ent = llist_delete(llist, &cmpent, htcmp);
+  struct htent *ent = find(ht, key, key_size);
 
   if (ent == NULL) {
     return NULL;
@@ -208,33 +194,24 @@ void *hashtable_delete_bin(struct hashtable *ht, void *key, int key_size) {
 
   void *data = ent->data;
 
+  hlist_del(&ent->node);
   free(ent);
 
   add_entry_count(ht, -1);
   return data;
 }
 
-/* Foreach callback function */
-void foreach_callback(void *vent, void *vpayload) {
-  struct htent *ent = vent;
-  struct foreach_callback_payload *payload = vpayload;
-  payload->f(ent->data, payload->arg);
-}
-
 /* For-each element in the hashtable
  *
  * NOTE: Elements are retured in effectively random order
  */
 void hashtable_foreach(struct hashtable *ht, void (*f)(void *, void *),
                        void *arg) {
-  struct foreach_callback_payload payload;
-
-  payload.f = f;
-  payload.arg = arg;
+  struct hlist_node *n, *next;
 
   for (int i = 0; i < ht->size; i++) {
-    struct llist *llist = ht->bucket[i];
-
-    llist_foreach(llist, foreach_callback, &payload);
+    HLIST_FOR_EACH(n, next, &ht->bucket[i]) {
+      f(container_of(n, struct htent, node)->data, arg);
+    }
   }
-}
\ No newline at end of file
+}
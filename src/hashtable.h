@@ -5,7 +5,7 @@ struct hashtable {
   int size;        // Read-only
   int num_entries; // Read-only
   float load;      // Read-only
-  struct llist **bucket;
+  struct hlist_head *bucket;
   int (*hashf)(void *data, int data_size, int bucket_count);
 };
 
@@ -0,0 +1,506 @@
+/* HPACK header compression (RFC 7541)
+ *
+ * The decoder handles everything a client may send: indexed fields, literals
+ * with and without indexing, table size updates and Huffman-coded strings.
+ * Fields that are entirely in the static table (":method: GET", ":path: /")
+ * decode without touching the dynamic table.
+ *
+ * The encoder never uses Huffman coding. A response header is sent as a
+ * static table index where there is one (":status: 200" is one byte), as an
+ * index into the dynamic table if it has been sent before, and otherwise as
+ * a literal, indexed for next time if the caller expects it to repeat.
+ */
+
+#include "hpack.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define STATIC_COUNT 61
+#define ENTRY_OVERHEAD 32 // Added to each entry's size by RFC 7541 4.1
+
+struct hpack_entry {
+  char *name, *value; // One allocation, name first
+  int name_len, value_len;
+};
+
+static struct {
+  char *name;
+  char *value;
+} static_table[STATIC_COUNT] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* Huffman code length of each symbol, 256 being EOS (RFC 7541 Appendix B).
+ * The code is canonical, so the lengths are enough to rebuild it. */
+static unsigned char huff_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// Canonical decoding tables, built on first use
+static int huff_first[31];  // First code of each length
+static int huff_count[31];  // Codes of each length
+static int huff_offset[31]; // Where each length's symbols start in huff_sym
+static short huff_sym[257]; // Symbols by code length, then value
+static int huff_built;
+
+static void huff_build(void) {
+  int code = 0, n = 0;
+
+  for (int len = 1; len <= 30; len++) {
+    huff_first[len] = code;
+    huff_offset[len] = n;
+    for (int sym = 0; sym < 257; sym++) {
+      if (huff_len[sym] == len) {
+        huff_sym[n++] = sym;
+      }
+    }
+    huff_count[len] = n - huff_offset[len];
+    code = len < 30 ? (code + huff_count[len]) << 1 : 0; // 30 is the longest
+  }
+  huff_built = 1;
+}
+
+/* Returns the decoded length, or -1 if the string is malformed */
+static int huff_decode(unsigned char *in, int len, char *out, int size) {
+  int code = 0, bits = 0, n = 0;
+
+  if (!huff_built) {
+    huff_build();
+  }
+
+  for (int i = 0; i < len; i++) {
+    for (int b = 7; b >= 0; b--) {
+      code = (code << 1) | ((in[i] >> b) & 1);
+      bits++;
+
+      if ((unsigned int)(code - huff_first[bits]) <
+          (unsigned int)huff_count[bits]) {
+        int sym = huff_sym[huff_offset[bits] + code - huff_first[bits]];
+
+        if (sym == 256 || n == size) {
+          return -1; // EOS may only appear as padding
+        }
+        out[n++] = sym;
+        code = bits = 0;
+      } else if (bits == 30) {
+        return -1;
+      }
+    }
+  }
+
+  // Padding is under a byte of the most significant bits of EOS, all ones
+  if (bits > 7 || code != (1 << bits) - 1) {
+    return -1;
+  }
+  return n;
+}
+
+/* Decode an integer with an n-bit prefix; *p must be before end */
+static int decode_int(unsigned char **p, unsigned char *end, int prefix,
+                      int *value) {
+  int max = (1 << prefix) - 1;
+  int v = *(*p)++ & max;
+
+  if (v == max) {
+    int shift = 0;
+    unsigned char b;
+
+    do {
+      if (*p == end || shift > 21) {
+        return -1;
+      }
+      b = *(*p)++;
+      v += (b & 127) << shift;
+      shift += 7;
+    } while (b & 128);
+  }
+
+  *value = v;
+  return 0;
+}
+
+/* Decode a string literal, into buf if it is Huffman-coded */
+static int decode_string(unsigned char **p, unsigned char *end, char *buf,
+                         char **s, int *len) {
+  int huffman, n;
+
+  if (*p == end) {
+    return -1;
+  }
+  huffman = **p & 0x80;
+
+  if (decode_int(p, end, 7, &n) < 0 || n > end - *p) {
+    return -1;
+  }
+
+  if (huffman) {
+    if ((*len = huff_decode(*p, n, buf, HPACK_MAX_STRING)) < 0) {
+      return -1;
+    }
+    *s = buf;
+  } else {
+    if (n > HPACK_MAX_STRING) {
+      return -1;
+    }
+    *s = (char *)*p;
+    *len = n;
+  }
+
+  *p += n;
+  return 0;
+}
+
+static struct hpack_entry *entry(struct hpack_table *t, int i) {
+  return &t->ring[(t->first + i) % t->cap];
+}
+
+static void evict_to(struct hpack_table *t, int size) {
+  while (t->count > 0 && t->size > size) {
+    struct hpack_entry *e = entry(t, t->count - 1);
+
+    t->size -= e->name_len + e->value_len + ENTRY_OVERHEAD;
+    free(e->name);
+    t->count--;
+  }
+}
+
+/* Add a field to the table, evicting the oldest to make room
+ *
+ * An entry bigger than the whole table just empties it. Returns -1 if out
+ * of memory.
+ */
+static int insert(struct hpack_table *t, char *name, int name_len,
+                  char *value, int value_len) {
+  int size = name_len + value_len + ENTRY_OVERHEAD;
+
+  if (size > t->max_size) {
+    evict_to(t, 0);
+    return 0;
+  }
+
+  char *copy = malloc(name_len + value_len + 1);
+
+  if (copy == NULL) {
+    return -1;
+  }
+
+  // Copied first: the name may be that of an entry about to be evicted
+  // (RFC 7541 4.4)
+  memcpy(copy, name, name_len);
+  memcpy(copy + name_len, value, value_len);
+
+  evict_to(t, t->max_size - size);
+
+  t->first = (t->first + t->cap - 1) % t->cap;
+  t->count++;
+  t->size += size;
+
+  struct hpack_entry *e = entry(t, 0);
+
+  e->name = copy;
+  e->value = copy + name_len;
+  e->name_len = name_len;
+  e->value_len = value_len;
+
+  return 0;
+}
+
+/* Look up a field by its HPACK index; value may be NULL */
+static int lookup(struct hpack_table *t, int index, char **name, int *name_len,
+                  char **value, int *value_len) {
+  if (index >= 1 && index <= STATIC_COUNT) {
+    *name = static_table[index - 1].name;
+    *name_len = strlen(*name);
+    if (value != NULL) {
+      *value = static_table[index - 1].value;
+      *value_len = strlen(*value);
+    }
+    return 0;
+  }
+
+  index -= STATIC_COUNT + 1;
+  if (index < 0 || index >= t->count) {
+    return -1;
+  }
+
+  struct hpack_entry *e = entry(t, index);
+
+  *name = e->name;
+  *name_len = e->name_len;
+  if (value != NULL) {
+    *value = e->value;
+    *value_len = e->value_len;
+  }
+  return 0;
+}
+
+/**
+ * Set up an empty table that may grow to max_size
+ *
+ * Returns -1 if out of memory.
+ */
+int hpack_init(struct hpack_table *t, int max_size) {
+  t->cap = max_size / ENTRY_OVERHEAD + 1;
+  t->first = t->count = t->size = 0;
+  t->max_size = t->limit = max_size;
+  t->update = 0;
+  t->ring = calloc(t->cap, sizeof *t->ring);
+
+  return t->ring == NULL ? -1 : 0;
+}
+
+void hpack_free(struct hpack_table *t) {
+  evict_to(t, 0);
+  free(t->ring);
+  t->ring = NULL;
+}
+
+/* Encoder: the peer allows a table of max_size; never more than at init */
+void hpack_set_max(struct hpack_table *t, int max_size) {
+  if (max_size > t->limit) {
+    max_size = t->limit;
+  }
+  if (max_size != t->max_size) {
+    t->max_size = max_size;
+    t->update = 1;
+    evict_to(t, max_size);
+  }
+}
+
+/**
+ * Decode a complete header block, calling field() for each field in order
+ *
+ * Returns -1 if the block is malformed (a connection error) or field()
+ * stopped it.
+ */
+int hpack_decode(struct hpack_table *t, unsigned char *in, int len,
+                 hpack_field_fn field, void *arg) {
+  unsigned char *p = in, *end = in + len;
+  char name_buf[HPACK_MAX_STRING], value_buf[HPACK_MAX_STRING];
+
+  while (p < end) {
+    char *name, *value;
+    int name_len, value_len, index;
+
+    if (*p & 0x80) {
+      // Indexed field
+      if (decode_int(&p, end, 7, &index) < 0 ||
+          lookup(t, index, &name, &name_len, &value, &value_len) < 0 ||
+          field(arg, name, name_len, value, value_len) < 0) {
+        return -1;
+      }
+      continue;
+    }
+
+    if ((*p & 0xe0) == 0x20) {
+      // Dynamic table size update
+      if (decode_int(&p, end, 5, &index) < 0 || index > t->limit) {
+        return -1;
+      }
+      t->max_size = index;
+      evict_to(t, index);
+      continue;
+    }
+
+    // Literal, with incremental indexing, without, or never indexed
+    int incremental = (*p & 0xc0) == 0x40;
+
+    if (decode_int(&p, end, incremental ? 6 : 4, &index) < 0) {
+      return -1;
+    }
+    if (index == 0) {
+      if (decode_string(&p, end, name_buf, &name, &name_len) < 0) {
+        return -1;
+      }
+    } else if (lookup(t, index, &name, &name_len, NULL, NULL) < 0) {
+      return -1;
+    }
+
+    if (decode_string(&p, end, value_buf, &value, &value_len) < 0 ||
+        field(arg, name, name_len, value, value_len) < 0) {
+      return -1;
+    }
+
+    // After the callback; the name may belong to an entry about to go
+    if (incremental &&
+        insert(t, name, name_len, value, value_len) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static unsigned char *encode_int(unsigned char *p, int prefix,
+                                 unsigned char flags, int value) {
+  int max = (1 << prefix) - 1;
+
+  if (value < max) {
+    *p++ = flags | value;
+    return p;
+  }
+
+  *p++ = flags | max;
+  value -= max;
+  while (value >= 128) {
+    *p++ = (value & 127) | 128;
+    value >>= 7;
+  }
+  *p++ = value;
+  return p;
+}
+
+/* Index of the whole field in either table, or 0; *name_index gets the
+ * first static entry with the name, or 0 */
+static int find(struct hpack_table *t, char *name, char *value, int value_len,
+                int *name_index) {
+  *name_index = 0;
+
+  for (int i = 0; i < STATIC_COUNT; i++) {
+    if (strcmp(static_table[i].name, name) != 0) {
+      continue;
+    }
+    if (*name_index == 0) {
+      *name_index = i + 1;
+    }
+    if ((int)strlen(static_table[i].value) == value_len &&
+        memcmp(static_table[i].value, value, value_len) == 0) {
+      return i + 1;
+    }
+  }
+
+  int name_len = strlen(name);
+
+  for (int i = 0; i < t->count; i++) {
+    struct hpack_entry *e = entry(t, i);
+
+    if (e->value_len == value_len && e->name_len == name_len &&
+        memcmp(e->value, value, value_len) == 0 &&
+        memcmp(e->name, name, name_len) == 0) {
+      return STATIC_COUNT + 1 + i;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Encode one field of a header block into out
+ *
+ * name must be lower case. If index is set and the field isn't in a table
+ * yet, it is added to the dynamic table for next time.
+ *
+ * Returns the encoded length, or -1 if size is too small.
+ */
+int hpack_encode(struct hpack_table *t, unsigned char *out, int size,
+                 char *name, char *value, int value_len, int index) {
+  unsigned char *p = out;
+  int name_len = strlen(name);
+  int name_index, found;
+
+  if (size < 3 * 6 + name_len + value_len) {
+    return -1; // Room for the worst case: three integers and both strings
+  }
+
+  if (t->update) {
+    p = encode_int(p, 5, 0x20, t->max_size);
+    t->update = 0;
+  }
+
+  if ((found = find(t, name, value, value_len, &name_index)) > 0) {
+    p = encode_int(p, 7, 0x80, found);
+    return p - out;
+  }
+
+  p = encode_int(p, index ? 6 : 4, index ? 0x40 : 0x00, name_index);
+  if (name_index == 0) {
+    p = encode_int(p, 7, 0, name_len);
+    memcpy(p, name, name_len);
+    p += name_len;
+  }
+  p = encode_int(p, 7, 0, value_len);
+  memcpy(p, value, value_len);
+  p += value_len;
+
+  if (index && insert(t, name, name_len, value, value_len) < 0) {
+    return -1;
+  }
+
+  return p - out;
+}
@@ -0,0 +1,32 @@
+#ifndef _HPACK_H_
+#define _HPACK_H_
+
+#define HPACK_TABLE_SIZE 4096  // Default dynamic table size, in RFC 7541 octets
+#define HPACK_MAX_STRING 8192  // Longest name or value we decode
+
+struct hpack_entry;
+
+// One direction's dynamic table
+struct hpack_table {
+  struct hpack_entry *ring; // Newest entry at first
+  int cap, first, count;
+  int size;     // Sum of entry sizes (name + value + 32)
+  int max_size; // Current limit
+  int limit;    // The most max_size may be set to
+  int update;   // Encoder: the limit changed; say so before the next field
+};
+
+/* Called for each decoded field; strings are not NUL-terminated. Return -1
+ * to stop decoding. */
+typedef int (*hpack_field_fn)(void *arg, char *name, int name_len,
+                              char *value, int value_len);
+
+extern int hpack_init(struct hpack_table *t, int max_size);
+extern void hpack_free(struct hpack_table *t);
+extern void hpack_set_max(struct hpack_table *t, int max_size);
+extern int hpack_decode(struct hpack_table *t, unsigned char *in, int len,
+                        hpack_field_fn field, void *arg);
+extern int hpack_encode(struct hpack_table *t, unsigned char *out, int size,
+                        char *name, char *value, int value_len, int index);
+
+#endif
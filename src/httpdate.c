@@ -0,0 +1,104 @@
+/* Cached HTTP Date header value
+ *
+ * A timer thread formats the current time as an RFC 7231 IMF-fixdate once a
+ * second into one of two shared slots and then bumps a generation counter.
+ * Each thread keeps its own copy and only re-copies when the generation has
+ * moved, so the hot path is one atomic load and no time formatting at all.
+ */
+
+#include "httpdate.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static char shared_date[2][HTTPDATE_LEN + 1];
+static unsigned int shared_gen; // Slot shared_gen & 1 is current
+
+static __thread unsigned int local_gen;
+static __thread char local_date[HTTPDATE_LEN + 1];
+
+/* Format a time as "Sun, 06 Nov 1994 08:49:37 GMT"
+ *
+ * Done by hand so the output doesn't depend on the locale.
+ */
+static void format_date(char *buf, time_t t) {
+  static const char *days[] = {"Sun", "Mon", "Tue", "Wed",
+                               "Thu", "Fri", "Sat"};
+  static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  struct tm tm;
+  char tmp[64];
+
+  gmtime_r(&t, &tm);
+  snprintf(tmp, sizeof tmp, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+           days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900,
+           tm.tm_hour, tm.tm_min, tm.tm_sec);
+  memcpy(buf, tmp, HTTPDATE_LEN);
+  buf[HTTPDATE_LEN] = '\0';
+}
+
+/* Publish the date for time t into the slot readers aren't using */
+static void publish(time_t t) {
+  unsigned int gen = __atomic_load_n(&shared_gen, __ATOMIC_RELAXED) + 1;
+
+  format_date(shared_date[gen & 1], t);
+  __atomic_store_n(&shared_gen, gen, __ATOMIC_RELEASE);
+}
+
+/* Timer thread: refresh the shared date at each second boundary */
+static void *date_ticker(void *arg) {
+  (void)arg;
+
+  while (1) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    struct timespec next = {now.tv_sec + 1, 0};
+    while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next, NULL) != 0) {
+      // Interrupted by a signal; keep sleeping
+    }
+
+    publish(next.tv_sec);
+  }
+
+  return NULL;
+}
+
+/* Publish the current date and start the once-a-second refresh
+ *
+ * Returns -1 if the timer thread can't be started
+ */
+int httpdate_start(void) {
+  pthread_t thread;
+
+  publish(time(NULL));
+
+  if (pthread_create(&thread, NULL, date_ticker, NULL) != 0) {
+    return -1;
+  }
+  pthread_detach(thread);
+
+  return 0;
+}
+
+/* Return the current Date header value (HTTPDATE_LEN characters)
+ *
+ * The string belongs to the calling thread and changes at most once a
+ * second.
+ */
+char *httpdate_get(void) {
+  unsigned int gen = __atomic_load_n(&shared_gen, __ATOMIC_ACQUIRE);
+
+  while (gen != local_gen) {
+    memcpy(local_date, shared_date[gen & 1], sizeof local_date);
+
+    // Copy again if the ticker lapped us while we were copying
+    unsigned int again = __atomic_load_n(&shared_gen, __ATOMIC_ACQUIRE);
+    local_gen = again == gen ? gen : 0;
+    gen = again;
+  }
+
+  return local_date;
+}
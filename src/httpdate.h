@@ -0,0 +1,9 @@
+#ifndef _HTTPDATE_H_
+#define _HTTPDATE_H_
+
+#define HTTPDATE_LEN 29 // "Sun, 06 Nov 1994 08:49:37 GMT"
+
+extern int httpdate_start(void);
+extern char *httpdate_get(void);
+
+#endif
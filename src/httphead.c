@@ -0,0 +1,472 @@
+/* Request head scanner
+ *
+ * One pass over an HTTP/1 request head finds every line ending, the colon
+ * ending each field name and the blank line ending the head, checking on
+ * the way that field names are tokens and that no control characters are
+ * hidden in it. What it finds is kept as an index of the fields, so
+ * looking one up afterwards doesn't go through the buffer again.
+ *
+ * The input is classified 64 bytes at a time into bitmasks -- line feeds,
+ * carriage returns, colons, bytes that can't be in a token, control
+ * bytes -- and then a small state machine walks the set bits in order.
+ * Classifying is the part that touches every byte. Where the CPU has AVX2
+ * or SSSE3 (picked at run time) it is done 32 or 16 bytes at a time, with
+ * the nibble lookup trick for the two character sets: pshufb maps each
+ * byte's low and high nibble to bitsets whose AND is nonzero only for
+ * bytes in the set. (The byte itself can index the low nibble's table:
+ * pshufb looks only at its low nibble, and gives 0 if its top bit is set,
+ * which is right for non-ASCII bytes.) Elsewhere a table lookup per byte
+ * does the same.
+ *
+ * SSE4.2's string instructions would take the character sets as ranges,
+ * but the token set needs more ranges than one instruction holds, so the
+ * 16-byte path needs only SSSE3.
+ *
+ * As before, a line may end with CRLF, a bare LF or a bare CR.
+ */
+
+#include "httphead.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86
+#endif
+
+#define BLOCK 64 // Bytes classified at a time, one bit each
+
+enum byte_class {
+  CLASS_LF = 1,
+  CLASS_CR = 2,
+  CLASS_COLON = 4,
+  CLASS_NOT_TOKEN = 8,
+  CLASS_CTL = 16, // Control bytes other than HTAB, CR and LF; and DEL
+};
+
+// One block's bytes by class; bit i stands for byte i
+struct classes {
+  uint64_t lf, cr, colon, not_token, ctl;
+};
+
+static unsigned char class_of[256];
+
+// For the vector classifiers: a byte is a token character iff
+// token_lo[byte & 15] & nibble_hi[byte >> 4] is nonzero; likewise ctl_lo
+static unsigned char token_lo[16], ctl_lo[16], nibble_hi[16];
+
+// scan_with() built for the classifier in use
+static int (*scan)(char *buf, int len, struct http_head *head);
+static char *impl;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static int is_token(int b) {
+  return (b >= '0' && b <= '9') || (b >= 'A' && b <= 'Z') ||
+         (b >= 'a' && b <= 'z') || (b != 0 && strchr("!#$%&'*+-.^_`|~", b));
+}
+
+static int is_ctl(int b) {
+  return (b < 0x20 && b != '\t' && b != '\r' && b != '\n') || b == 0x7f;
+}
+
+#define INLINE static inline __attribute__((always_inline))
+
+/* Bit j set where byte j of k has class cls */
+INLINE uint64_t gather(uint64_t k, enum byte_class cls) {
+  return ((k >> __builtin_ctz(cls)) & 0x0101010101010101) *
+             0x0102040810204080 >>
+         56;
+}
+
+INLINE void classify_scalar(const unsigned char *p, struct classes *c) {
+  memset(c, 0, sizeof *c);
+
+  // Classes for eight bytes at once, then each class's bits picked out;
+  // testing byte by byte mispredicts on every run of punctuation
+#pragma GCC unroll 8
+  for (int i = 0; i < BLOCK; i += 8) {
+    uint64_t k = 0;
+
+    for (int j = 0; j < 8; j++) {
+      k |= (uint64_t)class_of[p[i + j]] << 8 * j;
+    }
+    c->lf |= gather(k, CLASS_LF) << i;
+    c->cr |= gather(k, CLASS_CR) << i;
+    c->colon |= gather(k, CLASS_COLON) << i;
+    c->not_token |= gather(k, CLASS_NOT_TOKEN) << i;
+    c->ctl |= gather(k, CLASS_CTL) << i;
+  }
+}
+
+#ifdef HAVE_X86
+__attribute__((target("ssse3"))) INLINE void
+classify_ssse3(const unsigned char *p, struct classes *c) {
+  __m128i nibble = _mm_set1_epi8(0x0f), zero = _mm_setzero_si128();
+  __m128i tlo = _mm_loadu_si128((__m128i *)token_lo);
+  __m128i clo = _mm_loadu_si128((__m128i *)ctl_lo);
+  __m128i hi_bits = _mm_loadu_si128((__m128i *)nibble_hi);
+  __m128i ctl[BLOCK / 16], any_ctl = zero;
+
+  memset(c, 0, sizeof *c);
+
+  // Unrolled, so the masks stay in registers and shift by constants
+#pragma GCC unroll 4
+  for (int i = 0; i < BLOCK; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i *)(p + i));
+    __m128i hi = _mm_shuffle_epi8(
+        hi_bits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    __m128i token = _mm_and_si128(_mm_shuffle_epi8(tlo, v), hi);
+
+    ctl[i / 16] = _mm_and_si128(_mm_shuffle_epi8(clo, v), hi);
+    any_ctl = _mm_or_si128(any_ctl, ctl[i / 16]);
+
+    c->lf |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                 _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')))
+             << i;
+    c->cr |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                 _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')))
+             << i;
+    c->colon |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(v, _mm_set1_epi8(':')))
+                << i;
+    c->not_token |=
+        (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(token, zero))
+        << i;
+  }
+
+  // Control bytes are rare, so only where there are any are they pinned
+  // down
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(any_ctl, zero)) != 0xffff) {
+    for (int i = 0; i < BLOCK; i += 16) {
+      c->ctl |= (uint64_t)(uint16_t)~_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(ctl[i / 16], zero))
+                << i;
+    }
+  }
+}
+
+__attribute__((target("avx2"))) INLINE void
+classify_avx2(const unsigned char *p, struct classes *c) {
+  __m256i nibble = _mm256_set1_epi8(0x0f), zero = _mm256_setzero_si256();
+  // vpshufb looks up within each 128-bit lane, so both get the table
+  __m256i tlo =
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)token_lo));
+  __m256i clo =
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)ctl_lo));
+  __m256i hi_bits =
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)nibble_hi));
+  __m256i ctl[BLOCK / 32];
+
+  memset(c, 0, sizeof *c);
+
+#pragma GCC unroll 2
+  for (int i = 0; i < BLOCK; i += 32) {
+    __m256i v = _mm256_loadu_si256((__m256i *)(p + i));
+    __m256i hi = _mm256_shuffle_epi8(
+        hi_bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    __m256i token = _mm256_and_si256(_mm256_shuffle_epi8(tlo, v), hi);
+
+    ctl[i / 32] = _mm256_and_si256(_mm256_shuffle_epi8(clo, v), hi);
+
+    c->lf |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                 _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')))
+             << i;
+    c->cr |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                 _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')))
+             << i;
+    c->colon |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')))
+                << i;
+    c->not_token |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                        _mm256_cmpeq_epi8(token, zero))
+                    << i;
+  }
+
+  // As for SSSE3
+  if (!_mm256_testz_si256(_mm256_or_si256(ctl[0], ctl[1]),
+                          _mm256_or_si256(ctl[0], ctl[1]))) {
+    for (int i = 0; i < BLOCK; i += 32) {
+      c->ctl |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(ctl[i / 32], zero))
+                << i;
+    }
+  }
+}
+#endif
+
+/* Bits 0 to n - 1 */
+INLINE uint64_t below(int n) {
+  return n >= BLOCK ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+}
+
+/* Walk the head block by block, classifying each with classify
+ *
+ * Where field names are is worked out for the whole block at once: a name
+ * runs from a line start up to the first colon, CR or LF, and adding 1 at
+ * the start of a run of 1 bits clears the run, so that is how the bytes up
+ * to the next such stop are found for every line together. Names are then
+ * checked, and first colons found, with a mask each; per line, all that is
+ * left is to note where it ends and which colon is its.
+ *
+ * Everything called from here is inlined, so each instance below is
+ * compiled whole for its instruction set: no call per block, and no legacy
+ * SSE code run between AVX2 instructions, which some CPUs make very slow.
+ * What the walk keeps track of stays in locals until it stops: head shares
+ * memory with buf as far as the compiler knows, so every store to it
+ * would otherwise reload the rest.
+ */
+INLINE int scan_with(char *buf, int len, struct http_head *head,
+                     void (*classify)(const unsigned char *p,
+                                      struct classes *c)) {
+  unsigned char tail[BLOCK];
+  struct classes c;
+  struct http_field *fields = head->fields;
+  int line = head->line;   // Where the current line starts
+  int colon = head->colon; // Where its field name ends, once that is found
+  int line_len = head->line_len, nfields = head->nfields;
+  int error = head->error;
+  int base = head->scanned, end = 0;
+
+  // What the byte before this block leaves over for it
+  uint64_t starts_in = line_len >= 0 && base == line; // A field line starts
+  uint64_t name_in = head->in_name;
+  uint64_t cr_in = base > 0 && buf[base - 1] == '\r';
+
+  for (; base < len; base += BLOCK) {
+    unsigned char *p = (unsigned char *)buf + base;
+    int n = len - base < BLOCK ? len - base : BLOCK;
+
+    if (n == BLOCK) {
+      classify(p, &c);
+    } else if (len >= BLOCK) {
+      // Classify the last whole block's worth instead of reading past the
+      // end, and shift out what was already looked at
+      classify((unsigned char *)buf + len - BLOCK, &c);
+      c.lf >>= BLOCK - n;
+      c.cr >>= BLOCK - n;
+      c.colon >>= BLOCK - n;
+      c.not_token >>= BLOCK - n;
+      c.ctl >>= BLOCK - n;
+    } else {
+      // A short head: classify a padded copy
+      memcpy(tail, p, n);
+      memset(tail + n, 0, BLOCK - n);
+      classify(tail, &c);
+    }
+
+    // Lines end at every LF, and at every CR not followed by one. A CR
+    // that is the last byte so far may yet be, so it ends nothing.
+    uint64_t crlf = c.lf >> 1;
+
+    if (n < BLOCK || base + BLOCK == len) {
+      crlf |= (uint64_t)1 << (n - 1);
+    } else if (buf[base + BLOCK] == '\n') {
+      crlf |= (uint64_t)1 << (BLOCK - 1);
+    }
+
+    uint64_t ends = (c.lf | (c.cr & ~crlf)) & below(n);
+    uint64_t after_cr = c.lf & (c.cr << 1 | cr_in); // LFs ending a CRLF
+
+    // Field names, and the first colon after each
+    uint64_t starts = ends << 1 | starts_in;
+    uint64_t stops = starts | c.colon | c.cr | c.lf;
+    uint64_t opens = starts & ~(c.colon | c.cr | c.lf); // Names that aren't empty
+    uint64_t gaps = ~stops;
+    uint64_t names =
+        opens | (((gaps + (opens << 1 | name_in)) ^ gaps) & gaps);
+    uint64_t colons = c.colon & (names << 1 | name_in);
+    uint64_t bad = c.ctl | (c.not_token & names);
+
+    starts_in = ends >> (BLOCK - 1);
+    name_in = names >> (n - 1) & 1;
+    cr_in = c.cr >> (BLOCK - 1);
+
+    while (ends != 0) {
+      int i = __builtin_ctzll(ends), pos = base + i;
+      int eol = pos - (int)(after_cr >> i & 1);
+      uint64_t before = ((uint64_t)1 << i) - 1;
+      uint64_t m = colons & before;
+
+      ends &= ends - 1;
+
+      if (eol == line) {
+        // The blank line
+        error |= (bad & before) != 0;
+        line_len = line_len < 0 ? 0 : line_len;
+        end = pos + 1;
+        goto done;
+      }
+
+      // At most one first colon is this line's; it may be in an earlier
+      // block
+      colon = m != 0 ? base + __builtin_ctzll(m) : colon;
+      colons &= ~m;
+
+      if (line_len < 0) {
+        line_len = eol - line;
+      } else if (colon < 0 || nfields == HTTP_HEAD_MAX_FIELDS) {
+        error = 1;
+      } else {
+        fields[nfields++] = (struct http_field){line, colon - line, colon + 1,
+                                                eol - colon - 1};
+      }
+      line = pos + 1;
+      colon = -1;
+    }
+
+    // The rest of the block is all head
+    error |= (bad & below(n)) != 0;
+    if (colons != 0) {
+      colon = base + __builtin_ctzll(colons);
+    }
+  }
+
+  // Carry on from here next time, but look again at a CR at the very end;
+  // a CR is never part of a name, so what name_in says is right either way
+  head->scanned = len > line && buf[len - 1] == '\r' ? len - 1 : len;
+  head->in_name = name_in;
+
+done:
+  head->line = line;
+  head->colon = colon;
+  head->line_len = line_len;
+  head->nfields = nfields;
+  head->error = error;
+  return end;
+}
+
+static int scan_scalar(char *buf, int len, struct http_head *head) {
+  return scan_with(buf, len, head, classify_scalar);
+}
+
+#ifdef HAVE_X86
+__attribute__((target("ssse3"))) static int
+scan_ssse3(char *buf, int len, struct http_head *head) {
+  return scan_with(buf, len, head, classify_ssse3);
+}
+
+__attribute__((target("avx2"))) static int
+scan_avx2(char *buf, int len, struct http_head *head) {
+  return scan_with(buf, len, head, classify_avx2);
+}
+#endif
+
+/* Build the tables and pick the fastest classifier this CPU can run */
+static void setup(void) {
+  for (int b = 0; b < 256; b++) {
+    class_of[b] = (b == '\n' ? CLASS_LF : 0) | (b == '\r' ? CLASS_CR : 0) |
+                  (b == ':' ? CLASS_COLON : 0) |
+                  (is_token(b) ? 0 : CLASS_NOT_TOKEN) |
+                  (is_ctl(b) ? CLASS_CTL : 0);
+
+    // Both sets are ASCII, so high nibbles 8-15 map to no bits at all
+    if (b < 0x80) {
+      token_lo[b & 15] |= is_token(b) << (b >> 4);
+      ctl_lo[b & 15] |= is_ctl(b) << (b >> 4);
+      nibble_hi[b >> 4] = 1 << (b >> 4);
+    }
+  }
+
+  scan = scan_scalar;
+  impl = "scalar";
+#ifdef HAVE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scan = scan_avx2;
+    impl = "avx2";
+  } else if (__builtin_cpu_supports("ssse3")) {
+    scan = scan_ssse3;
+    impl = "ssse3";
+  }
+#endif
+}
+
+/* Start on a new head */
+void http_head_init(struct http_head *head) {
+  head->line_len = -1;
+  head->error = 0;
+  head->nfields = 0;
+  head->scanned = 0;
+  head->line = 0;
+  head->colon = -1;
+  head->in_name = 0;
+}
+
+/**
+ * Scan the len bytes of a request head received so far
+ *
+ * Fills in head as it goes; a malformed head still has its end found, with
+ * head->error set, so the request can be refused cleanly. Called again as
+ * more of the head arrives, with the same buffer grown, it carries on where
+ * it stopped rather than starting over.
+ *
+ * Returns where the body starts (just past the blank line), or 0 if the
+ * head isn't complete yet.
+ */
+int http_head_scan(char *buf, int len, struct http_head *head) {
+  pthread_once(&once, setup);
+  return scan(buf, len, head);
+}
+
+/**
+ * Find a field's value in a scanned head
+ *
+ * Returns a pointer into buf (not NUL-terminated) and stores its length in
+ * *len, or returns NULL if the field isn't there.
+ */
+char *http_head_field(struct http_head *head, char *buf, char *name,
+                      int *len) {
+  int name_len = strlen(name), first = name[0] | 0x20;
+
+  for (int i = 0; i < head->nfields; i++) {
+    struct http_field *f = &head->fields[i];
+
+    // Field names of a length tend to differ from the first byte (all the
+    // Sec-Fetch-*s aside), and ORing in 0x20 folds case for letters
+    if (f->name_len == name_len && (buf[f->name] | 0x20) == first &&
+        strncasecmp(buf + f->name, name, name_len) == 0) {
+      char *v = buf + f->value, *end = v + f->value_len;
+
+      while (v < end && (*v == ' ' || *v == '\t')) {
+        v++;
+      }
+      while (end > v && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+      }
+      *len = end - v;
+      return v;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Use a particular classifier: "scalar", "ssse3" or "avx2"
+ *
+ * For benchmarks and tests. Returns -1 if the CPU can't run it.
+ */
+int http_head_use(char *name) {
+  pthread_once(&once, setup);
+
+  if (strcmp(name, "scalar") == 0) {
+    scan = scan_scalar;
+#ifdef HAVE_X86
+  } else if (strcmp(name, "ssse3") == 0 && __builtin_cpu_supports("ssse3")) {
+    scan = scan_ssse3;
+  } else if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    scan = scan_avx2;
+#endif
+  } else {
+    return -1;
+  }
+  impl = name;
+  return 0;
+}
+
+/* The classifier in use */
+char *http_head_impl(void) {
+  pthread_once(&once, setup);
+  return impl;
+}
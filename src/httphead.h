@@ -0,0 +1,32 @@
+#ifndef _HTTPHEAD_H_
+#define _HTTPHEAD_H_
+
+#define HTTP_HEAD_MAX_FIELDS 100 // More than this is a malformed head
+
+// Where one field's name and value are in the buffer
+struct http_field {
+  int name, name_len;
+  int value, value_len; // Whitespace around it is trimmed on lookup
+};
+
+// What http_head_scan() found in a request head
+struct http_head {
+  int line_len; // The request line, without its ending
+  int error;    // Bad field name, control character, or too many fields
+  int nfields;
+  struct http_field fields[HTTP_HEAD_MAX_FIELDS];
+
+  // Where the last scan stopped, to carry on from there
+  int scanned;
+  int line, colon;
+  int in_name; // The byte before scanned is part of a field name
+};
+
+extern void http_head_init(struct http_head *head);
+extern int http_head_scan(char *buf, int len, struct http_head *head);
+extern char *http_head_field(struct http_head *head, char *buf, char *name,
+                             int *len);
+extern int http_head_use(char *impl);
+extern char *http_head_impl(void);
+
+#endif
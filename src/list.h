@@ -0,0 +1,105 @@
+#ifndef _LIST_H_
+#define _LIST_H_
+
+/* Intrusive lists
+ *
+ * The links live in the structs being listed, so putting something on a
+ * list allocates nothing and following a link lands on the struct itself,
+ * not on a separate node that points to it.
+ *
+ * DLIST: a doubly-linked list of one struct type threaded through its own
+ * prev and next members, NULL at both ends, whose owner keeps head and
+ * tail pointers. Inserting, unlinking and moving to the head are O(1). The
+ * macros evaluate their arguments more than once.
+ *
+ * hlist: a chain for hash buckets, headed by a single pointer. Each node
+ * also points at whatever points at it, so it unlinks without a walk.
+ */
+
+#include <stddef.h>
+
+/* The struct of type that ptr is the member of */
+#define container_of(ptr, type, member)                                        \
+  ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/* Put elem at the head */
+#define DLIST_INSERT_HEAD(head, tail, elem)                                    \
+  do {                                                                         \
+    (elem)->prev = NULL;                                                       \
+    (elem)->next = (head);                                                     \
+    if ((head) != NULL) {                                                      \
+      (head)->prev = (elem);                                                   \
+    } else {                                                                   \
+      (tail) = (elem);                                                         \
+    }                                                                          \
+    (head) = (elem);                                                           \
+  } while (0)
+
+/* Take elem out of the list; its own links are left as they were */
+#define DLIST_REMOVE(head, tail, elem)                                         \
+  do {                                                                         \
+    if ((elem)->prev != NULL) {                                                \
+      (elem)->prev->next = (elem)->next;                                       \
+    } else {                                                                   \
+      (head) = (elem)->next;                                                   \
+    }                                                                          \
+    if ((elem)->next != NULL) {                                                \
+      (elem)->next->prev = (elem)->prev;                                       \
+    } else {                                                                   \
+      (tail) = (elem)->prev;                                                   \
+    }                                                                          \
+  } while (0)
+
+/* Move elem, already in the list, to its head */
+#define DLIST_MOVE_TO_HEAD(head, tail, elem)                                   \
+  do {                                                                         \
+    if ((elem) != (head)) {                                                    \
+      DLIST_REMOVE(head, tail, elem);                                          \
+      DLIST_INSERT_HEAD(head, tail, elem);                                     \
+    }                                                                          \
+  } while (0)
+
+struct hlist_node {
+  struct hlist_node *next;
+  struct hlist_node **pprev; // The pointer to this node
+};
+
+// Empty when zeroed
+struct hlist_head {
+  struct hlist_node *first;
+};
+
+static inline void hlist_add_head(struct hlist_head *h, struct hlist_node *n) {
+  n->next = h->first;
+  if (h->first != NULL) {
+    h->first->pprev = &n->next;
+  }
+  h->first = n;
+  n->pprev = &h->first;
+}
+
+/* Put n at the end of the chain, which costs a walk along it */
+static inline void hlist_add_tail(struct hlist_head *h, struct hlist_node *n) {
+  struct hlist_node **pp = &h->first;
+
+  while (*pp != NULL) {
+    pp = &(*pp)->next;
+  }
+  n->next = NULL;
+  n->pprev = pp;
+  *pp = n;
+}
+
+static inline void hlist_del(struct hlist_node *n) {
+  *n->pprev = n->next;
+  if (n->next != NULL) {
+    n->next->pprev = n->pprev;
+  }
+}
+
+/* For each node in a chain; the body may unlink and free n, but no other */
+#define HLIST_FOR_EACH(n, next_n, h)                                           \
+  for ((n) = (h)->first; (n) != NULL && ((next_n) = (n)->next, 1);             \
+       (n) = (next_n))
+
+#endif
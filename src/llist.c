@@ -41,6 +41,9 @@ void *llist_insert(struct llist *llist, void *data) {
   n->data = data;
   n->next = llist->head;
   llist->head = n;
+  if (llist->tail == NULL) {
+    llist->tail = n;
+  }
 
   llist->count++;
 
@@ -49,9 +52,8 @@ void *llist_insert(struct llist *llist, void *data) {
 
 /* Append to the end of a list */
 void *llist_append(struct llist *llist, void *data) {
-  struct llist_node *tail = llist->head;
   // If list is empty, just insert
-  if (tail == NULL) {
+  if (llist->tail == NULL) {
     return llist_insert(llist, data);
   }
 
@@ -61,12 +63,9 @@ void *llist_append(struct llist *llist, void *data) {
     return NULL;
   }
 
-  while (tail->next != NULL) {
-    tail = tail->next;
-  }
-
   n->data = data;
-  tail->next = n;
+  llist->tail->next = n;
+  llist->tail = n;
 
   llist->count++;
 
@@ -83,17 +82,10 @@ void *llist_head(struct llist *llist) {
 
 /* Return the last element in a list */
 void *llist_tail(struct llist *llist) {
-  struct llist_node *n = llist->head;
-
-  if (n == NULL) {
+  if (llist->tail == NULL) {
     return NULL;
   }
-
-  while (n->next != NULL) {
-    n = n->next;
-  }
-
-  return n->data;
+  return llist->tail->data;
 }
 
 /* Find an element in the list
@@ -135,6 +127,9 @@ void *llist_delete(struct llist *llist, void *data,
   while (n != NULL) {
     if (cmpfn(data, n->data) == 0) {
       void *data = n->data;
+      if (n == llist->tail) {
+        llist->tail = prev;
+      }
       if (prev == NULL) {
         // Free the head
         llist->head = n->next;
@@ -181,7 +176,7 @@ void **llist_array_get(struct llist *llist) {
     return NULL;
   }
 
-  void **a = malloc(sizeof *a * llist->count + 1);
+  void **a = malloc(sizeof *a * (llist->count + 1));
 
   struct llist_node *n;
   int i;
@@ -2,7 +2,7 @@
 #define _LLIST_H_
 
 struct llist {
-  struct llist_node *head;
+  struct llist_node *head, *tail;
   int count;
 };
 
@@ -0,0 +1,256 @@
+/* Request metrics
+ *
+ * Every thread that records gets its own shard of counters and latency
+ * histograms, registered once on a lock-free list. A shard has a single
+ * writer, so recording is a plain increment published with a relaxed
+ * atomic store: no locks, no read-modify-write atomics, no shared cache
+ * lines between workers. /metrics sums the shards when it is scraped.
+ *
+ * Latencies go into log-linear buckets (four per power of two, ~25%
+ * precision) and are exported as Prometheus histograms with power-of-two
+ * bucket bounds from ~1us to ~68s.
+ */
+
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define HIST_SUB_BITS 2
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+#define EXPORT_MIN_SHIFT 10 // Smallest exported bound: 2^10 ns
+#define EXPORT_MAX_SHIFT 36 // Largest exported bound: 2^36 ns
+
+// Status codes counted individually; anything else is "other"
+static int status_codes[] = {200, 400, 404, 500, 502, 503, 504};
+#define STATUS_SLOTS (sizeof status_codes / sizeof status_codes[0] + 1)
+
+static char *phase_names[PHASE_COUNT] = {"total", "parse", "cache", "file",
+                                         "send"};
+static char *route_names[ROUTE_COUNT] = {"file",    "d20",   "save",
+                                         "metrics", "admin", "proxy",
+                                         "other"};
+
+struct metrics_shard {
+  uint64_t latency[PHASE_COUNT][HIST_BUCKETS];
+  uint64_t latency_sum[PHASE_COUNT]; // ns
+  uint64_t requests[ROUTE_COUNT][STATUS_SLOTS];
+  uint64_t bytes_in, bytes_out;
+  int64_t connections; // Opened minus closed by this thread
+
+  struct metrics_shard *next;
+};
+
+static struct metrics_shard *shards;
+
+static __thread struct metrics_shard *shard;
+
+/* Increment a counter owned by this thread */
+#define BUMP(counter, n)                                                       \
+  __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+
+/* Read a counter owned by any thread */
+#define READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/* Return this thread's shard, creating it on first use */
+static struct metrics_shard *get_shard(void) {
+  if (shard == NULL) {
+    shard = calloc(1, sizeof *shard);
+
+    struct metrics_shard *head = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+    do {
+      shard->next = head;
+    } while (!__atomic_compare_exchange_n(&shards, &head, shard, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+  return shard;
+}
+
+static int hist_index(uint64_t v) {
+  if (v < (2 << HIST_SUB_BITS)) {
+    return v;
+  }
+  int msb = 63 - __builtin_clzll(v);
+
+  return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+         ((v >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* Current monotonic time in ns */
+uint64_t metrics_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Record the time since start_ns against a phase */
+void metrics_phase(enum metrics_phase phase, uint64_t start_ns) {
+  struct metrics_shard *s = get_shard();
+  uint64_t ns = metrics_now() - start_ns;
+
+  BUMP(s->latency[phase][hist_index(ns)], 1);
+  BUMP(s->latency_sum[phase], ns);
+}
+
+/* Start timing a request whose first bytes arrived at start_ns */
+void metrics_begin(struct metrics_request *mr, uint64_t start_ns) {
+  mr->start_ns = start_ns;
+  mr->route = ROUTE_OTHER;
+  mr->status = 0;
+}
+
+/* Note which route is handling a request */
+void metrics_route(struct metrics_request *mr, enum metrics_route route) {
+  mr->route = route;
+}
+
+/* Note the status of the response to a request */
+void metrics_status(struct metrics_request *mr, int status) {
+  mr->status = status;
+}
+
+/* Count a request and record its total latency
+ *
+ * Requests that were never answered aren't counted.
+ */
+void metrics_end(struct metrics_request *mr) {
+  struct metrics_shard *s = get_shard();
+  unsigned int slot = 0;
+
+  if (mr->status == 0) {
+    return;
+  }
+
+  while (slot < STATUS_SLOTS - 1 && status_codes[slot] != mr->status) {
+    slot++;
+  }
+
+  BUMP(s->requests[mr->route][slot], 1);
+  metrics_phase(PHASE_TOTAL, mr->start_ns);
+}
+
+/* Count bytes received and sent */
+void metrics_bytes(long in, long out) {
+  struct metrics_shard *s = get_shard();
+
+  if (in > 0) {
+    BUMP(s->bytes_in, in);
+  }
+  if (out > 0) {
+    BUMP(s->bytes_out, out);
+  }
+}
+
+/* Track connections opened (+1) and closed (-1) */
+void metrics_connections(int delta) {
+  struct metrics_shard *s = get_shard();
+
+  BUMP(s->connections, delta);
+}
+
+/* Render all metrics in the Prometheus text exposition format
+ *
+ * Returns the length written, or -1 if buf was too small
+ */
+int metrics_render(char *buf, int size) {
+  struct metrics_shard *first = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+  int len = 0;
+
+#define EMIT(...)                                                              \
+  do {                                                                         \
+    int written = snprintf(buf + len, size - len, __VA_ARGS__);                \
+    if (written < 0 || written >= size - len) {                                \
+      return -1;                                                               \
+    }                                                                          \
+    len += written;                                                            \
+  } while (0)
+
+  EMIT("# HELP webserver_request_duration_seconds Time spent per request "
+       "phase.\n"
+       "# TYPE webserver_request_duration_seconds histogram\n");
+
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    uint64_t sum = 0, count = 0;
+    int bucket = 0;
+
+    for (struct metrics_shard *s = first; s != NULL; s = s->next) {
+      sum += READ(s->latency_sum[p]);
+    }
+
+    for (int shift = EXPORT_MIN_SHIFT; shift <= EXPORT_MAX_SHIFT; shift++) {
+      // Internal buckets below this index hold values < 2^shift
+      int end = (shift - HIST_SUB_BITS + 1) << HIST_SUB_BITS;
+
+      for (; bucket < end; bucket++) {
+        for (struct metrics_shard *s = first; s != NULL; s = s->next) {
+          count += READ(s->latency[p][bucket]);
+        }
+      }
+      EMIT("webserver_request_duration_seconds_bucket{phase=\"%s\","
+           "le=\"%.9g\"} %lu\n",
+           phase_names[p], (double)(1ull << shift) / 1e9,
+           (unsigned long)count);
+    }
+
+    for (; bucket < HIST_BUCKETS; bucket++) {
+      for (struct metrics_shard *s = first; s != NULL; s = s->next) {
+        count += READ(s->latency[p][bucket]);
+      }
+    }
+    EMIT("webserver_request_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"}"
+         " %lu\n"
+         "webserver_request_duration_seconds_sum{phase=\"%s\"} %.9f\n"
+         "webserver_request_duration_seconds_count{phase=\"%s\"} %lu\n",
+         phase_names[p], (unsigned long)count, phase_names[p], sum / 1e9,
+         phase_names[p], (unsigned long)count);
+  }
+
+  EMIT("# HELP webserver_requests_total Requests answered, by route and "
+       "status.\n"
+       "# TYPE webserver_requests_total counter\n");
+
+  for (int r = 0; r < ROUTE_COUNT; r++) {
+    for (unsigned int slot = 0; slot < STATUS_SLOTS; slot++) {
+      uint64_t n = 0;
+
+      for (struct metrics_shard *s = first; s != NULL; s = s->next) {
+        n += READ(s->requests[r][slot]);
+      }
+      if (n == 0) {
+        continue;
+      }
+      if (slot < STATUS_SLOTS - 1) {
+        EMIT("webserver_requests_total{route=\"%s\",code=\"%d\"} %lu\n",
+             route_names[r], status_codes[slot], (unsigned long)n);
+      } else {
+        EMIT("webserver_requests_total{route=\"%s\",code=\"other\"} %lu\n",
+             route_names[r], (unsigned long)n);
+      }
+    }
+  }
+
+  uint64_t bytes_in = 0, bytes_out = 0;
+  int64_t connections = 0;
+
+  for (struct metrics_shard *s = first; s != NULL; s = s->next) {
+    bytes_in += READ(s->bytes_in);
+    bytes_out += READ(s->bytes_out);
+    connections += READ(s->connections);
+  }
+
+  EMIT("# HELP webserver_received_bytes_total Request bytes received.\n"
+       "# TYPE webserver_received_bytes_total counter\n"
+       "webserver_received_bytes_total %lu\n"
+       "# HELP webserver_sent_bytes_total Response bytes sent.\n"
+       "# TYPE webserver_sent_bytes_total counter\n"
+       "webserver_sent_bytes_total %lu\n"
+       "# HELP webserver_active_connections Connections currently open.\n"
+       "# TYPE webserver_active_connections gauge\n"
+       "webserver_active_connections %ld\n",
+       (unsigned long)bytes_in, (unsigned long)bytes_out, (long)connections);
+
+#undef EMIT
+
+  return len;
+}
@@ -0,0 +1,46 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+// Request phases with their own latency histogram
+enum metrics_phase {
+  PHASE_TOTAL, // First request bytes in to response sent
+  PHASE_PARSE, // Header block complete to request line parsed
+  PHASE_CACHE, // Content cache lookup
+  PHASE_FILE,  // Resolving and loading a file on a cache miss
+  PHASE_SEND,  // Writing the response
+  PHASE_COUNT
+};
+
+// Routes counted separately
+enum metrics_route {
+  ROUTE_FILE,
+  ROUTE_D20,
+  ROUTE_SAVE,
+  ROUTE_METRICS,
+  ROUTE_ADMIN,
+  ROUTE_PROXY,
+  ROUTE_OTHER,
+  ROUTE_COUNT
+};
+
+// A request being timed; lives with the request
+struct metrics_request {
+  uint64_t start_ns;
+  int route;
+  int status;
+};
+
+extern uint64_t metrics_now(void);
+extern void metrics_phase(enum metrics_phase phase, uint64_t start_ns);
+extern void metrics_begin(struct metrics_request *mr, uint64_t start_ns);
+extern void metrics_route(struct metrics_request *mr,
+                          enum metrics_route route);
+extern void metrics_status(struct metrics_request *mr, int status);
+extern void metrics_end(struct metrics_request *mr);
+extern void metrics_bytes(long in, long out);
+extern void metrics_connections(int delta);
+extern int metrics_render(char *buf, int size);
+
+#endif
@@ -1,52 +1,31 @@
 #include "mime.h"
-#include <ctype.h>
+#include "mime_table.h"
 #include <string.h>
+#include <strings.h>
 
 #define DEFAULT_MIME_TYPE "application/octet-stream"
 
-/* Lowercase a string */
-char *strlower(char *s) {
-  for (char *p = s; *p != '\0'; p++) {
-    *p = tolower(*p);
-  }
-  return s;
-}
-
-/* Return a MIME type for a given filename */
+/* Return a MIME type for a given filename
+ *
+ * The extension is matched case-insensitively against the perfect hash
+ * table generated from mime.types; filename is not modified.
+ */
 char *mime_type_get(char *filename) {
   char *ext = strrchr(filename, '.');
 
-  if (ext == NULL) {
+  // No extension, or the dot belongs to a directory name
+  if (ext == NULL || strchr(ext, '/') != NULL) {
     return DEFAULT_MIME_TYPE;
   }
   ext++;
-  strlower(ext);
-  // TODO: This is O(n) and should be O(1)
 
-  if (strcmp(ext, "html") == 0 || strcmp(ext, "htm") == 0) {
-    return "text/html";
-  }
-  if (strcmp(ext, "jpeg") == 0 || strcmp(ext, "jpg") == 0) {
-    return "image/jpg";
-  }
-  if (strcmp(ext, "css") == 0) {
-    return "text/css";
-  }
-  if (strcmp(ext, "js") == 0) {
-    return "application/javascript";
-  }
-  if (strcmp(ext, "json") == 0) {
-    return "application/json";
-  }
-  if (strcmp(ext, "txt") == 0) {
-    return "text/plan";
-  }
-  if (strcmp(ext, "gif") == 0) {
-    return "image/gif";
-  }
-  if (strcmp(ext, "png") == 0) {
-    return "image/png";
+  unsigned int seed = mime_seed[mime_hash(ext, 0) & (MIME_BUCKETS - 1)];
+  int slot = mime_hash(ext, seed) & (MIME_SLOTS - 1);
+
+  if (mime_slots[slot].ext != NULL &&
+      strcasecmp(mime_slots[slot].ext, ext) == 0) {
+    return mime_slots[slot].type;
   }
 
   return DEFAULT_MIME_TYPE;
-}
\ No newline at end of file
+}
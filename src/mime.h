@@ -1,6 +1,24 @@
 #ifndef _MIME_H_
 #define _MIME_H_
 
+#include <ctype.h>
+
+/* Case-insensitive FNV-1a hash of a file extension
+ *
+ * Shared by mime.c and the mimegen table generator; changing it changes
+ * the generated table.
+ */
+static inline unsigned int mime_hash(const char *s, unsigned int seed) {
+  unsigned int h = 2166136261u ^ (seed * 0x9e3779b9u);
+
+  for (; *s != '\0'; s++) {
+    h ^= (unsigned char)tolower((unsigned char)*s);
+    h *= 16777619u;
+  }
+
+  return h ^ (h >> 15);
+}
+
 extern char *mime_type_get(char *filename);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,174 @@
+/* mimegen -- build the MIME perfect hash table
+ *
+ * Usage: mimegen mime.types > mime_table.h
+ *
+ * Reads "type ext ext ..." lines and emits a minimal-probe perfect hash
+ * ("hash and displace"): each extension's first-level hash picks a
+ * displacement seed, and the seeded hash picks a slot that no other
+ * extension uses. A lookup is two hashes and one string compare.
+ */
+
+#include "mime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define MAX_EXTS 1024
+#define MAX_SEED 65535
+
+struct ext {
+  char *ext;
+  char *type;
+  int bucket;
+};
+
+static struct ext exts[MAX_EXTS];
+static int num_exts;
+
+/* Order buckets biggest-first; they are the hardest to place */
+static int bucket_sizes[MAX_EXTS];
+
+static int cmp_bucket_size(const void *a, const void *b) {
+  const int *x = a, *y = b;
+  return bucket_sizes[*y] - bucket_sizes[*x];
+}
+
+int main(int argc, char *argv[]) {
+  char line[1024];
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: mimegen mime.types\n");
+    return 1;
+  }
+
+  FILE *fp = fopen(argv[1], "r");
+
+  if (fp == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  while (fgets(line, sizeof line, fp) != NULL) {
+    char *type = strtok(line, " \t\r\n");
+
+    if (type == NULL || type[0] == '#') {
+      continue;
+    }
+    type = strdup(type);
+
+    for (char *e; (e = strtok(NULL, " \t\r\n")) != NULL;) {
+      for (int i = 0; i < num_exts; i++) {
+        if (strcasecmp(exts[i].ext, e) == 0) {
+          fprintf(stderr, "mimegen: duplicate extension %s\n", e);
+          return 1;
+        }
+      }
+      if (num_exts == MAX_EXTS) {
+        fprintf(stderr, "mimegen: too many extensions\n");
+        return 1;
+      }
+      for (char *p = e; *p != '\0'; p++) {
+        *p = tolower((unsigned char)*p);
+      }
+      exts[num_exts].ext = strdup(e);
+      exts[num_exts].type = type;
+      num_exts++;
+    }
+  }
+  fclose(fp);
+
+  // Power-of-two slot count so the lookup can mask instead of divide
+  int num_slots = 1;
+  while (num_slots < num_exts) {
+    num_slots <<= 1;
+  }
+  int num_buckets = num_slots / 2 > 0 ? num_slots / 2 : 1;
+
+  for (int i = 0; i < num_exts; i++) {
+    exts[i].bucket = mime_hash(exts[i].ext, 0) & (num_buckets - 1);
+    bucket_sizes[exts[i].bucket]++;
+  }
+
+  int order[MAX_EXTS];
+  for (int b = 0; b < num_buckets; b++) {
+    order[b] = b;
+  }
+  qsort(order, num_buckets, sizeof order[0], cmp_bucket_size);
+
+  int *slot_ext = malloc(num_slots * sizeof *slot_ext);
+  unsigned int *seed = calloc(num_buckets, sizeof *seed);
+
+  for (int s = 0; s < num_slots; s++) {
+    slot_ext[s] = -1;
+  }
+
+  for (int o = 0; o < num_buckets && bucket_sizes[order[o]] > 0; o++) {
+    int b = order[o];
+    unsigned int d;
+
+    // Find a seed that sends every extension in the bucket to a free slot
+    for (d = 1; d <= MAX_SEED; d++) {
+      int placed[MAX_EXTS], num_placed = 0, ok = 1;
+
+      for (int i = 0; i < num_exts && ok; i++) {
+        if (exts[i].bucket != b) {
+          continue;
+        }
+        int s = mime_hash(exts[i].ext, d) & (num_slots - 1);
+
+        if (slot_ext[s] != -1) {
+          ok = 0;
+        }
+        for (int j = 0; j < num_placed && ok; j++) {
+          if (placed[j] == s) {
+            ok = 0;
+          }
+        }
+        if (ok) {
+          placed[num_placed++] = s;
+          slot_ext[s] = i;
+        }
+      }
+
+      if (ok) {
+        break;
+      }
+      // Undo the partial placement and try the next seed
+      for (int j = 0; j < num_placed; j++) {
+        slot_ext[placed[j]] = -1;
+      }
+    }
+
+    if (d > MAX_SEED) {
+      fprintf(stderr, "mimegen: no perfect hash found\n");
+      return 1;
+    }
+    seed[b] = d;
+  }
+
+  printf("/* Generated by mimegen from mime.types -- do not edit */\n\n");
+  printf("#include <stddef.h>\n\n");
+  printf("#define MIME_SLOTS %d\n", num_slots);
+  printf("#define MIME_BUCKETS %d\n\n", num_buckets);
+
+  printf("static const unsigned short mime_seed[MIME_BUCKETS] = {");
+  for (int b = 0; b < num_buckets; b++) {
+    printf("%s%u", b == 0 ? "\n    " : b % 12 ? ", " : ",\n    ", seed[b]);
+  }
+  printf("};\n\n");
+
+  printf("static const struct {\n  char *ext;\n  char *type;\n}"
+         " mime_slots[MIME_SLOTS] = {\n");
+  for (int s = 0; s < num_slots; s++) {
+    if (slot_ext[s] == -1) {
+      printf("    {NULL, NULL},\n");
+    } else {
+      printf("    {\"%s\", \"%s\"},\n", exts[slot_ext[s]].ext,
+             exts[slot_ext[s]].type);
+    }
+  }
+  printf("};\n");
+
+  return 0;
+}
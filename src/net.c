@@ -8,7 +8,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#define BACKLOG 10 // how many pending connections queue will hold
+#define BACKLOG 4096 // how many pending connections queue will hold
+                     // (capped by net.core.somaxconn)
 
 /**
  * This gets an Internet address, either IPv4 or IPv6
@@ -1,6 +1,10 @@
 #ifndef _NET_H_
 #define _NET_H_
 
+#include <stddef.h>
+#include <sys/socket.h>
+
+char *get_in_addr(const struct sockaddr *sa, char *s, size_t maxlen);
 int get_listener_socket(char *port);
 
 #endif
\ No newline at end of file
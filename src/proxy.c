@@ -0,0 +1,1371 @@
+/* Reverse proxy
+ *
+ * Requests the server has no answer for are passed on to upstream HTTP/1.1
+ * servers, listed one host:port per line in a config file. Each request
+ * goes to the upstream with the fewest requests in flight, equals taking
+ * turns, over a connection from that upstream's pool of idle keep-alive
+ * connections if it has one. A connection goes back to the pool once a
+ * response has been read to its end, and is dropped when the upstream
+ * closes it or it has sat there for IDLE_TIMEOUT.
+ *
+ * Bodies stream both ways and are never held whole: the request body is
+ * written upstream as it is read from the client (body.c), and the response
+ * body is passed to the client as it is read, each side waiting whenever
+ * the other falls behind. Both are re-framed on the way: what has no length
+ * goes upstream chunked, and comes back chunked to an HTTP/1.1 client, as
+ * DATA frames to an HTTP/2 one, and up to the connection's end to an
+ * HTTP/1.0 one.
+ *
+ * Upstream sockets are watched by the connection loop alongside the
+ * clients'. While a request waits on its upstream it is paused, and the
+ * proxy keeps the deadlines.
+ *
+ * A connection that fails before any of the response is back is tried
+ * again where nothing is lost by it: one that wouldn't open on another
+ * upstream, and a pooled one the upstream had given up on afresh, if the
+ * request had no body.
+ *
+ * A 200 answer to a GET, with a max-age and nothing private about it, is
+ * kept in the content cache until it goes stale when it's small enough, and
+ * served from there like a file.
+ */
+
+#define _GNU_SOURCE
+#include "proxy.h"
+#include "h2.h"
+#include "timerwheel.h"
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_UPSTREAMS 64
+#define BUFFER_SIZE BUFPOOL_SIZE // Response head must fit; reused for bodies
+#define HEAD_ROOM 1024         // Fields added to a request head
+#define MAX_IDLE 32            // Pooled connections per upstream
+#define CONNECT_TIMEOUT 3000   // ms
+#define READ_TIMEOUT 30000     // ms the upstream may keep a request waiting
+#define IDLE_TIMEOUT 4000      // ms pooled; under our own KEEPALIVE_TIMEOUT
+#define DOWN_TIME 2000         // ms an upstream is passed over once it fails
+#define MAX_FIELDS 100         // Response fields passed to an HTTP/2 client
+#define MAX_FIELD_BYTES 12288  // and their size, to fit one HEADERS frame
+#define MAX_TTL (7 * 24 * 3600) // Longest max-age honoured, in seconds
+
+// proxy_run() internals: the connection failed, so the request may be retried
+#define UPSTREAM_FAILED -5
+
+struct upstream_conn;
+
+// A server requests are passed to
+struct upstream {
+  char name[256]; // host:port, as configured
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int outstanding;             // Requests sent to it and not yet answered
+  uint64_t down_until;         // ms; passed over until then
+  struct upstream_conn *idle;  // Pooled connections, most recently used first
+  int nidle;
+};
+
+// A connection to an upstream, in use by a call or pooled
+struct upstream_conn {
+  struct conn_watch watch;
+  struct timer timer; // IDLE_TIMEOUT, while pooled
+  struct proxy *proxy;
+  struct upstream *up;
+  struct proxy_call *call; // The request it is carrying
+  struct upstream_conn *next;
+  int pooled;
+  int connecting;
+  int error;    // connect() failed with this errno
+  int requests; // Sent on it so far
+};
+
+struct proxy {
+  struct conn_loop *loop;
+  struct upstream upstreams[MAX_UPSTREAMS];
+  int n;
+  int turn; // Where the search for the least busy upstream starts
+
+  int cache_max; // Largest body cached
+};
+
+// A growable byte buffer
+struct buffer {
+  char *data;
+  int len, size;
+};
+
+// Where a call is in the exchange
+enum call_state {
+  CALL_REQUEST, // Sending the request, reading its body as it comes
+  CALL_HEAD,    // Waiting for the response head
+  CALL_BODY,    // Passing the response body on
+};
+
+struct proxy_call {
+  struct proxy *proxy;
+  struct request *req;
+  struct cache *cache; // Where the response may be kept, or NULL
+  struct upstream_conn *uc;
+  enum call_state state;
+  struct timer timer; // Connecting, or waiting on the upstream
+  int timed_out;
+  int attempts; // Connections tried
+  int reused;   // uc came from the pool
+
+  // The request head as it goes upstream; only sent once its framing is
+  // known, and kept in case it has to be sent again
+  char *head;
+  int head_len, head_sent;
+  int head_done;
+  int chunked_up;  // The body goes upstream chunked
+  int body_done;   // The whole request body has been read
+  struct buffer out; // Body bytes the upstream hasn't taken yet
+  int out_sent;
+
+  int client_http11;
+  int may_cache; // A GET without credentials
+
+  // The response
+  char *buf; // Pooled; the head, then the body reader's buffer
+  int buf_len;
+  struct http_head resp; // Where the head's fields are in buf
+  struct body_reader body;
+  struct body_io io;
+  int status;
+  int no_body;      // An answer to HEAD, or a 204 or 304
+  int reusable;     // The upstream will take another request on uc
+  int chunked_down; // The body goes to the client chunked
+  int responded;    // The client has the response head
+  int ended;        // and the end of the response
+  long long sent;   // Response bytes passed to the client
+  struct buffer reply; // Gathered for an HTTP/1 client, sent once per read
+
+  // A copy of the body for the cache, while ttl_ms > 0
+  struct buffer copy;
+  int ttl_ms;
+  char content_type[128];
+};
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Append n bytes, growing the buffer as needed; -1 if out of memory */
+static int put(struct buffer *b, void *data, int n) {
+  if (b->len + n > b->size) {
+    int size = b->size > 0 ? b->size : 4096;
+    char *p;
+
+    while (size < b->len + n) {
+      size *= 2;
+    }
+    if ((p = realloc(b->data, size)) == NULL) {
+      perror("realloc");
+      return -1;
+    }
+    b->data = p;
+    b->size = size;
+  }
+  memcpy(b->data + b->len, data, n);
+  b->len += n;
+  return 0;
+}
+
+/* Copy n bytes to p and return the end of the copy */
+static char *append(char *p, char *s, int n) {
+  memcpy(p, s, n);
+  return p + n;
+}
+
+static char *append_field(char *p, char *name, int name_len, char *value,
+                          int value_len) {
+  p = append(p, name, name_len);
+  p = append(p, ": ", 2);
+  p = append(p, value, value_len);
+  return append(p, "\r\n", 2);
+}
+
+static int is_field(char *name, int len, char *s) {
+  return len == (int)strlen(s) && strncasecmp(name, s, len) == 0;
+}
+
+/* Whether a comma-separated list has token in it, in any case */
+static int has_token(char *list, int len, char *token) {
+  char *end = list + len;
+
+  while (list != NULL && list < end) {
+    char *comma = memchr(list, ',', end - list);
+    char *e = comma != NULL ? comma : end;
+
+    while (list < e && (*list == ' ' || *list == '\t')) {
+      list++;
+    }
+    while (e > list && (e[-1] == ' ' || e[-1] == '\t')) {
+      e--;
+    }
+    if (is_field(list, e - list, token)) {
+      return 1;
+    }
+    list = comma != NULL ? comma + 1 : end;
+  }
+  return 0;
+}
+
+/* Whether a field only concerns this hop, and so isn't passed on: one of
+ * the standard ones, or one the Connection field names (RFC 9110 7.6.1) */
+static int hop_by_hop(char *name, int len, char *connection,
+                      int connection_len) {
+  static char *fields[] = {"Connection", "Keep-Alive",        "Proxy-Connection",
+                           "TE",         "Trailer",           "Transfer-Encoding",
+                           "Upgrade",    "HTTP2-Settings"};
+  char token[64];
+
+  for (unsigned int i = 0; i < sizeof fields / sizeof fields[0]; i++) {
+    if (is_field(name, len, fields[i])) {
+      return 1;
+    }
+  }
+
+  if (connection == NULL || len >= (int)sizeof token) {
+    return 0;
+  }
+  memcpy(token, name, len);
+  token[len] = '\0';
+  return has_token(connection, connection_len, token);
+}
+
+/* The next field of a header block, from *pos on
+ *
+ * Returns the field's name, storing its length, value and value length, or
+ * NULL at the end of the block. Lines that aren't fields (including
+ * obsolete line folding) are skipped.
+ */
+static char *next_field(char *block, int len, int *pos, int *name_len,
+                        char **value, int *value_len) {
+  char *end = block + len;
+
+  while (*pos < len) {
+    char *line = block + *pos, *eol = memchr(line, '\n', end - line);
+    char *colon, *v, *vend;
+
+    if (eol == NULL) {
+      eol = end;
+    }
+    *pos = eol + 1 - block;
+
+    vend = eol > line && eol[-1] == '\r' ? eol - 1 : eol;
+    if (vend == line) {
+      return NULL; // The blank line ending the block
+    }
+
+    colon = memchr(line, ':', vend - line);
+    if (colon == NULL || colon == line || *line == ' ' || *line == '\t') {
+      continue;
+    }
+
+    for (v = colon + 1; v < vend && (*v == ' ' || *v == '\t'); v++) {
+    }
+    while (vend > v && (vend[-1] == ' ' || vend[-1] == '\t')) {
+      vend--;
+    }
+
+    *name_len = colon - line;
+    *value = v;
+    *value_len = vend - v;
+    return line;
+  }
+  return NULL;
+}
+
+/* Where the first line of a header block ends */
+static int first_line(char *block, int len) {
+  char *eol = memchr(block, '\n', len);
+
+  return eol != NULL ? eol + 1 - block : len;
+}
+
+/* Read the host:port lines of config; # starts a comment */
+static int load_upstreams(struct proxy *proxy, char *config) {
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  FILE *f = fopen(config, "r");
+  char line[512];
+
+  if (f == NULL) {
+    perror(config);
+    return -1;
+  }
+
+  while (fgets(line, sizeof line, f) != NULL) {
+    char *host = line, *port, *end;
+    struct addrinfo *res;
+    int rv;
+
+    line[strcspn(line, "#\r\n")] = '\0';
+    while (isspace((unsigned char)*host)) {
+      host++;
+    }
+    for (end = host + strlen(host); end > host && isspace((unsigned char)end[-1]);) {
+      *--end = '\0';
+    }
+    if (*host == '\0') {
+      continue;
+    }
+
+    if (proxy->n == MAX_UPSTREAMS || (port = strrchr(host, ':')) == NULL ||
+        end - host >= (int)sizeof proxy->upstreams[0].name) {
+      fprintf(stderr, "%s: bad upstream \"%s\"\n", config, host);
+      fclose(f);
+      return -1;
+    }
+
+    struct upstream *up = &proxy->upstreams[proxy->n];
+
+    strcpy(up->name, host);
+    *port++ = '\0';
+    if (*host == '[' && port[-2] == ']') {
+      port[-2] = '\0'; // [IPv6]:port
+      host++;
+    }
+
+    if ((rv = getaddrinfo(host, port, &hints, &res)) != 0) {
+      fprintf(stderr, "%s: %s: %s\n", config, up->name, gai_strerror(rv));
+      fclose(f);
+      return -1;
+    }
+    memcpy(&up->addr, res->ai_addr, res->ai_addrlen);
+    up->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    proxy->n++;
+  }
+
+  fclose(f);
+
+  if (proxy->n == 0) {
+    fprintf(stderr, "%s: no upstreams\n", config);
+    return -1;
+  }
+  return 0;
+}
+
+/* The upstream with the fewest requests in flight, equals taking turns; one
+ * that failed lately only if they all have */
+static struct upstream *pick(struct proxy *proxy) {
+  uint64_t now = now_ms();
+  struct upstream *best = NULL;
+  int best_down = 0;
+
+  for (int i = 0; i < proxy->n; i++) {
+    struct upstream *up = &proxy->upstreams[(proxy->turn + i) % proxy->n];
+    int down = up->down_until > now;
+
+    if (best == NULL || down < best_down ||
+        (down == best_down && up->outstanding < best->outstanding)) {
+      best = up;
+      best_down = down;
+    }
+  }
+
+  proxy->turn = (proxy->turn + 1) % proxy->n;
+  return best;
+}
+
+/* Close an upstream connection, taking it out of its pool if it's there */
+static void upstream_close(struct upstream_conn *uc) {
+  if (uc->pooled) {
+    struct upstream_conn **p = &uc->up->idle;
+
+    while (*p != uc) {
+      p = &(*p)->next;
+    }
+    *p = uc->next;
+    uc->up->nidle--;
+  }
+
+  timer_cancel(&uc->timer);
+  conn_watch_events(uc->proxy->loop, &uc->watch, 0);
+  close(uc->watch.fd);
+  free(uc);
+}
+
+static void idle_expired(struct timer *timer) {
+  upstream_close((struct upstream_conn *)((char *)timer -
+                                          offsetof(struct upstream_conn,
+                                                   timer)));
+}
+
+/* The loop has an event for an upstream connection */
+static void upstream_ready(struct conn_watch *w) {
+  struct upstream_conn *uc =
+      (struct upstream_conn *)((char *)w - offsetof(struct upstream_conn, watch));
+
+  if (uc->pooled) {
+    // A pooled connection has nothing to say: the upstream is closing it
+    upstream_close(uc);
+    return;
+  }
+
+  if (uc->connecting) {
+    socklen_t len = sizeof uc->error;
+
+    if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &uc->error, &len) < 0) {
+      uc->error = errno;
+    }
+    uc->connecting = 0;
+  }
+
+  conn_wake(uc->call->req);
+}
+
+/* Open a connection to up; connect() finishes in the background */
+static struct upstream_conn *upstream_connect(struct proxy *proxy,
+                                              struct upstream *up) {
+  struct upstream_conn *uc = calloc(1, sizeof *uc);
+  int one = 1;
+
+  if (uc == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+
+  uc->watch.fd = socket(up->addr.ss_family,
+                        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (uc->watch.fd < 0) {
+    perror("socket");
+    free(uc);
+    return NULL;
+  }
+  setsockopt(uc->watch.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+  uc->watch.ready = upstream_ready;
+  uc->timer.expired = idle_expired;
+  uc->proxy = proxy;
+  uc->up = up;
+
+  if (connect(uc->watch.fd, (struct sockaddr *)&up->addr, up->addrlen) < 0) {
+    if (errno == EINPROGRESS) {
+      uc->connecting = 1;
+    } else {
+      uc->error = errno; // Retried like any failed connect
+    }
+  }
+  return uc;
+}
+
+/* Put a connection that is done with a request back in its pool */
+static void upstream_put(struct upstream_conn *uc) {
+  struct upstream *up = uc->up;
+
+  uc->call = NULL;
+  if (up->nidle == MAX_IDLE ||
+      conn_watch_events(uc->proxy->loop, &uc->watch, EPOLLIN) < 0) {
+    upstream_close(uc);
+    return;
+  }
+
+  uc->pooled = 1;
+  uc->next = up->idle;
+  up->idle = uc;
+  up->nidle++;
+  conn_timer(uc->proxy->loop, &uc->timer, IDLE_TIMEOUT);
+}
+
+/* Give the call a connection to up: a pooled one, unless fresh */
+static int attach(struct proxy_call *call, struct upstream *up, int fresh) {
+  struct upstream_conn *uc = up->idle;
+
+  if (uc != NULL && !fresh) {
+    up->idle = uc->next;
+    up->nidle--;
+    uc->pooled = 0;
+    timer_cancel(&uc->timer);
+  } else if ((uc = upstream_connect(call->proxy, up)) == NULL) {
+    return -1;
+  }
+
+  uc->call = call;
+  call->uc = uc;
+  call->reused = uc->requests++ > 0;
+  call->attempts++;
+  up->outstanding++;
+  return 0;
+}
+
+/* Let go of the call's connection, pooling it if reuse */
+static void detach(struct proxy_call *call, int reuse) {
+  struct upstream_conn *uc = call->uc;
+
+  if (uc == NULL) {
+    return;
+  }
+
+  call->uc = NULL;
+  uc->up->outstanding--;
+  if (reuse) {
+    upstream_put(uc);
+  } else {
+    upstream_close(uc);
+  }
+}
+
+static void call_expired(struct timer *timer) {
+  struct proxy_call *call =
+      (struct proxy_call *)((char *)timer - offsetof(struct proxy_call, timer));
+
+  call->timed_out = 1;
+  conn_wake(call->req);
+}
+
+/* Response body reader I/O: the upstream connection, up to its end for a
+ * body without a length */
+static int backed_up(struct proxy_call *call);
+
+static int upstream_recv(void *arg, void *buf, int len) {
+  struct proxy_call *call = arg;
+
+  if (backed_up(call)) {
+    errno = EAGAIN; // Read no faster than the client takes it
+    return -1;
+  }
+  return recv(call->uc->watch.fd, buf, len, 0);
+}
+
+static int no_send(void *arg, void *buf, int len) {
+  (void)arg;
+  (void)buf;
+  return len; // Nothing is said back to a response
+}
+
+/* End the request head with its framing field, if any, and let it go */
+static void finish_head(struct proxy_call *call, char *framing) {
+  char *p = call->head + call->head_len;
+
+  if (framing != NULL) {
+    p = append(p, framing, strlen(framing));
+  }
+  p = append(p, "\r\n", 2);
+  call->head_len = p - call->head;
+  call->head_done = 1;
+}
+
+/**
+ * Write the head of the request as it goes upstream
+ *
+ * The request line and fields are passed on, less the ones that only
+ * concern the client's connection, plus X-Forwarded-For; HTTP/2 cookie
+ * fields are joined back into one. The framing is left off until it's
+ * known, unless the client gave the body's length.
+ *
+ * Returns -1 if out of memory.
+ */
+static int build_head(struct proxy_call *call, char *host) {
+  struct request *req = call->req;
+  char *block = req->buf, *connection, *name, *value, *p;
+  int len = req->body_offset, pos = first_line(block, len);
+  int connection_len = 0, name_len, value_len, has_host = 0, has_xff = 0;
+  char *method_end = memchr(block, ' ', pos);
+  char *version = memrchr(block, ' ', pos);
+  char *cookies = NULL;
+  int cookies_len = 0;
+
+  // Fields may each grow by a space and a CR; cookies shrink when joined
+  if ((call->head = malloc(2 * len + HEAD_ROOM)) == NULL ||
+      (req->stream != NULL && (cookies = malloc(len)) == NULL)) {
+    perror("malloc");
+    free(cookies);
+    return -1;
+  }
+
+  call->client_http11 = req->stream == NULL && version != NULL &&
+                        block + pos - version >= 9 &&
+                        memcmp(version + 1, "HTTP/1.", 7) == 0 &&
+                        version[8] >= '1';
+
+  connection = http_head_field(&req->head, block, "Connection",
+                               &connection_len);
+
+  p = append(call->head, block, method_end - block);
+  p = append(p, " ", 1);
+  p = append(p, req->path, req->path_len);
+  p = append(p, " HTTP/1.1\r\n", 11);
+
+  while ((name = next_field(block, len, &pos, &name_len, &value,
+                            &value_len)) != NULL) {
+    if (hop_by_hop(name, name_len, connection, connection_len) ||
+        is_field(name, name_len, "Content-Length") ||
+        is_field(name, name_len, "Expect")) {
+      continue;
+    }
+
+    if (is_field(name, name_len, "Host")) {
+      has_host = 1;
+    } else if (is_field(name, name_len, "Authorization")) {
+      call->may_cache = 0;
+    } else if (is_field(name, name_len, "X-Forwarded-For")) {
+      p = append_field(p, name, name_len, value, value_len);
+      p = append(p - 2, ", ", 2);
+      p = append(p, req->log.addr, strlen(req->log.addr));
+      p = append(p, "\r\n", 2);
+      has_xff = 1;
+      continue;
+    } else if (cookies != NULL && is_field(name, name_len, "cookie")) {
+      if (cookies_len > 0) {
+        memcpy(cookies + cookies_len, "; ", 2);
+        cookies_len += 2;
+      }
+      memcpy(cookies + cookies_len, value, value_len);
+      cookies_len += value_len;
+      continue;
+    }
+
+    p = append_field(p, name, name_len, value, value_len);
+  }
+
+  if (!has_host) {
+    p = append_field(p, "Host", 4, host, strlen(host));
+  }
+  if (!has_xff) {
+    p = append_field(p, "X-Forwarded-For", 15, req->log.addr,
+                     strlen(req->log.addr));
+  }
+  if (cookies_len > 0) {
+    p = append_field(p, "Cookie", 6, cookies, cookies_len);
+  }
+  free(cookies);
+
+  call->head_len = p - call->head;
+
+  // A body of known length goes as it is; anything else waits to see
+  if (req->body.length > 0 ||
+      (req->body.length == 0 &&
+       http_head_field(&req->head, block, "Content-Length", &value_len) !=
+           NULL)) {
+    char framing[48];
+
+    sprintf(framing, "Content-Length: %lld\r\n", req->body.length);
+    finish_head(call, framing);
+  } else if (req->body.length == 0) {
+    finish_head(call, NULL);
+  }
+
+  return 0;
+}
+
+/* Body sink: the request body, on its way upstream */
+static int to_upstream(void *arg, void *data, int size) {
+  struct proxy_call *call = arg;
+  char line[16];
+
+  if (!call->head_done) {
+    // The body has no length; it goes in chunks
+    call->chunked_up = 1;
+    finish_head(call, "Transfer-Encoding: chunked\r\n");
+  }
+
+  if (call->chunked_up) {
+    int n = sprintf(line, "%x\r\n", size);
+
+    return put(&call->out, line, n) < 0 || put(&call->out, data, size) < 0 ||
+                   put(&call->out, "\r\n", 2) < 0
+               ? -1
+               : 0;
+  }
+  return put(&call->out, data, size);
+}
+
+/* Request bytes still to go upstream */
+static int unsent(struct proxy_call *call) {
+  if (!call->head_done) {
+    return 0;
+  }
+  return call->head_len - call->head_sent + call->out.len - call->out_sent;
+}
+
+/* Send what the upstream will take: the head, then body bytes
+ *
+ * Returns 1 once everything is out, 0 if the socket is full, -1 on error.
+ */
+static int flush_upstream(struct proxy_call *call) {
+  while (unsent(call) > 0) {
+    struct iovec iov[2] = {
+        {call->head + call->head_sent, call->head_len - call->head_sent},
+        {call->out.data + call->out_sent, call->out.len - call->out_sent}};
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    ssize_t n = sendmsg(call->uc->watch.fd, &msg, MSG_NOSIGNAL);
+    int k = iov[0].iov_len;
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+
+    if (n < k) {
+      k = n;
+    }
+    call->head_sent += k;
+    call->out_sent += n - k;
+  }
+
+  call->out.len = call->out_sent = 0;
+  return call->head_done;
+}
+
+/* Pass on as much of the request as the client and upstream allow
+ *
+ * Returns 0 once all of it is sent, PROXY_AGAIN, -1 if the client's body
+ * failed, or UPSTREAM_FAILED.
+ */
+static int send_request(struct proxy_call *call) {
+  struct request *req = call->req;
+  struct body_sink sink = {to_upstream, NULL, call};
+  int rv;
+
+  while (1) {
+    int input_gone = 0; // Read all the client had
+
+    if (!call->body_done && unsent(call) < BUFFER_SIZE) {
+      long long n = body_stream(&req->body, &sink);
+
+      if (n == BODY_AGAIN) {
+        input_gone = 1;
+      } else if (n < 0) {
+        return -1;
+      } else {
+        // The part of the body already in the request buffer was counted
+        // with it; whatever the reader took past the body is the next
+        // request
+        metrics_bytes(n - (req->buf_len - req->body_offset), 0);
+        req->body_unread = 0;
+        req->body_offset = req->body.start;
+        req->buf_len = req->body.end;
+
+        if (!call->head_done) {
+          finish_head(call, NULL);
+        } else if (call->chunked_up && put(&call->out, "0\r\n\r\n", 5) < 0) {
+          return -1;
+        }
+        call->body_done = 1;
+      }
+    }
+
+    if (call->uc->error != 0) {
+      return UPSTREAM_FAILED;
+    }
+    if (call->uc->connecting) {
+      return PROXY_AGAIN;
+    }
+    if ((rv = flush_upstream(call)) < 0) {
+      return UPSTREAM_FAILED;
+    }
+    if (rv == 1 && call->body_done) {
+      call->state = CALL_HEAD;
+      return 0;
+    }
+    if (rv == 0 || input_gone) {
+      return PROXY_AGAIN;
+    }
+  }
+}
+
+/* How long the response may be cached for, in ms; 0 if it may not be */
+static int freshness(struct proxy_call *call) {
+  char *buf = call->buf, *v, *p, *end;
+  long max_age = -1, s_maxage = -1;
+  int len;
+
+  if (!call->may_cache || call->status != 200 || call->no_body ||
+      http_head_field(&call->resp, buf, "Set-Cookie", &len) != NULL ||
+      http_head_field(&call->resp, buf, "Vary", &len) != NULL ||
+      (v = http_head_field(&call->resp, buf, "Cache-Control", &len)) ==
+          NULL) {
+    return 0;
+  }
+
+  if (has_token(v, len, "no-store") || has_token(v, len, "no-cache") ||
+      has_token(v, len, "private")) {
+    return 0;
+  }
+
+  for (p = v, end = v + len; p < end; p++) {
+    long *age = NULL;
+
+    if (end - p > 8 && strncasecmp(p, "s-maxage=", 9) == 0) {
+      age = &s_maxage;
+      p += 9;
+    } else if (end - p > 7 && strncasecmp(p, "max-age=", 8) == 0 &&
+               (p == v || p[-1] == ' ' || p[-1] == ',')) {
+      age = &max_age;
+      p += 8;
+    }
+    if (age != NULL) {
+      for (*age = 0; p < end && isdigit((unsigned char)*p); p++) {
+        if (*age < MAX_TTL) {
+          *age = *age * 10 + (*p - '0');
+        }
+      }
+    }
+  }
+
+  if (s_maxage >= 0) {
+    max_age = s_maxage; // For shared caches, like this one
+  }
+  if (max_age > MAX_TTL) {
+    max_age = MAX_TTL;
+  }
+  return max_age > 0 ? max_age * 1000 : 0;
+}
+
+/* Decide whether to keep a copy of the response for the cache */
+static void start_copy(struct proxy_call *call) {
+  struct proxy *proxy = call->proxy;
+  char *type;
+  int len;
+
+  if (call->cache == NULL || (call->ttl_ms = freshness(call)) == 0) {
+    return;
+  }
+
+  if ((type = http_head_field(&call->resp, call->buf, "Content-Type",
+                              &len)) == NULL) {
+    type = "application/octet-stream";
+    len = strlen(type);
+  }
+
+  if (call->body.length > proxy->cache_max ||
+      len >= (int)sizeof call->content_type) {
+    call->ttl_ms = 0;
+    return;
+  }
+  memcpy(call->content_type, type, len);
+  call->content_type[len] = '\0';
+}
+
+/* Keep a copy of a piece of the body, giving up past the cache's limit */
+static void copy_body(struct proxy_call *call, void *data, int size) {
+  if (call->copy.len + size > call->proxy->cache_max ||
+      put(&call->copy, data, size) < 0) {
+    free(call->copy.data);
+    call->copy = (struct buffer){NULL, 0, 0};
+    call->ttl_ms = 0;
+  }
+}
+
+/* Whether the client has yet to take what it has been sent, or there's
+ * enough to send it */
+static int backed_up(struct proxy_call *call) {
+  struct request *req = call->req;
+
+  if (req->stream != NULL) {
+    return h2_pending(req->stream) > 0;
+  }
+  return call->reply.len >= BUFFER_SIZE || conn_queued(req->conn);
+}
+
+/* Send an HTTP/1 client what has been gathered for it */
+static int flush_client(struct proxy_call *call) {
+  struct iovec iov = {call->reply.data, call->reply.len};
+  int n;
+
+  if (call->reply.len == 0) {
+    return 0;
+  }
+  if ((n = conn_send(call->req->conn, &iov, 1, 0)) < 0) {
+    return -1;
+  }
+  call->sent += n;
+  call->reply.len = 0;
+  return 0;
+}
+
+/* Body sink: the response body, on its way to the client */
+static int to_client(void *arg, void *data, int size) {
+  struct proxy_call *call = arg;
+  struct request *req = call->req;
+  char line[16];
+
+  if (call->ttl_ms > 0) {
+    copy_body(call, data, size);
+  }
+
+  if (req->stream != NULL) {
+    if (h2_write(req->stream, data, size, 0) < 0) {
+      return -1;
+    }
+    call->sent += size;
+    return 0;
+  }
+
+  if (call->chunked_down) {
+    int n = sprintf(line, "%x\r\n", size);
+
+    return put(&call->reply, line, n) < 0 ||
+                   put(&call->reply, data, size) < 0 ||
+                   put(&call->reply, "\r\n", 2) < 0
+               ? -1
+               : 0;
+  }
+  return put(&call->reply, data, size);
+}
+
+/* Write the response head for an HTTP/1 client
+ *
+ * It goes out with the first of the body, in one write rather than two the
+ * client would see a delayed ACK between. Returns -1 if out of memory.
+ */
+static int respond_http1(struct proxy_call *call, int head_len) {
+  struct request *req = call->req;
+  char *buf = call->buf, *connection, *name, *value, *head, *p;
+  int pos = first_line(buf, head_len), eol = pos, connection_len = 0;
+  int name_len, value_len, rv;
+
+  if ((head = malloc(2 * head_len + HEAD_ROOM)) == NULL) {
+    perror("malloc");
+    return -1;
+  }
+
+  while (eol > 0 && (buf[eol - 1] == '\n' || buf[eol - 1] == '\r')) {
+    eol--;
+  }
+  connection = http_head_field(&call->resp, buf, "Connection",
+                               &connection_len);
+
+  // The status line as the upstream had it, but for the version
+  p = append(head, "HTTP/1.1", 8);
+  p = append(p, buf + 8, eol - 8);
+  p = append(p, "\r\n", 2);
+
+  while ((name = next_field(buf, head_len, &pos, &name_len, &value,
+                            &value_len)) != NULL) {
+    if (!hop_by_hop(name, name_len, connection, connection_len) &&
+        !(call->body.chunked && is_field(name, name_len, "Content-Length"))) {
+      p = append_field(p, name, name_len, value, value_len);
+    }
+  }
+
+  if (!call->no_body && call->body.length < 0) {
+    if (call->client_http11) {
+      p = append(p, "Transfer-Encoding: chunked\r\n", 28);
+      call->chunked_down = 1;
+    } else {
+      req->keep_alive = 0; // The end of the connection ends the body
+    }
+  }
+
+  if (req->body_unread || conn_draining(req->conn)) {
+    req->keep_alive = 0;
+  }
+  if (req->keep_alive) {
+    p = append(p, "Connection: keep-alive\r\n\r\n", 26);
+  } else {
+    p = append(p, "Connection: close\r\n\r\n", 21);
+  }
+
+  rv = put(&call->reply, head, p - head);
+  free(head);
+  return rv;
+}
+
+/* Send the response head on to an HTTP/2 client
+ *
+ * The fields are lower-cased and terminated in place in the head, which
+ * isn't needed again. Returns -1 if the stream is gone, or PROXY_BAD_GATEWAY
+ * if the head won't fit a HEADERS frame.
+ */
+static int respond_h2(struct proxy_call *call, int head_len) {
+  struct h2_stream *s = call->req->stream;
+  struct h2_field fields[MAX_FIELDS];
+  char *buf = call->buf, *connection, *name, *value;
+  int pos = first_line(buf, head_len), connection_len = 0, n = 0, size = 0;
+  int name_len, value_len;
+  long length = call->no_body ? -1 : call->body.length;
+
+  connection = http_head_field(&call->resp, buf, "Connection",
+                               &connection_len);
+
+  while ((name = next_field(buf, head_len, &pos, &name_len, &value,
+                            &value_len)) != NULL) {
+    // h2_respond_stream() gives the length, unless there's no body to have it
+    if (hop_by_hop(name, name_len, connection, connection_len) ||
+        (!call->no_body && is_field(name, name_len, "Content-Length"))) {
+      continue;
+    }
+    if (n == MAX_FIELDS || (size += name_len + value_len) > MAX_FIELD_BYTES) {
+      return PROXY_BAD_GATEWAY;
+    }
+
+    for (int i = 0; i < name_len; i++) {
+      name[i] = tolower((unsigned char)name[i]);
+    }
+    name[name_len] = '\0';
+    value[value_len] = '\0';
+    fields[n++] = (struct h2_field){name, value, 0};
+  }
+
+  if (h2_respond_stream(s, call->status, fields, n, length) < 0) {
+    return -1;
+  }
+
+  if (length == 0) {
+    call->ended = 1; // The HEADERS frame ended the stream
+  } else if (call->no_body) {
+    call->ended = 1;
+    return h2_write(s, NULL, 0, 1) < 0 ? -1 : 0;
+  }
+  return 0;
+}
+
+/* Whether a response head doesn't start with a status line we can pass on;
+ * switching protocols isn't something a proxied request can do */
+static int bad_status(char *buf, int len) {
+  return len < 13 || memcmp(buf, "HTTP/1.", 7) != 0 || buf[8] != ' ' ||
+         !isdigit((unsigned char)buf[9]) || !isdigit((unsigned char)buf[10]) ||
+         !isdigit((unsigned char)buf[11]) || memcmp(buf + 9, "101", 3) == 0;
+}
+
+/* Read the response head and send it on
+ *
+ * Returns 0 once it is sent, PROXY_AGAIN, -1 if the client is gone,
+ * PROXY_BAD_GATEWAY, or UPSTREAM_FAILED if the connection closed before any
+ * of it came.
+ */
+static int read_head(struct proxy_call *call) {
+  struct request *req = call->req;
+  char *v;
+  int head_len, len, rv;
+
+  if (call->buf == NULL && (call->buf = bufpool_get()) == NULL) {
+    return PROXY_BAD_GATEWAY;
+  }
+
+  while (1) {
+    char *buf = call->buf;
+    ssize_t n;
+
+    if ((head_len = http_head_scan(buf, call->buf_len, &call->resp)) > 0) {
+      if (call->resp.error || bad_status(buf, head_len)) {
+        return PROXY_BAD_GATEWAY;
+      }
+      if (buf[9] != '1') {
+        break;
+      }
+      // An interim response; they aren't passed on
+      call->buf_len -= head_len;
+      memmove(buf, buf + head_len, call->buf_len);
+      http_head_init(&call->resp);
+      continue;
+    }
+
+    if (call->buf_len == BUFFER_SIZE) {
+      return PROXY_BAD_GATEWAY;
+    }
+    n = recv(call->uc->watch.fd, buf + call->buf_len,
+             BUFFER_SIZE - call->buf_len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return PROXY_AGAIN;
+    }
+    if (n <= 0) {
+      return call->buf_len == 0 ? UPSTREAM_FAILED : PROXY_BAD_GATEWAY;
+    }
+    call->buf_len += n;
+  }
+
+  call->status = atoi(call->buf + 9);
+  call->no_body = req->method == METHOD_HEAD || call->status == 204 ||
+                  call->status == 304;
+
+  v = http_head_field(&call->resp, call->buf, "Connection", &len);
+  if (call->buf[7] == '0') {
+    call->reusable = v != NULL && has_token(v, len, "keep-alive");
+  } else {
+    call->reusable = v == NULL || !has_token(v, len, "close");
+  }
+
+  if (call->no_body) {
+    call->reusable &= call->buf_len == head_len;
+  } else {
+    call->body.io = &call->io;
+    if (body_reader_init(&call->body, call->uc->watch.fd, call->buf,
+                         BUFFER_SIZE, &call->resp, head_len,
+                         call->buf_len) < 0) {
+      return PROXY_BAD_GATEWAY;
+    }
+    if (call->body.length < 0 && !call->body.chunked) {
+      call->reusable = 0; // The body runs to the end of the connection
+    }
+  }
+
+  start_copy(call);
+
+  rv = req->stream != NULL ? respond_h2(call, head_len)
+                           : respond_http1(call, head_len);
+  if (rv < 0) {
+    return rv;
+  }
+  call->responded = 1;
+  call->state = CALL_BODY;
+  return 0;
+}
+
+/* Pass the response body on as the upstream and client allow
+ *
+ * Returns 0 once it has all gone, PROXY_AGAIN, or -1 if either side failed.
+ */
+static int relay_body(struct proxy_call *call) {
+  struct request *req = call->req;
+  struct body_sink sink = {to_client, NULL, call};
+  long long n = 0;
+
+  if (!call->no_body && (n = body_stream(&call->body, &sink)) == BODY_AGAIN) {
+    // The head waits for the first of the body, which it usually just beat
+    if (call->body.total > 0 && flush_client(call) < 0) {
+      return -1;
+    }
+    return PROXY_AGAIN;
+  }
+  if (n < 0) {
+    return -1;
+  }
+
+  if (!call->ended) {
+    call->ended = 1;
+    if (req->stream != NULL) {
+      return h2_write(req->stream, NULL, 0, 1) < 0 ? -1 : 0;
+    }
+    if (call->chunked_down && put(&call->reply, "0\r\n\r\n", 5) < 0) {
+      return -1;
+    }
+  }
+  return flush_client(call);
+}
+
+/* The connection failed before any of the response came back
+ *
+ * It is tried again where nothing is lost by that: on another upstream if
+ * it never opened, and afresh if it came from the pool and there's no body
+ * to send again, as the upstream may just have closed it while idle.
+ * Returns 0 to carry on with a new connection, or PROXY_BAD_GATEWAY.
+ */
+static int retry(struct proxy_call *call) {
+  struct proxy *proxy = call->proxy;
+  struct upstream *up = call->uc->up;
+  int error = call->uc->error;
+  int stale = !error && call->reused && call->body_done &&
+              call->req->body.total == 0;
+
+  if (error) {
+    fprintf(stderr, "proxy: %s: %s\n", up->name, strerror(error));
+    up->down_until = now_ms() + DOWN_TIME;
+  }
+
+  detach(call, 0);
+  if ((!error && !stale) || call->attempts > proxy->n ||
+      attach(call, error ? pick(proxy) : up, stale) < 0) {
+    return PROXY_BAD_GATEWAY;
+  }
+
+  call->state = CALL_REQUEST;
+  call->head_sent = 0;
+  call->buf_len = 0;
+  return 0;
+}
+
+/* Take the exchange as far as it will go */
+static int step(struct proxy_call *call) {
+  int rv = 0;
+
+  if (call->timed_out) {
+    call->timed_out = 0;
+    if (!call->uc->connecting) {
+      return call->responded ? -1 : PROXY_TIMEOUT;
+    }
+    call->uc->connecting = 0;
+    call->uc->error = ETIMEDOUT;
+  }
+
+  while (rv == 0) {
+    switch (call->state) {
+    case CALL_REQUEST:
+      rv = send_request(call);
+      break;
+    case CALL_HEAD:
+      rv = read_head(call);
+      break;
+    case CALL_BODY:
+      return relay_body(call);
+    }
+
+    if (rv == UPSTREAM_FAILED) {
+      rv = retry(call);
+    }
+  }
+  return rv;
+}
+
+/* Settle what the call waits on until proxy_run() is called again: the
+ * upstream, or the client's body or taking the response */
+static void wait_for(struct proxy_call *call) {
+  struct upstream_conn *uc = call->uc;
+  unsigned int events = 0;
+  int client = 0;
+
+  switch (call->state) {
+  case CALL_REQUEST:
+    if (uc->connecting || unsent(call) > 0) {
+      events = EPOLLOUT;
+    }
+    client = !call->body_done && unsent(call) < BUFFER_SIZE;
+    break;
+  case CALL_HEAD:
+    events = EPOLLIN;
+    break;
+  case CALL_BODY:
+    if (backed_up(call)) {
+      client = 1;
+    } else {
+      events = EPOLLIN;
+    }
+    break;
+  }
+
+  conn_watch_events(call->proxy->loop, &uc->watch, events);
+  if (!client) {
+    conn_pause(call->req);
+  }
+
+  if (events != 0) {
+    conn_timer(call->proxy->loop, &call->timer,
+               uc->connecting ? CONNECT_TIMEOUT : READ_TIMEOUT);
+  } else {
+    timer_cancel(&call->timer);
+  }
+}
+
+static void end_call(struct proxy_call *call, int reuse) {
+  timer_cancel(&call->timer);
+  detach(call, reuse);
+  call->req->proxy = NULL;
+  free(call->head);
+  free(call->out.data);
+  bufpool_put(call->buf);
+  free(call->copy.data);
+  free(call->reply.data);
+  free(call);
+}
+
+/**
+ * Create a proxy for the upstreams listed in config
+ *
+ * Only responses with bodies no larger than cache_max are cached.
+ */
+struct proxy *proxy_create(struct conn_loop *loop, char *config,
+                           int cache_max) {
+  struct proxy *proxy = calloc(1, sizeof *proxy);
+
+  if (proxy == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+
+  proxy->loop = loop;
+  proxy->cache_max = cache_max;
+
+  if (load_upstreams(proxy, config) < 0) {
+    free(proxy);
+    return NULL;
+  }
+  return proxy;
+}
+
+/**
+ * Start passing a request on to an upstream; carry on with proxy_run()
+ *
+ * The request's body reader must be set up. A response that may be cached
+ * is kept in cache, unless that is NULL. Returns -1 if the request can't be
+ * passed on.
+ */
+int proxy_start(struct proxy *proxy, struct request *req,
+                struct cache *cache) {
+  struct proxy_call *call = calloc(1, sizeof *call);
+  struct upstream *up = pick(proxy);
+
+  if (call == NULL) {
+    perror("calloc");
+    return -1;
+  }
+
+  call->proxy = proxy;
+  call->req = req;
+  call->cache = cache;
+  call->timer.expired = call_expired;
+  call->io = (struct body_io){upstream_recv, no_send, call, 1};
+  http_head_init(&call->resp);
+  call->may_cache = req->method == METHOD_GET;
+
+  if (build_head(call, up->name) < 0 || attach(call, up, 0) < 0) {
+    free(call->head);
+    free(call);
+    return -1;
+  }
+
+  req->proxy = call;
+  return 0;
+}
+
+/**
+ * Take a request's exchange with its upstream as far as it will go
+ *
+ * Returns PROXY_AGAIN when it has to wait, with the request paused if
+ * it's the upstream it waits on; call again from req->resume. Otherwise
+ * the exchange is over: 0 if the response went through, PROXY_BAD_GATEWAY
+ * or PROXY_TIMEOUT if none came and an error response is wanted, or -1 if
+ * the client failed or the response was cut short. The status and response
+ * bytes sent are stored either way.
+ */
+int proxy_run(struct request *req, int *status, long long *bytes) {
+  struct proxy_call *call = req->proxy;
+  int rv = req->aborted ? -1 : step(call);
+
+  if (rv == PROXY_AGAIN) {
+    wait_for(call);
+    return rv;
+  }
+
+  if (rv == 0 && call->ttl_ms > 0) {
+    cache_put_ttl(call->cache, req->path, call->content_type,
+                  call->copy.data != NULL ? call->copy.data : "",
+                  call->copy.len, call->ttl_ms);
+  } else if (rv < 0 && call->responded && !req->aborted) {
+    // Too late for an error response: cut the client off instead
+    if (req->stream != NULL) {
+      h2_cancel(req->stream);
+    }
+    req->keep_alive = 0;
+  }
+
+  *status = call->status;
+  *bytes = call->sent;
+  end_call(call, rv == 0 && call->reusable);
+  return rv;
+}
@@ -0,0 +1,21 @@
+#ifndef _PROXY_H_
+#define _PROXY_H_
+
+#include "cache.h"
+#include "conn.h"
+#include "request.h"
+
+#define PROXY_AGAIN -2       // proxy_run() is waiting on the upstream or client
+#define PROXY_BAD_GATEWAY -3 // No usable response; nothing sent to the client
+#define PROXY_TIMEOUT -4     // The upstream took too long; nothing sent either
+
+struct proxy;
+struct proxy_call; // One request's exchange with an upstream
+
+extern struct proxy *proxy_create(struct conn_loop *loop, char *config,
+                                  int cache_max);
+extern int proxy_start(struct proxy *proxy, struct request *req,
+                       struct cache *cache);
+extern int proxy_run(struct request *req, int *status, long long *bytes);
+
+#endif
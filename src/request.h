@@ -0,0 +1,72 @@
+#ifndef _REQUEST_H_
+#define _REQUEST_H_
+
+#include "accesslog.h"
+#include "arena.h"
+#include "body.h"
+#include "httphead.h"
+#include "metrics.h"
+#include <stdint.h>
+
+#define REQUEST_PATH_MAX 1024
+
+enum http_method {
+  METHOD_GET,
+  METHOD_HEAD,
+  METHOD_POST,
+  METHOD_PUT,
+  METHOD_DELETE,
+  METHOD_OPTIONS,
+  METHOD_PATCH,
+  METHOD_UNKNOWN,
+  METHOD_COUNT = METHOD_UNKNOWN
+};
+
+// Everything a handler needs to know about the request it is answering
+struct request {
+  int fd;
+  struct conn *conn;        // For sending the response
+  struct h2_stream *stream; // The HTTP/2 stream it came on, or NULL
+  enum http_method method;
+  char path[REQUEST_PATH_MAX]; // NUL-terminated copy of the request target
+  int path_len;
+
+  char *buf;       // The request as received so far; reusable for I/O.
+                   // Borrowed from the buffer pool for the request's life
+  int buf_size;
+  int body_offset; // Where the headers end in buf; once answered, where any
+                   // pipelined request starts
+  int buf_len;     // Bytes received into buf
+
+  struct http_head head; // Where the request line and fields are in buf
+
+  uint64_t ready_ns; // When the request was ready to be handled, at latest
+  int admitted;      // Holds an in-flight slot
+
+  int keep_alive;  // Leave the connection open for another request
+  int body_unread; // There is a body nobody has read
+  struct body_reader body;
+
+  // Set by a handler that has to wait for more input; the request is
+  // answered once a call returns with it NULL
+  void (*resume)(struct request *req);
+  int aborted; // The connection is closing; resume must give up now
+  struct proxy_call *proxy; // Its exchange with an upstream, if passed on
+  struct upload *upload;    // Its body's way into the append log, if saved
+
+  struct route *route; // What it was routed to, if anything
+  char *cache_key;     // Where its response goes in the route's micro-cache,
+                       // while one is being computed for it
+
+  struct request *next; // In a queue of requests waiting their turn
+
+  struct arena arena; // Scratch for handlers, freed once it's answered
+
+  struct metrics_request metrics;
+  struct accesslog_record log;
+
+  struct server *server;
+  struct vhost *vhost; // The site it is for
+};
+
+#endif
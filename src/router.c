@@ -0,0 +1,279 @@
+/* Request router
+ *
+ * Routes are registered at startup into a radix trie keyed by path. Each
+ * node holds the routes for the path it spells, one slot per method, for
+ * exact and prefix matches. A lookup walks the trie once along the request
+ * path, remembering the deepest prefix route, so dispatch costs the same
+ * however many routes there are.
+ *
+ * A route can also carry settings for caching its responses; the server
+ * does the caching.
+ */
+
+#include "router.h"
+#include "vec.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct router_node {
+  char *label; // Edge from the parent; children differ in label[0]
+  int label_len;
+
+  VEC(struct router_node *) children;
+
+  struct route *exact[METHOD_COUNT];
+  struct route *prefix[METHOD_COUNT];
+};
+
+struct router {
+  struct router_node *root;
+};
+
+/* Map a method token to its enum without copying it */
+enum http_method http_method_parse(char *s, int len) {
+  static struct {
+    char *name;
+    int len;
+  } names[METHOD_COUNT] = {
+      [METHOD_GET] = {"GET", 3},         [METHOD_HEAD] = {"HEAD", 4},
+      [METHOD_POST] = {"POST", 4},       [METHOD_PUT] = {"PUT", 3},
+      [METHOD_DELETE] = {"DELETE", 6},   [METHOD_OPTIONS] = {"OPTIONS", 7},
+      [METHOD_PATCH] = {"PATCH", 5},
+  };
+
+  for (int m = 0; m < METHOD_COUNT; m++) {
+    if (names[m].len == len && memcmp(names[m].name, s, len) == 0) {
+      return m;
+    }
+  }
+  return METHOD_UNKNOWN;
+}
+
+static struct router_node *node_create(char *label, int label_len) {
+  struct router_node *node = calloc(1, sizeof *node);
+
+  if (node == NULL) {
+    return NULL;
+  }
+
+  node->label = malloc(label_len + 1);
+  if (node->label == NULL) {
+    free(node);
+    return NULL;
+  }
+  memcpy(node->label, label, label_len);
+  node->label[label_len] = '\0';
+  node->label_len = label_len;
+
+  return node;
+}
+
+static void node_free(struct router_node *node) {
+  for (int i = 0; i < node->children.len; i++) {
+    node_free(node->children.items[i]);
+  }
+  for (int m = 0; m < METHOD_COUNT; m++) {
+    free(node->exact[m]);
+    free(node->prefix[m]);
+  }
+  VEC_FREE(&node->children);
+  free(node->label);
+  free(node);
+}
+
+static int add_child(struct router_node *node, struct router_node *child) {
+  return VEC_PUSH(&node->children, child);
+}
+
+static struct router_node *find_child(struct router_node *node, char c) {
+  for (int i = 0; i < node->children.len; i++) {
+    if (node->children.items[i]->label[0] == c) {
+      return node->children.items[i];
+    }
+  }
+  return NULL;
+}
+
+/* Split a node's label after n bytes, pushing the rest into a new child */
+static int split(struct router_node *node, int n) {
+  struct router_node *tail = node_create(node->label + n, node->label_len - n);
+
+  if (tail == NULL) {
+    return -1;
+  }
+
+  // The tail takes over everything that hung off the old node
+  tail->children = node->children;
+  memcpy(tail->exact, node->exact, sizeof tail->exact);
+  memcpy(tail->prefix, node->prefix, sizeof tail->prefix);
+
+  memset(&node->children, 0, sizeof node->children);
+  memset(node->exact, 0, sizeof node->exact);
+  memset(node->prefix, 0, sizeof node->prefix);
+  node->label[n] = '\0';
+  node->label_len = n;
+
+  if (add_child(node, tail) < 0) {
+    node_free(tail);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Create an empty router */
+struct router *router_create(void) {
+  struct router *router = malloc(sizeof *router);
+
+  if (router == NULL) {
+    return NULL;
+  }
+
+  router->root = node_create("", 0);
+  if (router->root == NULL) {
+    free(router);
+    return NULL;
+  }
+
+  return router;
+}
+
+void router_free(struct router *router) {
+  node_free(router->root);
+  free(router);
+}
+
+/* Register a handler for a method and path
+ *
+ * Return 0, or -1 on error or if the route is already taken.
+ */
+int router_add(struct router *router, enum http_method method, char *path,
+               enum route_match match, route_handler handler, int id) {
+  struct router_node *node = router->root;
+  int len = strlen(path);
+
+  if (method >= METHOD_COUNT) {
+    return -1;
+  }
+
+  while (len > 0) {
+    struct router_node *child = find_child(node, path[0]);
+
+    if (child == NULL) {
+      // Nothing shares this path from here on
+      if ((child = node_create(path, len)) == NULL) {
+        return -1;
+      }
+      if (add_child(node, child) < 0) {
+        node_free(child);
+        return -1;
+      }
+      node = child;
+      break;
+    }
+
+    int common = 0;
+    while (common < child->label_len && common < len &&
+           child->label[common] == path[common]) {
+      common++;
+    }
+
+    if (common < child->label_len && split(child, common) < 0) {
+      return -1;
+    }
+
+    node = child;
+    path += common;
+    len -= common;
+  }
+
+  struct route **slot =
+      match == ROUTE_EXACT ? &node->exact[method] : &node->prefix[method];
+
+  if (*slot != NULL || (*slot = malloc(sizeof **slot)) == NULL) {
+    return -1;
+  }
+  (*slot)->handler = handler;
+  (*slot)->id = id;
+  (*slot)->cache = (struct route_cache){0, 0, NULL};
+
+  return 0;
+}
+
+/* Cache a registered route's responses
+ *
+ * A response is fresh for ttl_ms and may then be served stale for stale_ms
+ * more while it is computed anew. Responses are keyed on the method, path
+ * and the values of the header fields in vary, a NULL-terminated list kept
+ * by the caller, or NULL.
+ *
+ * Return 0, or -1 if there is no such route.
+ */
+int router_cache(struct router *router, enum http_method method, char *path,
+                 enum route_match match, int ttl_ms, int stale_ms,
+                 char **vary) {
+  struct router_node *node = router->root;
+  struct route *route;
+  int len = strlen(path);
+
+  if (method >= METHOD_COUNT) {
+    return -1;
+  }
+
+  // Only a node spelling the whole path holds its routes
+  while (len > 0) {
+    node = find_child(node, path[0]);
+
+    if (node == NULL || node->label_len > len ||
+        memcmp(node->label, path, node->label_len) != 0) {
+      return -1;
+    }
+
+    path += node->label_len;
+    len -= node->label_len;
+  }
+
+  route = match == ROUTE_EXACT ? node->exact[method] : node->prefix[method];
+
+  if (route == NULL) {
+    return -1;
+  }
+  route->cache = (struct route_cache){ttl_ms, stale_ms, vary};
+
+  return 0;
+}
+
+/* Find the route for a request
+ *
+ * An exact route for the whole path wins, then the longest matching prefix
+ * route. Returns NULL if nothing matches.
+ */
+struct route *router_lookup(struct router *router, enum http_method method,
+                            char *path, int path_len) {
+  struct router_node *node = router->root;
+  struct route *best = NULL;
+
+  if (method >= METHOD_COUNT) {
+    return NULL;
+  }
+
+  while (1) {
+    if (node->prefix[method] != NULL) {
+      best = node->prefix[method];
+    }
+
+    if (path_len == 0) {
+      return node->exact[method] != NULL ? node->exact[method] : best;
+    }
+
+    node = find_child(node, path[0]);
+
+    if (node == NULL || node->label_len > path_len ||
+        memcmp(node->label, path, node->label_len) != 0) {
+      return best;
+    }
+
+    path += node->label_len;
+    path_len -= node->label_len;
+  }
+}
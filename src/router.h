@@ -0,0 +1,42 @@
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+#include "request.h"
+
+// How a registered path matches request paths
+enum route_match {
+  ROUTE_EXACT,  // The whole path
+  ROUTE_PREFIX, // Any path starting with it; longest prefix wins
+};
+
+typedef void (*route_handler)(struct request *req);
+
+// A route's response micro-cache, set up with router_cache()
+struct route_cache {
+  int ttl_ms;   // How long a response is fresh; 0 if they aren't cached
+  int stale_ms; // How much longer it may be served while recomputed
+  char **vary;  // Header fields keying responses too; NULL-terminated
+};
+
+struct route {
+  route_handler handler;
+  int id; // Caller's tag, e.g. for per-route stats
+  struct route_cache cache;
+};
+
+struct router;
+
+extern enum http_method http_method_parse(char *s, int len);
+extern struct router *router_create(void);
+extern void router_free(struct router *router);
+extern int router_add(struct router *router, enum http_method method,
+                      char *path, enum route_match match,
+                      route_handler handler, int id);
+extern int router_cache(struct router *router, enum http_method method,
+                        char *path, enum route_match match, int ttl_ms,
+                        int stale_ms, char **vary);
+extern struct route *router_lookup(struct router *router,
+                                   enum http_method method, char *path,
+                                   int path_len);
+
+#endif
@@ -0,0 +1,711 @@
+/* Second cache tier: a log of segment files on local disk
+ *
+ * What the RAM cache evicts is appended to the active segment as one
+ * record -- path, version, content type and content -- and read back through a
+ * shared mmap() of the segment, so a hit is copied once, straight into
+ * the RAM cache. Segments are files of SEGSTORE_SEGMENT_SIZE bytes in dir,
+ * unlinked as soon as they are made: they go away with the process, and
+ * two processes (as during an upgrade) never share one.
+ *
+ * The index is kept small: per entry, a hash of the path and where the
+ * record is, but not the path itself, which is checked against the record
+ * instead. Deleting an entry only drops it from the index, leaving dead
+ * bytes in its segment. Once the budget's worth of segments is in use,
+ * starting another reclaims the one with the fewest live bytes. If at
+ * most half of it is live it is compacted: the live records are copied
+ * forward into the new segment. Otherwise it is dropped whole, and its
+ * entries leave this tier too.
+ *
+ * Writes go to a thread of the store's own, so a put only copies the
+ * record and queues it. Until it is written, a lookup finds the record in
+ * that copy, or, for one being compacted, where it is moving from; a
+ * segment is closed once the writer is done with it. A put that finds the
+ * writer MAX_QUEUED behind is refused, as the entry can be fetched again.
+ *
+ * Like file_load(), reads fault pages in from disk on the caller's thread.
+ */
+
+#include "segstore.h"
+#include "list.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define MIN_SEGMENTS 2   // However small the budget
+#define MIN_BUCKETS 1024 // Index buckets to start with; a power of two
+#define ALIGN 8          // Records start on this boundary
+#define MAX_QUEUED SEGSTORE_SEGMENT_SIZE // Copied record bytes not yet written
+#define BATCH 64         // Adjoining records written with one pwritev()
+
+// What comes before each record's path, content type and content; the
+// path and type are NUL-terminated in the record too
+struct record {
+  uint32_t size; // The whole record, padding included
+  uint32_t path_len;
+  uint32_t type_len;
+  uint32_t content_len;
+  uint64_t version; // As the RAM cache had it
+};
+
+// Work for the writer: a record to write into segment seg, from a copy of
+// its own or from the segment it is moving out of; or, with fd -1, a mark
+// that seg may be closed, as everything queued before it is done
+struct job {
+  struct job *next;
+  struct slot *slot; // The entry the record is for; NULL once dropped
+  int seg;
+  int fd;
+  uint32_t offset;
+  uint32_t size;
+  char *data;  // The record, until it is written
+  int copied;  // data is the job's own
+  int status;  // 0 once written, -1 if the write failed
+};
+
+// Where one entry's record is
+struct slot {
+  struct hlist_node node;     // In the index
+  struct hlist_node seg_node; // In its segment's list
+  uint32_t hash; // Of the path
+  int seg;
+  uint32_t offset;
+  uint32_t size;   // The record's
+  struct job *job; // Until the record is written; NULL after
+};
+
+struct segment {
+  int fd; // -1 if the slot isn't in use
+  char *map;
+  uint32_t used; // Bytes appended
+  uint32_t live; // Bytes in records still indexed
+  struct hlist_head slots; // The entries whose records are here
+  int jobs;                // Queued writes into it, or its closing
+};
+
+struct segstore {
+  char *dir;
+  struct segment *segs;
+  int nsegs;  // The budget's worth, and one more to compact into
+  int active; // Where records are appended
+
+  struct hlist_head *buckets;
+  int nbuckets; // A power of two
+
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t work; // Signalled when jobs are queued
+  pthread_cond_t idle; // Signalled when the writer finishes a batch
+  struct job *head, *tail; // Waiting for the writer
+  struct job *done, *last; // Done, waiting for reap()
+  int started;             // The writer is running
+  int busy;                // It has a batch in hand
+  int stopping;
+  long queued; // Bytes of copied records not yet reaped
+
+  struct segstore_stats stats;
+};
+
+/* FNV-1a */
+static uint32_t hash_path(char *path, int len) {
+  uint32_t h = 2166136261u;
+
+  for (int i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)path[i]) * 16777619u;
+  }
+  return h;
+}
+
+static struct record *record_at(struct segstore *store, int seg,
+                                uint32_t offset) {
+  return (struct record *)(store->segs[seg].map + offset);
+}
+
+static char *record_path(struct record *r) { return (char *)(r + 1); }
+
+static char *record_type(struct record *r) {
+  return record_path(r) + r->path_len + 1;
+}
+
+static void *record_content(struct record *r) {
+  return record_type(r) + r->type_len + 1;
+}
+
+/* An entry's record, written or not */
+static struct record *slot_record(struct segstore *store, struct slot *slot) {
+  if (slot->job != NULL) {
+    return (struct record *)slot->job->data;
+  }
+  return record_at(store, slot->seg, slot->offset);
+}
+
+static struct slot *find(struct segstore *store, char *path, int len,
+                         uint32_t hash) {
+  struct hlist_head *bucket = &store->buckets[hash & (store->nbuckets - 1)];
+  struct hlist_node *n, *next;
+
+  HLIST_FOR_EACH(n, next, bucket) {
+    struct slot *slot = container_of(n, struct slot, node);
+    struct record *r;
+
+    if (slot->hash != hash) {
+      continue;
+    }
+    r = slot_record(store, slot);
+    if (r->path_len == (uint32_t)len && memcmp(record_path(r), path, len) == 0) {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+/* Double the buckets once there are more entries than buckets */
+static void grow_index(struct segstore *store) {
+  int nbuckets = store->nbuckets * 2;
+  struct hlist_head *buckets = calloc(nbuckets, sizeof *buckets);
+  struct hlist_node *n, *next;
+
+  if (buckets == NULL) {
+    return; // Longer chains, but still correct
+  }
+
+  for (int i = 0; i < store->nbuckets; i++) {
+    HLIST_FOR_EACH(n, next, &store->buckets[i]) {
+      struct slot *slot = container_of(n, struct slot, node);
+
+      hlist_add_head(&buckets[slot->hash & (nbuckets - 1)], n);
+    }
+  }
+
+  free(store->buckets);
+  store->buckets = buckets;
+  store->nbuckets = nbuckets;
+}
+
+static void drop(struct segstore *store, struct slot *slot) {
+  store->segs[slot->seg].live -= slot->size;
+  store->stats.entries--;
+  if (slot->job != NULL) {
+    slot->job->slot = NULL; // Still written, but to dead bytes
+  }
+  hlist_del(&slot->node);
+  hlist_del(&slot->seg_node);
+  free(slot);
+}
+
+/* Make a new, empty segment in slot i */
+static int open_segment(struct segstore *store, int i) {
+  struct segment *seg = &store->segs[i];
+  char name[4096];
+
+  snprintf(name, sizeof name, "%s/segment.XXXXXX", store->dir);
+
+  if ((seg->fd = mkstemp(name)) < 0) {
+    perror(name);
+    return -1;
+  }
+  unlink(name);
+
+  if (ftruncate(seg->fd, SEGSTORE_SEGMENT_SIZE) < 0 ||
+      (seg->map = mmap(NULL, SEGSTORE_SEGMENT_SIZE, PROT_READ, MAP_SHARED,
+                       seg->fd, 0)) == MAP_FAILED) {
+    perror("segstore");
+    close(seg->fd);
+    seg->fd = -1;
+    return -1;
+  }
+
+  seg->used = seg->live = 0;
+  seg->slots.first = NULL;
+  store->stats.disk_bytes += SEGSTORE_SEGMENT_SIZE;
+  return 0;
+}
+
+static void close_segment(struct segstore *store, int i) {
+  struct segment *seg = &store->segs[i];
+
+  munmap(seg->map, SEGSTORE_SEGMENT_SIZE);
+  close(seg->fd);
+  seg->fd = -1;
+  store->stats.disk_bytes -= SEGSTORE_SEGMENT_SIZE;
+}
+
+/* Write iovcnt pieces, size bytes in all, at offset */
+static int write_at(int fd, struct iovec *iov, int iovcnt, uint32_t offset,
+                    size_t size) {
+  while (size > 0) {
+    ssize_t n = pwritev(fd, iov, iovcnt, offset);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      perror("segstore");
+      return -1;
+    }
+    offset += n;
+    size -= n;
+
+    // Skip what went out
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/* Write a batch of jobs, records that adjoin in a segment together */
+static void write_batch(struct job *batch) {
+  struct iovec iov[BATCH];
+
+  while (batch != NULL) {
+    struct job *run = batch, *j;
+    size_t size = 0;
+    int iovcnt = 0, status;
+
+    if (run->fd < 0) {
+      run->status = 0; // Only a mark
+      batch = run->next;
+      continue;
+    }
+
+    for (j = run; j != NULL && iovcnt < BATCH && j->fd == run->fd &&
+                  j->offset == run->offset + size;
+         j = j->next) {
+      iov[iovcnt++] = (struct iovec){j->data, j->size};
+      size += j->size;
+    }
+
+    status = write_at(run->fd, iov, iovcnt, run->offset, size);
+    for (; run != j; run = run->next) {
+      run->status = status;
+    }
+    batch = j;
+  }
+}
+
+/* Writer thread: write what is queued, in order, until the store is freed */
+static void *writer(void *arg) {
+  struct segstore *store = arg;
+
+  pthread_mutex_lock(&store->lock);
+
+  while (1) {
+    while (store->head == NULL && !store->stopping) {
+      pthread_cond_wait(&store->work, &store->lock);
+    }
+    if (store->head == NULL) {
+      break; // Stopping and nothing left to write
+    }
+
+    struct job *batch = store->head, *last = store->tail;
+
+    store->head = store->tail = NULL;
+    store->busy = 1;
+    pthread_mutex_unlock(&store->lock);
+
+    write_batch(batch);
+
+    pthread_mutex_lock(&store->lock);
+    if (store->last == NULL) {
+      store->done = batch;
+    } else {
+      store->last->next = batch;
+    }
+    store->last = last;
+    store->busy = 0;
+    pthread_cond_broadcast(&store->idle);
+  }
+
+  pthread_mutex_unlock(&store->lock);
+  return NULL;
+}
+
+static void queue(struct segstore *store, struct job *job) {
+  job->next = NULL;
+  store->segs[job->seg].jobs++;
+
+  pthread_mutex_lock(&store->lock);
+  if (store->tail == NULL) {
+    store->head = job;
+  } else {
+    store->tail->next = job;
+  }
+  store->tail = job;
+  pthread_cond_signal(&store->work);
+  pthread_mutex_unlock(&store->lock);
+}
+
+static void free_job(struct segstore *store, struct job *job) {
+  if (job->copied) {
+    store->queued -= job->size;
+    free(job->data);
+  }
+  free(job);
+}
+
+/* Settle what the writer has done: records now on disk are read from
+ * there, ones it failed to write are dropped, and marked segments closed
+ */
+static void reap(struct segstore *store) {
+  struct job *job, *next;
+
+  pthread_mutex_lock(&store->lock);
+  job = store->done;
+  store->done = store->last = NULL;
+  pthread_mutex_unlock(&store->lock);
+
+  for (; job != NULL; job = next) {
+    next = job->next;
+    store->segs[job->seg].jobs--;
+
+    if (job->fd < 0) {
+      close_segment(store, job->seg);
+    } else if (job->slot != NULL) {
+      job->slot->job = NULL;
+      if (job->status < 0) {
+        drop(store, job->slot);
+        store->stats.drops++;
+      }
+    }
+    free_job(store, job);
+  }
+}
+
+/* Take space for a record at the end of the active segment, which has room
+ *
+ * Returns its offset.
+ */
+static uint32_t reserve(struct segstore *store, uint32_t size) {
+  struct segment *seg = &store->segs[store->active];
+  uint32_t offset = seg->used;
+
+  seg->used += size;
+  seg->live += size;
+  return offset;
+}
+
+/* Move or drop every live record in segment victim, and have it closed once
+ * the writer has copied them out
+ */
+static void evacuate(struct segstore *store, int victim, int move) {
+  struct segment *seg = &store->segs[victim];
+  struct hlist_node *n, *next;
+  struct job *job;
+
+  HLIST_FOR_EACH(n, next, &seg->slots) {
+    struct slot *slot = container_of(n, struct slot, seg_node);
+
+    if (!move || (job = malloc(sizeof *job)) == NULL) {
+      drop(store, slot);
+      store->stats.drops++;
+      continue;
+    }
+
+    *job = (struct job){.slot = slot,
+                        .seg = store->active,
+                        .fd = store->segs[store->active].fd,
+                        .offset = reserve(store, slot->size),
+                        .size = slot->size,
+                        .data = seg->map + slot->offset};
+
+    seg->live -= slot->size;
+    hlist_del(&slot->seg_node);
+    hlist_add_head(&store->segs[store->active].slots, &slot->seg_node);
+    slot->seg = store->active;
+    slot->offset = job->offset;
+    slot->job = job;
+    queue(store, job);
+  }
+
+  if ((job = calloc(1, sizeof *job)) == NULL) {
+    perror("calloc");
+    return; // Empty, so it is the next one reclaimed
+  }
+  job->seg = victim;
+  job->fd = -1;
+  queue(store, job);
+}
+
+/* Start appending to a new segment, reclaiming one if the budget is used
+ * up
+ *
+ * A segment the writer still has work for isn't reclaimed; if there is no
+ * other, this fails until the writer catches up.
+ */
+static int next_segment(struct segstore *store) {
+  int fresh = -1, victim = -1, used = 0;
+
+  for (int i = 0; i < store->nsegs; i++) {
+    if (store->segs[i].fd < 0) {
+      fresh = fresh < 0 ? i : fresh;
+    } else {
+      used++;
+      if (store->segs[i].jobs == 0 &&
+          (victim < 0 || store->segs[i].live < store->segs[victim].live)) {
+        victim = i;
+      }
+    }
+  }
+
+  if (fresh < 0 || (used == store->nsegs - 1 && victim < 0) ||
+      open_segment(store, fresh) < 0) {
+    return -1;
+  }
+  store->active = fresh;
+
+  if (used == store->nsegs - 1) {
+    int move = store->segs[victim].live <= SEGSTORE_SEGMENT_SIZE / 2;
+
+    evacuate(store, victim, move);
+    store->stats.compactions += move;
+  }
+
+  return 0;
+}
+
+/**
+ * Create a store keeping its segments in dir, using up to budget bytes of
+ * disk
+ *
+ * The budget is counted in whole segments, at least two; one more is open
+ * while another is reclaimed into it, until the writer is done with that.
+ *
+ * Returns NULL on error.
+ */
+struct segstore *segstore_create(char *dir, long budget) {
+  struct segstore *store = calloc(1, sizeof *store);
+  int nsegs = budget / SEGSTORE_SEGMENT_SIZE;
+
+  if (store == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+
+  store->nsegs = (nsegs > MIN_SEGMENTS ? nsegs : MIN_SEGMENTS) + 1;
+  store->nbuckets = MIN_BUCKETS;
+  pthread_mutex_init(&store->lock, NULL);
+  pthread_cond_init(&store->work, NULL);
+  pthread_cond_init(&store->idle, NULL);
+
+  if ((store->dir = strdup(dir)) == NULL ||
+      (store->segs = calloc(store->nsegs, sizeof *store->segs)) == NULL ||
+      (store->buckets = calloc(store->nbuckets, sizeof *store->buckets)) ==
+          NULL) {
+    perror("calloc");
+    segstore_free(store);
+    return NULL;
+  }
+
+  for (int i = 0; i < store->nsegs; i++) {
+    store->segs[i].fd = -1;
+  }
+
+  // Find out now if dir is no good
+  if (open_segment(store, 0) < 0) {
+    segstore_free(store);
+    return NULL;
+  }
+  store->active = 0;
+
+  if (pthread_create(&store->writer, NULL, writer, store) != 0) {
+    fprintf(stderr, "segstore: cannot start writer thread\n");
+    segstore_free(store);
+    return NULL;
+  }
+  store->started = 1;
+
+  return store;
+}
+
+/* Wait for the writer to finish everything queued so far */
+void segstore_flush(struct segstore *store) {
+  pthread_mutex_lock(&store->lock);
+  while (store->head != NULL || store->busy) {
+    pthread_cond_wait(&store->idle, &store->lock);
+  }
+  pthread_mutex_unlock(&store->lock);
+
+  reap(store);
+}
+
+/* Finish the writes queued, then close everything */
+void segstore_free(struct segstore *store) {
+  struct hlist_node *n, *next;
+
+  if (store->started) {
+    pthread_mutex_lock(&store->lock);
+    store->stopping = 1;
+    pthread_cond_signal(&store->work);
+    pthread_mutex_unlock(&store->lock);
+
+    pthread_join(store->writer, NULL);
+    reap(store);
+  }
+
+  for (int i = 0; store->buckets != NULL && i < store->nbuckets; i++) {
+    HLIST_FOR_EACH(n, next, &store->buckets[i]) {
+      free(container_of(n, struct slot, node));
+    }
+  }
+  for (int i = 0; store->segs != NULL && i < store->nsegs; i++) {
+    if (store->segs[i].fd >= 0) {
+      close_segment(store, i);
+    }
+  }
+
+  pthread_mutex_destroy(&store->lock);
+  pthread_cond_destroy(&store->work);
+  pthread_cond_destroy(&store->idle);
+  free(store->buckets);
+  free(store->segs);
+  free(store->dir);
+  free(store);
+}
+
+/**
+ * Store an entry, in place of any stored under path
+ *
+ * The record is copied and written by the writer; if that fails, the entry
+ * is dropped then. Return 0, or -1 if it is too big, there's no room for
+ * it, or the writer is too far behind.
+ */
+int segstore_put(struct segstore *store, char *path, char *content_type,
+                 void *content, int content_length, uint64_t version) {
+  struct record r = {0, strlen(path), strlen(content_type), content_length,
+                     version};
+  uint32_t len = sizeof r + r.path_len + 1 + r.type_len + 1 + content_length;
+  struct slot *slot;
+  struct job *job;
+  char *p;
+
+  r.size = (len + ALIGN - 1) & ~(ALIGN - 1);
+  if (r.size > SEGSTORE_MAX_RECORD) {
+    return -1;
+  }
+
+  segstore_delete(store, path); // Reaps too
+
+  if (store->queued + r.size > MAX_QUEUED) {
+    return -1;
+  }
+
+  // A new segment has room: at most half of it is copied forward
+  if (store->segs[store->active].used + r.size > SEGSTORE_SEGMENT_SIZE &&
+      next_segment(store) < 0) {
+    return -1;
+  }
+
+  slot = malloc(sizeof *slot);
+  job = malloc(sizeof *job);
+  p = malloc(r.size);
+  if (slot == NULL || job == NULL || p == NULL) {
+    perror("malloc");
+    free(slot);
+    free(job);
+    free(p);
+    return -1;
+  }
+
+  *job = (struct job){.slot = slot,
+                      .seg = store->active,
+                      .fd = store->segs[store->active].fd,
+                      .offset = reserve(store, r.size),
+                      .size = r.size,
+                      .data = p,
+                      .copied = 1};
+
+  memcpy(p, &r, sizeof r);
+  memcpy(record_path((struct record *)p), path, r.path_len + 1);
+  memcpy(record_type((struct record *)p), content_type, r.type_len + 1);
+  memcpy(record_content((struct record *)p), content, content_length);
+  memset(p + len, 0, r.size - len);
+
+  slot->hash = hash_path(path, r.path_len);
+  slot->seg = store->active;
+  slot->offset = job->offset;
+  slot->size = r.size;
+  slot->job = job;
+  hlist_add_head(&store->buckets[slot->hash & (store->nbuckets - 1)],
+                 &slot->node);
+  hlist_add_head(&store->segs[store->active].slots, &slot->seg_node);
+
+  store->queued += r.size;
+  queue(store, job);
+
+  if (++store->stats.entries > store->nbuckets) {
+    grow_index(store);
+  }
+  return 0;
+}
+
+/**
+ * Find the entry stored under path
+ *
+ * The content type and content point into the segment, or the record's
+ * copy while it waits for the writer, and stay valid until the next call
+ * into the store. Returns 0, or -1 if there is none.
+ */
+int segstore_get(struct segstore *store, char *path, char **content_type,
+                 void **content, int *content_length, uint64_t *version) {
+  int len = strlen(path);
+  struct slot *slot;
+  struct record *r;
+
+  reap(store);
+  if ((slot = find(store, path, len, hash_path(path, len))) == NULL) {
+    return -1;
+  }
+
+  r = slot_record(store, slot);
+  *content_type = record_type(r);
+  *content = record_content(r);
+  *content_length = r->content_len;
+  *version = r->version;
+  store->stats.hits++;
+  return 0;
+}
+
+/**
+ * Drop the entry stored under path
+ *
+ * Return 0, or -1 if there was none.
+ */
+int segstore_delete(struct segstore *store, char *path) {
+  int len = strlen(path);
+  struct slot *slot;
+
+  reap(store);
+  if ((slot = find(store, path, len, hash_path(path, len))) == NULL) {
+    return -1;
+  }
+  drop(store, slot);
+  return 0;
+}
+
+/* Fill in the store's counters and sizes */
+void segstore_stats(struct segstore *store, struct segstore_stats *stats) {
+  long bytes = 0;
+
+  reap(store);
+
+  for (int i = 0; i < store->nsegs; i++) {
+    if (store->segs[i].fd >= 0) {
+      bytes += store->segs[i].live;
+    }
+  }
+
+  *stats = store->stats;
+  stats->bytes = bytes;
+}
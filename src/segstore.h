@@ -0,0 +1,33 @@
+#ifndef _SEGSTORE_H_
+#define _SEGSTORE_H_
+
+#include <stdint.h>
+
+#define SEGSTORE_SEGMENT_SIZE (16 << 20) // Bytes per segment file
+#define SEGSTORE_MAX_RECORD (SEGSTORE_SEGMENT_SIZE / 2) // Largest entry kept
+
+// Counters and sizes reported by segstore_stats()
+struct segstore_stats {
+  unsigned long hits;
+  unsigned long compactions; // Segments emptied by copying forward
+  unsigned long drops;       // Entries lost with a mostly-live segment
+  int entries;
+  long bytes;      // Record bytes still indexed
+  long disk_bytes; // Segments in use
+};
+
+struct segstore;
+
+extern struct segstore *segstore_create(char *dir, long budget);
+extern void segstore_free(struct segstore *store);
+extern void segstore_flush(struct segstore *store);
+extern int segstore_put(struct segstore *store, char *path, char *content_type,
+                        void *content, int content_length, uint64_t version);
+extern int segstore_get(struct segstore *store, char *path,
+                        char **content_type, void **content,
+                        int *content_length, uint64_t *version);
+extern int segstore_delete(struct segstore *store, char *path);
+extern void segstore_stats(struct segstore *store,
+                           struct segstore_stats *stats);
+
+#endif
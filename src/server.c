@@ -5,6 +5,8 @@
  *
  *    curl -D - http://localhost:3490/
  *    curl -D - http://localhost:3490/d20
+ *    curl -D - http://localhost:3490/metrics
+ *    curl -D - http://localhost:3490/admin/cache
  *    curl -D - http://localhost:3490/date
  *
  * You can also test the above URLs in your browser! They should work!
@@ -15,24 +17,75 @@
  * http://localhost:3490/save
  *
  * (Posting data is harder to test from a browser.)
+ *
+ * HTTPS, once `make cert` has made a self-signed certificate:
+ *
+ *    curl -k -D - https://localhost:3491/
+ *
+ * HTTP/2, with prior knowledge, by upgrading, or over HTTPS:
+ *
+ *    curl -D - --http2-prior-knowledge http://localhost:3490/ \
+ *        http://localhost:3490/d20
+ *    curl -D - --http2 http://localhost:3490/
+ *    curl -k -D - --http2 https://localhost:3491/
+ *
+ * Reverse proxying, to the stand-in upstream in bench/ for instance. Paths
+ * the server has no answer for go to the upstreams in UPSTREAMS:
+ *
+ *    make bench/upstream && ./bench/upstream 3500 &
+ *    echo localhost:3500 > upstreams.conf    (then start the server)
+ *    curl -D - http://localhost:3490/hello
+ *    curl -D - -d 'Hello, upstream!' http://localhost:3490/echo
+ *
+ * Virtual hosts, once VHOSTS lists them (see vhost.c); other hosts get
+ * SERVER_ROOT:
+ *
+ *    echo 'example.test ./serverroot ./serverfiles 4M' > vhosts.conf
+ *    curl -D - -H 'Host: example.test' http://localhost:3490/
+ *
+ * Upgrading:
+ *
+ *    Start the new binary while the old one runs. It takes over the
+ *    listening sockets through UPGRADE_SOCKET, and the old process finishes
+ *    its open connections and exits.
  */
 
+#include "accesslog.h"
+#include "admission.h"
+#include "body.h"
+#include "bufpool.h"
 #include "cache.h"
+#include "conn.h"
+#include "fdcache.h"
+#include "h2.h"
+#include "httpdate.h"
 #include "file.h"
+#include "metrics.h"
 #include "mime.h"
 #include "net.h"
+#include "proxy.h"
+#include "router.h"
+#include "segstore.h"
+#include "tls.h"
+#include "trace.h"
+#include "upgrade.h"
+#include "vhost.h"
+#include "wal.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/file.h>
+#include <strings.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -40,6 +93,30 @@
 #define PORT "3490" // the port users will be connecting to
 #define SERVER_FILES "./serverfiles"
 #define SERVER_ROOT "./serverroot"
+#define FDCACHE_SIZE 256                 // open files kept under each root
+#define VHOSTS "vhosts.conf"             // per-host sites, if it exists
+#define VHOST_CACHE_ENTRIES 1024         // per site, within its byte quota
+#define CACHE_MAX_ENTRY_SIZE (1 << 20)   // larger files are sendfile()d
+#define CACHE_DISK "./cachedir"          // second cache tier, if it exists
+#define CACHE_DISK_BUDGET (1L << 30)     // bytes of segments it may fill
+#define SAVE_LOG "data.txt"              // where POST /save bodies are appended
+#define SAVE_LOG_SYNC WAL_SYNC_INTERVAL  // none, interval or every batch
+#define SAVE_LOG_SYNC_INTERVAL_MS 1000   // for WAL_SYNC_INTERVAL
+#define ACCESS_LOG "access.log"         // one line per request
+#define ACCESS_LOG_MAX_BYTES (64 << 20)  // rotate at this size
+#define ACCESS_LOG_MAX_AGE (24 * 3600)   // or after this many seconds
+#define METRICS_BUFFER_SIZE (64 * 1024)  // room for a /metrics response
+#define CACHE_HOT_KEYS 16                // keys tracked for /admin/cache
+#define STATS_BUFFER_SIZE (128 * 1024)   // room for an /admin/cache response
+#define MAX_INFLIGHT 1024                // expensive requests being answered
+#define UPGRADE_SOCKET "webserver.sock"  // where a new binary takes over
+#define TLS_PORT "3491"                  // HTTPS, if TLS_CERT exists
+#define TLS_CERT "server.crt"            // PEM certificate chain (make cert)
+#define TLS_KEY "server.key"             // and its private key
+#define UPSTREAMS "upstreams.conf"       // host:port lines to proxy to, if it exists
+#define PROXY_CACHE 1                    // keep cacheable upstream responses
+#define D20_CACHE_TTL_MS 100             // /d20 answers are reused this long
+#define D20_CACHE_STALE_MS 1000          // then served stale while recomputed
 // /**
 //  * Handle SIGCHILD signal
 //  *
@@ -84,58 +161,291 @@
 //   }
 // }
 
+// State shared by every request
+struct server {
+  struct cache *cache; // The default site's, handed over on upgrade
+  struct vhosts *vhosts;
+  struct router *router;
+  struct accesslog *accesslog;
+  struct admission admission;
+  struct upgrade *upgrade;
+  struct proxy *proxy; // NULL without upstreams
+  int draining;        // A new process has taken over
+
+  struct wal *wal; // NULL until the previous process has let go of it
+  struct conn_watch wal_watch;            // For its acks
+  struct request *save_queue, *save_tail; // Uploads waiting for it
+  int uploads;                            // Uploads using it
+  uint32_t next_entry;                    // Id for the next one's entry
+  struct conn_loop *loop;
+};
+
+/* Status lines, preformatted with their line ending */
+#define STATUS_LINE(code, reason)                                              \
+  { code, "HTTP/1.1 " #code " " reason "\r\n",                                \
+    sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1 }
+
+struct status_line {
+  int status;
+  char *line;
+  int len;
+};
+
+static struct status_line status_lines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(500, "Internal Server Error"),
+    STATUS_LINE(502, "Bad Gateway"),
+    STATUS_LINE(504, "Gateway Timeout"),
+};
+
+/* Fixed header text around the per-response values */
+#define FRAGMENT(s) s, sizeof(s) - 1
+
+/* Copy n bytes to p and return the end of the copy */
+static char *append(char *p, char *s, int n) {
+  memcpy(p, s, n);
+  return p + n;
+}
+
+/* Write a non-negative number in decimal, returning the end of it */
+static char *append_number(char *p, long n) {
+  char digits[24];
+  int i = sizeof digits;
+
+  do {
+    digits[--i] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+
+  return append(p, digits + i, sizeof digits - i);
+}
+
+/**
+ * Format the response header
+ *
+ * Assembled from the preformatted status line, the cached Date value and
+ * fixed fragments; only Content-Length is formatted per response. buf
+ * needs room for 256 bytes plus the content type.
+ *
+ * Return the length of the header written into buf.
+ */
+int format_header(char *buf, int status, char *content_type,
+                  long content_length, int keep_alive) {
+  struct status_line *sl = &status_lines[0];
+  char *p = buf;
+
+  for (unsigned int i = 0; i < sizeof status_lines / sizeof status_lines[0];
+       i++) {
+    if (status_lines[i].status == status) {
+      sl = &status_lines[i];
+      break;
+    }
+  }
+
+  p = append(p, sl->line, sl->len);
+  p = append(p, FRAGMENT("Date: "));
+  p = append(p, httpdate_get(), HTTPDATE_LEN);
+  if (keep_alive) {
+    p = append(p, FRAGMENT("\r\nConnection: keep-alive\r\nContent-Length: "));
+  } else {
+    p = append(p, FRAGMENT("\r\nConnection: close\r\nContent-Length: "));
+  }
+  p = append_number(p, content_length);
+  p = append(p, FRAGMENT("\r\nContent-Type: "));
+  p = append(p, content_type, strlen(content_type));
+  p = append(p, FRAGMENT("\r\n\r\n"));
+
+  return p - buf;
+}
+
+/**
+ * Whether the connection can take another request after this response
+ */
+static int keep_alive(struct request *req) {
+  // An unread body would be mistaken for the next request
+  if (req->body_unread || conn_draining(req->conn)) {
+    req->keep_alive = 0;
+  }
+  return req->keep_alive;
+}
+
+/**
+ * The header fields of an HTTP/2 response besides :status and
+ * content-length
+ */
+static struct h2_field *h2_fields(struct h2_field *fields,
+                                  char *content_type) {
+  fields[0] = (struct h2_field){"date", httpdate_get(), 1};
+  fields[1] = (struct h2_field){"content-type", content_type, 1};
+  return fields;
+}
+
 /**
  * Send an HTTP response
  *
- * header:       "HTTP/1.1 404 NOT FOUND" or "HTTP/1.1 200 OK", etc.
+ * status:       404, 200, etc.
  * content_type: "text/plain", etc.
  * body:         the data to send.
  *
- * Return the value from the send() function.
+ * Return the number of bytes sent or queued, or -1 on error.
+ */
+int send_response(struct request *req, int status, char *content_type,
+                  void *body, int content_length) {
+  char response[1024];
+  uint64_t start = metrics_now();
+  int rv;
+
+  if (req->cache_key != NULL && status == 200) {
+    cache_put_swr(req->vhost->cache, req->cache_key, content_type, body,
+                  content_length, req->route->cache.ttl_ms,
+                  req->route->cache.stale_ms);
+    req->cache_key = NULL;
+  }
+
+  if (req->stream != NULL) {
+    struct h2_field fields[2];
+
+    rv = h2_respond(req->stream, status, h2_fields(fields, content_type), 2,
+                    body, content_length);
+  } else {
+    // !!!!  IMPLEMENT ME
+    int response_length = format_header(response, status, content_type,
+                                        content_length, keep_alive(req));
+
+    // Send it all, without copying the body behind the header
+    struct iovec iov[2] = {{response, response_length},
+                           {body, content_length}};
+    rv = conn_send(req->conn, iov, 2, 0);
+  }
+
+  metrics_status(&req->metrics, status);
+  metrics_bytes(0, rv);
+  accesslog_response(&req->log, status, rv);
+  TRACE3(send_done, req->fd, status, rv);
+  metrics_phase(PHASE_SEND, start);
+
+  return rv;
+}
+
+/**
+ * Send an HTTP response whose body is read straight from an open file
+ *
+ * The file is sent with sendfile() from offset 0 without touching the fd's
+ * own offset, so cached fds can be shared. On HTTP/2 it goes out a frame
+ * at a time.
+ *
+ * Return 0, or -1 on error.
+ */
+int send_response_file(struct request *req, int status, char *content_type,
+                       int filefd, off_t content_length) {
+  char response[1024];
+  uint64_t start = metrics_now();
+  int response_length;
+
+  metrics_status(&req->metrics, status);
+  accesslog_response(&req->log, status, 0);
+
+  if (req->stream != NULL) {
+    struct h2_field fields[2];
+
+    response_length =
+        h2_respond_file(req->stream, status, h2_fields(fields, content_type),
+                        2, filefd, content_length);
+  } else {
+    struct iovec iov = {response, 0};
+
+    response_length = format_header(response, status, content_type,
+                                    content_length, keep_alive(req));
+    iov.iov_len = response_length;
+
+    if (conn_send(req->conn, &iov, 1, MSG_MORE) < 0 ||
+        conn_sendfile(req->conn, filefd, 0, content_length) < 0) {
+      response_length = -1;
+    }
+  }
+
+  if (response_length < 0) {
+    TRACE3(send_done, req->fd, status, -1);
+    return -1;
+  }
+
+  metrics_bytes(0, response_length + content_length);
+  accesslog_response(&req->log, status, response_length + content_length);
+  TRACE3(send_done, req->fd, status, response_length + content_length);
+  metrics_phase(PHASE_SEND, start);
+
+  return 0;
+}
+
+/* Refusal sent when shedding load; prebuilt so it costs next to nothing.
+ * 5xx responses may leave out Date. */
+#define SHED_RESPONSE(connection)                                              \
+  "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\n"                     \
+  "Connection: " connection "\r\nContent-Length: 0\r\n\r\n"
+
+static char shed_keep_alive[] = SHED_RESPONSE("keep-alive");
+static char shed_close[] = SHED_RESPONSE("close");
+
+/**
+ * Send a 503 to a request we won't take on now
  */
-int send_response(int fd, char *header, char *content_type, void *body,
-                  int content_length) {
-  const int max_response_size = 65536;
-  char response[max_response_size];
+static void shed(struct request *req) {
+  struct iovec iov = {shed_close, sizeof shed_close - 1};
+  int rv;
 
-  // !!!!  IMPLEMENT ME
-  time_t rawtime;
-  struct tm *info;
+  if (req->stream != NULL) {
+    struct h2_field retry_after = {"retry-after", "1", 0};
 
-  info = localtime(&rawtime);
+    rv = h2_respond(req->stream, 503, &retry_after, 1, NULL, 0);
+  } else {
+    if (keep_alive(req)) {
+      iov.iov_base = shed_keep_alive;
+      iov.iov_len = sizeof shed_keep_alive - 1;
+    }
+    rv = conn_send(req->conn, &iov, 1, 0);
+  }
 
-  int response_length =
-      sprintf(response,
-              "%s\n"
-              "Date: %s"
-              "Connection: close\n"
-              "Content-Length: %d\n"
-              "Content-Type: %s\n"
-              "\n",
-              header, asctime(info), content_length, content_type);
-  memcpy(response + response_length, body, content_length);
-  // Send it all!
-  int rv = send(fd, response, response_length + content_length, 0);
+  metrics_status(&req->metrics, 503);
+  metrics_bytes(0, rv);
+  accesslog_response(&req->log, 503, rv);
+  TRACE3(send_done, req->fd, 503, rv);
+}
 
-  if (rv < 0) {
-    perror("send");
+/**
+ * Take an in-flight slot for an expensive request, or shed it
+ *
+ * Return 1 if the request may go ahead.
+ */
+static int admit(struct request *req) {
+  if (!admission_admit(&req->server->admission,
+                       metrics_now() - req->ready_ns)) {
+    shed(req);
+    return 0;
   }
 
-  return rv;
+  req->admitted = 1;
+  return 1;
 }
 
 /**
  * Send a 404 response
  */
-void resp_404(int fd) {
+void resp_404(struct request *req) {
   char filepath[4096];
   struct file_data *filedata;
   char *mime_type;
 
-  // Fetch the 404.html file
-  snprintf(filepath, sizeof filepath, "%s/404.html", SERVER_FILES);
+  // Fetch the site's 404.html file, or the server's
+  snprintf(filepath, sizeof filepath, "%s/404.html", req->vhost->files);
   filedata = file_load(filepath);
 
+  if (filedata == NULL) {
+    snprintf(filepath, sizeof filepath, "%s/404.html", SERVER_FILES);
+    filedata = file_load(filepath);
+  }
+
   if (filedata == NULL) {
     fprintf(stderr, "Cannot find system 404 file\n");
     exit(3);
@@ -143,8 +453,7 @@ void resp_404(int fd) {
 
   mime_type = mime_type_get(filepath);
 
-  send_response(fd, "HTTP/1.1 404 NOT FOUND", mime_type, filedata->data,
-                filedata->size);
+  send_response(req, 404, mime_type, filedata->data, filedata->size);
 
   file_free(filedata);
 }
@@ -152,16 +461,14 @@ void resp_404(int fd) {
 /**
  * Send a /d20 endpoint response
  */
-void get_d20(int fd) {
+void get_d20(struct request *req) {
   // !!!! IMPLEMENT ME
-  srand(time(NULL) + getpid());
-
   char str[8];
 
   int random = rand() % 20 + 1;
   int length = sprintf(str, "%d\n", random);
 
-  send_response(fd, "HTTP/1.1 200 OK", "text/plain", str, length);
+  send_response(req, 200, "text/plain", str, length);
 }
 
 /**
@@ -178,222 +485,964 @@ void get_d20(int fd) {
 //   send_response(fd, "HTTP/1.1 200 OK", "text/plain", current, length);
 // }
 
+// A /save body on its way into the append log, as one entry
+struct upload {
+  struct wal_record rec; // Its latest record
+  struct server *server;
+  struct request *req; // NULL once the request has given up
+  int flags;           // For its next record
+  int pending;         // rec has not been acked yet
+  int committed;       // The record ending the entry has gone in
+  char *buf;           // What the writer may still be reading, taken from
+  int pipefd[2];       // a request that gave up while rec was pending
+};
+
 /**
- * Post /save endpoint data
+ * Let go of the append log once no upload needs it any more, if a new
+ * process is waiting for it
  */
-void post_save(int fd, char *body) {
+static void release_log(struct server *server) {
+  if (server->draining && server->uploads == 0 && server->wal != NULL) {
+    conn_unwatch(server->loop, &server->wal_watch);
+    wal_close(server->wal);
+    server->wal = NULL;
+    upgrade_release(server->upgrade);
+  }
+}
+
+static void free_upload(struct upload *up) {
+  struct server *server = up->server;
+
+  bufpool_put(up->buf);
+  if (up->pipefd[0] >= 0) {
+    close(up->pipefd[0]);
+    close(up->pipefd[1]);
+  }
+  free(up);
+
+  server->uploads--;
+  release_log(server);
+}
+
+/* An upload's record is in the log: carry on with its request */
+static void upload_acked(struct wal_record *rec) {
+  struct upload *up =
+      (struct upload *)((char *)rec - offsetof(struct upload, rec));
+
+  up->pending = 0;
+  if (up->req != NULL) {
+    conn_wake(up->req);
+  } else {
+    free_upload(up);
+  }
+}
+
+/* Give the append log the next of a request's records */
+static int upload_record(struct upload *up, void *data, int pipefd,
+                         int size, int flags) {
+  struct wal *wal = up->server->wal;
+  int rv = pipefd >= 0 ? wal_append_pipe(wal, &up->rec, pipefd, size, flags)
+                       : wal_append(wal, &up->rec, data, size, flags);
+
+  if (rv == 0) {
+    up->flags = 0;
+    up->pending = 1;
+  }
+  return rv;
+}
+
+/* Body sink callbacks that feed the append log
+ *
+ * The data is not copied, so the body reader must wait until it is in.
+ */
+int save_write(void *arg, void *data, int size) {
+  struct upload *up = arg;
+
+  return upload_record(up, data, -1, size, up->flags) < 0 ? -1 : BODY_AGAIN;
+}
+
+int save_splice(void *arg, int pipefd, int size) {
+  struct upload *up = arg;
+
+  return upload_record(up, NULL, pipefd, size, up->flags) < 0 ? -1
+                                                              : BODY_AGAIN;
+}
+
+static struct upload *start_upload(struct request *req) {
+  struct server *server = req->server;
+  struct upload *up = malloc(sizeof *up);
+
+  if (up == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+
+  up->rec.frame.entry = server->next_entry++;
+  up->rec.done = upload_acked;
+  up->rec.status = 0;
+  up->server = server;
+  up->req = req;
+  up->flags = WAL_FIRST;
+  up->pending = up->committed = 0;
+  up->buf = NULL;
+  up->pipefd[0] = up->pipefd[1] = -1;
+
+  req->upload = up;
+  server->uploads++;
+  return up;
+}
+
+/**
+ * A request has given up on its upload
+ *
+ * If the writer may still be reading its buffer or pipe, those are kept
+ * until the record is in.
+ */
+static void abandon_upload(struct request *req) {
+  struct upload *up = req->upload;
+
+  req->upload = NULL;
+  if (!up->pending) {
+    free_upload(up);
+    return;
+  }
+
+  up->req = NULL;
+  up->buf = req->buf;
+  req->buf = NULL;
+  up->pipefd[0] = req->body.pipefd[0];
+  up->pipefd[1] = req->body.pipefd[1];
+  req->body.pipefd[0] = req->body.pipefd[1] = -1;
+}
+
+/**
+ * Take an upload that has given up out of the queue
+ *
+ * Only HTTP/2 uploads can: their streams may be reset while they wait.
+ */
+static void unqueue_upload(struct server *server, struct request *req) {
+  struct request **p = &server->save_queue, *prev = NULL;
+
+  while (*p != NULL && *p != req) {
+    prev = *p;
+    p = &(*p)->next;
+  }
+  if (*p != NULL) {
+    *p = req->next;
+    if (server->save_tail == req) {
+      server->save_tail = prev;
+    }
+  }
+}
+
+/**
+ * Stream a /save body into the append log as far as the input allows
+ *
+ * Each record goes to the log's writer thread, and the request is paused
+ * until that has written it, along with whatever other uploads queued
+ * meanwhile. Their records may be interleaved in the log, so each upload
+ * is an entry of its own.
+ */
+static void save_body(struct request *req) {
+  struct server *server = req->server;
+  struct upload *up = req->upload;
   char *status;
+  long long n;
 
-  // !!!! IMPLEMENT ME
-  int file = open("data.txt", O_CREAT | O_WRONLY | O_APPEND, 0644);
+  if (up == NULL && req->aborted) {
+    unqueue_upload(server, req);
+    return;
+  }
+  if (up == NULL && server->wal == NULL) {
+    req->resume = save_body; // Woken while still waiting for the log
+    conn_pause(req);
+    return;
+  }
+  if (up == NULL && (up = start_upload(req)) == NULL) {
+    send_response(req, 500, "text/plain", "Internal server error\n", 22);
+    return;
+  }
+  if (req->aborted) {
+    abandon_upload(req);
+    return;
+  }
 
-  // lseek(file, SEEK_SET, SEEK_DATA);
+  struct body_sink sink = {save_write, save_splice, up};
+
+  if (up->pending) {
+    n = BODY_AGAIN; // Woken early
+  } else if (up->rec.status < 0) {
+    n = -1;
+  } else if (up->committed) {
+    n = req->body.total;
+  } else {
+    n = body_stream(&req->body, &sink);
+  }
+
+  // Only a whole body is committed; what a failed or aborted one logged is
+  // an entry that never ends, which readers skip
+  if (n >= 0 && !up->committed) {
+    up->committed = 1;
+    n = upload_record(up, NULL, -1, 0, up->flags | WAL_LAST) < 0 ? -1
+                                                                  : BODY_AGAIN;
+  }
+
+  if (n == BODY_AGAIN) {
+    req->resume = save_body;
+    if (up->pending) {
+      conn_pause(req);
+    }
+    return;
+  }
 
-  // int bytes_written = write(file, buffer, size);
-  // if (bytes_written < 0)
-  // {
-  //   perror("write");
-  // }
-  if (file < 0) {
+  req->upload = NULL;
+  free_upload(up);
+
+  // The part of the body already in the request buffer was counted with it
+  if (n < 0) {
     status = "failed";
   } else {
-    flock(file, LOCK_EX);
-    write(file, body, strlen(body));
-    flock(file, LOCK_UN);
-    close(file);
     status = "ok";
+    metrics_bytes(n - (req->buf_len - req->body_offset), 0);
+
+    // Whatever the reader took past the body is the next request
+    req->body_unread = 0;
+    req->body_offset = req->body.start;
+    req->buf_len = req->body.end;
   }
 
   char response_body[128];
   int length = sprintf(response_body, "{\"status\": \"%s\"}\n", status);
 
-  send_response(fd, "HTTP/1.1 200 OK", "application/json", response_body,
-                length);
-  // Save the body and send a response
+  send_response(req, 200, "application/json", response_body, length);
 }
 
-int get_file_or_cache(int fd, struct cache *cache, char *filepath) {
-  struct file_data *filedata;
-  struct cache_entry *cacheent;
-  char *mime_type;
+/* Wait for the append log, until the previous process lets go of it */
+static void queue_upload(struct server *server, struct request *req) {
+  req->resume = save_body;
+  req->next = NULL;
+  conn_pause(req);
 
-  cacheent = cache_get(cache, filepath);
+  if (server->save_tail == NULL) {
+    server->save_queue = req;
+  } else {
+    server->save_tail->next = req;
+  }
+  server->save_tail = req;
+}
 
-  if (cacheent != NULL) {
-    send_response(fd, "HTTP/1.1 200 OK", cacheent->content_type,
-                  cacheent->content, cacheent->content_length);
+/**
+ * Post /save endpoint data
+ *
+ * The body is streamed into the append log as it arrives, one buffer at a
+ * time, as one entry whose last record only goes in once the body is
+ * complete; the response waits until that is durable under SAVE_LOG_SYNC.
+ *
+ * The request buffer is reused as the I/O buffer.
+ */
+void post_save(struct request *req) {
+  struct server *server = req->server;
+
+  if (body_reader_init(&req->body, req->fd, req->buf, req->buf_size,
+                       &req->head, req->body_offset, req->buf_len) < 0) {
+    send_response(req, 400, "text/plain", "Bad request body\n", 17);
+    return;
+  }
+
+  // The log has gone to the new process; the client can retry there
+  if (server->draining && server->wal == NULL) {
+    shed(req);
+    return;
+  }
+
+  if (server->wal == NULL) {
+    queue_upload(server, req);
+    return;
+  }
+
+  save_body(req);
+}
+
+/**
+ * Carry on with a request's exchange with its upstream
+ *
+ * The upstream's response goes straight to the client; only a failure
+ * before any of it came is answered here.
+ */
+static void relay(struct request *req) {
+  long long bytes;
+  int status, rv = proxy_run(req, &status, &bytes);
+
+  if (rv == PROXY_AGAIN) {
+    req->resume = relay;
+    return;
+  }
+
+  if (req->aborted) {
+    return;
+  }
+
+  if (rv == PROXY_BAD_GATEWAY) {
+    send_response(req, 502, "text/plain", "Bad gateway\n", 12);
+  } else if (rv == PROXY_TIMEOUT) {
+    send_response(req, 504, "text/plain", "Gateway timeout\n", 16);
   } else {
-    filedata = file_load(filepath);
-    if (filedata == NULL) {
-      return -1;
-    }
+    metrics_status(&req->metrics, status);
+    metrics_bytes(0, bytes);
+    accesslog_response(&req->log, status, bytes);
+    TRACE3(send_done, req->fd, status, bytes);
+  }
+}
 
-    mime_type = mime_type_get(filepath);
-    send_response(fd, "HTTP/1.1 200 OK", mime_type, filedata->data,
-                  filedata->size);
+/**
+ * Pass a request on to an upstream
+ *
+ * The request body streams upstream as it arrives, through the request
+ * buffer as post_save() does.
+ */
+static void pass_upstream(struct request *req) {
+  if (body_reader_init(&req->body, req->fd, req->buf, req->buf_size,
+                       &req->head, req->body_offset, req->buf_len) < 0) {
+    send_response(req, 400, "text/plain", "Bad request body\n", 17);
+    return;
+  }
 
-    cache_put(cache, filepath, mime_type, filedata->data, filedata->size);
+  metrics_route(&req->metrics, ROUTE_PROXY);
 
-    file_free(filedata);
+  if (proxy_start(req->server->proxy, req,
+                  PROXY_CACHE ? req->vhost->cache : NULL) < 0) {
+    send_response(req, 502, "text/plain", "Bad gateway\n", 12);
+    return;
   }
 
-  return 0;
+  relay(req);
 }
 
-void get_file(int fd, struct cache *cache, char *request_path) {
-  char filepath[65536];
+/**
+ * Answer a request for something the server doesn't have: from the
+ * upstreams if there are any, otherwise with a 404
+ */
+static void not_found(struct request *req) {
+  if (req->server->proxy != NULL) {
+    pass_upstream(req);
+  } else {
+    resp_404(req);
+  }
+}
+
+/* Look up a request path in the fd cache: the file, or else the
+ * directory's index.html
+ */
+static struct fdcache_entry *find_file(struct fdcache *fdcache, char *path) {
+  char index_path[REQUEST_PATH_MAX + 16];
+  struct fdcache_entry *fe = fdcache_open(fdcache, path);
+
+  if (fe == NULL) {
+    snprintf(index_path, sizeof index_path, "%s/index.html", path);
+    fe = fdcache_open(fdcache, index_path);
+  }
+  return fe;
+}
+
+/**
+ * Send a file under the site's root
+ *
+ * Small files are served from (and loaded into) the cache; anything bigger
+ * than CACHE_MAX_ENTRY_SIZE goes out with sendfile() from the fd cache.
+ * Cache hits are always answered; going to disk has to be admitted. A hit
+ * stands only while the file the path leads to is the version it was
+ * loaded from, as the fd cache sees it every few seconds. An entry with no
+ * version, an upstream's response, stands while there's no file there.
+ */
+void get_file(struct request *req) {
+  struct cache *cache = req->vhost->cache;
+  struct fdcache *fdcache = req->vhost->fdcache;
+  char *request_path = req->path;
+  struct fdcache_entry *fe;
   struct file_data *filedata;
-  char *mime_type;
+  struct cache_entry *cacheent;
+  uint64_t start = metrics_now();
 
-  //     // Try to find the file
-  snprintf(filepath, sizeof(filepath), "%s%s", SERVER_ROOT, request_path);
-  filedata = file_load(filepath);
+  cacheent = cache_get(cache, request_path);
 
-  if (filedata == NULL) {
-    snprintf(filepath, sizeof filepath, "%s%s/index.html", SERVER_ROOT,
-             request_path);
-    filedata = file_load(filepath);
+  if (cacheent != NULL) {
+    fe = find_file(fdcache, request_path);
 
-    if (filedata == NULL) {
-      resp_404(fd);
+    if ((fe != NULL && fe->version == cacheent->version) ||
+        (fe == NULL && cacheent->version == 0)) {
+      metrics_phase(PHASE_CACHE, start);
+      send_response(req, 200, cacheent->content_type, cacheent->content,
+                    cacheent->content_length);
       return;
     }
+    cache_remove(cache, request_path);
   }
 
-  mime_type = mime_type_get(filepath);
-  send_response(fd, "HTTP/1.1 200 OK", mime_type, filedata->data,
-                filedata->size);
+  metrics_phase(PHASE_CACHE, start);
+
+  if (!admit(req)) {
+    return;
+  }
+
+  // Try to find the file, then the directory's index.html
+  start = metrics_now();
+  fe = find_file(fdcache, request_path);
+
+  if (fe == NULL) {
+    metrics_phase(PHASE_FILE, start);
+    not_found(req);
+    return;
+  }
+
+  if (fe->st.st_size > CACHE_MAX_ENTRY_SIZE) {
+    metrics_phase(PHASE_FILE, start);
+    send_response_file(req, 200, fe->content_type, fe->fd, fe->st.st_size);
+    return;
+  }
+
+  filedata = file_load_fd(fe->fd, fe->st.st_size);
+
+  metrics_phase(PHASE_FILE, start);
+
+  if (filedata == NULL) {
+    resp_404(req);
+    return;
+  }
+
+  send_response(req, 200, fe->content_type, filedata->data, filedata->size);
+
+  cache_put_version(cache, request_path, fe->content_type, filedata->data,
+                    filedata->size, fe->version);
 
   file_free(filedata);
 }
 
 /**
- * Search for the start of the HTTP body.
+ * Send a /metrics endpoint response
+ */
+void get_metrics(struct request *req) {
+  char *buf = arena_alloc(&req->arena, METRICS_BUFFER_SIZE);
+  int length;
+
+  if (buf == NULL || (length = metrics_render(buf, METRICS_BUFFER_SIZE)) < 0) {
+    send_response(req, 500, "text/plain", "Cannot render metrics\n", 22);
+  } else {
+    send_response(req, 200, "text/plain; version=0.0.4", buf, length);
+  }
+}
+
+/**
+ * Send an /admin/cache endpoint response: statistics for the site's cache
+ * partition as JSON
+ */
+void get_cache_stats(struct request *req) {
+  struct cache *cache = req->vhost->cache;
+  struct cache_stats stats;
+  struct cache_hot_key hot[CACHE_HOT_KEYS];
+  char *body = arena_alloc(&req->arena, STATS_BUFFER_SIZE);
+  int length, n;
+
+  if (body == NULL) {
+    send_response(req, 500, "text/plain", "Cannot render statistics\n", 25);
+    return;
+  }
+
+  cache_stats(cache, &stats);
+  n = cache_hot_keys(cache, hot, CACHE_HOT_KEYS);
+
+  length = sprintf(body,
+                   "{\"hits\": %lu, \"misses\": %lu, \"insertions\": %lu, "
+                   "\"evictions\": %lu, \"entries\": %d, \"max_entries\": %d, "
+                   "\"bytes\": %ld, \"max_bytes\": %ld, "
+                   "\"avg_entry_size\": %.1f, \"tail_age\": %.3f, "
+                   "\"disk_hits\": %lu, \"disk_entries\": %d, "
+                   "\"disk_bytes\": %ld, \"hot_keys\": [",
+                   stats.hits, stats.misses, stats.insertions, stats.evictions,
+                   stats.entries, cache->max_size, stats.bytes,
+                   cache->max_bytes, stats.avg_entry_size, stats.tail_age,
+                   stats.disk_hits, stats.disk_entries, stats.disk_bytes);
+
+  for (int i = 0; i < n; i++) {
+    length += sprintf(body + length, "%s{\"path\": \"", i > 0 ? ", " : "");
+
+    // Paths come straight from request lines; keep the JSON well formed
+    for (char *c = hot[i].path; *c != '\0'; c++) {
+      if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) {
+        length += sprintf(body + length, "\\u%04x", (unsigned char)*c);
+      } else {
+        body[length++] = *c;
+      }
+    }
+
+    length += sprintf(body + length,
+                      "\", \"count\": %lu, \"error\": %lu, \"cached\": %s}",
+                      hot[i].count, hot[i].error,
+                      hot[i].cached ? "true" : "false");
+  }
+  length += sprintf(body + length, "]}\n");
+
+  send_response(req, 200, "application/json", body, length);
+}
+
+/**
+ * Whether the client means to send another request on this connection
  *
- * The body is after the header, separated from it by a blank line (two newlines
- * in a row).
+ * HTTP/1.1 connections persist unless the client says "close"; HTTP/1.0
+ * ones only if it asks for "keep-alive".
+ */
+static int wants_keep_alive(struct request *req, char *version, int len) {
+  int vlen;
+  char *v = http_head_field(&req->head, req->buf, "Connection", &vlen);
+
+  for (int i = 0; v != NULL && i < vlen; i++) {
+    if (vlen - i >= 5 && strncasecmp(v + i, "close", 5) == 0) {
+      return 0;
+    }
+    if (vlen - i >= 10 && strncasecmp(v + i, "keep-alive", 10) == 0) {
+      return 1;
+    }
+  }
+
+  return len >= 8 && memcmp(version, "HTTP/1.1", 8) == 0;
+}
+
+/**
+ * Parse the request line into req
  *
- * "Newlines" in HTTP can be \r\n (carriage return followed by newline) or \n
- * (newline) or \r (carriage return).
+ * The method is matched in place; only the path is copied out.
+ *
+ * Return 0, or -1 if the line is malformed or the path too long.
  */
-char *find_start_of_body(char *header) {
-  char *start;
+int parse_request_line(struct request *req) {
+  char *line = req->buf;
+  char *eol = line + req->head.line_len;
+  char *sp1, *sp2;
+
+  if ((sp1 = memchr(line, ' ', eol - line)) == NULL ||
+      (sp2 = memchr(sp1 + 1, ' ', eol - sp1 - 1)) == NULL) {
+    return -1;
+  }
 
-  if ((start = strstr(header, "\r\n\r\n")) != NULL) {
-    return start + 2;
-  } else if ((start = strstr(header, "\n\n")) != NULL) {
-    return start + 2;
-  } else if ((start = strstr(header, "\r\r")) != NULL) {
-    return start + 2;
-  } else {
-    return start;
+  req->method = http_method_parse(line, sp1 - line);
+  req->path_len = sp2 - sp1 - 1;
+
+  if (req->path_len == 0 || req->path_len >= REQUEST_PATH_MAX) {
+    return -1;
   }
+
+  memcpy(req->path, sp1 + 1, req->path_len);
+  req->path[req->path_len] = '\0';
+
+  req->keep_alive = wants_keep_alive(req, sp2 + 1, eol - sp2 - 1);
+
+  accesslog_request(&req->log, line, sp1 - line, req->path);
+
+  return 0;
 }
 
 /**
- * Handle HTTP request and send response
+ * Whether the request has a body, going by its framing headers
  */
-void handle_http_request(int fd, struct cache *cache) {
-  const int request_buffer_size = 65536; // 64K
-  char request[request_buffer_size];
-  char *p;
-  char request_type[8];       // GET or POST
-  char request_path[1024];    // /info etc.
-  char request_protocol[128]; // HTTP/1.1
+static int has_body(struct request *req) {
+  int len;
+  char *v = http_head_field(&req->head, req->buf, "Content-Length", &len);
 
-  // Read request
-  int bytes_recvd = recv(fd, request, request_buffer_size - 1, 0);
+  if (v != NULL && !(len == 1 && *v == '0')) {
+    return 1;
+  }
+  return http_head_field(&req->head, req->buf, "Transfer-Encoding", &len) !=
+         NULL;
+}
 
-  if (bytes_recvd < 0) {
-    perror("recv");
+/**
+ * Whether a route is cheap enough to answer even when overloaded
+ *
+ * File requests are admitted by get_file() once they miss the cache, and
+ * requests for micro-cached routes by run_cached().
+ */
+static int priority_route(struct route *route) {
+  return route != NULL &&
+         (route->id == ROUTE_FILE || route->id == ROUTE_METRICS ||
+          route->id == ROUTE_ADMIN || route->cache.ttl_ms > 0);
+}
+
+/**
+ * The micro-cache key for a request: its method and path, then each of
+ * the route's vary fields on a line of its own
+ *
+ * Return the key, allocated from the request's arena, or NULL on error.
+ */
+static char *cache_key(struct request *req, struct route *route) {
+  char *method_end = memchr(req->buf, ' ', req->head.line_len);
+  int method_len = method_end - req->buf;
+  int size = method_len + req->path_len + 2;
+  char *key, *p, *v;
+  int len;
+
+  for (char **f = route->cache.vary; f != NULL && *f != NULL; f++) {
+    v = http_head_field(&req->head, req->buf, *f, &len);
+    size += strlen(*f) + 2 + (v != NULL ? len : 0);
+  }
+
+  if ((key = p = arena_alloc(&req->arena, size)) == NULL) {
+    return NULL;
+  }
+
+  p = append(p, req->buf, method_len);
+  *p++ = ' ';
+  p = append(p, req->path, req->path_len);
+
+  for (char **f = route->cache.vary; f != NULL && *f != NULL; f++) {
+    *p++ = '\n';
+    p = append(p, *f, strlen(*f));
+
+    // A missing field keys differently from an empty one
+    if ((v = http_head_field(&req->head, req->buf, *f, &len)) != NULL) {
+      *p++ = ':';
+      p = append(p, v, len);
+    }
+  }
+  *p = '\0';
+
+  return key;
+}
+
+/**
+ * Answer from the route's micro-cache, or run its handler and keep what it
+ * answers
+ *
+ * Once a response goes stale, the next request computes it anew; requests
+ * coming meanwhile (while an asynchronous handler waits) get the stale one.
+ * So a busy route's handler runs about once per TTL, not once per request.
+ * Cache hits are always answered; running the handler has to be admitted.
+ */
+static void run_cached(struct request *req, struct route *route) {
+  struct cache_entry *ce;
+  uint64_t start = metrics_now();
+  char *key = cache_key(req, route);
+  int refresh = 1;
+
+  ce = key != NULL ? cache_get_swr(req->vhost->cache, key,
+                                   route->cache.ttl_ms, &refresh)
+                   : NULL;
+
+  metrics_phase(PHASE_CACHE, start);
+
+  if (!refresh) {
+    send_response(req, 200, ce->content_type, ce->content,
+                  ce->content_length);
     return;
   }
 
-  // NUL terminate request string
-  request[bytes_recvd] = '\0';
+  if (!admit(req)) {
+    return;
+  }
 
-  p = find_start_of_body(request);
+  req->cache_key = key;
+  route->handler(req);
+}
 
-  char *body = p + 1;
-  // !!!! IMPLEMENT ME
-  // Get the request type and path from the first line
-  // Hint: sscanf()!
-  sscanf(request, "%s %s %s", request_type, request_path, request_protocol);
-  printf("Request: %s %s %s\n", request_type, request_path, request_protocol);
+/**
+ * Handle HTTP request and send response
+ *
+ * Called by the connection loop once the headers are in, and again
+ * whenever a handler waiting in req->resume can go on.
+ */
+void handle_http_request(struct request *req, void *arg) {
+  struct server *server = arg;
+  struct route *route;
+  uint64_t start;
+  char *host;
+  int host_len = 0;
+
+  if (req->resume != NULL) {
+    void (*resume)(struct request *req) = req->resume;
+
+    req->resume = NULL;
+    resume(req);
+  } else {
+    req->server = server;
 
-  // !!!! IMPLEMENT ME (stretch goal)
+    start = metrics_now();
 
-  // !!!! IMPLEMENT ME
-  // call the appropriate handler functions, above, with the incoming data
-  if (strcmp(request_type, "GET") == 0) {
-    if (strcmp(request_path, "/d20") == 0) {
-      get_d20(fd);
-    } else {
-      get_file(fd, cache, request_path);
+    host = http_head_field(&req->head, req->buf, "Host", &host_len);
+    req->vhost = vhosts_lookup(server->vhosts, host, host_len);
+
+    if (parse_request_line(req) < 0) {
+      send_response(req, 400, "text/plain", "Bad request line\n", 17);
+      metrics_end(&req->metrics);
+      accesslog_end(server->accesslog, &req->log);
+      return;
+    }
+
+    if (req->head.error) {
+      // Where a malformed head's body ends can't be trusted either
+      req->keep_alive = 0;
+      send_response(req, 400, "text/plain", "Bad request headers\n", 20);
+      metrics_end(&req->metrics);
+      accesslog_end(server->accesslog, &req->log);
+      return;
     }
-  } else if (strcmp(request_type, "POST") == 0) {
-    if (strcmp(request_path, "/save") == 0) {
-      post_save(fd, body);
+
+    req->body_unread = has_body(req);
+
+    route = router_lookup(server->router, req->method, req->path,
+                          req->path_len);
+    req->route = route;
+
+    metrics_phase(PHASE_PARSE, start);
+    TRACE3(parse_done, req->fd, req->method, req->path);
+
+    admission_observe(&server->admission, start - req->ready_ns, start);
+
+    if (!priority_route(route) && !admit(req)) {
+      metrics_route(&req->metrics, route != NULL ? route->id : ROUTE_OTHER);
+    } else if (route == NULL) {
+      metrics_route(&req->metrics, ROUTE_OTHER);
+      not_found(req);
     } else {
-      resp_404(fd);
+      metrics_route(&req->metrics, route->id);
+      if (route->cache.ttl_ms > 0) {
+        run_cached(req, route);
+      } else {
+        route->handler(req);
+      }
     }
-  } else {
-    fprintf(stderr, "Unknown request type \"%s\"\n", request_type);
-    return;
   }
+
+  if (req->resume == NULL) {
+    if (req->admitted) {
+      admission_done(&server->admission);
+    }
+    metrics_end(&req->metrics);
+    accesslog_end(server->accesslog, &req->log);
+  }
+}
+
+/**
+ * Register the server's endpoints
+ */
+struct router *create_router(void) {
+  struct router *router = router_create();
+
+  if (router == NULL ||
+      router_add(router, METHOD_GET, "/d20", ROUTE_EXACT, get_d20,
+                 ROUTE_D20) < 0 ||
+      router_cache(router, METHOD_GET, "/d20", ROUTE_EXACT, D20_CACHE_TTL_MS,
+                   D20_CACHE_STALE_MS, NULL) < 0 ||
+      router_add(router, METHOD_GET, "/metrics", ROUTE_EXACT, get_metrics,
+                 ROUTE_METRICS) < 0 ||
+      router_add(router, METHOD_GET, "/admin/cache", ROUTE_EXACT,
+                 get_cache_stats, ROUTE_ADMIN) < 0 ||
+      router_add(router, METHOD_POST, "/save", ROUTE_EXACT, post_save,
+                 ROUTE_SAVE) < 0 ||
+      router_add(router, METHOD_GET, "/", ROUTE_PREFIX, get_file,
+                 ROUTE_FILE) < 0) {
+    return NULL;
+  }
+
+  return router;
+}
+
+/**
+ * A new process has taken over; this one is draining
+ */
+static void handed_off(void *arg) {
+  struct server *server = arg;
+
+  server->draining = 1;
+  release_log(server); // Right away, if no upload is using it
+}
+
+/* The append log's writer has acked records */
+static void log_acked(struct conn_watch *w) {
+  struct server *server =
+      (struct server *)((char *)w - offsetof(struct server, wal_watch));
+
+  if (server->wal != NULL) { // Not one that has just been let go
+    wal_reap(server->wal);
+  }
+}
+
+/**
+ * The previous process is done with the append log, or there wasn't one
+ */
+static void log_released(void *arg) {
+  struct server *server = arg;
+
+  server->wal = wal_open(SAVE_LOG, SAVE_LOG_SYNC, SAVE_LOG_SYNC_INTERVAL_MS);
+  server->wal_watch.ready = log_acked;
+
+  if (server->wal == NULL ||
+      conn_watch(server->loop, &server->wal_watch,
+                 wal_event_fd(server->wal)) < 0) {
+    fprintf(stderr, "webserver: fatal error opening %s\n", SAVE_LOG);
+    exit(1);
+  }
+
+  // Let the uploads that were waiting for it in
+  while (server->save_queue != NULL) {
+    struct request *req = server->save_queue;
+
+    server->save_queue = req->next;
+    conn_wake(req);
+  }
+  server->save_tail = NULL;
 }
-char *get_in_addr(const struct sockaddr *sa, char *s, size_t maxlen);
+
 /**
  * Main
  */
 int main(void) {
-  int newfd; // listen on sock_fd, new connection on newfd
-  struct sockaddr_storage their_addr; // connector's address information
-  char s[INET6_ADDRSTRLEN];
-
   // Start reaping child processes
   // start_reaper();
 
-  struct cache *cache = cache_create(10, 0);
+  struct server server = {0};
 
-  // Get a listening socket
-  int listenfd = get_listener_socket(PORT);
+  srand(time(NULL) + getpid());
 
-  if (listenfd < 0) {
-    fprintf(stderr, "webserver: fatal error getting listening socket\n");
+  admission_init(&server.admission, MAX_INFLIGHT);
+
+  server.cache = cache_create(10, 0);
+
+  cache_track_hot(server.cache, CACHE_HOT_KEYS);
+
+  // What the default site's cache evicts goes down to disk, not away
+  if (access(CACHE_DISK, F_OK) == 0) {
+    struct segstore *disk = segstore_create(CACHE_DISK, CACHE_DISK_BUDGET);
+
+    if (disk == NULL) {
+      fprintf(stderr, "webserver: fatal error opening %s\n", CACHE_DISK);
+      exit(1);
+    }
+    cache_use_disk(server.cache, disk);
+  }
+
+  server.vhosts = vhosts_create(vhost_create(NULL, SERVER_ROOT, SERVER_FILES,
+                                              server.cache, FDCACHE_SIZE));
+
+  if (server.vhosts == NULL) {
+    fprintf(stderr, "webserver: fatal error opening %s\n", SERVER_ROOT);
     exit(1);
   }
 
-  printf("webserver: waiting for connections on port %s...\n", PORT);
+  if (access(VHOSTS, F_OK) == 0 &&
+      vhosts_load(server.vhosts, VHOSTS, FDCACHE_SIZE, VHOST_CACHE_ENTRIES,
+                  CACHE_HOT_KEYS) < 0) {
+    fprintf(stderr, "webserver: fatal error loading %s\n", VHOSTS);
+    exit(1);
+  }
+
+  server.router = create_router();
+
+  if (server.router == NULL) {
+    fprintf(stderr, "webserver: fatal error registering routes\n");
+    exit(1);
+  }
 
-  // This is the main loop that accepts incoming connections and
-  // fork()s a handler process to take care of it. The main parent
-  // process then goes back to waiting for new connections.
+  // A client hanging up mid-response must not kill the server
+  signal(SIGPIPE, SIG_IGN);
 
-  while (1) {
-    socklen_t sin_size = sizeof their_addr;
+  if (httpdate_start() < 0) {
+    fprintf(stderr, "webserver: fatal error starting the date timer\n");
+    exit(1);
+  }
 
-    // Parent process will block on the accept() call until someone
-    // makes a new connection:
-    newfd = accept(listenfd, (struct sockaddr *)&their_addr, &sin_size);
-    if (newfd == -1) {
-      perror("accept");
-      continue;
+  server.accesslog =
+      accesslog_open(ACCESS_LOG, ACCESS_LOG_MAX_BYTES, ACCESS_LOG_MAX_AGE);
+
+  if (server.accesslog == NULL) {
+    fprintf(stderr, "webserver: fatal error opening %s\n", ACCESS_LOG);
+    exit(1);
+  }
+
+  // Every connection is a file descriptor; allow as many as we may
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  // HTTPS only if there's a certificate to serve it with
+  struct tls *tls = NULL;
+
+  if (access(TLS_CERT, F_OK) == 0 &&
+      (tls = tls_create(TLS_CERT, TLS_KEY)) == NULL) {
+    fprintf(stderr, "webserver: fatal error loading %s\n", TLS_CERT);
+    exit(1);
+  }
+
+  // Take over the listening sockets from a running server, or get our own:
+  // HTTP first, then HTTPS
+  server.upgrade = upgrade_create(UPGRADE_SOCKET, server.cache);
+
+  if (server.upgrade == NULL) {
+    fprintf(stderr, "webserver: fatal error setting up upgrades\n");
+    exit(1);
+  }
+
+  int listenfds[UPGRADE_MAX_LISTENERS];
+  int nlisteners = upgrade_takeover(server.upgrade, listenfds);
+
+  if (nlisteners > 0) {
+    printf("webserver: took over from the running server\n");
+  } else if ((listenfds[0] = get_listener_socket(PORT)) >= 0) {
+    nlisteners = 1;
+  } else {
+    fprintf(stderr, "webserver: fatal error getting listening socket\n");
+    exit(1);
+  }
+
+  if (tls != NULL && nlisteners == 1) {
+    if ((listenfds[1] = get_listener_socket(TLS_PORT)) < 0) {
+      fprintf(stderr, "webserver: fatal error getting HTTPS socket\n");
+      exit(1);
     }
+    nlisteners = 2;
+  }
 
-    // Print out a message that we got the connection
-    get_in_addr(((struct sockaddr *)&their_addr), s, sizeof s);
-    printf("server: got connection from %s\n", s);
+  while (tls == NULL && nlisteners > 1) {
+    close(listenfds[--nlisteners]); // The old server had HTTPS; we don't
+  }
+
+  // All connections are served from this one thread
+  struct conn_loop *loop = conn_loop_create(handle_http_request, &server);
+
+  server.loop = loop;
+  if (loop == NULL || conn_loop_listen(loop, listenfds[0], NULL) < 0 ||
+      (tls != NULL && conn_loop_listen(loop, listenfds[1], tls) < 0) ||
+      upgrade_listen(server.upgrade, loop, listenfds, nlisteners, handed_off,
+                     log_released, &server) < 0) {
+    fprintf(stderr, "webserver: fatal error starting the event loop\n");
+    exit(1);
+  }
+
+  // A reverse proxy too, if there are upstreams to pass requests to
+  if (access(UPSTREAMS, F_OK) == 0 &&
+      (server.proxy = proxy_create(loop, UPSTREAMS, CACHE_MAX_ENTRY_SIZE)) ==
+          NULL) {
+    fprintf(stderr, "webserver: fatal error loading %s\n", UPSTREAMS);
+    exit(1);
+  }
 
-    // newfd is a new socket descriptor for the new connection.
-    // listenfd is still listening for new connections.
+  printf("webserver: waiting for connections on port %s...\n", PORT);
+  if (tls != NULL) {
+    printf("webserver: HTTPS on port %s\n", TLS_PORT);
+  }
 
-    handle_http_request(newfd, cache);
+  if (conn_loop_run(loop) < 0) {
+    exit(1);
+  }
 
-    close(newfd);
+  // Drained after an upgrade; let the new process have the log
+  if (server.wal != NULL) {
+    wal_close(server.wal);
+    upgrade_release(server.upgrade);
   }
+  accesslog_close(server.accesslog);
 
-  // Unreachable code
+  printf("webserver: drained, exiting\n");
 
   return 0;
 }
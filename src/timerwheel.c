@@ -0,0 +1,130 @@
+/* Hierarchical timing wheel
+ *
+ * Level 0 has one slot per tick for the next 64 ticks; each level above
+ * covers 64 times the span of the one below. A timer goes in the slot for
+ * its expiry at the lowest level that reaches that far, so arming and
+ * cancelling are a list insert and unlink. As the wheel turns past the end
+ * of a level's span, the next slot of the level above is emptied into the
+ * lower levels ("cascading"). Each timer is moved at most once per level,
+ * so even hundreds of thousands of idle connections cost next to nothing.
+ */
+
+#include "timerwheel.h"
+#include <stddef.h>
+
+static void list_init(struct timer *head) { head->prev = head->next = head; }
+
+static void list_add(struct timer *head, struct timer *timer) {
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+/* Put an armed timer in the slot for its expiry */
+static void place(struct timerwheel *tw, struct timer *timer) {
+  uint64_t expires = timer->expires;
+  uint64_t delta;
+  int level = 0;
+
+  if (expires <= tw->tick) {
+    expires = tw->tick + 1; // Overdue: run on the next tick
+  }
+  delta = expires - tw->tick;
+
+  while (level < TIMERWHEEL_LEVELS - 1 &&
+         delta >= (uint64_t)1 << (TIMERWHEEL_BITS * (level + 1))) {
+    level++;
+  }
+
+  if (level == TIMERWHEEL_LEVELS - 1 &&
+      delta >= (uint64_t)1 << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS)) {
+    // Beyond the wheel: park in the farthest slot, re-placed on cascade
+    expires = tw->tick + ((uint64_t)1 << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS)) -
+              1;
+  }
+
+  int slot = (expires >> (TIMERWHEEL_BITS * level)) & (TIMERWHEEL_SLOTS - 1);
+
+  list_add(&tw->slots[level][slot], timer);
+}
+
+/* Start the wheel at the current time */
+void timerwheel_init(struct timerwheel *tw, uint64_t now_ms) {
+  tw->tick = now_ms / TIMERWHEEL_TICK_MS;
+
+  for (int level = 0; level < TIMERWHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMERWHEEL_SLOTS; slot++) {
+      list_init(&tw->slots[level][slot]);
+    }
+  }
+}
+
+/* Arm (or re-arm) a timer to expire at expires_ms */
+void timer_arm(struct timerwheel *tw, struct timer *timer,
+               uint64_t expires_ms) {
+  timer_cancel(timer);
+  timer->expires = (expires_ms + TIMERWHEEL_TICK_MS - 1) / TIMERWHEEL_TICK_MS;
+  place(tw, timer);
+}
+
+/* Disarm a timer; harmless if it isn't armed */
+void timer_cancel(struct timer *timer) {
+  if (timer->next != NULL) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+  }
+}
+
+/* Move every timer in a slot down to where it now belongs */
+static void cascade(struct timerwheel *tw, int level, int slot) {
+  struct timer *head = &tw->slots[level][slot];
+  struct timer list;
+
+  if (head->next == head) {
+    return;
+  }
+
+  // Detach the whole slot first; place() may put timers back into it
+  list.next = head->next;
+  list.prev = head->prev;
+  list.next->prev = list.prev->next = &list;
+  list_init(head);
+
+  while (list.next != &list) {
+    struct timer *timer = list.next;
+
+    timer_cancel(timer);
+    place(tw, timer);
+  }
+}
+
+/* Run every timer due by now_ms
+ *
+ * Expiry callbacks may arm or cancel any timer, including their own.
+ */
+void timerwheel_advance(struct timerwheel *tw, uint64_t now_ms) {
+  uint64_t target = now_ms / TIMERWHEEL_TICK_MS;
+
+  while (tw->tick < target) {
+    tw->tick++;
+
+    int slot = tw->tick & (TIMERWHEEL_SLOTS - 1);
+
+    // Wrapped around level 0: pull the next span down from above
+    for (int level = 1; level < TIMERWHEEL_LEVELS && slot == 0; level++) {
+      slot = (tw->tick >> (TIMERWHEEL_BITS * level)) & (TIMERWHEEL_SLOTS - 1);
+      cascade(tw, level, slot);
+    }
+
+    struct timer *head = &tw->slots[0][tw->tick & (TIMERWHEEL_SLOTS - 1)];
+
+    while (head->next != head) {
+      struct timer *timer = head->next;
+
+      timer_cancel(timer);
+      timer->expired(timer);
+    }
+  }
+}
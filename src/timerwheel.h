@@ -0,0 +1,29 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include <stdint.h>
+
+#define TIMERWHEEL_TICK_MS 100 // Resolution of every deadline
+#define TIMERWHEEL_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_LEVELS 4 // 64^4 ticks: about 19 days
+
+// A deadline; embed one in whatever it times out
+struct timer {
+  struct timer *prev, *next; // Slot list; NULL when not armed
+  uint64_t expires;          // In ticks
+  void (*expired)(struct timer *timer);
+};
+
+struct timerwheel {
+  uint64_t tick; // Everything due at or before this tick has run
+  struct timer slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS]; // List heads
+};
+
+extern void timerwheel_init(struct timerwheel *tw, uint64_t now_ms);
+extern void timer_arm(struct timerwheel *tw, struct timer *timer,
+                      uint64_t expires_ms);
+extern void timer_cancel(struct timer *timer);
+extern void timerwheel_advance(struct timerwheel *tw, uint64_t now_ms);
+
+#endif
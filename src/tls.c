@@ -0,0 +1,356 @@
+/* HTTPS
+ *
+ * OpenSSL does the handshake. Where the kernel supports it (the "tls"
+ * module, kernel TLS), OpenSSL then hands the session keys to the socket
+ * and the kernel does the record layer: writes go straight to the socket
+ * and sendfile() still works, with the kernel encrypting file pages as they
+ * are sent. Without kernel TLS every record goes through OpenSSL, and files
+ * are read into a buffer and written as records.
+ *
+ * Sessions resume from stateless tickets, or from a server-side cache for
+ * clients that don't do tickets, so a returning client skips the key
+ * exchange and certificate signature.
+ *
+ * ALPN offers HTTP/2 ("h2") ahead of HTTP/1.1; a client that picks it
+ * starts its session as soon as the handshake is done.
+ *
+ * Built with WITH_TLS only (the Makefile's TLS=1, the default); otherwise
+ * there is no HTTPS and tls_create() says so.
+ */
+
+#include "tls.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WITH_TLS
+
+#include <linux/tls.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define TLS_RECORD_SIZE 16384        // Largest record payload
+#define TLS_SESSION_CACHE_SIZE 20480 // Sessions kept for resumption by id
+#define TLS_SESSION_LIFETIME 7200    // Seconds a session may be resumed
+
+struct tls {
+  SSL_CTX *ctx;
+};
+
+struct tls_conn {
+  SSL *ssl;
+  int ktls_send; // The kernel encrypts what we write
+  int failed;    // Fatal error; no close_notify
+};
+
+static int reported; // Whether kernel TLS use has been logged
+
+// ALPN protocols, most preferred first
+static unsigned char alpn_protos[] = "\x02h2\x08http/1.1";
+
+/* Pick the client's choice of ours; carry on without ALPN if none match */
+static int select_alpn(SSL *ssl, const unsigned char **out,
+                       unsigned char *outlen, const unsigned char *in,
+                       unsigned int inlen, void *arg) {
+  (void)ssl;
+  (void)arg;
+  if (SSL_select_next_proto((unsigned char **)out, outlen, alpn_protos,
+                            sizeof alpn_protos - 1, in,
+                            inlen) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+static int configure(SSL_CTX *ctx, char *cert, char *key) {
+  static unsigned char id_context[] = "webserver";
+
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                               SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+  // Writes are retried from a copy of what didn't fit; idle connections
+  // don't hold on to record buffers
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                            SSL_MODE_RELEASE_BUFFERS);
+
+  // Tickets are on by default; the cache covers resumption by session id
+  SSL_CTX_set_session_id_context(ctx, id_context, sizeof id_context - 1);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_timeout(ctx, TLS_SESSION_LIFETIME);
+
+  SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+
+  if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Load a PEM certificate chain and private key for serving HTTPS
+ *
+ * Returns NULL on error.
+ */
+struct tls *tls_create(char *cert, char *key) {
+  struct tls *tls = malloc(sizeof *tls);
+
+  if (tls == NULL) {
+    return NULL;
+  }
+
+  if ((tls->ctx = SSL_CTX_new(TLS_server_method())) == NULL ||
+      configure(tls->ctx, cert, key) < 0) {
+    fprintf(stderr, "tls: cannot use %s and %s\n", cert, key);
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(tls->ctx);
+    free(tls);
+    return NULL;
+  }
+
+  return tls;
+}
+
+/* Start a server-side session on a newly accepted socket */
+struct tls_conn *tls_accept(struct tls *tls, int fd) {
+  struct tls_conn *tc = calloc(1, sizeof *tc);
+
+  if (tc == NULL) {
+    return NULL;
+  }
+
+  if ((tc->ssl = SSL_new(tls->ctx)) == NULL || SSL_set_fd(tc->ssl, fd) != 1) {
+    ERR_clear_error();
+    SSL_free(tc->ssl);
+    free(tc);
+    return NULL;
+  }
+
+  return tc;
+}
+
+/* Note whether OpenSSL handed the record layer to the kernel */
+static void offloaded(struct tls_conn *tc) {
+  int ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(tc->ssl));
+
+  tc->ktls_send = BIO_get_ktls_send(SSL_get_wbio(tc->ssl));
+
+#ifdef TLS_TX_ZEROCOPY_RO
+  // Let sendfile() encrypt straight from the page cache; files being served
+  // aren't rewritten in place. Older kernels just copy.
+  int one = 1;
+
+  if (tc->ktls_send) {
+    setsockopt(SSL_get_fd(tc->ssl), SOL_TLS, TLS_TX_ZEROCOPY_RO, &one,
+               sizeof one);
+  }
+#endif
+
+  if (!reported) {
+    printf("tls: kernel TLS send %s, receive %s\n", tc->ktls_send ? "on" : "off",
+           ktls_recv ? "on" : "off");
+    reported = 1;
+  }
+}
+
+/**
+ * Carry on with the handshake
+ *
+ * Returns TLS_DONE once it is complete, TLS_WANT_READ or TLS_WANT_WRITE
+ * when it has to wait for the socket, or TLS_FAILED.
+ */
+enum tls_status tls_handshake(struct tls_conn *tc) {
+  int rv;
+
+  ERR_clear_error();
+  if ((rv = SSL_accept(tc->ssl)) == 1) {
+    offloaded(tc);
+    return TLS_DONE;
+  }
+
+  switch (SSL_get_error(tc->ssl, rv)) {
+  case SSL_ERROR_WANT_READ:
+    return TLS_WANT_READ;
+  case SSL_ERROR_WANT_WRITE:
+    return TLS_WANT_WRITE;
+  default:
+    tc->failed = 1;
+    ERR_clear_error();
+    return TLS_FAILED;
+  }
+}
+
+/* Turn a failed SSL_read() or SSL_write() into a recv() style result */
+static int io_error(struct tls_conn *tc, int rv) {
+  int error = SSL_get_error(tc->ssl, rv);
+
+  switch (error) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_ZERO_RETURN:
+    return 0; // close_notify, or the peer just hung up
+  default:
+    tc->failed = 1;
+    ERR_clear_error();
+    if (error != SSL_ERROR_SYSCALL || errno == 0) {
+      errno = ECONNRESET;
+    }
+    return -1;
+  }
+}
+
+/* As recv(): -1 with errno EAGAIN when nothing can be read yet */
+int tls_recv(struct tls_conn *tc, void *buf, int len) {
+  int n;
+
+  ERR_clear_error();
+  if ((n = SSL_read(tc->ssl, buf, len)) > 0) {
+    return n;
+  }
+  return io_error(tc, n);
+}
+
+/**
+ * As send()
+ *
+ * After -1 with errno EAGAIN, the next call must start with the same bytes,
+ * though they may have moved and there may be more of them.
+ */
+int tls_send(struct tls_conn *tc, void *buf, int len) {
+  int n;
+
+  ERR_clear_error();
+  if ((n = SSL_write(tc->ssl, buf, len)) > 0) {
+    return n;
+  }
+  if ((n = io_error(tc, n)) == 0) {
+    errno = EPIPE;
+    n = -1;
+  }
+  return n;
+}
+
+/**
+ * As sendfile(): send up to len bytes of filefd from *offset, and advance it
+ *
+ * With kernel TLS the file is never copied into user space. Otherwise a
+ * record's worth at a time is read and encrypted here.
+ */
+ssize_t tls_sendfile(struct tls_conn *tc, int filefd, off_t *offset,
+                     size_t len) {
+  ssize_t n;
+
+  if (tc->ktls_send) {
+    ERR_clear_error();
+    if ((n = SSL_sendfile(tc->ssl, filefd, *offset, len, 0)) > 0) {
+      *offset += n;
+      return n;
+    }
+    if (n == 0) {
+      return 0;
+    }
+    return io_error(tc, n) == 0 ? 0 : -1;
+  }
+
+  char buf[TLS_RECORD_SIZE];
+
+  if ((n = pread(filefd, buf, len < sizeof buf ? len : sizeof buf, *offset)) <=
+      0) {
+    return n;
+  }
+  if ((n = tls_send(tc, buf, n)) > 0) {
+    *offset += n;
+  }
+  return n;
+}
+
+/* Whether decrypted input is waiting that the socket won't signal */
+int tls_pending(struct tls_conn *tc) { return SSL_pending(tc->ssl) > 0; }
+
+/* Whether the client chose HTTP/2 in the handshake */
+int tls_alpn_h2(struct tls_conn *tc) {
+  const unsigned char *proto;
+  unsigned int len;
+
+  SSL_get0_alpn_selected(tc->ssl, &proto, &len);
+  return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+/* Say goodbye if the session is healthy, and free it; fd is left open */
+void tls_close(struct tls_conn *tc) {
+  if (!tc->failed && SSL_is_init_finished(tc->ssl)) {
+    SSL_shutdown(tc->ssl); // Once, without waiting for the peer's
+  }
+  ERR_clear_error();
+  SSL_free(tc->ssl);
+  free(tc);
+}
+
+#else
+
+struct tls *tls_create(char *cert, char *key) {
+  (void)cert;
+  (void)key;
+  fprintf(stderr, "tls: built without TLS support\n");
+  return NULL;
+}
+
+struct tls_conn *tls_accept(struct tls *tls, int fd) {
+  (void)tls;
+  (void)fd;
+  return NULL;
+}
+
+enum tls_status tls_handshake(struct tls_conn *tc) {
+  (void)tc;
+  return TLS_FAILED;
+}
+
+int tls_recv(struct tls_conn *tc, void *buf, int len) {
+  (void)tc;
+  (void)buf;
+  (void)len;
+  errno = ENOTSUP;
+  return -1;
+}
+
+int tls_send(struct tls_conn *tc, void *buf, int len) {
+  (void)tc;
+  (void)buf;
+  (void)len;
+  errno = ENOTSUP;
+  return -1;
+}
+
+ssize_t tls_sendfile(struct tls_conn *tc, int filefd, off_t *offset,
+                     size_t len) {
+  (void)tc;
+  (void)filefd;
+  (void)offset;
+  (void)len;
+  errno = ENOTSUP;
+  return -1;
+}
+
+int tls_pending(struct tls_conn *tc) {
+  (void)tc;
+  return 0;
+}
+
+int tls_alpn_h2(struct tls_conn *tc) {
+  (void)tc;
+  return 0;
+}
+
+void tls_close(struct tls_conn *tc) { (void)tc; }
+
+#endif
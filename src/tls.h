@@ -0,0 +1,22 @@
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <sys/types.h>
+
+struct tls;      // Certificate, key and session resumption state
+struct tls_conn; // One connection's TLS session
+
+enum tls_status { TLS_DONE, TLS_WANT_READ, TLS_WANT_WRITE, TLS_FAILED };
+
+extern struct tls *tls_create(char *cert, char *key);
+extern struct tls_conn *tls_accept(struct tls *tls, int fd);
+extern enum tls_status tls_handshake(struct tls_conn *tc);
+extern int tls_recv(struct tls_conn *tc, void *buf, int len);
+extern int tls_send(struct tls_conn *tc, void *buf, int len);
+extern ssize_t tls_sendfile(struct tls_conn *tc, int filefd, off_t *offset,
+                            size_t len);
+extern int tls_pending(struct tls_conn *tc);
+extern int tls_alpn_h2(struct tls_conn *tc);
+extern void tls_close(struct tls_conn *tc);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/* Static tracepoints on the request path
+ *
+ * Built on systemtap's <sys/sdt.h> when it is installed: each probe is a
+ * single nop plus an ELF note, so it costs nothing until a tracer attaches
+ * to it, e.g.
+ *
+ *    bpftrace -e 'usdt:./server:webserver:cache_miss { printf("%s\n",
+ *                 str(arg0)); }'
+ *    perf buildid-cache --add ./server && perf list sdt_webserver:*
+ *
+ * Without <sys/sdt.h>, or when built with -DTRACE_DISABLE, probes compile
+ * to nothing. Probe arguments must be cheap to evaluate; they are computed
+ * even when no tracer is attached.
+ *
+ * Probes (provider "webserver"):
+ *
+ *    accept(fd)                           connection accepted
+ *    parse_done(fd, method, path)         request routed; method is an
+ *                                         enum http_method
+ *    cache_hit(path), cache_miss(path)    cache_get() result
+ *    cache_evict(path, content_length)    clean_lru() dropped an entry
+ *    file_load_start(name)                file_load() called; name is the
+ *    file_load_end(name, size)            path, or NULL for file_load_fd()
+ *    send_done(fd, status, bytes)         response written; bytes < 0 on
+ *                                         error
+ */
+
+#if !defined(TRACE_DISABLE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_ENABLED 1
+#endif
+#endif
+
+#ifdef TRACE_ENABLED
+#define TRACE(name) DTRACE_PROBE(webserver, name)
+#define TRACE1(name, a) DTRACE_PROBE1(webserver, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(webserver, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(webserver, name, a, b, c)
+#else
+#define TRACE(name) ((void)0)
+#define TRACE1(name, a) ((void)0)
+#define TRACE2(name, a, b) ((void)0)
+#define TRACE3(name, a, b, c) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,578 @@
+/* Zero-downtime upgrades
+ *
+ * A running server listens on a Unix control socket. A new server started
+ * while it runs connects there instead of binding the port:
+ *
+ *    old -> new   the listening sockets, passed with SCM_RIGHTS
+ *    old -> new   the content cache, oldest entry first, so the new
+ *                 process starts warm
+ *    new -> old   'R': ready; the new process is about to accept
+ *    old          stops accepting and drains its open connections
+ *    old -> new   'W': done with the append log (or just hangs up)
+ *
+ * The old process sends the cache from its loop, an entry at a time as the
+ * socket takes it, so its own clients aren't kept waiting meanwhile.
+ *
+ * Both processes hold the same listening sockets during the handover, so
+ * connections queue in its backlog rather than being refused, and the old
+ * process keeps accepting until the new one is ready. Only one process may
+ * write the append log, so the new one waits for 'W' before opening it.
+ *
+ * If the new process dies before it is ready, the old one carries on.
+ */
+
+#define _GNU_SOURCE
+#include "upgrade.h"
+#include "hashtable.h"
+#include "timerwheel.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define UPGRADE_IO_TIMEOUT 1 // Seconds a handover may stall before giving up
+#define UPGRADE_SNAPSHOT_BATCH (1 << 20) // Cache bytes sent per loop turn
+
+struct upgrade {
+  char *path;
+  struct cache *cache;
+  struct conn_loop *loop;
+  int listenfds[UPGRADE_MAX_LISTENERS];
+  int nlisteners;
+
+  struct conn_watch control; // Listening for a successor
+  struct conn_watch peer;    // Talking to a successor or predecessor
+  int peer_is_successor;
+
+  // The cache snapshot on its way to a successor
+  char **snapshot;         // Paths to send, least recently used first
+  int snapshot_len, snapshot_next; // Past snapshot_len once the end is sent
+  char *out;               // What is being sent: an entry, or the end
+  size_t out_len, out_sent;
+  struct timer stall;      // Gives up on a successor that stops reading
+
+  upgrade_fn handed_off, on_release;
+  void *arg;
+};
+
+// Precedes each cache entry sent to a successor
+struct snapshot_header {
+  uint32_t path_len; // 0 ends the snapshot
+  uint32_t type_len;
+  uint32_t content_len;
+  uint64_t version;
+};
+
+static int set_timeouts(int fd) {
+  struct timeval tv = {UPGRADE_IO_TIMEOUT, 0};
+
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv) < 0) {
+    perror("setsockopt");
+    return -1;
+  }
+  return 0;
+}
+
+static int write_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = recv(fd, p, len, 0);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int unix_address(char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof *addr);
+  addr->sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof addr->sun_path) {
+    fprintf(stderr, "upgrade: socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+/* Send the listening sockets as the ancillary data of a one-byte message */
+static int send_listeners(int sock, int *listenfds, int n) {
+  char byte = 'L';
+  struct iovec iov = {&byte, 1};
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+  } control;
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = CMSG_SPACE(sizeof(int) * n)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+  memset(&control, 0, sizeof control);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+  memcpy(CMSG_DATA(cmsg), listenfds, sizeof(int) * n);
+
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/* Returns how many sockets were stored in listenfds, or -1 */
+static int recv_listeners(int sock, int *listenfds) {
+  char byte;
+  struct iovec iov = {&byte, 1};
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+  } control;
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof control.buf};
+  struct cmsghdr *cmsg;
+  int n;
+
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 || byte != 'L' ||
+      (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS) {
+    return -1;
+  }
+
+  n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(listenfds, CMSG_DATA(cmsg), sizeof(int) * n);
+  return n;
+}
+
+/* Note which entries to send, least recently used first
+ *
+ * Entries that go stale (upstream responses) are left behind; the
+ * successor fetches them again. The rest are looked up again as they go,
+ * so any evicted meanwhile are left out.
+ */
+static int start_snapshot(struct upgrade *up) {
+  struct cache *cache = up->cache;
+
+  up->snapshot = malloc(sizeof(char *) * (cache->cur_size + 1));
+  up->snapshot_len = up->snapshot_next = 0;
+  if (up->snapshot == NULL) {
+    perror("malloc");
+    return -1;
+  }
+
+  for (struct cache_entry *ce = cache->tail; ce != NULL; ce = ce->prev) {
+    if (ce->expires_ms != 0) {
+      continue;
+    }
+    if ((up->snapshot[up->snapshot_len] = strdup(ce->path)) == NULL) {
+      perror("strdup");
+      return -1;
+    }
+    up->snapshot_len++;
+  }
+  return 0;
+}
+
+static void free_snapshot(struct upgrade *up) {
+  for (int i = 0; i < up->snapshot_len; i++) {
+    free(up->snapshot[i]);
+  }
+  free(up->snapshot);
+  free(up->out);
+  up->snapshot = NULL;
+  up->snapshot_len = up->snapshot_next = 0;
+  up->out = NULL;
+  up->out_len = up->out_sent = 0;
+}
+
+/* Copy an entry, header first, to be sent */
+static int stage(struct upgrade *up, struct snapshot_header *h, char *path,
+                 char *type, void *content) {
+  size_t len = sizeof *h + h->path_len + h->type_len + h->content_len;
+  char *p = malloc(len);
+
+  if (p == NULL) {
+    perror("malloc");
+    return -1;
+  }
+
+  free(up->out);
+  up->out = p;
+  up->out_len = len;
+  up->out_sent = 0;
+
+  memcpy(p, h, sizeof *h);
+  p += sizeof *h;
+  memcpy(p, path, h->path_len);
+  p += h->path_len;
+  memcpy(p, type, h->type_len);
+  memcpy(p + h->type_len, content, h->content_len);
+  return 0;
+}
+
+/* Stage the next entry still in the cache, or else the end of the snapshot
+ *
+ * Returns 1 if there is something to send, 0 once everything is out, or -1
+ * on error.
+ */
+static int stage_next(struct upgrade *up) {
+  struct snapshot_header end = {0, 0, 0, 0};
+
+  while (up->snapshot_next < up->snapshot_len) {
+    struct cache_entry *ce =
+        hashtable_get(up->cache->index, up->snapshot[up->snapshot_next++]);
+
+    if (ce == NULL || ce->expires_ms != 0) {
+      continue;
+    }
+
+    struct snapshot_header h = {strlen(ce->path), strlen(ce->content_type),
+                                ce->content_length, ce->version};
+
+    return stage(up, &h, ce->path, ce->content_type, ce->content) < 0 ? -1
+                                                                       : 1;
+  }
+
+  if (up->snapshot_next > up->snapshot_len) {
+    return 0;
+  }
+  up->snapshot_next++;
+  return stage(up, &end, "", "", "") < 0 ? -1 : 1;
+}
+
+/* Load the predecessor's cache; entries arrive oldest first */
+static int recv_cache(int sock, struct cache *cache) {
+  struct snapshot_header h;
+
+  while (read_all(sock, &h, sizeof h) == 0) {
+    if (h.path_len == 0) {
+      return 0;
+    }
+
+    char *path = malloc(h.path_len + 1);
+    char *type = malloc(h.type_len + 1);
+    char *content = malloc(h.content_len > 0 ? h.content_len : 1);
+    int rv = -1;
+
+    if (path != NULL && type != NULL && content != NULL &&
+        read_all(sock, path, h.path_len) == 0 &&
+        read_all(sock, type, h.type_len) == 0 &&
+        read_all(sock, content, h.content_len) == 0) {
+      path[h.path_len] = '\0';
+      type[h.type_len] = '\0';
+      cache_put_version(cache, path, type, content, h.content_len,
+                        h.version);
+      rv = 0;
+    }
+
+    free(path);
+    free(type);
+    free(content);
+
+    if (rv < 0) {
+      return -1;
+    }
+  }
+
+  return -1;
+}
+
+struct upgrade *upgrade_create(char *path, struct cache *cache) {
+  struct upgrade *up = calloc(1, sizeof *up);
+
+  if (up == NULL || (up->path = strdup(path)) == NULL) {
+    free(up);
+    return NULL;
+  }
+
+  up->cache = cache;
+  up->control.fd = -1;
+  up->peer.fd = -1;
+
+  return up;
+}
+
+/**
+ * Take over from a server already running, if there is one
+ *
+ * Stores its listening sockets in listenfds, in the order it was given
+ * them, and loads the cache from it. listenfds must have room for
+ * UPGRADE_MAX_LISTENERS.
+ *
+ * Returns the number of sockets, or -1 if there is no server to take over
+ * from.
+ */
+int upgrade_takeover(struct upgrade *up, int *listenfds) {
+  struct sockaddr_un addr;
+  int sock, n;
+
+  if (unix_address(up->path, &addr) < 0 ||
+      (sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    return -1;
+  }
+
+  if (connect(sock, (struct sockaddr *)&addr, sizeof addr) < 0) {
+    close(sock); // Nobody there, or a stale socket file
+    return -1;
+  }
+
+  if (set_timeouts(sock) < 0 || (n = recv_listeners(sock, listenfds)) <= 0) {
+    fprintf(stderr, "upgrade: no listener from the running server\n");
+    close(sock);
+    return -1;
+  }
+
+  if (recv_cache(sock, up->cache) < 0) {
+    fprintf(stderr, "upgrade: cache snapshot incomplete\n");
+  }
+
+  up->peer.fd = sock;
+  up->peer_is_successor = 0;
+
+  return n;
+}
+
+static void peer_closed(struct upgrade *up) {
+  conn_unwatch(up->loop, &up->peer);
+  close(up->peer.fd);
+  up->peer.fd = -1;
+}
+
+/* The successor is ready, or the predecessor is done with the log */
+static void peer_ready(struct conn_watch *w) {
+  struct upgrade *up =
+      (struct upgrade *)((char *)w - offsetof(struct upgrade, peer));
+  char byte;
+  ssize_t n = recv(w->fd, &byte, 1, MSG_DONTWAIT);
+
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+
+  if (!up->peer_is_successor) {
+    // 'W', or the predecessor exited; either way the log is ours
+    peer_closed(up);
+    up->on_release(up->arg);
+    return;
+  }
+
+  if (n == 1 && byte == 'R') {
+    printf("webserver: handed over to a new process, draining\n");
+    conn_unwatch(up->loop, &up->peer); // Only written to from now on
+    conn_unwatch(up->loop, &up->control);
+    close(up->control.fd);
+    up->control.fd = -1;
+    conn_loop_drain(up->loop);
+    up->handed_off(up->arg);
+    return;
+  }
+
+  // The successor died before it was ready; keep serving
+  fprintf(stderr, "upgrade: new process went away, carrying on\n");
+  peer_closed(up);
+  conn_watch(up->loop, &up->control, up->control.fd);
+}
+
+/* Give up on a successor, and wait for another */
+static void handover_failed(struct upgrade *up) {
+  fprintf(stderr, "upgrade: handover failed\n");
+  timer_cancel(&up->stall);
+  free_snapshot(up);
+  peer_closed(up);
+  conn_watch(up->loop, &up->control, up->control.fd);
+}
+
+static void snapshot_stalled(struct timer *timer) {
+  handover_failed(
+      (struct upgrade *)((char *)timer - offsetof(struct upgrade, stall)));
+}
+
+/* The successor can take more of the cache */
+static void snapshot_ready(struct conn_watch *w) {
+  struct upgrade *up =
+      (struct upgrade *)((char *)w - offsetof(struct upgrade, peer));
+  long budget = UPGRADE_SNAPSHOT_BATCH;
+
+  while (budget > 0) {
+    if (up->out_sent == up->out_len) {
+      int rv = stage_next(up);
+
+      if (rv < 0) {
+        handover_failed(up);
+        return;
+      }
+      if (rv == 0) {
+        // All sent; now wait for 'R'
+        timer_cancel(&up->stall);
+        free_snapshot(up);
+        up->peer.ready = peer_ready;
+        conn_watch_events(up->loop, &up->peer, EPOLLIN);
+        return;
+      }
+    }
+
+    ssize_t n = send(w->fd, up->out + up->out_sent, up->out_len - up->out_sent,
+                     MSG_NOSIGNAL);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n < 0) {
+      handover_failed(up);
+      return;
+    }
+    up->out_sent += n;
+    budget -= n;
+  }
+
+  conn_timer(up->loop, &up->stall, UPGRADE_IO_TIMEOUT * 1000);
+}
+
+/* A new process has connected to take over */
+static void successor_connected(struct conn_watch *w) {
+  struct upgrade *up =
+      (struct upgrade *)((char *)w - offsetof(struct upgrade, control));
+  int sock = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+  if (sock < 0) {
+    return;
+  }
+
+  // The socket is empty, so the one byte goes straight out
+  if (send_listeners(sock, up->listenfds, up->nlisteners) < 0 ||
+      start_snapshot(up) < 0) {
+    fprintf(stderr, "upgrade: handover failed\n");
+    free_snapshot(up);
+    close(sock);
+    return;
+  }
+
+  // One successor at a time
+  conn_unwatch(up->loop, &up->control);
+
+  up->peer.fd = sock;
+  up->peer.ready = snapshot_ready;
+  up->peer_is_successor = 1;
+  up->stall.expired = snapshot_stalled;
+  if (conn_watch_events(up->loop, &up->peer, EPOLLOUT) < 0) {
+    handover_failed(up);
+    return;
+  }
+  conn_timer(up->loop, &up->stall, UPGRADE_IO_TIMEOUT * 1000);
+}
+
+/**
+ * Accept successors on the control socket, and tell a predecessor we are
+ * ready
+ *
+ * handed_off(arg) is called once a successor has taken over the n sockets
+ * in listenfds and the loop is draining. released(arg) is called once the
+ * predecessor has finished with the append log; straight away if there was
+ * none.
+ *
+ * Returns -1 on error.
+ */
+int upgrade_listen(struct upgrade *up, struct conn_loop *loop, int *listenfds,
+                   int n, upgrade_fn handed_off, upgrade_fn released,
+                   void *arg) {
+  struct sockaddr_un addr;
+  int sock;
+
+  if (n > UPGRADE_MAX_LISTENERS) {
+    fprintf(stderr, "upgrade: too many listening sockets\n");
+    return -1;
+  }
+
+  up->loop = loop;
+  memcpy(up->listenfds, listenfds, sizeof(int) * n);
+  up->nlisteners = n;
+  up->handed_off = handed_off;
+  up->on_release = released;
+  up->arg = arg;
+
+  // Replaces the predecessor's socket file; its socket stays open but
+  // unreachable, which is fine as it is on its way out
+  if (unix_address(up->path, &addr) < 0 ||
+      (sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     0)) < 0) {
+    return -1;
+  }
+
+  unlink(up->path);
+
+  if (bind(sock, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+      listen(sock, 1) < 0) {
+    perror("upgrade: control socket");
+    close(sock);
+    return -1;
+  }
+
+  up->control.ready = successor_connected;
+  conn_watch(loop, &up->control, sock);
+
+  if (up->peer.fd < 0) {
+    released(arg);
+    return 0;
+  }
+
+  // Tell the predecessor to stop accepting
+  char byte = 'R';
+
+  up->peer.ready = peer_ready;
+  if (write_all(up->peer.fd, &byte, 1) < 0 ||
+      conn_watch(loop, &up->peer, up->peer.fd) < 0) {
+    close(up->peer.fd);
+    up->peer.fd = -1;
+    released(arg);
+  }
+
+  return 0;
+}
+
+/* Tell the successor we are done with the append log */
+void upgrade_release(struct upgrade *up) {
+  char byte = 'W';
+
+  if (up->peer.fd >= 0 && up->peer_is_successor) {
+    write_all(up->peer.fd, &byte, 1);
+    close(up->peer.fd);
+    up->peer.fd = -1;
+  }
+}
@@ -0,0 +1,21 @@
+#ifndef _UPGRADE_H_
+#define _UPGRADE_H_
+
+#include "cache.h"
+#include "conn.h"
+
+#define UPGRADE_MAX_LISTENERS 4 // Listening sockets handed over
+
+struct upgrade;
+
+// Called from the loop
+typedef void (*upgrade_fn)(void *arg);
+
+extern struct upgrade *upgrade_create(char *path, struct cache *cache);
+extern int upgrade_takeover(struct upgrade *up, int *listenfds);
+extern int upgrade_listen(struct upgrade *up, struct conn_loop *loop,
+                          int *listenfds, int n, upgrade_fn handed_off,
+                          upgrade_fn released, void *arg);
+extern void upgrade_release(struct upgrade *up);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef _VEC_H_
+#define _VEC_H_
+
+/* Growable arrays
+ *
+ * VEC(type) is a struct holding an array of type with its length and room;
+ * zeroed, it is empty. Pushing doubles the room when it runs out, so n
+ * pushes cost O(n) copying in all, and the items stay contiguous for
+ * walking. Pointers into the array last only until the next push.
+ */
+
+#include <stdlib.h>
+
+#define VEC_MIN_CAP 4
+
+#define VEC(type)                                                              \
+  struct {                                                                     \
+    type *items;                                                               \
+    int len, cap;                                                              \
+  }
+
+/* Grow an array of cap items of size bytes; returns NULL if out of memory,
+ * leaving it as it was */
+static inline void *vec_grow(void *items, int *cap, size_t size) {
+  int n = *cap > 0 ? *cap * 2 : VEC_MIN_CAP;
+  void *p = realloc(items, n * size);
+
+  if (p != NULL) {
+    *cap = n;
+  }
+  return p;
+}
+
+/* Append item; 0, or -1 if out of memory */
+#define VEC_PUSH(v, item)                                                      \
+  ({                                                                           \
+    int rv_ = 0;                                                               \
+    if ((v)->len == (v)->cap) {                                                \
+      void *p_ = vec_grow((v)->items, &(v)->cap, sizeof *(v)->items);          \
+      if (p_ != NULL) {                                                        \
+        (v)->items = p_;                                                       \
+      } else {                                                                 \
+        rv_ = -1;                                                              \
+      }                                                                        \
+    }                                                                          \
+    if (rv_ == 0) {                                                            \
+      (v)->items[(v)->len++] = (item);                                         \
+    }                                                                          \
+    rv_;                                                                       \
+  })
+
+/* Free the array, leaving v empty */
+#define VEC_FREE(v)                                                            \
+  do {                                                                         \
+    free((v)->items);                                                          \
+    (v)->items = NULL;                                                         \
+    (v)->len = (v)->cap = 0;                                                   \
+  } while (0)
+
+#endif
@@ -0,0 +1,213 @@
+/* Virtual hosts
+ *
+ * One process serves many sites, told apart by the Host field (HTTP/2's
+ * :authority arrives as Host too). Each site has its own document root,
+ * error pages and fd cache, and its own partition of the content cache
+ * with a byte quota, so a busy site evicts only its own entries.
+ *
+ * Sites are listed one per line in a config file:
+ *
+ *    # names                          root              error pages  quota
+ *    example.com,www.example.com      ./sites/example   ./sites/ex-files  8M
+ *
+ * The quota is in bytes, with an optional K, M or G; without one only the
+ * partition's entry limit applies. Requests naming no listed site go to the
+ * default one.
+ */
+
+#include "vhost.h"
+#include "hashtable.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NAME 255 // Longest host name (RFC 1035)
+
+/**
+ * Create a site
+ *
+ * Its files are opened relative to root, which must exist. cache becomes
+ * the site's.
+ */
+struct vhost *vhost_create(char *name, char *root, char *files,
+                           struct cache *cache, int fdcache_size) {
+  struct vhost *vh = calloc(1, sizeof *vh);
+
+  if (vh == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+
+  if ((name != NULL && (vh->name = strdup(name)) == NULL) ||
+      (vh->root = strdup(root)) == NULL ||
+      (vh->files = strdup(files)) == NULL ||
+      (vh->fdcache = fdcache_create(root, fdcache_size)) == NULL) {
+    free(vh->name);
+    free(vh->root);
+    free(vh->files);
+    free(vh);
+    return NULL;
+  }
+
+  vh->cache = cache;
+  return vh;
+}
+
+/**
+ * Create the host table, with the site for requests it doesn't list
+ */
+struct vhosts *vhosts_create(struct vhost *fallback) {
+  struct vhosts *vhosts;
+
+  if (fallback == NULL || (vhosts = malloc(sizeof *vhosts)) == NULL) {
+    return NULL;
+  }
+
+  vhosts->index = hashtable_create(0, NULL);
+  vhosts->fallback = fallback;
+  return vhosts;
+}
+
+/* Parse a byte count with an optional K, M or G; -1 if it isn't one */
+static long parse_quota(char *s) {
+  char *end;
+  long n = strtol(s, &end, 10);
+
+  if (end == s || n < 0) {
+    return -1;
+  }
+
+  switch (toupper((unsigned char)*end)) {
+  case 'G':
+    n <<= 10;
+    // Fall through
+  case 'M':
+    n <<= 10;
+    // Fall through
+  case 'K':
+    n <<= 10;
+    end++;
+    break;
+  }
+  return *end == '\0' ? n : -1;
+}
+
+/* Add a site under each of its comma-separated names */
+static int add_names(struct vhosts *vhosts, char *names, struct vhost *vh) {
+  for (char *name = strtok(names, ","); name != NULL;
+       name = strtok(NULL, ",")) {
+    if (strlen(name) > MAX_NAME || hashtable_get(vhosts->index, name) != NULL) {
+      fprintf(stderr, "vhost: bad or repeated name \"%s\"\n", name);
+      return -1;
+    }
+    if (hashtable_put(vhosts->index, name, vh) == NULL) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Add the sites listed in config
+ *
+ * Each gets an fd cache of fdcache_size files and a content cache
+ * partition of cache_entries entries, within its quota, that tracks
+ * hot_keys hot keys.
+ *
+ * Returns -1 if the file can't be read or a line is bad.
+ */
+int vhosts_load(struct vhosts *vhosts, char *config, int fdcache_size,
+                int cache_entries, int hot_keys) {
+  FILE *f = fopen(config, "r");
+  char line[1024];
+  int lineno = 0;
+
+  if (f == NULL) {
+    perror(config);
+    return -1;
+  }
+
+  while (fgets(line, sizeof line, f) != NULL) {
+    char names[512], root[256], files[256], quota[32] = "0";
+    struct cache *cache;
+    struct vhost *vh;
+    long max_bytes;
+    int n;
+
+    lineno++;
+    line[strcspn(line, "#\r\n")] = '\0';
+
+    if ((n = sscanf(line, "%511s %255s %255s %31s", names, root, files,
+                    quota)) <= 0) {
+      continue; // Blank, or a comment
+    }
+
+    if (n < 3 || (max_bytes = parse_quota(quota)) < 0) {
+      fprintf(stderr, "%s:%d: expected names, root, error pages and quota\n",
+              config, lineno);
+      fclose(f);
+      return -1;
+    }
+
+    for (char *c = names; *c != '\0'; c++) {
+      *c = tolower((unsigned char)*c);
+    }
+
+    cache = cache_create(cache_entries, 0);
+    cache_limit_bytes(cache, max_bytes);
+    cache_track_hot(cache, hot_keys);
+
+    if ((vh = vhost_create(names, root, files, cache, fdcache_size)) == NULL) {
+      fprintf(stderr, "%s:%d: can't open %s\n", config, lineno, root);
+      cache_free(cache);
+      fclose(f);
+      return -1;
+    }
+
+    if (add_names(vhosts, names, vh) < 0) {
+      fclose(f);
+      return -1;
+    }
+  }
+
+  fclose(f);
+  return 0;
+}
+
+/**
+ * The site a request's Host field names
+ *
+ * The port and any trailing dot are ignored, and case doesn't matter. host
+ * may be NULL, for a request without one.
+ */
+struct vhost *vhosts_lookup(struct vhosts *vhosts, char *host, int len) {
+  char key[MAX_NAME];
+  struct vhost *vh;
+  char *end;
+
+  if (host == NULL || vhosts->index->num_entries == 0) {
+    return vhosts->fallback;
+  }
+
+  if (len > 0 && host[0] == '[') {
+    end = memchr(host, ']', len); // An IPv6 literal
+    len = end != NULL ? end + 1 - host : len;
+  } else if ((end = memchr(host, ':', len)) != NULL) {
+    len = end - host;
+  }
+  if (len > 0 && host[len - 1] == '.') {
+    len--;
+  }
+
+  if (len == 0 || len > MAX_NAME) {
+    return vhosts->fallback;
+  }
+
+  for (int i = 0; i < len; i++) {
+    key[i] = tolower((unsigned char)host[i]);
+  }
+
+  vh = hashtable_get_bin(vhosts->index, key, len);
+  return vh != NULL ? vh : vhosts->fallback;
+}
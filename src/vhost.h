@@ -0,0 +1,31 @@
+#ifndef _VHOST_H_
+#define _VHOST_H_
+
+#include "cache.h"
+#include "fdcache.h"
+
+// A site: its files, its error pages and its share of the content cache
+struct vhost {
+  char *name;  // Its names, lower case and comma-separated; NULL for the
+               // default site
+  char *root;  // Document root
+  char *files; // Where its error pages (404.html) are
+  struct fdcache *fdcache;
+  struct cache *cache; // Its own partition, so no site evicts another's
+};
+
+// Every site served, by Host
+struct vhosts {
+  struct hashtable *index; // Host name -> vhost
+  struct vhost *fallback;  // For no Host, or one not configured
+};
+
+extern struct vhost *vhost_create(char *name, char *root, char *files,
+                                  struct cache *cache, int fdcache_size);
+extern struct vhosts *vhosts_create(struct vhost *fallback);
+extern int vhosts_load(struct vhosts *vhosts, char *config, int fdcache_size,
+                       int cache_entries, int hot_keys);
+extern struct vhost *vhosts_lookup(struct vhosts *vhosts, char *host,
+                                   int len);
+
+#endif
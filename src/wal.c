@@ -0,0 +1,538 @@
+/* Group-commit append log
+ *
+ * Callers queue records and carry on; a single writer thread drains
+ * everything queued since its last pass with as few writev() calls as
+ * possible, syncs according to the log's policy, then acks the whole batch
+ * at once by bumping an eventfd. The caller's event loop watches that and
+ * calls wal_reap(), which runs each acked record's done callback on the
+ * loop's own thread. Under load many requests share one write and one
+ * fdatasync() instead of each taking a file lock and paying for its own
+ * syscalls, and none of them holds up the loop while that happens.
+ *
+ * Records can also be pipes holding data spliced in from a socket; those are
+ * moved into the file with splice() so large uploads never touch user space.
+ * splice() refuses O_APPEND files, so the log is opened without it and the
+ * writer (the only thread writing) keeps the file offset at the end.
+ *
+ * Records are framed (see wal.h), so a reader can tell where each ends and
+ * skip entries that were never finished. A batch that fails to go out
+ * whole is cut off the file again, so no record is ever left half written.
+ * The log starts with a magic number, so a file that isn't one is never
+ * mistaken for it.
+ */
+
+#define _GNU_SOURCE
+#include "wal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct wal {
+  int fd;
+  enum wal_sync sync;
+  int interval_ms;
+
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t work; // Signalled when records are queued
+
+  struct wal_record *head, *tail;  // Records waiting for the writer
+  struct wal_record *acked, *last; // Records waiting for wal_reap()
+  int event_fd;                    // Readable while there are acked ones
+  int stopping;
+
+  int dirty; // Written but not yet synced (WAL_SYNC_INTERVAL)
+  struct timespec last_sync;
+};
+
+/* Milliseconds elapsed since a monotonic timestamp */
+static long ms_since(struct timespec *then) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - then->tv_sec) * 1000 +
+         (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+/* Sync the log file and reset the interval clock */
+static int wal_sync_now(struct wal *wal) {
+  int rv = fdatasync(wal->fd);
+
+  if (rv < 0) {
+    perror("fdatasync");
+  }
+  clock_gettime(CLOCK_MONOTONIC, &wal->last_sync);
+  wal->dirty = 0;
+
+  return rv;
+}
+
+/* writev() every byte of an iovec array, resuming after short writes
+ *
+ * NOTE: modifies the iovecs in place
+ */
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("writev");
+      return -1;
+    }
+
+    // Skip the iovecs that went out completely, trim the partial one
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+/* Move len bytes from a pipe into the log file */
+static int splice_all(int pipefd, int fd, size_t len) {
+  while (len > 0) {
+    ssize_t n = splice(pipefd, NULL, fd, NULL, len, SPLICE_F_MOVE);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n < 0 && errno == EINVAL) {
+      // Filesystem can't splice; copy through a buffer instead
+      char buf[16384];
+
+      n = read(pipefd, buf, len < sizeof buf ? len : sizeof buf);
+      if (n > 0) {
+        struct iovec iov = {buf, n};
+
+        if (writev_all(fd, &iov, 1) < 0) {
+          return -1;
+        }
+      }
+    }
+
+    if (n <= 0) {
+      perror("splice");
+      return -1;
+    }
+    len -= n;
+  }
+
+  return 0;
+}
+
+/* Write a batch of records, IOV_MAX at a time
+ *
+ * Runs of in-memory records go out with one writev() each, headers and
+ * all; a pipe record's header ends a run and its data is spliced in after
+ * it, preserving queue order.
+ *
+ * Returns -1 if any part of the batch failed to reach the file, which is
+ * then truncated back to where the batch started
+ */
+static int wal_write_batch(struct wal *wal, struct wal_record *batch) {
+  struct iovec iov[IOV_MAX];
+  off_t start = lseek(wal->fd, 0, SEEK_CUR);
+  int status = 0;
+
+  while (batch != NULL && status == 0) {
+    struct wal_record *piped = NULL;
+    int iovcnt = 0;
+
+    for (; batch != NULL && iovcnt + 2 <= IOV_MAX; batch = batch->next) {
+      iov[iovcnt].iov_base = &batch->frame;
+      iov[iovcnt++].iov_len = sizeof batch->frame;
+
+      if (batch->pipefd >= 0) {
+        piped = batch;
+        batch = batch->next;
+        break;
+      }
+      if (batch->iov.iov_len > 0) {
+        iov[iovcnt++] = batch->iov;
+      }
+    }
+
+    if (writev_all(wal->fd, iov, iovcnt) < 0 ||
+        (piped != NULL &&
+         splice_all(piped->pipefd, wal->fd, piped->iov.iov_len) < 0)) {
+      status = -1;
+    }
+  }
+
+  if (status < 0 && (ftruncate(wal->fd, start) < 0 ||
+                     lseek(wal->fd, start, SEEK_SET) < 0)) {
+    perror("ftruncate");
+  }
+
+  return status;
+}
+
+/* Writer thread: drain the queue in batches until the log is closed */
+static void *wal_writer(void *arg) {
+  struct wal *wal = arg;
+
+  pthread_mutex_lock(&wal->lock);
+
+  while (1) {
+    while (wal->head == NULL && !wal->stopping) {
+      if (wal->sync == WAL_SYNC_INTERVAL && wal->dirty) {
+        // Sleep until the next sync is due, unless more work shows up
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wal->interval_ms / 1000;
+        deadline.tv_nsec += (wal->interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000L;
+        }
+
+        if (pthread_cond_timedwait(&wal->work, &wal->lock, &deadline) ==
+            ETIMEDOUT) {
+          wal_sync_now(wal);
+        }
+      } else {
+        pthread_cond_wait(&wal->work, &wal->lock);
+      }
+    }
+
+    if (wal->head == NULL) {
+      break; // Stopping and nothing left to write
+    }
+
+    // Take everything queued so far as one batch
+    struct wal_record *batch = wal->head;
+    wal->head = wal->tail = NULL;
+    pthread_mutex_unlock(&wal->lock);
+
+    int status = wal_write_batch(wal, batch);
+
+    switch (wal->sync) {
+    case WAL_SYNC_BATCH:
+      if (wal_sync_now(wal) < 0) {
+        status = -1;
+      }
+      break;
+    case WAL_SYNC_INTERVAL:
+      wal->dirty = 1;
+      if (ms_since(&wal->last_sync) >= wal->interval_ms) {
+        wal_sync_now(wal);
+      }
+      break;
+    case WAL_SYNC_NONE:
+      break;
+    }
+
+    // Ack the batch
+    struct wal_record *last = batch;
+    uint64_t one = 1;
+
+    for (struct wal_record *r = batch; r != NULL; r = r->next) {
+      r->status = status;
+      last = r;
+    }
+
+    pthread_mutex_lock(&wal->lock);
+    if (wal->last == NULL) {
+      wal->acked = batch;
+    } else {
+      wal->last->next = batch;
+    }
+    wal->last = last;
+
+    if (write(wal->event_fd, &one, sizeof one) < 0) {
+      perror("write"); // Only if the counter is full, which it can't be
+    }
+  }
+
+  pthread_mutex_unlock(&wal->lock);
+
+  if (wal->sync != WAL_SYNC_NONE && wal->dirty) {
+    wal_sync_now(wal);
+  }
+
+  return NULL;
+}
+
+/* Find where the last whole record in a log ends
+ *
+ * Whatever follows was being written when the previous owner died, and is
+ * cut off so the next record starts where a reader expects one.
+ *
+ * Returns -1 if a header makes no sense: the log is damaged, not torn.
+ */
+static off_t wal_recover(int fd, off_t end) {
+  struct wal_frame frame;
+  off_t pos = sizeof WAL_MAGIC - 1;
+
+  while (pos < end) {
+    ssize_t n = pread(fd, &frame, sizeof frame, pos);
+
+    if (n == sizeof frame && (frame.flags & ~(WAL_FIRST | WAL_LAST)) != 0) {
+      return -1;
+    }
+    if (n != sizeof frame || frame.length > end - pos - sizeof frame) {
+      break;
+    }
+    pos += sizeof frame + frame.length;
+  }
+
+  return pos;
+}
+
+/* Move a file that isn't a log out of the way, to the first free one of
+ * path.old, path.old.1, ...
+ */
+static int wal_move_aside(char *path) {
+  char aside[PATH_MAX];
+
+  for (int i = 0;; i++) {
+    if (i == 0) {
+      snprintf(aside, sizeof aside, "%s.old", path);
+    } else {
+      snprintf(aside, sizeof aside, "%s.old.%d", path, i);
+    }
+
+    // Unlike rename(), never replaces one moved aside before
+    if (link(path, aside) == 0) {
+      break;
+    }
+    if (errno != EEXIST) {
+      perror("link");
+      return -1;
+    }
+  }
+
+  fprintf(stderr, "wal: %s is not a log; moved it to %s\n", path, aside);
+  return unlink(path);
+}
+
+/* Open the log at path, ready to append to
+ *
+ * A new log starts with WAL_MAGIC. A file that doesn't, or is damaged, is
+ * left whole and moved aside, and a new log started in its place: it may be
+ * what an older server appended unframed.
+ *
+ * Returns -1 on error
+ */
+static int wal_open_file(char *path) {
+  char magic[sizeof WAL_MAGIC - 1];
+  int fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+  off_t end = fd >= 0 ? lseek(fd, 0, SEEK_END) : -1;
+
+  if (end < 0) {
+    goto fail;
+  }
+
+  if (end >= (off_t)sizeof magic &&
+      pread(fd, magic, sizeof magic, 0) == sizeof magic &&
+      memcmp(magic, WAL_MAGIC, sizeof magic) == 0) {
+    off_t whole = wal_recover(fd, end);
+
+    if (whole >= 0) {
+      if (ftruncate(fd, whole) < 0 || lseek(fd, whole, SEEK_SET) < 0) {
+        goto fail;
+      }
+      return fd;
+    }
+  }
+
+  if (end > 0) {
+    close(fd);
+    fd = -1;
+    if (wal_move_aside(path) < 0 ||
+        (fd = open(path, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644)) < 0) {
+      goto fail;
+    }
+  }
+
+  if (pwrite(fd, WAL_MAGIC, sizeof magic, 0) != sizeof magic ||
+      lseek(fd, sizeof magic, SEEK_SET) < 0 || fdatasync(fd) < 0) {
+    goto fail;
+  }
+  return fd;
+
+fail:
+  perror(path);
+  if (fd >= 0) {
+    close(fd);
+  }
+  return -1;
+}
+
+/* Open (or create) an append log and start its writer thread
+ *
+ * interval_ms is only used with WAL_SYNC_INTERVAL.
+ *
+ * Returns NULL on error
+ */
+struct wal *wal_open(char *path, enum wal_sync sync, int interval_ms) {
+  struct wal *wal = calloc(1, sizeof *wal);
+
+  if (wal == NULL) {
+    return NULL;
+  }
+
+  if ((wal->fd = wal_open_file(path)) < 0) {
+    free(wal);
+    return NULL;
+  }
+
+  wal->sync = sync;
+  wal->interval_ms = interval_ms > 0 ? interval_ms : 1000;
+  clock_gettime(CLOCK_MONOTONIC, &wal->last_sync);
+
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_cond_init(&wal->work, NULL);
+
+  if ((wal->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    perror("eventfd");
+    close(wal->fd);
+    free(wal);
+    return NULL;
+  }
+
+  if (pthread_create(&wal->writer, NULL, wal_writer, wal) != 0) {
+    fprintf(stderr, "wal: cannot start writer thread\n");
+    close(wal->event_fd);
+    close(wal->fd);
+    free(wal);
+    return NULL;
+  }
+
+  return wal;
+}
+
+/* Flush everything still queued, stop the writer and close the log
+ *
+ * Records acked after the last wal_reap() never have their callbacks run.
+ */
+void wal_close(struct wal *wal) {
+  pthread_mutex_lock(&wal->lock);
+  wal->stopping = 1;
+  pthread_cond_signal(&wal->work);
+  pthread_mutex_unlock(&wal->lock);
+
+  pthread_join(wal->writer, NULL);
+
+  close(wal->event_fd);
+  close(wal->fd);
+  pthread_mutex_destroy(&wal->lock);
+  pthread_cond_destroy(&wal->work);
+  free(wal);
+}
+
+/* A descriptor that is readable while acked records await wal_reap() */
+int wal_event_fd(struct wal *wal) { return wal->event_fd; }
+
+/**
+ * Run the done callbacks of the records acked since the last call
+ *
+ * For the thread that appends, whenever wal_event_fd() is readable. The
+ * callbacks may append more, or close the log.
+ */
+void wal_reap(struct wal *wal) {
+  struct wal_record *r;
+  uint64_t count;
+
+  if (read(wal->event_fd, &count, sizeof count) < 0 && errno != EAGAIN) {
+    perror("read");
+  }
+
+  pthread_mutex_lock(&wal->lock);
+  r = wal->acked;
+  wal->acked = wal->last = NULL;
+  pthread_mutex_unlock(&wal->lock);
+
+  while (r != NULL) {
+    struct wal_record *next = r->next; // r is its owner's again after done
+
+    r->done(r);
+    r = next;
+  }
+}
+
+/* Hand a record to the writer */
+static void wal_submit(struct wal *wal, struct wal_record *rec, int flags) {
+  rec->frame.length = rec->iov.iov_len;
+  rec->frame.flags = flags;
+  rec->status = 0;
+  rec->next = NULL;
+
+  pthread_mutex_lock(&wal->lock);
+
+  if (wal->tail == NULL) {
+    wal->head = wal->tail = rec;
+  } else {
+    wal->tail->next = rec;
+    wal->tail = rec;
+  }
+  pthread_cond_signal(&wal->work);
+
+  pthread_mutex_unlock(&wal->lock);
+}
+
+/* Queue a record for the log
+ *
+ * flags says whether it starts an entry, ends one, or both; an empty record
+ * can do either. Returns straight away: rec->done is called from
+ * wal_reap() once the batch containing the record has been written and
+ * synced as the log's policy requires. Until then rec and the data belong
+ * to the log; the data is not copied.
+ *
+ * Returns 0 if the record was queued, -1 on error
+ */
+int wal_append(struct wal *wal, struct wal_record *rec, void *data, int size,
+               int flags) {
+  if (size < 0) {
+    return -1;
+  }
+
+  rec->iov.iov_base = data;
+  rec->iov.iov_len = size;
+  rec->pipefd = -1;
+
+  wal_submit(wal, rec, flags);
+  return 0;
+}
+
+/* Queue size bytes waiting in a pipe for the log
+ *
+ * Same as wal_append(); the pipe must stay open until the record is acked.
+ * If that is with an error, the pipe may still hold some of the data.
+ */
+int wal_append_pipe(struct wal *wal, struct wal_record *rec, int pipefd,
+                    int size, int flags) {
+  if (size <= 0) {
+    return wal_append(wal, rec, NULL, 0, flags);
+  }
+
+  rec->iov.iov_base = NULL;
+  rec->iov.iov_len = size;
+  rec->pipefd = pipefd;
+
+  wal_submit(wal, rec, flags);
+  return 0;
+}
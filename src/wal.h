@@ -0,0 +1,53 @@
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+// When the writer thread makes appended data durable
+enum wal_sync {
+  WAL_SYNC_NONE,     // Never fsync; ack once the data is in the page cache
+  WAL_SYNC_INTERVAL, // Ack after write, fdatasync at most every interval_ms
+  WAL_SYNC_BATCH,    // fdatasync every batch before acking it
+};
+
+// A log starts with these bytes, then holds nothing but records
+#define WAL_MAGIC "webwal2\n"
+
+// Each record in the log is this header, in host byte order, then its data
+struct wal_frame {
+  uint32_t length; // Bytes of data that follow
+  uint32_t entry;  // Which entry the record belongs to
+  uint32_t flags;
+};
+
+// An entry is the records with its id from one flagged WAL_FIRST up to one
+// flagged WAL_LAST; other entries' records may come in between. One that
+// the next WAL_FIRST with the same id or the end of the log cuts short was
+// never finished, and is to be ignored.
+#define WAL_FIRST 1
+#define WAL_LAST 2
+
+// An append on its way to the log, owned by the caller until it is acked.
+// The caller sets frame.entry and done; wal_append() fills in the rest.
+struct wal_record {
+  struct wal_frame frame;
+  struct iovec iov;
+  int pipefd; // If >= 0, iov_len bytes are to be drained from this pipe
+  int status; // 0 once acked, or -1 if the record didn't make it
+  void (*done)(struct wal_record *rec); // Called by wal_reap() once acked
+  struct wal_record *next;
+};
+
+struct wal;
+
+extern struct wal *wal_open(char *path, enum wal_sync sync, int interval_ms);
+extern void wal_close(struct wal *wal);
+extern int wal_event_fd(struct wal *wal);
+extern void wal_reap(struct wal *wal);
+extern int wal_append(struct wal *wal, struct wal_record *rec, void *data,
+                      int size, int flags);
+extern int wal_append_pipe(struct wal *wal, struct wal_record *rec,
+                           int pipefd, int size, int flags);
+
+#endif